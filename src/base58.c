@@ -25,6 +25,22 @@
 /** All alphanumeric characters except for "0", "I", "O", and "l" */
 static const char* b58charset = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
 
+/* Digit value plus one, 0 for a character not in b58charset */
+static const uint8_t b58values[256] = {
+	['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4, ['5'] = 5,
+	['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+	['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14,
+	['F'] = 15, ['G'] = 16, ['H'] = 17, ['J'] = 18, ['K'] = 19,
+	['L'] = 20, ['M'] = 21, ['N'] = 22, ['P'] = 23, ['Q'] = 24,
+	['R'] = 25, ['S'] = 26, ['T'] = 27, ['U'] = 28, ['V'] = 29,
+	['W'] = 30, ['X'] = 31, ['Y'] = 32, ['Z'] = 33,
+	['a'] = 34, ['b'] = 35, ['c'] = 36, ['d'] = 37, ['e'] = 38,
+	['f'] = 39, ['g'] = 40, ['h'] = 41, ['i'] = 42, ['j'] = 43,
+	['k'] = 44, ['m'] = 45, ['n'] = 46, ['o'] = 47, ['p'] = 48,
+	['q'] = 49, ['r'] = 50, ['s'] = 51, ['t'] = 52, ['u'] = 53,
+	['v'] = 54, ['w'] = 55, ['x'] = 56, ['y'] = 57, ['z'] = 58,
+};
+
 /*
  * Allow leading and trailing space in b58src, but not in middle.
  *
@@ -34,7 +50,7 @@ size_t base58_decode(const char* b58src, uint8_t *b256, size_t dstlen)
 {
 	const char *p = (const char*)b58src;
 	size_t n, zeroes=0;
-	int i;
+	int i, high;
 	
 	// Skip leading spaces.
 	while (*p && isspace(*p))
@@ -55,21 +71,24 @@ size_t base58_decode(const char* b58src, uint8_t *b256, size_t dstlen)
 		return n;
 	}
 	
-	// Process the characters.
+	// Process the characters. b256[0..high] is still zero.
+	memset(b256, 0, n);
+	high = (int)n-1;
 	while (*p && !isspace(*p)) {
 		int carry;
 		// Decode base58 character
-		const char* ch = strchr(b58charset, *p);
-		if (ch == NULL)
+		int ch = b58values[(unsigned char)*p];
+		if (ch == 0)
 			return 0;
 		// Apply "b256 = b256 * 58 + ch".
-		carry = (int)(ch - b58charset);
-		for (i = (int)n-1; i >= 0; i--) {
+		carry = ch - 1;
+		for (i = (int)n-1; i > high || carry != 0; i--) {
+			assert(i >= 0);
 			carry += 58 * b256[i];
 			b256[i] = carry % 256;
 			carry /= 256;
 		}
-		assert(carry == 0);
+		high = i;
 		p++;
 	}
 	
@@ -97,7 +116,7 @@ size_t base58_encode(const uint8_t* src, size_t srclen, char *b58, size_t dstlen
 
 	// Skip & count leading zeroes.
 	int zeroes = 0;
-	int i, j;
+	int i, j, high;
 	size_t n;
 	
 	while (p != end && *p == 0) {
@@ -115,16 +134,18 @@ size_t base58_encode(const uint8_t* src, size_t srclen, char *b58, size_t dstlen
 	
 	memset(b58, 0, dstlen);
 	
-	// Process the bytes.
+	// Process the bytes. b58[0..high] is still zero.
+	high = (int)n-1;
 	for (;p != end; p++) {
 		int carry = *p;
 		// Apply "b58 = b58 * 256 + ch".
-		for (i = (int)n-1; i >= 0; i--) {
+		for (i = (int)n-1; i > high || carry != 0; i--) {
+			assert(i >= 0);
 			carry += 256 * b58[i];
 			b58[i] = carry % 58;
 			carry /= 58;
 		}
-		assert(carry == 0);
+		high = i;
 	}
 	
 	for (i = 0; (unsigned)i < n; i++)
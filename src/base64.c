@@ -55,6 +55,22 @@ static const char Base64[] =
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 static const char Pad64 = '=';
 
+static int
+base64_value(int ch)
+{
+	if (ch >= 'A' && ch <= 'Z')
+		return ch - 'A';
+	if (ch >= 'a' && ch <= 'z')
+		return ch - 'a' + 26;
+	if (ch >= '0' && ch <= '9')
+		return ch - '0' + 52;
+	if (ch == '+')
+		return 62;
+	if (ch == '/')
+		return 63;
+	return -1;
+}
+
 /* (From RFC1521 and draft-ietf-dnssec-secext-03.txt)
    The following encoding technique is taken from RFC 1521 by Borenstein
    and Freed.  It is reproduced here in a slightly edited form for
@@ -186,21 +202,38 @@ base64_encode(const uint8_t *src, size_t srclength, char *target,
 int
 base64_decode(const char *src, uint8_t *target, size_t targsize)
 {
-	int tarindex, state, ch;
-	char *pos;
+	int tarindex, state, ch, v;
+	int a, b, c, d;
 
 	state = 0;
 	tarindex = 0;
 
-	while ((ch = *src++) != '\0') {
+	for (;;) {
+		/* Whole quanta with room for them go at once. */
+		while (state == 0 && target &&
+		       (size_t)tarindex + 3 <= targsize &&
+		       (a = base64_value(src[0])) >= 0 &&
+		       (b = base64_value(src[1])) >= 0 &&
+		       (c = base64_value(src[2])) >= 0 &&
+		       (d = base64_value(src[3])) >= 0) {
+			target[tarindex]   = (a << 2) | (b >> 4);
+			target[tarindex+1] = ((b & 0x0f) << 4) | (c >> 2);
+			target[tarindex+2] = ((c & 0x03) << 6) | d;
+			tarindex += 3;
+			src += 4;
+		}
+
+		if ((ch = *src++) == '\0')
+			break;
+
 		if (isspace(ch))	/* Skip whitespace anywhere. */
 			continue;
 
 		if (ch == Pad64)
 			break;
 
-		pos = strchr(Base64, ch);
-		if (pos == 0)		/* A non-base64 character. */
+		v = base64_value(ch);
+		if (v < 0)		/* A non-base64 character. */
 			return (-1);
 
 		switch (state) {
@@ -208,7 +241,7 @@ base64_decode(const char *src, uint8_t *target, size_t targsize)
 			if (target) {
 				if ((unsigned)tarindex >= targsize)
 					return (-1);
-				target[tarindex] = (pos - Base64) << 2;
+				target[tarindex] = v << 2;
 			}
 			state = 1;
 			break;
@@ -216,8 +249,8 @@ base64_decode(const char *src, uint8_t *target, size_t targsize)
 			if (target) {
 				if ((unsigned)(tarindex + 1) >= targsize)
 					return (-1);
-				target[tarindex]   |=  (pos - Base64) >> 4;
-				target[tarindex+1]  = ((pos - Base64) & 0x0f)
+				target[tarindex]   |=  v >> 4;
+				target[tarindex+1]  = (v & 0x0f)
 							<< 4 ;
 			}
 			tarindex++;
@@ -227,8 +260,8 @@ base64_decode(const char *src, uint8_t *target, size_t targsize)
 			if (target) {
 				if ((unsigned)(tarindex + 1) >= targsize)
 					return (-1);
-				target[tarindex]   |=  (pos - Base64) >> 2;
-				target[tarindex+1]  = ((pos - Base64) & 0x03)
+				target[tarindex]   |=  v >> 2;
+				target[tarindex+1]  = (v & 0x03)
 							<< 6;
 			}
 			tarindex++;
@@ -238,7 +271,7 @@ base64_decode(const char *src, uint8_t *target, size_t targsize)
 			if (target) {
 				if ((unsigned)tarindex >= targsize)
 					return (-1);
-				target[tarindex] |= (pos - Base64);
+				target[tarindex] |= v;
 			}
 			tarindex++;
 			state = 0;
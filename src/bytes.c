@@ -0,0 +1,419 @@
+/*
+ * Copyright (C) 2020, Twinkle Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "bytes.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define BYTES_SSE2 1
+# include <emmintrin.h>
+# if defined(__GNUC__)
+#  define BYTES_AVX2 1
+#  include <immintrin.h>
+#  define AVX2 __attribute__((target("avx2")))
+# endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+# define BYTES_NEON 1
+# include <arm_neon.h>
+#endif
+
+enum { SIMD_NONE, SIMD_NEON, SIMD_SSE2, SIMD_AVX2 };
+
+static const char *simd_names[] = { "none", "neon", "sse2", "avx2" };
+
+/* Best the target and the CPU can do, or what TWK_SIMD asks for */
+static int detect(void)
+{
+	int level = SIMD_NONE;
+#if BYTES_SSE2
+	level = SIMD_SSE2;
+#elif BYTES_NEON
+	level = SIMD_NEON;
+#endif
+#if BYTES_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		level = SIMD_AVX2;
+#endif
+	const char *s = getenv("TWK_SIMD");
+	if (s) {
+		for (int i = 0; i < level; i++)
+			if (strcmp(s, simd_names[i]) == 0)
+				level = i;
+	}
+	return level;
+}
+
+/* Threads racing on first use all find the same value. */
+static int simd(void)
+{
+	static volatile int level = -1;
+	int l = level;
+	if (l < 0)
+		level = l = detect();
+	return l;
+}
+
+static inline uint64_t load64(const uint8_t *p)
+{
+	uint64_t x;
+	memcpy(&x, p, 8);
+	return x;
+}
+
+static inline void store64(uint8_t *p, uint64_t x)
+{
+	memcpy(p, &x, 8);
+}
+
+/*
+ * Bitwise operations. Each vector loop leaves off where it ran out
+ * of whole vectors, for the next narrower one to go on from.
+ */
+
+#define BYTES_BINARY(name, op, sse, avx, neon)                            \
+AVX2_KERNEL(name, avx)                                                    \
+void name(uint8_t *r, const uint8_t *a, const uint8_t *b, size_t n)       \
+{                                                                         \
+	size_t i = 0;                                                     \
+	int level = simd();                                               \
+	AVX2_CALL(name)                                                   \
+	VECTOR_LOOP(sse, neon)                                            \
+	for (; i + 8 <= n; i += 8)                                        \
+		store64(r+i, load64(a+i) op load64(b+i));                 \
+	for (; i < n; i++)                                                \
+		r[i] = a[i] op b[i];                                      \
+}
+
+#if BYTES_AVX2
+# define AVX2_KERNEL(name, avx)                                           \
+AVX2 static size_t name##_avx2(uint8_t *r, const uint8_t *a,              \
+			       const uint8_t *b, size_t n)                \
+{                                                                         \
+	size_t i = 0;                                                     \
+	for (; i + 32 <= n; i += 32) {                                    \
+		__m256i x = _mm256_loadu_si256((const __m256i*)(a+i));    \
+		__m256i y = _mm256_loadu_si256((const __m256i*)(b+i));    \
+		_mm256_storeu_si256((__m256i*)(r+i), avx(x, y));          \
+	}                                                                 \
+	return i;                                                         \
+}
+# define AVX2_CALL(name) if (level == SIMD_AVX2) i = name##_avx2(r, a, b, n);
+#else
+# define AVX2_KERNEL(name, avx)
+# define AVX2_CALL(name)
+#endif
+
+#if BYTES_SSE2
+# define VECTOR_LOOP(sse, neon)                                           \
+	if (level >= SIMD_SSE2) {                                         \
+		for (; i + 16 <= n; i += 16) {                            \
+			__m128i x = _mm_loadu_si128((const __m128i*)(a+i)); \
+			__m128i y = _mm_loadu_si128((const __m128i*)(b+i)); \
+			_mm_storeu_si128((__m128i*)(r+i), sse(x, y));     \
+		}                                                         \
+	}
+#elif BYTES_NEON
+# define VECTOR_LOOP(sse, neon)                                           \
+	if (level == SIMD_NEON) {                                         \
+		for (; i + 16 <= n; i += 16)                              \
+			vst1q_u8(r+i, neon(vld1q_u8(a+i), vld1q_u8(b+i)));\
+	}
+#else
+# define VECTOR_LOOP(sse, neon)
+#endif
+
+BYTES_BINARY(bytes_xor, ^, _mm_xor_si128, _mm256_xor_si256, veorq_u8)
+BYTES_BINARY(bytes_and, &, _mm_and_si128, _mm256_and_si256, vandq_u8)
+BYTES_BINARY(bytes_or,  |, _mm_or_si128,  _mm256_or_si256,  vorrq_u8)
+
+void bytes_not(uint8_t *r, const uint8_t *a, size_t n)
+{
+	size_t i = 0;
+#if BYTES_SSE2
+	if (simd() >= SIMD_SSE2) {
+		__m128i ones = _mm_set1_epi8(-1);
+		for (; i + 16 <= n; i += 16) {
+			__m128i x = _mm_loadu_si128((const __m128i*)(a+i));
+			_mm_storeu_si128((__m128i*)(r+i), _mm_xor_si128(x, ones));
+		}
+	}
+#elif BYTES_NEON
+	if (simd() == SIMD_NEON) {
+		for (; i + 16 <= n; i += 16)
+			vst1q_u8(r+i, vmvnq_u8(vld1q_u8(a+i)));
+	}
+#endif
+	for (; i + 8 <= n; i += 8)
+		store64(r+i, ~load64(a+i));
+	for (; i < n; i++)
+		r[i] = ~a[i];
+}
+
+/*
+ * ASCII scan. The vector loops stop at the block holding the first
+ * high byte, which the byte loop then finds.
+ */
+
+#if BYTES_AVX2
+AVX2 static size_t ascii_avx2(const uint8_t *s, size_t n)
+{
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(s+i));
+		if (_mm256_movemask_epi8(x) != 0)
+			break;
+	}
+	return i;
+}
+#endif
+
+size_t bytes_ascii(const uint8_t *s, size_t n)
+{
+	size_t i = 0;
+	int level = simd();
+#if BYTES_AVX2
+	if (level == SIMD_AVX2)
+		i = ascii_avx2(s, n);
+#endif
+#if BYTES_SSE2
+	if (level >= SIMD_SSE2) {
+		for (; i + 16 <= n; i += 16) {
+			__m128i x = _mm_loadu_si128((const __m128i*)(s+i));
+			if (_mm_movemask_epi8(x) != 0)
+				break;
+		}
+	}
+#elif BYTES_NEON
+	if (level == SIMD_NEON) {
+		for (; i + 16 <= n; i += 16) {
+			uint64x2_t x = vreinterpretq_u64_u8(vld1q_u8(s+i));
+			uint64_t m = vgetq_lane_u64(x, 0) | vgetq_lane_u64(x, 1);
+			if (m & 0x8080808080808080ULL)
+				break;
+		}
+	}
+#endif
+	(void)level;
+	for (; i + 8 <= n; i += 8)
+		if (load64(s+i) & 0x8080808080808080ULL)
+			break;
+	for (; i < n; i++)
+		if (s[i] & 0x80)
+			break;
+	return i;
+}
+
+/*
+ * Hex coding. For a nibble v the digit is v + '0', plus 'a'-'0'-10
+ * when v > 9.
+ */
+
+static const char hex_digits[] = "0123456789abcdef";
+
+#if BYTES_SSE2
+static inline __m128i hex_chars(__m128i v)
+{
+	__m128i gt9 = _mm_cmpgt_epi8(v, _mm_set1_epi8(9));
+	__m128i c = _mm_add_epi8(v, _mm_set1_epi8('0'));
+	return _mm_add_epi8(c, _mm_and_si128(gt9, _mm_set1_epi8('a'-'0'-10)));
+}
+#elif BYTES_NEON
+static inline uint8x16_t hex_chars(uint8x16_t v)
+{
+	uint8x16_t gt9 = vcgtq_u8(v, vdupq_n_u8(9));
+	uint8x16_t c = vaddq_u8(v, vdupq_n_u8('0'));
+	return vaddq_u8(c, vandq_u8(gt9, vdupq_n_u8('a'-'0'-10)));
+}
+#endif
+
+void bytes_hex_encode(char *out, const uint8_t *s, size_t n)
+{
+	size_t i = 0;
+#if BYTES_SSE2
+	if (simd() >= SIMD_SSE2) {
+		__m128i low4 = _mm_set1_epi8(0x0f);
+		for (; i + 16 <= n; i += 16) {
+			__m128i x = _mm_loadu_si128((const __m128i*)(s+i));
+			__m128i hi = hex_chars(_mm_and_si128(_mm_srli_epi16(x, 4), low4));
+			__m128i lo = hex_chars(_mm_and_si128(x, low4));
+			_mm_storeu_si128((__m128i*)(out+2*i), _mm_unpacklo_epi8(hi, lo));
+			_mm_storeu_si128((__m128i*)(out+2*i+16), _mm_unpackhi_epi8(hi, lo));
+		}
+	}
+#elif BYTES_NEON
+	if (simd() == SIMD_NEON) {
+		for (; i + 16 <= n; i += 16) {
+			uint8x16_t x = vld1q_u8(s+i);
+			uint8x16x2_t t;
+			t.val[0] = hex_chars(vshrq_n_u8(x, 4));
+			t.val[1] = hex_chars(vandq_u8(x, vdupq_n_u8(0x0f)));
+			vst2q_u8((uint8_t*)out+2*i, t);
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		out[2*i] = hex_digits[s[i] >> 4];
+		out[2*i+1] = hex_digits[s[i] & 0xf];
+	}
+}
+
+/* Digit value plus one, 0 for a non digit */
+static const uint8_t hex_values[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+#if BYTES_SSE2
+/*
+ * Values of the 16 digits in c, with *ok set to the lanes holding
+ * a digit. Bytes from 0x80 are negative, which fails both ranges.
+ */
+static inline __m128i hex_values_sse2(__m128i c, __m128i *ok)
+{
+	__m128i l = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	__m128i isd = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0'-1)),
+				    _mm_cmplt_epi8(c, _mm_set1_epi8('9'+1)));
+	__m128i isl = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a'-1)),
+				    _mm_cmplt_epi8(l, _mm_set1_epi8('f'+1)));
+	__m128i d = _mm_and_si128(isd, _mm_sub_epi8(c, _mm_set1_epi8('0')));
+	__m128i x = _mm_and_si128(isl, _mm_sub_epi8(l, _mm_set1_epi8('a'-10)));
+	*ok = _mm_or_si128(isd, isl);
+	return _mm_or_si128(d, x);
+}
+
+/* Bytes from the 8 digit pairs in v, one per 16 bit lane */
+static inline __m128i hex_pairs_sse2(__m128i v)
+{
+	__m128i hi = _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x00ff)), 4);
+	return _mm_or_si128(hi, _mm_srli_epi16(v, 8));
+}
+#elif BYTES_NEON
+static inline uint8x16_t hex_values_neon(uint8x16_t c, uint8x16_t *ok)
+{
+	uint8x16_t d = vsubq_u8(c, vdupq_n_u8('0'));
+	uint8x16_t l = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+	uint8x16_t isd = vcltq_u8(d, vdupq_n_u8(10));
+	uint8x16_t isl = vcltq_u8(l, vdupq_n_u8(6));
+	*ok = vorrq_u8(isd, isl);
+	return vbslq_u8(isd, d, vaddq_u8(l, vdupq_n_u8(10)));
+}
+#endif
+
+long bytes_hex_decode(uint8_t *out, const char *s, size_t n)
+{
+	const uint8_t *p = (const uint8_t*)s;
+	size_t i = 0;
+#if BYTES_SSE2
+	if (simd() >= SIMD_SSE2) {
+		for (; i + 32 <= n; i += 32) {
+			__m128i ok1, ok2;
+			__m128i v1 = hex_values_sse2(_mm_loadu_si128((const __m128i*)(p+i)), &ok1);
+			__m128i v2 = hex_values_sse2(_mm_loadu_si128((const __m128i*)(p+i+16)), &ok2);
+			if (_mm_movemask_epi8(_mm_and_si128(ok1, ok2)) != 0xffff)
+				break;
+			__m128i x = _mm_packus_epi16(hex_pairs_sse2(v1), hex_pairs_sse2(v2));
+			_mm_storeu_si128((__m128i*)(out+i/2), x);
+		}
+	}
+#elif BYTES_NEON
+	if (simd() == SIMD_NEON) {
+		for (; i + 32 <= n; i += 32) {
+			uint8x16x2_t c = vld2q_u8(p+i);
+			uint8x16_t ok1, ok2;
+			uint8x16_t hi = hex_values_neon(c.val[0], &ok1);
+			uint8x16_t lo = hex_values_neon(c.val[1], &ok2);
+			uint64x2_t ok = vreinterpretq_u64_u8(vandq_u8(ok1, ok2));
+			if ((vgetq_lane_u64(ok, 0) & vgetq_lane_u64(ok, 1)) != ~0ULL)
+				break;
+			vst1q_u8(out+i/2, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+		}
+	}
+#endif
+	for (; i + 1 < n; i += 2) {
+		int h = hex_values[p[i]];
+		int l = hex_values[p[i+1]];
+		if (h == 0)
+			return (long)i;
+		if (l == 0)
+			return (long)i+1;
+		out[i/2] = (uint8_t)(((h-1) << 4) | (l-1));
+	}
+	return -1;
+}
+
+/*
+ * Bit buffers
+ */
+
+static inline uint8_t byte_at(const uint8_t *a, size_t n, long j, uint8_t fill)
+{
+	return j >= 0 && (size_t)j < n ? a[j] : fill;
+}
+
+void bytes_shift(uint8_t *r, const uint8_t *a, size_t n, long bits, int fill)
+{
+	uint8_t f = fill ? 0xff : 0;
+	if (n == 0)
+		return;
+	if (bits >= (long)n*8 || bits <= -(long)n*8) {
+		memset(r, f, n);
+		return;
+	}
+
+	// r[i] is the 8 bits at bit i*8+bits of a, i.e. a[i+q] and
+	// a[i+q+1] shifted by s. Going to the left r[i] only needs a[i]
+	// and later bytes, going to the right a[i] and earlier ones, so
+	// a can also be r.
+	long q = bits >= 0 ? bits / 8 : -((-bits + 7) / 8);
+	int s = (int)(bits - q*8);
+	long i;
+	if (q >= 0) {
+		long m = (long)n - q - 1;
+		for (i = 0; i < m; i++)
+			r[i] = (uint8_t)((a[i+q] << s) | (a[i+q+1] >> (8-s)));
+		for (; i < (long)n; i++)
+			r[i] = (uint8_t)((byte_at(a, n, i+q, f) << s) |
+					 (byte_at(a, n, i+q+1, f) >> (8-s)));
+	} else {
+		for (i = (long)n-1; i >= -q; i--)
+			r[i] = (uint8_t)((a[i+q] << s) | (a[i+q+1] >> (8-s)));
+		for (; i >= 0; i--)
+			r[i] = (uint8_t)((byte_at(a, n, i+q, f) << s) |
+					 (byte_at(a, n, i+q+1, f) >> (8-s)));
+	}
+}
+
+static inline void setbit(uint8_t *s, size_t i, int bit)
+{
+	if (bit)
+		s[i>>3] |= 0x80 >> (i & 7);
+	else
+		s[i>>3] &= ~(0x80 >> (i & 7));
+}
+
+void bytes_setbits(uint8_t *s, size_t begin, size_t end, int bit)
+{
+	for (; begin < end && (begin & 7) != 0; begin++)
+		setbit(s, begin, bit);
+	for (; end > begin && (end & 7) != 0; end--)
+		setbit(s, end-1, bit);
+	if (end > begin)
+		memset(s + begin/8, bit ? 0xff : 0, (end-begin)/8);
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2020, Twinkle Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * BYTES -- Kernels for byte buffers
+ *
+ * Bitwise operations, hex coding and ASCII scanning over whole buffers.
+ * They use SSE2 or NEON when the target has it, and AVX2 when the
+ * CPU running us has it, which is found out on first use. Setting
+ * TWK_SIMD to sse2 or none holds them back, to compare results.
+ *
+ * Unless told otherwise the output may be the same as an input, so
+ * buffers can be updated in place, but must not overlap it otherwise.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* r = a ^ b, r = a & b, r = a | b, r = ~a over n bytes */
+void bytes_xor(uint8_t *r, const uint8_t *a, const uint8_t *b, size_t n);
+void bytes_and(uint8_t *r, const uint8_t *a, const uint8_t *b, size_t n);
+void bytes_or(uint8_t *r, const uint8_t *a, const uint8_t *b, size_t n);
+void bytes_not(uint8_t *r, const uint8_t *a, size_t n);
+
+/* Number of leading bytes of s below 0x80 */
+size_t bytes_ascii(const uint8_t *s, size_t n);
+
+/* Write 2*n lowercase hex digits to out, without a terminating NUL. */
+void bytes_hex_encode(char *out, const uint8_t *s, size_t n);
+
+/*
+ * Decode n hex digits of s, either case, into n/2 bytes of out,
+ * which may not be s. n must be even. Return the position of the
+ * first bad digit, or -1 if there is none.
+ */
+long bytes_hex_decode(uint8_t *out, const char *s, size_t n);
+
+/*
+ * Shift the n bytes of a, most significant first, by bits to the
+ * left, or to the right if bits is negative. Vacated bits are copies
+ * of fill, 0 or 1.
+ */
+void bytes_shift(uint8_t *r, const uint8_t *a, size_t n, long bits, int fill);
+
+/* Set bits [begin, end) of s, counted from the msb of s[0], to bit. */
+void bytes_setbits(uint8_t *s, size_t begin, size_t end, int bit);
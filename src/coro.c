@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2020, Twinkle Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if defined(__APPLE__)
+# define _XOPEN_SOURCE 600 /* ucontext */
+#endif
+#include "coro.h"
+#include <stdlib.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+# define CORO_FIBER
+# include <windows.h>
+#elif defined(__OpenBSD__)
+  /* No makecontext() */
+#else
+# define CORO_UCONTEXT
+# include <ucontext.h>
+# include <sys/mman.h>
+# include <unistd.h>
+# ifndef MAP_NORESERVE
+#  define MAP_NORESERVE 0
+# endif
+#endif
+
+#if defined(CORO_FIBER)
+
+struct coro {
+	void *fiber;
+	void *caller;
+	void (*fn)(void*);
+	void *arg;
+	volatile bool done;
+};
+
+/* The fiber loops, so it can be started again without a new one */
+static void WINAPI fiber_main(void *data)
+{
+	struct coro *c = data;
+	while (true) {
+		c->fn(c->arg);
+		c->done = true;
+		SwitchToFiber(c->caller);
+	}
+}
+
+bool coro_thread_init(void)
+{
+	return ConvertThreadToFiber(NULL) != NULL
+	    || GetLastError() == ERROR_ALREADY_FIBER;
+}
+
+struct coro *coro_new(size_t stack_size)
+{
+	struct coro *c = calloc(1, sizeof(struct coro));
+	if (!c)
+		return NULL;
+	c->fiber = CreateFiber(stack_size, fiber_main, c);
+	if (!c->fiber) {
+		free(c);
+		return NULL;
+	}
+	c->done = true;
+	return c;
+}
+
+void coro_delete(struct coro *c)
+{
+	DeleteFiber(c->fiber);
+	free(c);
+}
+
+void coro_resume(struct coro *c)
+{
+	c->caller = GetCurrentFiber();
+	SwitchToFiber(c->fiber);
+}
+
+void coro_yield(struct coro *c)
+{
+	SwitchToFiber(c->caller);
+}
+
+#elif defined(CORO_UCONTEXT)
+
+struct coro {
+	ucontext_t ctx;
+	ucontext_t caller;
+	void *stack;
+	size_t stack_size;
+	void (*fn)(void*);
+	void *arg;
+	volatile bool done;
+};
+
+/* makecontext() only passes ints */
+static void context_main(unsigned hi, unsigned lo)
+{
+	struct coro *c = (struct coro*)(((uintptr_t)hi << 16 << 16) | lo);
+	while (true) {
+		c->fn(c->arg);
+		c->done = true;
+		swapcontext(&c->ctx, &c->caller);
+	}
+}
+
+bool coro_thread_init(void)
+{
+	return true;
+}
+
+struct coro *coro_new(size_t stack_size)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	struct coro *c = calloc(1, sizeof(struct coro));
+	if (!c)
+		return NULL;
+	/* Pages are committed as the stack grows. One more at the
+	 * bottom turns an overflow into a fault. */
+	stack_size = (stack_size + page - 1) / page * page;
+	c->stack_size = stack_size + page;
+	c->stack = mmap(NULL, c->stack_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+	if (c->stack == MAP_FAILED) {
+		free(c);
+		return NULL;
+	}
+	mprotect(c->stack, page, PROT_NONE);
+	if (getcontext(&c->ctx) != 0) {
+		munmap(c->stack, c->stack_size);
+		free(c);
+		return NULL;
+	}
+	c->ctx.uc_stack.ss_sp = (char*)c->stack + page;
+	c->ctx.uc_stack.ss_size = stack_size;
+	c->ctx.uc_link = NULL;
+	uintptr_t p = (uintptr_t)c;
+	makecontext(&c->ctx, (void (*)(void))context_main, 2,
+		(unsigned)(p >> 16 >> 16), (unsigned)(p & 0xffffffffu));
+	c->done = true;
+	return c;
+}
+
+void coro_delete(struct coro *c)
+{
+	munmap(c->stack, c->stack_size);
+	free(c);
+}
+
+void coro_resume(struct coro *c)
+{
+	swapcontext(&c->caller, &c->ctx);
+}
+
+void coro_yield(struct coro *c)
+{
+	swapcontext(&c->ctx, &c->caller);
+}
+
+#else
+
+struct coro {
+	bool done;
+};
+
+bool coro_thread_init(void)
+{
+	return true;
+}
+
+struct coro *coro_new(size_t stack_size)
+{
+	return NULL;
+}
+
+void coro_delete(struct coro *c)
+{
+}
+
+void coro_resume(struct coro *c)
+{
+}
+
+void coro_yield(struct coro *c)
+{
+}
+
+#endif
+
+void coro_start(struct coro *c, void (*fn)(void*), void *arg)
+{
+#if defined(CORO_FIBER) || defined(CORO_UCONTEXT)
+	c->fn = fn;
+	c->arg = arg;
+#endif
+	c->done = false;
+}
+
+bool coro_done(struct coro *c)
+{
+	return c->done;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2020, Twinkle Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Coro -- run a function on its own stack
+ *
+ * The function can suspend itself with coro_yield(), and be resumed
+ * later from any thread. Backed by ucontext, or fibers on Windows.
+ * Where neither is available coro_new() returns NULL and callers
+ * should just call the function.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct coro;
+
+/* Call once in every thread that resumes coros. */
+bool coro_thread_init(void);
+
+struct coro *coro_new(size_t stack_size);
+
+void coro_delete(struct coro *c);
+
+/* Have c run fn(arg) when resumed next. c must not be running. */
+void coro_start(struct coro *c, void (*fn)(void*), void *arg);
+
+/* Run c until it yields or fn returns. */
+void coro_resume(struct coro *c);
+
+/* Called by fn, return to the one that resumed c. */
+void coro_yield(struct coro *c);
+
+/* True once fn has returned. c can be started again. */
+bool coro_done(struct coro *c);
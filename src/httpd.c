@@ -45,6 +45,7 @@
 #include "common.h"
 #include "lisp_fs.h"
 #include "lisp_socket.h"
+#include "lisp_zstream.h"
 
 
 #define MAX_HTTP_HEADER_LINE (4*1024)
@@ -126,12 +127,11 @@ static void url_parse_query_string(Lisp_VM *vm, char *s, int url_encoded)
 
 
 
-static void parse_method(Lisp_VM *vm, Lisp_Buffer *line)
+/* s is a line of k bytes, null terminated */
+static void parse_method(Lisp_VM *vm, char *s, int k)
 {
 	// method line
-	char *s = (char*)lisp_buffer_bytes(line);
 	int j = 0;
-	int k = (int)lisp_buffer_size(line);
 	while (j < k && !isspace(s[j]))
 		j++;
 
@@ -181,21 +181,15 @@ static void parse_method(Lisp_VM *vm, Lisp_Buffer *line)
 	}
 }
 
-static void parse_header(Lisp_VM *vm, Lisp_Buffer *line)
+static void parse_header(Lisp_VM *vm, char *s, int k)
 {
-	char *s = (char*)lisp_buffer_bytes(line);
-	int j = 0;
-	int k = (int)lisp_buffer_size(line);
-	while (j < k && s[j] != ':')
-		j++;
-	
-	if (j < k && s[j] == ':') {
-		s[j++] = 0;
-		lisp_make_symbol(vm, s);
-	} else {
+	char *colon = memchr(s, ':', k);
+	if (!colon)
 		lisp_err(vm, "http read: bad header field");
-	}
-	
+	*colon = 0;
+	lisp_make_symbol(vm, s);
+
+	int j = (int)(colon - s) + 1;
 	while (j < k && isspace(s[j]))
 		j++;
 
@@ -212,6 +206,11 @@ static void parse_header(Lisp_VM *vm, Lisp_Buffer *line)
 
 /*
   (http-read <port>)
+
+  Lines are found with memchr() and parsed where they are in the
+  port buffer. Only a line split between two reads is copied. The
+  bytes after the headers stay in the port, so pipelined requests
+  are read from there without waiting for the socket.
 */
 static void op_http_read(Lisp_VM *vm, Lisp_Pair *args)
 {
@@ -233,39 +232,48 @@ static void op_http_read(Lisp_VM *vm, Lisp_Pair *args)
 				goto Done;
 			lisp_err(vm,"http-read: incomplete request");
 		}
-		uint8_t *p = (uint8_t*)lisp_port_pending_bytes(port);
-		unsigned i = 0;
-		for (i = 0; i < n; i++) {
-			if (p[i] == '\n') {
-				if (lisp_buffer_size(line) == 0) {
-					if (ln == 0) {
-						lisp_err(vm, "http-read: missing first line");
-					}
-					lisp_make_list(vm, ln-1);
-					lisp_make_symbol(vm, "headers");
-					lisp_exch(vm);
-					lisp_cons(vm);
-					total_bytes += i+1;
-					lisp_port_drain(port, i+1);
-					goto Done;
-				}
-				if (ln == 0) {
-					parse_method(vm, line);
-				} else {
-					parse_header(vm, line);
-				}
-				ln++;
-				lisp_buffer_set_size(line, 0);
-			} else if (p[i] != '\r'){
-				lisp_buffer_add_byte(line, p[i]);
+		char *p = (char*)lisp_port_pending_bytes(port);
+		char *nl = memchr(p, '\n', n);
+		size_t used = nl ? (size_t)(nl - p) + 1 : n;
+		if (lisp_buffer_size(line) + used > MAX_HTTP_HEADER_LINE)
+			lisp_err(vm, "Header line too big");
+		total_bytes += used;
+		if (!nl) {
+			lisp_buffer_add_bytes(line, p, n);
+			lisp_port_drain(port, n);
+			continue;
+		}
+
+		char *s = p;
+		size_t len = nl - p;
+		if (lisp_buffer_size(line) > 0) {
+			lisp_buffer_add_bytes(line, p, len + 1);
+			s = (char*)lisp_buffer_bytes(line);
+			len = lisp_buffer_size(line) - 1;
+		}
+		if (len > 0 && s[len-1] == '\r')
+			len--;
+		s[len] = 0;
+
+		if (len == 0) {
+			if (ln == 0) {
+				lisp_err(vm, "http-read: missing first line");
 			}
+			lisp_make_list(vm, ln-1);
+			lisp_make_symbol(vm, "headers");
+			lisp_exch(vm);
+			lisp_cons(vm);
+			lisp_port_drain(port, used);
+			goto Done;
 		}
-		
-		if (lisp_buffer_size(line) > MAX_HTTP_HEADER_LINE)
-			lisp_err(vm, "Header line too big");
-		
-		total_bytes += n;
-		lisp_port_drain(port, n);
+		if (ln == 0) {
+			parse_method(vm, s, (int)len);
+		} else {
+			parse_header(vm, s, (int)len);
+		}
+		ln++;
+		lisp_buffer_set_size(line, 0);
+		lisp_port_drain(port, used);
 	}
 
 Done:
@@ -353,40 +361,44 @@ static const char *websocket_op_table[16] = {
 	[10] = "pong"
 };
 
-/* (websocket-read <port>)
- * return a websocket frame.
- *
- */
-static void op_websocket_read(Lisp_VM *vm, Lisp_Pair *args)
+#define WEBSOCKET_MAX_PAYLOAD (16*1024*1024)
+#define WEBSOCKET_CONTROL_P(op) ((op) >= WEBSOCKET_OP_CLOSE)
+#define WEBSOCKET_FIN 0x80
+#define WEBSOCKET_RSV1 0x40 // compressed, see permessage-deflate
+
+struct websocket_frame {
+	int fin;
+	int rsv1;
+	int opcode;
+	int mask;
+	uint8_t masking_key[4];
+	uint64_t payload_len;
+};
+
+/* Return false if the port is at its end, before any byte */
+static bool read_frame_head(Lisp_VM *vm, Lisp_Port *port, struct websocket_frame *f)
 {
-	if (!lisp_input_port_p(CAR(args))) {
-		lisp_err(vm, "http-read: not input port");
-	}
-	Lisp_Port *port = (Lisp_Port*)CAR(args);
 	int b0 = lisp_port_getc(port);
 	if (b0 == EOF)
-	{
-		lisp_push(vm, lisp_false);
-		return;
-	}
+		return false;
 	int b1 = read_byte(vm, port);
-	int fin = !!(b0 & 0x80);
-	int opcode = (b0 & 0xf);
-	int mask = !!(b1 & 0x80);
-	uint8_t masking_key[4];
-	uint64_t payload_len = (b1 & 0x7f);
+	f->fin = !!(b0 & WEBSOCKET_FIN);
+	f->rsv1 = !!(b0 & WEBSOCKET_RSV1);
+	f->opcode = (b0 & 0xf);
+	f->mask = !!(b1 & 0x80);
+	f->payload_len = (b1 & 0x7f);
 	
-	if (!mask && payload_len > 0) {
+	if (!f->mask && f->payload_len > 0) {
 		lisp_err(vm, "websocket-read: frame not masked");
 	}
 	
-	if (payload_len == 126) {
-		payload_len = (
+	if (f->payload_len == 126) {
+		f->payload_len = (
 			((uint64_t)read_byte(vm, port) << 8) |
 			((uint64_t)read_byte(vm, port) << 0)
 		);
-	} else if (payload_len == 127) {
-		payload_len = (
+	} else if (f->payload_len == 127) {
+		f->payload_len = (
 			((uint64_t)read_byte(vm, port) <<56) |
 			((uint64_t)read_byte(vm, port) <<48) |
 			((uint64_t)read_byte(vm, port) <<40) |
@@ -398,53 +410,156 @@ static void op_websocket_read(Lisp_VM *vm, Lisp_Pair *args)
 		);
 	}
 	
-	if (payload_len >= 16*1024*1024)
+	if (f->payload_len >= WEBSOCKET_MAX_PAYLOAD)
 		lisp_err(vm, "websocket-read: payload too large, maximum=16MiB");
 	
-	if (mask) {
-		masking_key[0] = read_byte(vm, port);
-		masking_key[1] = read_byte(vm, port);
-		masking_key[2] = read_byte(vm, port);
-		masking_key[3] = read_byte(vm, port);
+	if (f->mask) {
+		f->masking_key[0] = read_byte(vm, port);
+		f->masking_key[1] = read_byte(vm, port);
+		f->masking_key[2] = read_byte(vm, port);
+		f->masking_key[3] = read_byte(vm, port);
 	}
-	
-	lisp_begin_list(vm);
+	return true;
+}
 
-	if (websocket_op_table[opcode]) {
-		lisp_make_symbol(vm, websocket_op_table[opcode]);
-	} else {
-		lisp_push_number(vm, opcode);
+/*
+ * dst = src ^ key, 8 bytes at a time. offset is how many bytes of the
+ * payload came before src, it tells where we are in the key.
+ */
+static void unmask(uint8_t *dst, const uint8_t *src, size_t len,
+  const uint8_t key[4], size_t offset)
+{
+	uint8_t k[8];
+	uint64_t kw;
+	size_t i = 0;
+	for (int j = 0; j < 8; j++)
+		k[j] = key[(offset + j) & 3];
+	memcpy(&kw, k, 8);
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, src + i, 8);
+		w ^= kw;
+		memcpy(dst + i, &w, 8);
 	}
+	for (; i < len; i++)
+		dst[i] = src[i] ^ k[i & 7];
+}
 
-	Lisp_Buffer *b = lisp_push_buffer(vm, NULL, (size_t)payload_len);
-	int n = 0;
-	while (n < payload_len)
+/* Append the payload of f to b, unmasked on the way out of the port */
+static void read_frame_payload(Lisp_VM *vm, Lisp_Port *port,
+  struct websocket_frame *f, Lisp_Buffer *b)
+{
+	size_t start = lisp_buffer_size(b);
+	size_t total = start + (size_t)f->payload_len;
+	if (total >= WEBSOCKET_MAX_PAYLOAD)
+		lisp_err(vm, "websocket-read: message too large, maximum=16MiB");
+	if (total > lisp_buffer_cap(b))
+		lisp_buffer_grow(b, total);
+	uint8_t *p = (uint8_t*)lisp_buffer_bytes(b) + start;
+	size_t n = 0;
+	while (n < f->payload_len)
 	{
 		size_t x = lisp_port_fill(port);
 		if (x == 0)
 			lisp_err(vm, "bad frame: missing payload");
-		x = MIN(x, (size_t)(payload_len-n));
-		lisp_buffer_add_bytes(b, lisp_port_pending_bytes(port), x);
+		x = MIN(x, (size_t)(f->payload_len-n));
+		const uint8_t *src = lisp_port_pending_bytes(port);
+		if (f->mask)
+			unmask(p + n, src, x, f->masking_key, n);
+		else
+			memcpy(p + n, src, x);
 		// Remove added bytes from input buffer
 		lisp_port_drain(port, x);
 		n += x;
 	}
-	assert(lisp_buffer_size(b) == payload_len);
+	lisp_buffer_set_size(b, total);
+}
+
+/* (websocket-read <port> [<coalesce>])
+ * return a websocket frame.
+ *
+ * With <coalesce>, the fragments of a message are read and returned
+ * as one frame. Control frames sent in between are returned with it,
+ * under `controls'. A compressed message is always coalesced.
+ */
+static void op_websocket_read(Lisp_VM *vm, Lisp_Pair *args)
+{
+	if (!lisp_input_port_p(CAR(args))) {
+		lisp_err(vm, "http-read: not input port");
+	}
+	Lisp_Port *port = (Lisp_Port*)CAR(args);
+	bool coalesce = (void*)lisp_nil != CDR(args) && CADR(args) == lisp_true;
+	struct websocket_frame f;
+	if (!read_frame_head(vm, port, &f))
+	{
+		lisp_push(vm, lisp_false);
+		return;
+	}
+	int opcode = f.opcode;
+	bool compressed = f.rsv1 && !WEBSOCKET_CONTROL_P(opcode);
+	
+	lisp_begin_list(vm);
 
-	if (mask) {
-		uint8_t *p = lisp_buffer_bytes(b);
-		for (int i = 0; i < payload_len; i++) {
-			p[i] ^= masking_key[i%4];
+	if (websocket_op_table[opcode]) {
+		lisp_make_symbol(vm, websocket_op_table[opcode]);
+	} else {
+		lisp_push_number(vm, opcode);
+	}
+
+	size_t cap = (size_t)f.payload_len;
+	Lisp_Buffer *b = lisp_push_buffer(vm, NULL, cap > 0 ? cap : 16);
+	read_frame_payload(vm, port, &f, b);
+
+	int ncontrols = 0;
+	if ((coalesce || compressed) && !WEBSOCKET_CONTROL_P(opcode)) {
+		while (!f.fin) {
+			if (!read_frame_head(vm, port, &f))
+				lisp_err(vm, "websocket-read: missing fragment");
+			if (WEBSOCKET_CONTROL_P(f.opcode)) {
+				lisp_make_symbol(vm, websocket_op_table[f.opcode]
+				  ? websocket_op_table[f.opcode] : "control");
+				cap = (size_t)f.payload_len;
+				Lisp_Buffer *c = lisp_push_buffer(vm, NULL, cap > 0 ? cap : 16);
+				read_frame_payload(vm, port, &f, c);
+				lisp_make_list(vm, 2);
+				ncontrols++;
+				f.fin = 0;
+			} else if (f.opcode == WEBSOCKET_OP_CONTINUATION) {
+				read_frame_payload(vm, port, &f, b);
+			} else {
+				lisp_err(vm, "websocket-read: fragment expected");
+			}
 		}
 	}
+
+	if (compressed) {
+		Lisp_Buffer *z = lisp_push_buffer(vm, NULL, lisp_buffer_size(b) * 2 + 16);
+		if (!lisp_zstream_inflate_message(z, lisp_buffer_bytes(b),
+		  lisp_buffer_size(b), WEBSOCKET_MAX_PAYLOAD))
+			lisp_err(vm, "websocket-read: bad compressed message");
+		lisp_buffer_set_size(b, 0);
+		lisp_buffer_add_bytes(b, lisp_buffer_bytes(z), lisp_buffer_size(z));
+		lisp_pop(vm, 1);
+	}
+
+	if (ncontrols > 0) {
+		lisp_make_list(vm, ncontrols);
+		lisp_make_symbol(vm, "controls");
+		lisp_exch(vm);
+		lisp_cons(vm);
+		lisp_exch(vm); // payload back on top
+	}
 	
 	if (opcode == WEBSOCKET_OP_TEXT) {
 		lisp_push_string_from_buffer(vm, b);
 		lisp_exch(vm);
 		lisp_pop(vm, 1);
 	}
+
+	if (ncontrols > 0)
+		lisp_exch(vm);
 	
-	if (fin) {
+	if (f.fin) {
 		lisp_make_symbol(vm, "fin");
 		lisp_push(vm, lisp_true);
 		lisp_cons(vm);
@@ -453,19 +568,14 @@ static void op_websocket_read(Lisp_VM *vm, Lisp_Pair *args)
 	lisp_end_list(vm);
 }
 
-/* (websocket-write <data> <port>) */
-static void op_websocket_write(Lisp_VM *vm, Lisp_Pair *args)
+/* Frame header, and payload that may be deflated */
+static void write_frame(Lisp_VM *vm, Lisp_Port *output, Lisp_Object *o, bool deflate)
 {
-	Lisp_Object *o = CAR(args);
-	Lisp_Port *output = (Lisp_Port*)CADR(args);
 	int opcode = -1;
 	const uint8_t *payload = NULL;
 	size_t len = 0;
 	int fin = 1;
-	
-	if (!lisp_output_port_p((Lisp_Object*)output)) {
-		lisp_err(vm, "not output port");
-	}
+	int rsv1 = 0;
 	
 	if (lisp_buffer_p(o)) {
 		opcode = WEBSOCKET_OP_BINARY;
@@ -487,34 +597,146 @@ static void op_websocket_write(Lisp_VM *vm, Lisp_Pair *args)
 		} else {
 			lisp_err(vm, "unrecognized op: %s", s);
 		}
+	} else {
+		lisp_err(vm, "websocket-write: bad data");
 	}
 	
-	if (len >= 16*1024*1024) {
+	if (len >= WEBSOCKET_MAX_PAYLOAD) {
 		lisp_err(vm, "payload too large");
 	}
+
+	// Tiny payloads do not shrink
+	Lisp_Buffer *z = NULL;
+	if (deflate && len >= 64) {
+		z = lisp_push_buffer(vm, NULL, len / 2 + 64);
+		if (!lisp_zstream_deflate_message(z, payload, len))
+			lisp_err(vm, "websocket-write: deflate failed");
+		payload = lisp_buffer_bytes(z);
+		len = lisp_buffer_size(z);
+		rsv1 = 1;
+	}
 	
-	lisp_port_putc(output, (fin << 7) | opcode);
+	uint8_t hdr[10];
+	int k = 0;
+	hdr[k++] = (uint8_t)((fin << 7) | (rsv1 << 6) | opcode);
 	if (len < 126) {
-		lisp_port_putc(output, (int)len);
+		hdr[k++] = (uint8_t)len;
 	} else if (len < 65535) {
-		lisp_port_putc(output, 126);
-		lisp_port_putc(output, (len >> 8) & 0xff);
-		lisp_port_putc(output, (len >> 0) & 0xff);
+		hdr[k++] = 126;
+		hdr[k++] = (len >> 8) & 0xff;
+		hdr[k++] = (len >> 0) & 0xff;
 	} else {
-		lisp_port_putc(output, 127);
-		lisp_port_putc(output, 0);
-		lisp_port_putc(output, 0);
-		lisp_port_putc(output, 0);
-		lisp_port_putc(output, 0);
-		lisp_port_putc(output, (len >>24) & 0xff);
-		lisp_port_putc(output, (len >>16) & 0xff);
-		lisp_port_putc(output, (len >> 8) & 0xff);
-		lisp_port_putc(output, (len >> 0) & 0xff);
+		hdr[k++] = 127;
+		hdr[k++] = 0;
+		hdr[k++] = 0;
+		hdr[k++] = 0;
+		hdr[k++] = 0;
+		hdr[k++] = (len >>24) & 0xff;
+		hdr[k++] = (len >>16) & 0xff;
+		hdr[k++] = (len >> 8) & 0xff;
+		hdr[k++] = (len >> 0) & 0xff;
 	}
+	lisp_port_put_bytes(output, hdr, k);
 	
 	if (len > 0) {
 		lisp_port_put_bytes(output, payload, len);
 	}
+	if (z)
+		lisp_pop(vm, 1);
+}
+
+/* (websocket-write <data> <port> [<deflate>])
+ *
+ * <data> is a frame, or a list of frames to be written one after
+ * another. They stay in the port buffer as far as they fit, so
+ * a flush sends them together. With <deflate>, text and binary
+ * frames are compressed, if permessage-deflate was agreed on.
+ */
+static void op_websocket_write(Lisp_VM *vm, Lisp_Pair *args)
+{
+	Lisp_Object *o = CAR(args);
+	Lisp_Port *output = (Lisp_Port*)CADR(args);
+	bool deflate = (void*)lisp_nil != CDDR(args) && CADDR(args) == lisp_true;
+	
+	if (!lisp_output_port_p((Lisp_Object*)output)) {
+		lisp_err(vm, "not output port");
+	}
+
+	if (lisp_pair_p(o)) {
+		for (; o != lisp_nil && lisp_pair_p(o); o = CDR(o))
+			write_frame(vm, output, CAR(o), deflate);
+	} else {
+		write_frame(vm, output, o, deflate);
+	}
+	lisp_push(vm, lisp_undef);
+}
+
+struct chunked_stream {
+	Lisp_Port *port;
+};
+
+/* Each flush of the port becomes one chunk */
+static size_t chunked_stream_write(void *context, const void *buf, size_t size)
+{
+	struct chunked_stream *s = context;
+	char head[24];
+	if (!s->port)
+		return 0;
+	if (size > 0) {
+		int n = snprintf(head, sizeof(head), "%zx\r\n", size);
+		lisp_port_put_bytes(s->port, head, n);
+		lisp_port_put_bytes(s->port, buf, size);
+		lisp_port_put_bytes(s->port, "\r\n", 2);
+	}
+	return size;
+}
+
+static void chunked_stream_mark(void *context)
+{
+	struct chunked_stream *s = context;
+	if (s->port)
+		lisp_mark((Lisp_Object*)s->port);
+}
+
+static struct lisp_stream_class_t chunked_stream_class = {
+	.context_size = sizeof(struct chunked_stream),
+	.write = chunked_stream_write,
+	.mark = chunked_stream_mark
+};
+
+/* (open-chunked-output <port>)
+ * Bytes written are sent to <port> with the chunked transfer coding.
+ * (chunked-output-finish <chunked-port>) ends the body.
+ */
+static void op_open_chunked_output(Lisp_VM *vm, Lisp_Pair *args)
+{
+	if (!lisp_output_port_p(CAR(args)))
+		lisp_err(vm, "Bad output port");
+	lisp_push_buffer(vm, NULL, 16*1024);
+	Lisp_Stream *stream = lisp_push_stream(vm, &chunked_stream_class, NULL);
+	struct chunked_stream *s = lisp_stream_context(stream);
+	s->port = (Lisp_Port*)CAR(args);
+	lisp_make_output_port(vm);
+}
+
+/* (chunked-output-finish <chunked-port>)
+ * Send what is left and the last chunk, then flush the port below.
+ */
+static void op_chunked_output_finish(Lisp_VM *vm, Lisp_Pair *args)
+{
+	if (!lisp_output_port_p(CAR(args)))
+		lisp_err(vm, "Bad output port");
+	Lisp_Port *p = (Lisp_Port*)CAR(args);
+	Lisp_Stream *stream = lisp_port_get_stream(p);
+	if (!stream || lisp_stream_class(stream) != &chunked_stream_class)
+		lisp_err(vm, "Bad chunked port");
+	lisp_port_flush(p);
+	struct chunked_stream *s = lisp_stream_context(stream);
+	if (s->port) {
+		lisp_port_put_bytes(s->port, "0\r\n\r\n", 5);
+		lisp_port_flush(s->port);
+		s->port = NULL;
+	}
 	lisp_push(vm, lisp_undef);
 }
 
@@ -524,6 +746,8 @@ bool lisp_http_init(Lisp_VM *vm)
 	lisp_defn(vm, "websocket-read", op_websocket_read);
 	lisp_defn(vm, "websocket-write", op_websocket_write);
 	lisp_defn(vm, "http-parse-range", op_http_parse_range);
+	lisp_defn(vm, "open-chunked-output", op_open_chunked_output);
+	lisp_defn(vm, "chunked-output-finish", op_chunked_output_finish);
 	return true;
 }
 
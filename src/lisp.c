@@ -29,30 +29,45 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #ifdef WIN32
+#include <windows.h>
 #include <io.h>
 #define fileno(x) _fileno(x)
 #define isatty(x) _isatty(x)
 #define stat _stat
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #endif
 #include "./lisp.h"
+#include "./bytes.h"
+#include "./microtime.h"
 
 #define PROGNAME "lisp"
 #define IOBUFSIZE 256 /* Port buffer size */
 #define FILEIOBUFSIZE 1024 /* File Port buffer size */
+#define MINMAPSIZE 4096 /* Smaller files are read by a port rather than mapped */
 #define TOKENBUFSIZE 256 /* Tokenizer buffer size */
 #define INISTACKSIZE 512 /* Initial stack size */
 #define INIPOOLSIZE 1024 /* Initial object pool size */
+#define MINPOOLSIZE 64 /* Nursery grows from this to INIPOOLSIZE before a gc */
+#define MINMAJORGCSIZE (INIPOOLSIZE*8) /* Old objects before a full gc */
 #define INISYMLISTSIZE 512 /* Initial symbols dictionary size */
 #define INIFILELISTSIZE 64 /* Initial source files dictionary size  */
 #define MAX_DEPTH    1000 /* Max nested levels for expression eval */
+#define ICACHESIZE 128 /* Method lookup cache entries. See cached_assoc() */
+#define PROFILEINTERVAL 1000 /* Default evaluations between profile samples */
 #define BLKSIZE 16  /* Min memory block size */
 #define DTOA_BUFSIZE 32 /* dtoa() buffer size */
 #define MAX_CACHED_OBJECT_SIZE 128 /* Max cachable memory block */
+#define ARENACHUNKSIZE (64*1024) /* Small blocks are carved from such chunks */
+#define MINARENACHUNKSIZE (4*1024) /* First chunk of a vm, doubled up to ARENACHUNKSIZE */
+#define INIOLDPOOLSIZE 64 /* Initial old object pool size */
+#define MAXREGIONPOOLSIZE (INIPOOLSIZE*64) /* Nursery limit inside a region */
 #define MAX_SYMBOL_LENGTH 127 /* Limit for parsing symbols in source */
 #define DEBUG_TOKENIZER 0
 
@@ -70,6 +85,19 @@
 #endif
 #define MAX(a,b) ((a)>(b)?(a):(b))
 #define MIN(a,b) ((a)>(b)?(b):(a))
+/*
+ * Caches kept in code and procedures, which child VMs on other
+ * threads may run at the same time, are read and written whole.
+ */
+#ifdef _WIN32
+#  define load_word(p) (*(volatile uint32_t*)(p))
+#  define store_word(p, v) (*(volatile uint32_t*)(p) = (v))
+#  define bump_word(p) InterlockedIncrement((volatile LONG*)(p))
+#else
+#  define load_word(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#  define store_word(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#  define bump_word(p) __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#endif
 // Windows always use little endian.
 #ifdef _WIN32
 #  define __BYTE_ORDER__ __ORDER_LITTLE_ENDIAN__
@@ -89,7 +117,10 @@ static void memcpy_r(uint8_t *dest, const uint8_t *src, size_t n)
 
 typedef struct Lisp_SourceFile Lisp_SourceFile;
 typedef struct Lisp_SourceMapping Lisp_SourceMapping;
+typedef struct Cached_Source Cached_Source;
+typedef struct Lisp_Hamt Lisp_Hamt;
 typedef struct lisp_memblock_t lisp_memblock_t;
+typedef struct lisp_chunk_t lisp_chunk_t;
 
 typedef enum {
 	T_INVALID = 0, T_EOF,
@@ -98,6 +129,7 @@ typedef enum {
 	T_LBRACKET, T_RBRACKET, T_LBRACE, T_RBRACE,
 	T_QUOTE, T_QUASIQUOTE, T_UNQUOTE, T_UNQUOTE_SPLICING,
 	T_AT, T_DOLLAR, T_CIRCUMFLEX, T_BUFFER, T_ARRAY_BEGIN, T_DICT_BEGIN,
+	T_HAMT_BEGIN,
 	T_COLON, T_STRING_PART, T_COLON_COMPONENT
 } Token_Type;
 
@@ -105,7 +137,7 @@ typedef enum {
   O_INVALID, O_BUFFER, O_PORT, O_SYMBOL, O_STRING, O_NUMBER, O_PAIR,
 	O_ARRAY, O_DICT, O_ENV, O_PROC, O_NATIVE_PROC, O_MACRO,
 	O_OBJECT_EX, O_STREAM,
-	O_SOURCE_FILE, O_SOURCE_MAPPING, O_MAX
+	O_SOURCE_FILE, O_SOURCE_MAPPING, O_HAMT, O_MAX
 } Object_Type;
 
 struct Lisp_Object {
@@ -120,6 +152,8 @@ struct Lisp_Object {
 	unsigned tail_call   : 1; /* pair is a tail call */
 	unsigned is_return   : 1; /* pair is a returning result */
 	unsigned no_def      : 1; /* prohibit new definition in env */
+	unsigned old         : 1; /* promoted to old generation */
+	unsigned remembered  : 1; /* old object in remembered set */
 };
 
 struct Lisp_Buffer {
@@ -128,6 +162,7 @@ struct Lisp_Buffer {
 	size_t length;
 	size_t cap;
 	Lisp_VM *vm;
+	void *map; /* buf is a private mapping of a file, see lisp_buffer_map_file() */
 };
 
 struct Lisp_Stream {
@@ -157,15 +192,22 @@ struct Lisp_Port {
 	Lisp_Buffer *iobuf;
 	Lisp_Stream *stream; /* could be a filter */
 	Lisp_SourceFile *src_file;
+	Cached_Source *source; // see open_source()
+	size_t source_next; // next form to decode from source
 	size_t input_pos;  // getc pointer to iobuf. Input port only
 	uint32_t line; // 1-based. Defined only in input port
 	uint32_t src_pos; // 0-based. Only in input port.
 	size_t byte_count; // Input/Output Bytes
 	size_t max_output;
+	size_t binary_limit; // largest binary object taken, 0 for none
 	unsigned isatty: 1; // file port only
 	unsigned no_buf: 1; // for error output purpose
+	unsigned full_buf: 1; // flush when full or asked, not at newlines
+	unsigned mapped: 1; // iobuf is a mapping of its own, released at close
 	unsigned out: 1; // is a output port.
 	unsigned closed: 1; // port is closed
+	unsigned compile: 1; // compile procedures defined in this file
+	unsigned recording: 1; // forms read go to source, not yet cached
 };
 
 struct Lisp_Number {
@@ -175,6 +217,7 @@ struct Lisp_Number {
 
 struct Lisp_Pair {
 	Lisp_Object obj;
+	uint32_t addr; /* depth<<16|slot of car variable, or slot of binding in dict */
 	Lisp_SourceMapping *mapping;
 	Lisp_Object *car, *cdr;
 };
@@ -191,25 +234,42 @@ struct Lisp_String {
 	uint32_t hash;
 	const char *buf;
 	size_t length;
+	Lisp_String *base;    // owner of buf if this is a tail of it
+};
+
+/* A node of a hash array mapped trie, see lisp_hamt_set() */
+struct Lisp_Hamt {
+	Lisp_Object obj;
+	uint32_t bitmap;      // slots used, one bit each, by hash bits
+	uint32_t n;           // items
+	uint32_t size;        // entries under the node
+	Lisp_Object **items;  // (key . value) pairs and child nodes
 };
 
 struct Lisp_Env {
 	Lisp_Object obj;
 	Lisp_Array *bindings; /* of type dict */
 	struct Lisp_Env *parent;
+	uint64_t names; /* bloom filter of bound names */
+	uint32_t cached; /* searched by an inline cache entry, see cached_assoc() */
 };
 
 typedef struct { // Procedure
 	Lisp_Object obj;
 	Lisp_Env *env;
 	Lisp_Pair *lambda;
+	Lisp_Array *code; /* compiled body or NULL. See exec_code() */
+	uint32_t scan; /* 0 until scanned, then SCANNED and CAPTURES if the body may keep its env */
 } Lisp_Proc;
 
+enum { SCANNED = 1, CAPTURES = 2 }; /* Lisp_Proc scan, see may_capture_env() */
+
 typedef struct {
 	Lisp_Object obj;
 	Lisp_Env *env;
 	Lisp_String *name;
 	lisp_func fn;
+	lisp_stack_func fn_stack; /* Takes arguments on stack. See lisp_arg() */
 } Lisp_Native_Proc;
 
 struct Lisp_ObjectEx {
@@ -232,15 +292,34 @@ struct Lisp_SourceMapping {
 	uint32_t begin, end;
 	uint32_t line;
 	uint32_t cnt;
+	Lisp_Buffer *lazy; // positions of the lists under expr, see expr_mapping()
 };
 
 // Lisp_VM -- Virtual Machine State
+typedef struct {
+	Lisp_Pair *site; /* expression of the call */
+	Lisp_Env *env; /* where the lookup started */
+	Lisp_Pair *binding; /* found binding */
+	uint32_t epoch; /* valid while equal to cache_epoch */
+} Inline_Cache;
+
+/*
+ * Bumped when cached lookups may change. It is shared by all VMs,
+ * since child VMs search the envs of their parent.
+ */
+static uint32_t cache_epoch;
+
 struct Lisp_VM {
 	int eval_level;
 	Lisp_VM *parent;
 	Lisp_Env *env, *root_env;
 	Lisp_Array *stack;
-	Lisp_Array *pool;
+	Lisp_Array *pool; // young generation
+	Lisp_Array *old_pool; // objects survived at least one collection
+	Lisp_Array *remembered; // old objects which may point to young ones
+	size_t major_threshold; // old pool size to trigger full collection
+	lisp_gc_stats_t gc_stats;
+	Inline_Cache icache[ICACHESIZE];
 	Lisp_Array *symbols; // dictionary of all dynamic symbols; reduce sym check to ptr comp
 	Lisp_Array *source_files; // dictionary of all loaded files
 	Lisp_Array *keep_alive_pool;
@@ -253,6 +332,21 @@ struct Lisp_VM {
 	Lisp_Buffer* token;
 	Token_Type token_type;
 	lisp_memblock_t *freelist[MAX_CACHED_OBJECT_SIZE/BLKSIZE];
+	lisp_chunk_t *chunks; /* arena chunks of small blocks */
+	size_t chunk_size; /* size of the next chunk */
+	char *arena, *arena_end; /* free part of the current chunk */
+	int region; /* nesting depth of regions. See lisp_vm_begin_region() */
+	size_t region_pool_cap; /* nursery capacity when region began */
+	unsigned profile_interval; /* evaluations between samples, 0 if off */
+	unsigned profile_tick; /* evaluations left until next sample */
+	double profile_time; /* clock of the last sample, or time since it if paused */
+	bool profile_paused; /* see lisp_vm_pause_profile() */
+	Lisp_Array *profile; /* folded stack -> seconds. See profile_sample() */
+	Lisp_Buffer *profile_buf; /* scratch for building folded stacks */
+	unsigned yield_budget; /* evaluations between yields, 0 if off */
+	unsigned yield_tick; /* evaluations left until next yield */
+	void (*yield)(Lisp_VM*); /* See lisp_vm_set_yield() */
+	uintptr_t stack_limit; /* lowest C stack address allowed, see check_stack() */
 	struct {
 		uint32_t first_line, first_pos;
 		uint32_t last_line, last_pos;
@@ -354,6 +448,7 @@ static Lisp_String _symtab[] = {
 	_SYM("clear!",                  0,1,0), // S_CLEAR
 	_SYM("clone",                   0,1,0), // S_CLONE
 	_SYM("close",                   0,1,0), // S_CLOSE
+	_SYM("compile",                 0,1,0), // S_COMPILE
 	_SYM("concat",                  0,1,0), // S_CONCAT
 	_SYM("cond",                    0,1,1), // S_COND
 	_SYM("cons",                    0,1,0), // S_CONS
@@ -387,13 +482,24 @@ static Lisp_String _symtab[] = {
 	_SYM("floor",                   0,1,0), // S_FLOOR
 	_SYM("flush",                   0,1,0), // S_FLUSH
 	_SYM("format",                  0,1,0), // S_FORMAT
+	_SYM("gc-stats",                0,1,0), // S_GC_STATS
 	_SYM("get",                     0,1,0), // S_GET
 	_SYM("get-byte-count",          0,1,0), // S_GET_BYTE_COUNT
 	_SYM("get-output-buffer",       0,1,0), // S_GET_OUTPUT_BUFFER
+	_SYM("get-output-string",       0,1,0), // S_GET_OUTPUT_STRING
+	_SYM("hamt",                    0,1,0), // S_HAMT
+	_SYM("hamt->list",              0,1,0), // S_HAMT_TO_LIST
+	_SYM("hamt-count",              0,1,0), // S_HAMT_COUNT
+	_SYM("hamt-get",                0,1,0), // S_HAMT_GET
+	_SYM("hamt-set",                0,1,0), // S_HAMT_SET
+	_SYM("hamt-unset",              0,1,0), // S_HAMT_UNSET
+	_SYM("hamt?",                   0,1,0), // S_HAMTP
 	_SYM("if",                      0,1,1), // S_IF
 	_SYM("input-port?",             0,1,0), // S_INPUT_PORTP
 	_SYM("integer?",                0,1,0), // S_INTEGERP
 	_SYM("join",                    0,1,0), // S_JOIN
+	_SYM("json-decode",             0,1,0), // S_JSON_DECODE
+	_SYM("json-encode",             0,1,0), // S_JSON_ENCODE
 	_SYM("lambda",                  0,1,1), // S_LAMBDA
 	_SYM("length",                  0,1,0), // S_LENGTH
 	_SYM("let",                     0,1,1), // S_LET
@@ -417,12 +523,16 @@ static Lisp_String _symtab[] = {
 	_SYM("open-input-file",         0,1,0), // S_OPEN_INPUT_FILE
 	_SYM("open-output-buffer",      0,1,0), // S_OPEN_OUTPUT_BUFFER
 	_SYM("open-output-file",        0,1,0), // S_OPEN_OUTPUT_FILE
+	_SYM("open-output-string",      0,1,0), // S_OPEN_OUTPUT_STRING
 	_SYM("or",                      0,1,1), // S_OR
 	_SYM("output-port?",            0,1,0), // S_OUTPUT_PORTP
 	_SYM("pair?",                   0,1,0), // S_PAIRP
 	_SYM("print",                   0,1,0), // S_PRINT
 	_SYM("println",                 0,1,0), // S_PRINTLN
 	_SYM("procedure?",              0,1,0), // S_PROCEDUREP
+	_SYM("profile-dump",            0,1,0), // S_PROFILE_DUMP
+	_SYM("profile-start",           0,1,0), // S_PROFILE_START
+	_SYM("profile-stop",            0,1,0), // S_PROFILE_STOP
 	_SYM("pump",                    0,1,0), // S_PUMP
 	_SYM("quasiquote",              0,1,1), // S_QUASIQUOTE
 	_SYM("quote",                   0,1,1), // S_QUOTE
@@ -445,6 +555,7 @@ static Lisp_String _symtab[] = {
 	_SYM("string->buffer",          0,1,0), // S_STRING_TO_BUFFER
 	_SYM("string->number",          0,1,0), // S_STRING_TO_NUMBER
 	_SYM("string->symbol",          0,1,0), // S_STRING_TO_SYMBOL
+	_SYM("string-append!",          0,1,0), // S_STRING_APPEND
 	_SYM("string-compare",          0,1,0), // S_STRING_COMPARE
 	_SYM("string-find",             0,1,0), // S_STRING_FIND
 	_SYM("string-find-backward",    0,1,0), // S_STRING_FIND_BACKWARD
@@ -466,6 +577,7 @@ static Lisp_String _symtab[] = {
 	_SYM("unquote",                 1,0,0), // S_UNQUOTE
 	_SYM("unquote-splicing",        1,0,0), // S_UNQUOTE_SPLICING
 	_SYM("untrace",                 0,1,0), // S_UNTRACE
+	_SYM("with-arena",              0,1,1), // S_WITH_ARENA
 	_SYM("with-input",              0,1,1), // S_WITH_INPUT
 	_SYM("with-output",             0,1,1), // S_WITH_OUTPUT
 	_SYM("write",                   0,1,0), // S_WRITE
@@ -489,31 +601,34 @@ enum SymID { /* Must follow the order in `_symtab' */
 	S_BUFFER_GETU8, S_BUFFER_SET, S_BUFFER_SETD, S_BUFFER_SETF,
 	S_BUFFER_SETI16, S_BUFFER_SETI32, S_BUFFER_SETI8, S_BUFFER_SETU16,
 	S_BUFFER_SETU32, S_BUFFER_SETU8, S_CAR, S_CASE, S_CATCH, S_CDR,
-	S_CEIL, S_CHAR_AT, S_CLEAR, S_CLONE, S_CLOSE,
+	S_CEIL, S_CHAR_AT, S_CLEAR, S_CLONE, S_CLOSE, S_COMPILE,
 	S_CONCAT, S_COND, S_CONS, S_CONSQ, S_COS,
 	S_CURRENT_INPUT, S_CURRENT_OUTPUT, S_DATE, S_DEBUG, S_DEFCONST, S_DEFINE,
 	S_DEFMACRO, S_DEFMETHOD, S_DICT, S_DICT_TO_LIST,
 	S_DICT_GET, S_DICT_SET, S_DICT_UNSET, S_DICTP,
 	S_DISPLAY, S_ELSE, S_ENVP, S_EQP, S_ERROR,
 	S_EVAL, S_EVALQ, S_EXISTS, S_EXP, S_FALSE, S_FIND_FILE, S_FLOOR, S_FLUSH,
-	S_FORMAT, S_GET, S_GET_BYTE_COUNT, S_GET_OUTPUT_BUFFER, S_IF, S_INPUT_PORTP,
-	S_INTEGERP, S_JOIN, S_LAMBDA, S_LENGTH, S_LET,
+	S_FORMAT, S_GC_STATS, S_GET, S_GET_BYTE_COUNT, S_GET_OUTPUT_BUFFER,
+	S_GET_OUTPUT_STRING, 	S_HAMT, S_HAMT_TO_LIST, S_HAMT_COUNT, S_HAMT_GET, S_HAMT_SET, S_HAMT_UNSET,
+	S_HAMTP, S_IF, S_INPUT_PORTP,
+	S_INTEGERP, S_JOIN, S_JSON_DECODE, S_JSON_ENCODE, S_LAMBDA, S_LENGTH, S_LET,
 	S_LIST, S_LISTP, S_LOAD, S_LOAD_PATH, S_LOG,
 	S_MAKE_BUFFER, S_MATCH, S_METHODP, S_MOD, S_NEW, S_NEWLINE, S_NOT,
 	S_NTH, S_NULLP, S_NUMBER_TO_STRING, S_NUMBERP,
 	S_OPEN_INPUT_BUFFER, S_OPEN_INPUT_FILE, S_OPEN_OUTPUT_BUFFER, S_OPEN_OUTPUT_FILE,
-	S_OR, S_OUTPUT_PORTP, S_PAIRP,
-	S_PRINT, S_PRINTLN, S_PROCEDUREP, S_PUMP,
+	S_OPEN_OUTPUT_STRING, 	S_OR, S_OUTPUT_PORTP, S_PAIRP,
+	S_PRINT, S_PRINTLN, S_PROCEDUREP,
+	S_PROFILE_DUMP, S_PROFILE_START, S_PROFILE_STOP, S_PUMP,
 	S_QUASIQUOTE, S_QUOTE, S_RANDOM, S_RANDOM_SEED, S_READ, S_READYP, S_RETURN, S_ROUND,
 	S_SEEK,S_SET, S_SET_CURRENT_ERROR, S_SET_CURRENT_INPUT, S_SET_CURRENT_OUTPUT, S_SIN,
 	S_SLICE, S_SORT, S_SPLIT, S_SQRT, S_STRING_TO_BUFFER, S_STRING_TO_NUMBER,
-	S_STRING_TO_SYMBOL, S_STRING_COMPARE, S_STRING_FIND, S_STRING_FIND_BACKWARD,
+	S_STRING_TO_SYMBOL, S_STRING_APPEND, S_STRING_COMPARE, S_STRING_FIND, S_STRING_FIND_BACKWARD,
 	S_STRING_LENGTH, S_STRING_QUOTE, S_STRINGP,
 	S_SUBSTRING, S_SYMBOL_TO_STRING, S_SYMBOLP, S_SYSTEM, S_TAN,
 	S_THIS, S_THROW, S_TIME, S_TRACE, S_TRUE,
 	S_TRUNCATE, S_UNDEF, S_UNQUOTE,
-	S_UNQUOTE_SPLICING, S_UNTRACE, S_WITH_INPUT, S_WITH_OUTPUT, S_WRITE,
-	S_WRITE_BUFFER, S_WRITE_STRING,
+	S_UNQUOTE_SPLICING, S_UNTRACE, S_WITH_ARENA, S_WITH_INPUT,
+	S_WITH_OUTPUT, S_WRITE, S_WRITE_BUFFER, S_WRITE_STRING,
 	S_TOTAL
 };
 
@@ -547,7 +662,7 @@ static Lisp_Pair _lisp_nil = {
 		.is_const = 1,
 		.is_list = 1
 	},
-	0, LISP_UNDEF, LISP_NIL
+	.mapping = 0, .car = LISP_UNDEF, .cdr = LISP_NIL
 };
 
 Lisp_Object *lisp_nil = &_lisp_nil.obj;
@@ -555,6 +670,25 @@ Lisp_Object *lisp_true = LISP_TRUE;
 Lisp_Object *lisp_false = LISP_FALSE;
 Lisp_Object *lisp_undef = LISP_UNDEF;
 
+/* Small integers are preallocated constants shared by all VMs.
+ * Like _symtab they are marked and never enter the pool, so
+ * counters and loop indices don't need any heap allocation.
+ */
+#define SMALLINT_MIN   (-1024)
+#define SMALLINT_COUNT 4096
+
+#define _NUM(i) {.obj = {.type = O_NUMBER, .marked = 1, .is_const = 1}, \
+	.value = SMALLINT_MIN + (i)}
+#define _NUM4(i)    _NUM(i), _NUM((i)+1), _NUM((i)+2), _NUM((i)+3)
+#define _NUM16(i)   _NUM4(i), _NUM4((i)+4), _NUM4((i)+8), _NUM4((i)+12)
+#define _NUM64(i)   _NUM16(i), _NUM16((i)+16), _NUM16((i)+32), _NUM16((i)+48)
+#define _NUM256(i)  _NUM64(i), _NUM64((i)+64), _NUM64((i)+128), _NUM64((i)+192)
+#define _NUM1024(i) _NUM256(i), _NUM256((i)+256), _NUM256((i)+512), _NUM256((i)+768)
+
+static Lisp_Number _smallint[SMALLINT_COUNT] = {
+	_NUM1024(0), _NUM1024(1024), _NUM1024(2048), _NUM1024(3072)
+};
+
 static struct {
 	const char *name;
 	size_t size;
@@ -575,6 +709,7 @@ static struct {
 	[O_STREAM]      = {"STREAM", sizeof(Lisp_Stream)},
 	[O_SOURCE_FILE]      = {"SOURCE-FILE", sizeof(Lisp_SourceFile)},
 	[O_SOURCE_MAPPING]   = {"SOURCE-MAPPING", sizeof(Lisp_SourceMapping)},
+	[O_HAMT]   = {"HAMT", sizeof(Lisp_Hamt)},
 };
 
 static void load(Lisp_VM *vm);
@@ -593,8 +728,39 @@ struct lisp_memblock_t {
 	struct lisp_memblock_t *next;
 };
 
+struct lisp_chunk_t {
+	struct lisp_chunk_t *next;
+	size_t size;
+};
+
 #define ROUND_BLOCK_SIZE(sz) (((sz) + (BLKSIZE-1)) & ~(BLKSIZE-1))
 
+/* Start a new arena chunk. What's left of the current one
+ * goes to the freelist of its size.
+ * Chunks start small and grow, so that a new vm which may never
+ * allocate much is cheap to create.
+ */
+static void new_chunk(Lisp_VM *vm)
+{
+	size_t left = vm->arena_end - vm->arena;
+	if (left >= BLKSIZE) {
+		lisp_memblock_t *b = (lisp_memblock_t*)vm->arena;
+		b->next = vm->freelist[left / BLKSIZE - 1];
+		vm->freelist[left / BLKSIZE - 1] = b;
+	}
+	size_t size = vm->chunk_size ? vm->chunk_size : MINARENACHUNKSIZE;
+	lisp_chunk_t *c = calloc(1, size);
+	if (!c)
+		lisp_err(vm, "memory allocation failure");
+	vm->memsize += size;
+	vm->chunk_size = size < ARENACHUNKSIZE ? size * 2 : size;
+	c->size = size;
+	c->next = vm->chunks;
+	vm->chunks = c;
+	vm->arena = (char*)c + ROUND_BLOCK_SIZE(sizeof(lisp_chunk_t));
+	vm->arena_end = (char*)c + size;
+}
+
 /* lisp_alloc -- Allocate a memory block
  * Just a thin wrapper over c lib call. 
  * Callers must lisp_free() manually. 
@@ -605,7 +771,9 @@ void *lisp_alloc(Lisp_VM *vm, size_t size)
 	assert(size > 0);
 	size = ROUND_BLOCK_SIZE(size);
 
-	/* Small blocks are fetched from freelist.
+	/* Small blocks are fetched from freelist, or bump allocated
+	 * from the arena. They are never returned to c lib until
+	 * the vm is deleted.
 	 * Making cons and env really cheap.
 	 * Huge performance boost.
 	 */
@@ -617,6 +785,11 @@ void *lisp_alloc(Lisp_VM *vm, size_t size)
 			memset(p, 0, size);
 			return p;
 		}
+		if (vm->arena + size > vm->arena_end)
+			new_chunk(vm);
+		void *p = vm->arena;
+		vm->arena += size;
+		return p;
 	}
 
 	void *ptr = calloc(1, size);
@@ -633,6 +806,14 @@ void *lisp_realloc(Lisp_VM *vm, void *buf,
 {
 	oldsize = ROUND_BLOCK_SIZE(oldsize);
 	newsize = ROUND_BLOCK_SIZE(newsize);
+
+	/* Small blocks may live in an arena chunk */
+	if (oldsize <= MAX_CACHED_OBJECT_SIZE || newsize <= MAX_CACHED_OBJECT_SIZE) {
+		void *ptr = lisp_alloc(vm, newsize);
+		memcpy(ptr, buf, oldsize < newsize ? oldsize : newsize);
+		lisp_free(vm, buf, oldsize);
+		return ptr;
+	}
 	
 	void *ptr = realloc(buf, newsize);
 	if (!ptr) {
@@ -661,12 +842,16 @@ void lisp_free(Lisp_VM*vm, void *ptr, size_t size)
 }
 
 static void lisp_port_close(Lisp_Port*);
+static void unmap_buffer(Lisp_Buffer *b);
 static void delete_obj(Lisp_VM *vm, Lisp_Object *obj)
 {
 	switch (obj->type) {
 	case O_BUFFER: {
 		Lisp_Buffer *b = (Lisp_Buffer*)obj;
-		lisp_free(vm, b->buf, b->cap);
+		if (b->map)
+			unmap_buffer(b);
+		else
+			lisp_free(vm, b->buf, b->cap);
 		break;
 	}
 	case O_ARRAY: case O_DICT: {
@@ -674,9 +859,16 @@ static void delete_obj(Lisp_VM *vm, Lisp_Object *obj)
 		lisp_free(vm, a->items, sizeof(Lisp_Object*)*a->cap);
 		break;
 	}
+	case O_HAMT: {
+		Lisp_Hamt *h = (Lisp_Hamt*)obj;
+		if (h->n > 0)
+			lisp_free(vm, h->items, sizeof(Lisp_Object*)*h->n);
+		break;
+	}
 	case O_STRING: case O_SYMBOL: {
 		Lisp_String *s = (Lisp_String*)obj;
-		lisp_free(vm, (void*)s->buf, s->length+1);
+		if (!s->base)
+			lisp_free(vm, (void*)s->buf, s->length+1);
 		break;
 	}
 	case O_PORT: {
@@ -785,6 +977,16 @@ Loop:
 				mark(a->items[i]);
 			break;
 		}
+		case O_HAMT: {
+			Lisp_Hamt *h = (Lisp_Hamt*)obj;
+			for (unsigned i = 0; i < h->n; i++)
+				mark(h->items[i]);
+			break;
+		}
+		case O_STRING:
+			if (((Lisp_String*)obj)->base)
+				mark(((Lisp_String*)obj)->base);
+			break;
 		case O_NATIVE_PROC:
 			mark(((Lisp_Native_Proc*)obj)->env);
 			mark(((Lisp_Native_Proc*)obj)->name);
@@ -792,6 +994,8 @@ Loop:
 		case O_PROC: case O_MACRO:
 			mark(((Lisp_Proc*)obj)->env);
 			mark(((Lisp_Proc*)obj)->lambda);
+			if (((Lisp_Proc*)obj)->code)
+				mark(((Lisp_Proc*)obj)->code);
 			break;
 		case O_PAIR:
 		{
@@ -840,6 +1044,7 @@ Loop:
 			Lisp_SourceMapping *m = (Lisp_SourceMapping*)obj;
 			mark(m->file);
 			if (m->expr) mark(m->expr);
+			if (m->lazy) mark(m->lazy);
 			break;
 		}
 		default:
@@ -852,20 +1057,62 @@ void lisp_mark(Lisp_Object *o)
 	mark(o);
 }
 
-static void gc(Lisp_VM *vm)
+/*
+ * Two generations are maintained. New objects go to vm->pool (young).
+ * A minor collection only traces young objects: survivors are promoted
+ * to vm->old_pool and keep their mark bit, so tracing stops as soon as
+ * it reaches an old object. Old objects which may refer to young ones
+ * are recorded in vm->remembered by write_barrier() and traced again.
+ * When the old generation has doubled, a major collection clears and
+ * rebuilds all marks like a traditional mark & sweep.
+ */
+
+void lisp_array_push(Lisp_Array*, Lisp_Object*);
+
+/* Streams and extension objects are marked by client callbacks,
+ * whose writes we can not see, so they're always rescanned. */
+static bool is_opaque(Lisp_Object *obj)
+{
+	return obj->type == O_STREAM || obj->type == O_OBJECT_EX;
+}
+
+static void remember(Lisp_VM *vm, Lisp_Object *obj)
 {
-	unsigned i;
-	for (i = 0; i < vm->pool->count; i++)
-		vm->pool->items[i]->marked = 0;
+	obj->remembered = 1;
+	lisp_array_push(vm->remembered, obj);
+}
+
+/* Must be called after storing a reference into an existing object */
+static inline void write_barrier(Lisp_VM *vm, Lisp_Object *obj)
+{
+	if (obj->old && !obj->remembered)
+		remember(vm, obj);
+}
+
+static double gc_clock(void)
+{
+#ifdef _WIN32
+	return (double)clock() / CLOCKS_PER_SEC;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
 
+static void mark_roots(Lisp_VM *vm)
+{
 	mark(vm->stack);
 	mark(vm->env);
 	mark(vm->root_env);
-	mark(vm->input);
-	mark(vm->output);
-	mark(vm->error);
-	mark(vm->token);
-	mark(vm->last_eval);
+	/* Ports may not be ready while VM is being set up */
+	if (vm->input) mark(vm->input);
+	if (vm->output) mark(vm->output);
+	if (vm->error) mark(vm->error);
+	if (vm->token) mark(vm->token);
+	if (vm->last_eval) mark(vm->last_eval);
+	if (vm->profile) mark(vm->profile);
+	if (vm->profile_buf) mark(vm->profile_buf);
 
 	// TODO Optimize symbol table
 	// Mark symbols last because we can know if some of them
@@ -874,33 +1121,166 @@ static void gc(Lisp_VM *vm)
 	mark(vm->source_files);
 	mark(vm->keep_alive_pool);
 
-	Lisp_Object **p = vm->pool->items;
-	for (i = 0; i < vm->pool->count; i++) {
+	/* Keep live cache entries so that their objects are not
+	 * reused for others. Drop stale ones.
+	 */
+	for (int i = 0; i < ICACHESIZE; i++) {
+		Inline_Cache *c = &vm->icache[i];
+		if (c->site && c->epoch == load_word(&cache_epoch)) {
+			mark(c->site);
+			mark(c->env);
+			mark(c->binding);
+		} else {
+			c->site = NULL;
+		}
+	}
+}
+
+/* Delete dead young objects and promote the others */
+static void sweep_young(Lisp_VM *vm)
+{
+	for (unsigned i = 0; i < vm->pool->count; i++) {
 		Lisp_Object *obj = vm->pool->items[i];
+		if (!obj->marked) {
+			delete_obj(vm, obj);
+		} else {
+			obj->old = 1;
+			lisp_array_push(vm->old_pool, obj);
+			if (is_opaque(obj))
+				remember(vm, obj);
+		}
+	}
+	vm->pool->count = 0;
+}
+
+static void minor_gc(Lisp_VM *vm)
+{
+	unsigned i;
+	mark_roots(vm);
+	for (i = 0; i < vm->remembered->count; i++) {
+		Lisp_Object *obj = vm->remembered->items[i];
+		obj->marked = 0; /* So that mark() goes into it */
+		mark(obj);
+	}
+
+	/* No old object can refer to a young one after promotion */
+	Lisp_Object **p = vm->remembered->items;
+	for (i = 0; i < vm->remembered->count; i++) {
+		Lisp_Object *obj = vm->remembered->items[i];
+		if (is_opaque(obj))
+			*p++ = obj;
+		else
+			obj->remembered = 0;
+	}
+	vm->remembered->count = (size_t)(p - vm->remembered->items);
+	sweep_young(vm);
+	vm->gc_stats.minor_count++;
+}
+
+static void major_gc(Lisp_VM *vm)
+{
+	unsigned i;
+	for (i = 0; i < vm->pool->count; i++)
+		vm->pool->items[i]->marked = 0;
+	for (i = 0; i < vm->old_pool->count; i++)
+		vm->old_pool->items[i]->marked = 0;
+	for (i = 0; i < vm->remembered->count; i++)
+		vm->remembered->items[i]->remembered = 0;
+	vm->remembered->count = 0;
+
+	mark_roots(vm);
+
+	Lisp_Object **p = vm->old_pool->items;
+	for (i = 0; i < vm->old_pool->count; i++) {
+		Lisp_Object *obj = vm->old_pool->items[i];
 		if (!obj->marked) {
 			delete_obj(vm, obj);
 		} else {
 			*p++ = obj;
+			if (is_opaque(obj))
+				remember(vm, obj);
 		}
 	}
-	vm->pool->count = (size_t)(p - vm->pool->items);
+	vm->old_pool->count = (size_t)(p - vm->old_pool->items);
+	sweep_young(vm);
+
+	vm->major_threshold = vm->old_pool->count * 2;
+	if (vm->major_threshold < MINMAJORGCSIZE)
+		vm->major_threshold = MINMAJORGCSIZE;
+	vm->gc_stats.major_count++;
+}
+
+static void gc(Lisp_VM *vm, bool full)
+{
+	double t = gc_clock();
+	if (full || vm->old_pool->count >= vm->major_threshold)
+		major_gc(vm);
+	else
+		minor_gc(vm);
+	t = gc_clock() - t;
+	vm->gc_stats.last_pause = t;
+	vm->gc_stats.total_pause += t;
+	if (t > vm->gc_stats.max_pause)
+		vm->gc_stats.max_pause = t;
 #if 0
-	fprintf(stderr, "GC: %zd of %zd objects are deleted\n",
-		vm->pool->cap - vm->pool->count, vm->pool->cap);
+	fprintf(stderr, "GC: %zd young, %zd old objects, %.3fms\n",
+		vm->pool->count, vm->old_pool->count, t * 1000);
 #endif
 }
 
+/*
+ * Regions
+ *
+ * Objects allocated while handling a request are mostly garbage once
+ * it's done. Inside a region the nursery grows instead of being
+ * collected, and is collected when the outermost region ends, so only
+ * objects escaping the region are promoted to the old generation. The
+ * rest return to the arena freelists at once, without a full gc.
+ */
+void lisp_vm_begin_region(Lisp_VM *vm)
+{
+	if (vm->region++ == 0)
+		vm->region_pool_cap = vm->pool->cap;
+}
+
+void lisp_vm_end_region(Lisp_VM *vm)
+{
+	assert(vm->region > 0);
+	if (--vm->region > 0)
+		return;
+	gc(vm, false);
+	Lisp_Array *a = vm->pool;
+	if (a->cap > vm->region_pool_cap && a->count <= vm->region_pool_cap) {
+		a->items = lisp_realloc(vm, a->items, a->cap * sizeof(Lisp_Object*),
+			vm->region_pool_cap * sizeof(Lisp_Object*));
+		a->cap = vm->region_pool_cap;
+	}
+}
+
+void lisp_vm_get_gc_stats(Lisp_VM *vm, lisp_gc_stats_t *stats)
+{
+	*stats = vm->gc_stats;
+	stats->young_count = vm->pool->count;
+	stats->old_count = vm->old_pool->count;
+	stats->memsize = vm->memsize;
+}
 
 
-void lisp_array_push(Lisp_Array*, Lisp_Object*);
 static void lisp_array_grow(Lisp_Array*);
 static void *new_obj(Lisp_VM*vm, Object_Type type)
 {
 	Lisp_Object *o = lisp_alloc(vm, objtypes[type].size);
 	o->type = type;
-	if (vm->pool->count == vm->pool->cap) {
-	  gc(vm);
-	  if (vm->pool->count > vm->pool->cap / 2)
+	if (vm->pool->count == vm->pool->cap && vm->pool->cap < INIPOOLSIZE) {
+	  lisp_array_grow(vm->pool); /* a new vm starts with a small nursery */
+	} else if (vm->pool->count == vm->pool->cap && vm->region
+	    && vm->pool->cap < MAXREGIONPOOLSIZE) {
+	  lisp_array_grow(vm->pool); /* defer collection to end of region */
+	} else if (vm->pool->count == vm->pool->cap) {
+	  size_t n = vm->old_pool->count;
+	  gc(vm, false);
+	  /* Too many survivors, nursery is too small */
+	  if (vm->old_pool->count > n + vm->pool->cap / 2)
 	    lisp_array_grow(vm->pool);
 	}
 	lisp_array_push(vm->pool, o);
@@ -953,9 +1333,71 @@ bool lisp_buffer_p(Lisp_Object* o)
 	return o->type == O_BUFFER;
 }
 
+/*
+ * Map the regular file at path. The buffer shares the page cache
+ * instead of holding a copy, and changes to it stay private. It
+ * moves to the heap if it has to grow. Return NULL if the file is
+ * smaller than min_size, or can not be mapped; read it instead.
+ *
+ * The buffer is not a snapshot: it sees writes to the file made
+ * after, and touching pages past the end of a file truncated after
+ * raises SIGBUS. Only map files that do not change while in use.
+ * The mapping counts in vm->memsize like a heap buffer.
+ */
+Lisp_Buffer *lisp_buffer_map_file(Lisp_VM *vm, const char *path, size_t min_size)
+{
+#ifdef WIN32
+	return NULL;
+#else
+	struct stat sb;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)
+	    || (size_t)sb.st_size < min_size || sb.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	size_t size = (size_t)sb.st_size;
+	void *p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+#ifdef MADV_SEQUENTIAL
+	madvise(p, size, MADV_SEQUENTIAL);
+#endif
+	Lisp_Buffer *b = new_obj(vm, O_BUFFER);
+	b->buf = p;
+	b->map = p;
+	b->cap = b->length = size;
+	b->vm = vm;
+	vm->memsize += size;
+	return b;
+#endif
+}
+
+static void unmap_buffer(Lisp_Buffer *b)
+{
+#ifndef WIN32
+	munmap(b->map, b->cap);
+#endif
+	b->map = NULL;
+	assert(b->vm->memsize >= b->cap);
+	b->vm->memsize -= b->cap;
+}
+
 void lisp_buffer_grow(Lisp_Buffer *sb, size_t size)
 {
-	if (size > sb->cap) {
+	if (size > sb->cap && sb->map) {
+		size_t cap = sb->cap;
+		while (size > cap)
+			cap *= 2;
+		unsigned char *buf = lisp_alloc(sb->vm, cap);
+		memcpy(buf, sb->buf, sb->length);
+		unmap_buffer(sb);
+		sb->buf = buf;
+		sb->cap = cap;
+	} else if (size > sb->cap) {
 		size_t oldcap = sb->cap;
 		while (size > sb->cap) {
 		    sb->cap *= 2;
@@ -1229,6 +1671,7 @@ bool lisp_output_port_p(Lisp_Object *o)
 
 bool lisp_port_set_output_stream(Lisp_Port *port, Lisp_Stream *stream)
 {
+    write_barrier(port->vm, &port->obj);
     port->stream = stream;
     port->out = 1;
     return true;
@@ -1241,6 +1684,7 @@ Lisp_Stream *lisp_port_get_stream(Lisp_Port *port)
 
 bool lisp_port_set_input_stream(Lisp_Port *port, Lisp_Stream *stream)
 {
+    write_barrier(port->vm, &port->obj);
     port->stream = stream;
     port->out = 0;
     return true;
@@ -1267,6 +1711,7 @@ Lisp_Port* lisp_open_input_file(Lisp_VM *vm, Lisp_String* path)
 	p->vm = vm;
 	p->isatty = isatty(fileno(fp));
 	p->iobuf = lisp_buffer_new(vm, FILEIOBUFSIZE);
+	write_barrier(vm, &p->obj); /* p may be promoted by now */
 	p->line = 1;
 	lisp_pop(vm, 1);
 	return p;
@@ -1298,6 +1743,7 @@ Lisp_Port* lisp_open_output_file(Lisp_VM *vm, Lisp_String*path, File_Output_Mode
 	p->vm = vm;
 	p->isatty = isatty(fileno(fp));
 	p->iobuf = lisp_buffer_new(vm, FILEIOBUFSIZE);
+	write_barrier(vm, &p->obj);
 	p->out = 1;
 	lisp_pop(vm, 1);
 	return p;
@@ -1309,6 +1755,7 @@ Lisp_Port *lisp_open_output_buffer(Lisp_VM *vm, Lisp_Buffer *buffer)
 	pushx(vm, p);
 	p->vm = vm;
 	p->iobuf = buffer?buffer:lisp_buffer_new(vm, IOBUFSIZE);
+	write_barrier(vm, &p->obj);
 	p->out = 1;
 	lisp_pop(vm, 1);
 	return p;
@@ -1324,6 +1771,24 @@ Lisp_Port *lisp_open_input_buffer(Lisp_VM *vm, Lisp_Buffer *buffer, Lisp_String
     return p;
 }
 
+/*
+ * The reader works on the mapped file itself, see
+ * lisp_buffer_map_file(), so the file must not change until the port
+ * is closed. A file that is not mapped gets a file port.
+ */
+Lisp_Port *lisp_open_input_map(Lisp_VM *vm, Lisp_String *path)
+{
+    Lisp_Buffer *b = lisp_buffer_map_file(vm, path->buf, MINMAPSIZE);
+    if (!b)
+        return lisp_open_input_file(vm, path);
+    pushx(vm, b);
+    Lisp_Port *p = lisp_open_input_buffer(vm, b, path);
+    p->line = 1;
+    p->mapped = 1;
+    lisp_pop(vm, 1);
+    return p;
+}
+
 Lisp_Port *lisp_open_input_string(Lisp_VM *vm, Lisp_String *data, Lisp_String *name)
 {
     Lisp_Buffer *iobuf = lisp_buffer_new(vm, data->length);
@@ -1402,11 +1867,17 @@ size_t lisp_port_fill(Lisp_Port *port)
 	return port->iobuf->length - port->input_pos;
 }
 
+static void release_source(Cached_Source *c);
+
 /* Close port. Flush output and close stream. */
 void lisp_port_close(Lisp_Port *port)
 {
 	if (port->closed)
 		return;
+	if (port->source) {
+		release_source(port->source);
+		port->source = NULL;
+	}
 	if (port->out) {
 		lisp_port_flush(port);
 	}
@@ -1414,6 +1885,14 @@ void lisp_port_close(Lisp_Port *port)
 		lisp_stream_close(port->stream);
 		port->stream = 0;
 	}
+	if (port->mapped && port->iobuf->map) {
+		// Rather than holding the pages until a gc
+		unmap_buffer(port->iobuf);
+		port->iobuf->buf = lisp_alloc(port->vm, 64);
+		port->iobuf->cap = 64;
+		port->iobuf->length = 0;
+		port->input_pos = 0;
+	}
 	port->closed = 1;
 }
 
@@ -1456,41 +1935,61 @@ void lisp_port_putc(Lisp_Port *port, int c)
 	assert(port->out);
 	if (!port->out || port->closed)
         return;
-    if (port->iobuf->length >= port->iobuf->cap)
+    // Buffer ports grow instead
+    if (port->stream && port->iobuf->length >= port->iobuf->cap)
         lisp_port_flush(port);
-	assert(port->iobuf->length < port->iobuf->cap);
 	lisp_buffer_add_byte(port->iobuf, c);
-	if (port->no_buf || c == '\n' || port->iobuf->length == port->iobuf->cap)
+	if (port->no_buf || (c == '\n' && !port->full_buf)
+	 || port->iobuf->length == port->iobuf->cap)
 		lisp_port_flush(port);
 }
 
-// Buffered, unless there is a newline character.
-// or the port has `no_buf` set.
+// Buffered, unless there is a newline character and the port
+// is not fully buffered, or the port has `no_buf` set.
 void lisp_port_puts(Lisp_Port *port, const char *s)
 {
-	size_t n = 0;
-	bool should_flush = false;
-	for (; *s; s++, n++) {
-		if (port->iobuf->cap == port->iobuf->length) {
-			lisp_port_flush(port);
-			should_flush = false;
-		}
-		lisp_buffer_add_byte(port->iobuf, (uint8_t)*s);
-		if (*s == '\n')
-			should_flush = true;
-	}
-	if (port->no_buf)
-		should_flush = true;
-	if (should_flush)
+	size_t len = strlen(s);
+	lisp_port_put_bytes(port, s, len);
+	if (port->no_buf || (!port->full_buf && memchr(s, '\n', len)))
 		lisp_port_flush(port);
 }
 
+/*
+ * Ports on sockets are written by whole responses rather than by
+ * lines, see lisp_open_socket_output().
+ */
+void lisp_port_set_full_buf(Lisp_Port *port, bool on)
+{
+	port->full_buf = on;
+}
+
+/*
+ * Let lisp_read() take binary objects of up to limit bytes from
+ * port, or none if limit is 0. Only ports fed by other VMs of this
+ * process, such as mailboxes, should accept them.
+ */
+void lisp_port_set_binary(Lisp_Port *port, size_t limit)
+{
+	port->binary_limit = limit;
+}
+
 void lisp_port_put_bytes(Lisp_Port *port, const void *data, size_t size)
 {
 	assert(port->out);
 	if (port->stream) {
 		if (port->iobuf->cap - port->iobuf->length >= size) {
 			lisp_buffer_add_bytes(port->iobuf, data, size);
+		} else if (port->stream->cls->writev && port->stream->context
+		        && port->max_output == 0) {
+			// The buffered bytes and data leave together, data
+			// is not copied
+			struct lisp_iovec iov[2] = {
+				{port->iobuf->buf, port->iobuf->length},
+				{data, size}
+			};
+			port->byte_count += port->stream->cls->writev(
+				port->stream->context, iov, 2);
+			port->iobuf->length = 0;
 		} else {
 			lisp_port_flush(port);
 			size_t n = lisp_stream_write(port->stream, (const uint8_t*)data, size);
@@ -1546,18 +2045,21 @@ void lisp_port_printf(Lisp_Port *port, const char *fmt, ...)
 
 void lisp_port_print(Lisp_Port*,Lisp_Object*);
 
+static Lisp_SourceMapping *expr_mapping(Lisp_VM *vm, Lisp_Pair *expr);
+
 static void show_expr(Lisp_VM *vm, int i, Lisp_Pair *expr)
 {
 	lisp_port_printf(vm->error, "#%zu: ", i);
-	if (expr->mapping && expr->mapping->file) {
-		Lisp_String *name = (Lisp_String*)expr->mapping->file->path;
+	Lisp_SourceMapping *m = expr_mapping(vm, expr);
+	if (m && m->file) {
+		Lisp_String *name = (Lisp_String*)m->file->path;
 		FILE *fp = fopen(name->buf, "rb");
 		if (fp) {
 			char buf[128];
-			long nleft = expr->mapping->begin;
+			long nleft = m->begin;
 			if (nleft > 40)
 				nleft = 40;
-			fseek(fp, expr->mapping->begin-nleft, SEEK_SET);
+			fseek(fp, m->begin-nleft, SEEK_SET);
 			int n = (int)fread(buf, 1, sizeof(buf)-1, fp);
 			if (n > nleft) {
 				buf[n] = 0;
@@ -1571,7 +2073,7 @@ static void show_expr(Lisp_VM *vm, int i, Lisp_Pair *expr)
 					endp++;
 				*endp = 0;
 				lisp_port_printf(vm->error, "%s:%d: %s\n",
-					name->buf, expr->mapping->line, p);
+					name->buf, m->line, p);
 			}
 			fclose(fp);
 			return;
@@ -1735,6 +2237,21 @@ bool lisp_eq(Lisp_Object *a, Lisp_Object *b)
  */
 static void dtoa(double d, char s[DTOA_BUFSIZE])
 {
+	/* Integers of up to 15 digits print the same as with %.15g */
+	if (d > -1e15 && d < 1e15 && d == (double)(int64_t)d && !(d == 0 && signbit(d))) {
+		char t[16], *q = t + sizeof(t);
+		int64_t v = (int64_t)d;
+		uint64_t u = v < 0 ? (uint64_t)-v : (uint64_t)v;
+		do {
+			*--q = (char)('0' + u % 10);
+			u /= 10;
+		} while (u);
+		if (v < 0)
+			*s++ = '-';
+		memcpy(s, q, t + sizeof(t) - q);
+		s[t + sizeof(t) - q] = 0;
+		return;
+	}
 	int n = snprintf(s, DTOA_BUFSIZE, "%.*g", DBL_DIG /* =15 */, d);
 	assert(n > 0 && n < DTOA_BUFSIZE);
 	volatile double t = strtod(s, NULL);
@@ -1757,6 +2274,12 @@ static bool str2dbl(const char *s, double *d)
 
 Lisp_Number *lisp_number_new(Lisp_VM *vm, double val)
 {
+	if (val >= SMALLINT_MIN && val < SMALLINT_MIN + SMALLINT_COUNT) {
+		int i = (int)val;
+		/* -0.0 must keep its sign, so it's allocated as usual */
+		if (i == val && !(i == 0 && signbit(val)))
+			return &_smallint[i - SMALLINT_MIN];
+	}
 	Lisp_Number *n = new_obj(vm, O_NUMBER);
 	n->obj.is_const = 1;
 	n->value = val;
@@ -1792,15 +2315,18 @@ bool lisp_pair_p(Lisp_Object *o) { return o->type == O_PAIR; }
 static int check_utf8(const char *s, size_t n)
 {
 	int remain = 0;
-	int i = 0;
-	for (; (unsigned)i < n; i++) {
+	size_t i = 0;
+	for (; i < n; i++) {
+		if (remain == 0) {
+			i += bytes_ascii((const uint8_t*)s + i, n - i);
+			if (i == n)
+				break;
+		}
 		int c = (unsigned char)s[i];
 		if (remain > 0) {
 			if ((c & ~0x3f) != 0x80)
 				return i;
 			remain--;
-		} else if ((c >> 7) == 0) { // ASCII
-			assert(remain==0);
 		} else if ((c >> 6) == 2) { // 0x10xxxxxx
 			return i;
 		} else if ((c >> 5) == 6) { // 0x110xxxxx
@@ -1847,6 +2373,90 @@ Lisp_String *lisp_push_cstr(Lisp_VM *vm, const char *buf)
 	return lisp_push_string(vm, buf, strlen(buf));
 }
 
+#define STRING_SHARE_MIN 64 /* Shorter tails are copied */
+
+/*
+ * string_tail -- The part of s from start on
+ * Long tails share the bytes of s rather than copy them, they end
+ * where s ends and so stay terminated. A tail much shorter than s
+ * is copied, so it does not keep a big string alive.
+ * s must be reachable.
+ */
+static Lisp_String *string_tail(Lisp_VM *vm, Lisp_String *s, size_t start)
+{
+	size_t n = s->length - start;
+	if (s->obj.type != O_STRING || n < STRING_SHARE_MIN || n < s->length / 4)
+		return lisp_string_new(vm, s->buf + start, n);
+	Lisp_String *t = new_obj(vm, O_STRING);
+	t->obj.is_const = 1;
+	t->buf = s->buf + start;
+	t->length = n;
+	t->base = s->base ? s->base : s;
+	return t;
+}
+
+/*
+ * find_bytes -- The first m bytes at p in the n bytes at s
+ * Short searches let memchr() find the candidates, longer ones skip
+ * ahead by the last byte of the window (Horspool).
+ */
+static const char *find_bytes(const char *s, size_t n, const char *p, size_t m)
+{
+	if (m == 0)
+		return s;
+	if (m > n)
+		return NULL;
+	const char *end = s + (n - m);
+	if (m < 4 || n < 256) {
+		while (s <= end) {
+			s = memchr(s, p[0], (size_t)(end - s) + 1);
+			if (!s)
+				return NULL;
+			if (memcmp(s + 1, p + 1, m - 1) == 0)
+				return s;
+			s++;
+		}
+		return NULL;
+	}
+	unsigned char skip[256];
+	memset(skip, (int)MIN(m, 255), sizeof(skip));
+	for (size_t i = m > 255 ? m - 255 : 0; i < m - 1; i++)
+		skip[(unsigned char)p[i]] = (unsigned char)(m - 1 - i);
+	unsigned char last = (unsigned char)p[m-1];
+	while (s <= end) {
+		unsigned char c = (unsigned char)s[m-1];
+		if (c == last && memcmp(s, p, m - 1) == 0)
+			return s;
+		if ((size_t)(end - s) < skip[c])
+			break;
+		s += skip[c];
+	}
+	return NULL;
+}
+
+/* Like find_bytes() but the last occurrence, by the first byte of the window */
+static const char *find_last_bytes(const char *s, size_t n, const char *p, size_t m)
+{
+	if (m > n)
+		return NULL;
+	if (m == 0)
+		return s + n;
+	unsigned char skip[256];
+	memset(skip, (int)MIN(m, 255), sizeof(skip));
+	for (size_t i = MIN(m - 1, 254); i > 0; i--)
+		skip[(unsigned char)p[i]] = (unsigned char)i;
+	unsigned char first = (unsigned char)p[0];
+	const char *q = s + (n - m);
+	while (1) {
+		unsigned char c = (unsigned char)*q;
+		if (c == first && memcmp(q + 1, p + 1, m - 1) == 0)
+			return q;
+		if ((size_t)(q - s) < skip[c])
+			return NULL;
+		q -= skip[c];
+	}
+}
+
 const char *lisp_string_cstr(Lisp_String*s) { return s->buf; }
 
 bool lisp_string_equal(Lisp_String* a, Lisp_String *b)
@@ -1887,16 +2497,53 @@ static uint32_t lisp_string_hash(Lisp_String *a)
 	return a->hash;
 }
 
-static Lisp_String *find_sym(Lisp_String table[], size_t n, const char *name)
+/* Same as hash_cstr() on the first len bytes */
+static uint32_t hash_bytes(const char *s, size_t len)
+{
+	uint32_t hash = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		int c = s[i];
+		hash = c + (hash << 6) + (hash << 16) - hash;
+	}
+
+	return hash;
+}
+
+static bool same_symbol(Lisp_String *s, const char *name, size_t len, uint32_t h)
+{
+	return lisp_string_hash(s) == h && s->length == len
+	    && memcmp(s->buf, name, len) == 0;
+}
+
+/* Hash index of _symtab: slot -> symbol id + 1, or 0 if empty */
+#define SYMINDEXSIZE 1024
+static uint16_t symindex[SYMINDEXSIZE];
+static bool symindex_ready;
+
+/* Done when the first vm is created, before others may run
+ * in their threads. Builtin symbols are read only from then on.
+ */
+static void index_symtab(void)
+{
+	if (symindex_ready)
+		return;
+	for (int i = 0; i < S_TOTAL; i++) {
+		unsigned j = lisp_string_hash(&_symtab[i]) % SYMINDEXSIZE;
+		while (symindex[j])
+			j = (j + 1) % SYMINDEXSIZE;
+		symindex[j] = i + 1;
+	}
+	symindex_ready = true;
+}
+
+static Lisp_String *find_sym(const char *name, size_t len, uint32_t h)
 {
-	size_t low = 0, high = n;
-	while (low < high) {
- 		size_t mid = low + (high-low)/2;
- 		int cmp = strcmp(table[mid].buf, name);
- 		if (cmp == 0) return table + mid;
- 		else if (cmp < 0) low = mid + 1;
- 		else high = mid;
- 	}
+	for (unsigned i = h % SYMINDEXSIZE; symindex[i]; i = (i + 1) % SYMINDEXSIZE) {
+		Lisp_String *s = &_symtab[symindex[i] - 1];
+		if (same_symbol(s, name, len, h))
+			return s;
+	}
 	return NULL;
 }
 
@@ -1976,8 +2623,9 @@ Lisp_Array *lisp_pool_new(Lisp_VM *vm, size_t cap)
 Lisp_Array *lisp_array_new(Lisp_VM *vm, size_t cap)
 {
 	Lisp_Array *a = new_obj(vm, O_ARRAY);
+	if (cap < 4) cap = 4;
 	a->items = lisp_alloc(vm, sizeof(Lisp_Object*)*cap);
-	a->cap = (cap > 4 ? cap : 4);
+	a->cap = cap;
 	a->vm = vm;
 	return a;
 }
@@ -2007,6 +2655,7 @@ static void lisp_array_grow(Lisp_Array *a)
 void lisp_array_push(Lisp_Array *a, Lisp_Object *obj)
 {
 	assert(obj && obj->type > 0 && obj->type < O_MAX);
+	write_barrier(a->vm, &a->obj);
 	if (a->count == a->cap)
 		lisp_array_grow(a);
 	a->items[a->count++] = obj;
@@ -2152,6 +2801,21 @@ void lisp_make_list(Lisp_VM *vm, int n)
 		make_pair(vm);
 }
 
+/* Replace the top n items by an array of them, deepest first */
+void lisp_make_array(Lisp_VM *vm, int n)
+{
+	Lisp_Array *a = lisp_array_new(vm, n);
+	if (n == 0) {
+		lisp_push(vm, &a->obj);
+		return;
+	}
+	Lisp_Object **items = vm->stack->items + vm->stack->count - n;
+	memcpy(a->items, items, sizeof(Lisp_Object*) * n);
+	a->count = n;
+	items[0] = &a->obj;
+	vm->stack->count -= n - 1;
+}
+
 static int push_list(Lisp_VM *vm, Lisp_Pair *l)
 {
 	int n = 0;
@@ -2279,12 +2943,38 @@ Lisp_Pair *lisp_dict_assoc_cstr(Lisp_Array* dict, const char *name)
 	return NULL;
 }
 
+/* Like lisp_dict_assoc_cstr() but with known length and hash */
+static Lisp_Pair *dict_assoc_symbol(Lisp_Array *dict, const char *name,
+	size_t len, uint32_t h)
+{
+	if (dict->count > DICT_LOOKUP_COUNT) {
+		Lisp_Array *a = (Lisp_Array*)dict->items[0];
+		for (unsigned i = h % (a->cap-1), n = 0; n < a->cap; n++) {
+			Lisp_Pair *p = (Lisp_Pair*)a->items[i];
+			if (!p)
+				break;
+			if (same_symbol((Lisp_String*)p->car, name, len, h))
+				return p;
+			if (++i >= a->cap)
+				i = 0;
+		}
+	} else {
+		for (unsigned i = 1; i < dict->count; i++) {
+			Lisp_Pair *p = (Lisp_Pair*)dict->items[i];
+			if (same_symbol((Lisp_String*)p->car, name, len, h))
+				return p;
+		}
+	}
+	return NULL;
+}
+
 static void add_to_lookup_table(Lisp_Array *a, Lisp_Pair *p)
 {
 	Lisp_String *s = (Lisp_String*)p->car;
 	uint32_t h = lisp_string_hash(s);
 	for (unsigned i = h % (a->cap-1), n = 0; n < a->cap; n++) {
 		if (!a->items[i]) {
+			write_barrier(a->vm, &a->obj);
 			a->items[i] = (Lisp_Object*)p;
 			return;
 		}
@@ -2297,6 +2987,7 @@ static void add_to_lookup_table(Lisp_Array *a, Lisp_Pair *p)
 void lisp_dict_add_item(Lisp_Array *dict, Lisp_Pair *p)
 {
 	lisp_array_push(dict, (Lisp_Object*)p);
+	p->addr = dict->count <= UINT16_MAX ? dict->count - 1 : 0;
 	if (dict->count > DICT_LOOKUP_COUNT) {
 		Lisp_Array *table = (Lisp_Array*)dict->items[0];
 		if (!table || table->cap < dict->cap * 2) {
@@ -2332,29 +3023,327 @@ void lisp_dict_clear(Lisp_Array* dict)
 	dict->count = 1;
 }
 
-////////////////////////////////////////////////
-/// Environment
-////////////////////////////////////////////////
+/////////////////////////////////////////
+/// Hash array mapped trie
+//
+//  An immutable map. Each level of nodes takes 5 more bits of the
+//  key hash to pick one of 32 slots, and keeps only the slots in
+//  use. Setting or removing a key copies the nodes on its path
+//  and shares the others, so older versions stay valid and cost
+//  little to keep. Past the 32 bits of the hash, keys that still
+//  collide share a node and are searched in turn.
+//
+//  Nodes never change once made, they only refer to objects older
+//  than themselves and need no write barrier.
+/////////////////////////////////////////
 
-Lisp_Env *lisp_env_new(Lisp_VM* vm, Lisp_Env *parent)
-{
-	Lisp_Env *env = new_obj(vm, O_ENV);
-	lisp_push(vm, (Lisp_Object*)env);
-	env->bindings = lisp_dict_new(vm, 8);
-	env->parent = parent;
-	lisp_pop(vm, 1);
-	return env;
+#define HAMT_BITS 5
+#define HAMT_MAX_SHIFT 32
+
+/* Keys are symbols, strings or numbers */
+static uint32_t hamt_hash(Lisp_VM *vm, Lisp_Object *k)
+{
+	switch (k->type) {
+	case O_SYMBOL: case O_STRING:
+		return lisp_string_hash((Lisp_String*)k);
+	case O_NUMBER: {
+		uint64_t u;
+		double v = ((Lisp_Number*)k)->value;
+		if (v == 0) v = 0; // -0 and 0 are the same key
+		memcpy(&u, &v, sizeof(u));
+		u ^= u >> 33;
+		u *= 0xff51afd7ed558ccdULL;
+		u ^= u >> 33;
+		return (uint32_t)u;
+	}
+	default:
+		lisp_err(vm, "hamt: key must be a symbol, string or number");
+		return 0;
+	}
 }
 
-void lisp_begin_env(Lisp_VM *vm, Lisp_Env *parent)
+static bool hamt_key_eq(Lisp_Object *a, Lisp_Object *b)
 {
-	lisp_push(vm, LISP_FRAME_MARK);
-	lisp_push(vm, (Lisp_Object*)vm->env);
-	vm->env = lisp_env_new(vm, parent);
+	if (a == b)
+		return true;
+	if (a->type != b->type)
+		return false;
+	if (a->type == O_STRING) {
+		Lisp_String *x = (Lisp_String*)a, *y = (Lisp_String*)b;
+		return x->length == y->length && memcmp(x->buf, y->buf, x->length) == 0;
+	}
+	if (a->type == O_NUMBER)
+		return ((Lisp_Number*)a)->value == ((Lisp_Number*)b)->value;
+	return false; // symbols are unique
 }
 
-/* STACK: FRAME-MARK <PREV-ENV> <RESULT> */
-void lisp_end_env(Lisp_VM* vm)
+static Lisp_Hamt *hamt_node_new(Lisp_VM *vm, uint32_t bitmap, uint32_t n, uint32_t size)
+{
+	Lisp_Hamt *h = new_obj(vm, O_HAMT);
+	h->obj.is_const = 1; // evals to itself
+	h->bitmap = bitmap;
+	h->n = n;
+	h->size = size;
+	if (n > 0)
+		h->items = lisp_alloc(vm, sizeof(Lisp_Object*)*n);
+	return h;
+}
+
+Lisp_Hamt *lisp_hamt_new(Lisp_VM *vm)
+{
+	return hamt_node_new(vm, 0, 0, 0);
+}
+
+static unsigned hamt_index(uint32_t bitmap, uint32_t bit)
+{
+	return (unsigned)__builtin_popcount(bitmap & (bit - 1));
+}
+
+/* A copy of h with item i replaced by o */
+static Lisp_Hamt *hamt_with_item(Lisp_VM *vm, Lisp_Hamt *h, unsigned i,
+	Lisp_Object *o, uint32_t size)
+{
+	lisp_push(vm, o);
+	Lisp_Hamt *t = hamt_node_new(vm, h->bitmap, h->n, size);
+	lisp_pop(vm, 1);
+	memcpy(t->items, h->items, sizeof(Lisp_Object*)*h->n);
+	t->items[i] = o;
+	return t;
+}
+
+/* A copy of h with o inserted at i, under bit */
+static Lisp_Hamt *hamt_with_insert(Lisp_VM *vm, Lisp_Hamt *h, unsigned i,
+	uint32_t bit, Lisp_Object *o)
+{
+	lisp_push(vm, o);
+	Lisp_Hamt *t = hamt_node_new(vm, h->bitmap | bit, h->n + 1, h->size + 1);
+	lisp_pop(vm, 1);
+	if (h->n > 0) {
+		memcpy(t->items, h->items, sizeof(Lisp_Object*)*i);
+		memcpy(t->items + i + 1, h->items + i, sizeof(Lisp_Object*)*(h->n - i));
+	}
+	t->items[i] = o;
+	return t;
+}
+
+/* A copy of h without item i, under bit */
+static Lisp_Hamt *hamt_with_remove(Lisp_VM *vm, Lisp_Hamt *h, unsigned i, uint32_t bit)
+{
+	Lisp_Hamt *t = hamt_node_new(vm, h->bitmap & ~bit, h->n - 1, h->size - 1);
+	memcpy(t->items, h->items, sizeof(Lisp_Object*)*i);
+	memcpy(t->items + i, h->items + i + 1, sizeof(Lisp_Object*)*(h->n - i - 1));
+	return t;
+}
+
+/* A node for two entries whose hashes agree below shift */
+static Lisp_Hamt *hamt_join(Lisp_VM *vm, Lisp_Object *a, uint32_t ha,
+	Lisp_Object *b, uint32_t hb, int shift)
+{
+	Lisp_Hamt *t;
+	if (shift >= HAMT_MAX_SHIFT) {
+		t = hamt_node_new(vm, 0, 2, 2);
+		t->items[0] = a;
+		t->items[1] = b;
+		return t;
+	}
+	uint32_t ba = 1u << ((ha >> shift) & 31);
+	uint32_t bb = 1u << ((hb >> shift) & 31);
+	if (ba == bb) {
+		Lisp_Object *c = (Lisp_Object*)hamt_join(vm, a, ha, b, hb, shift + HAMT_BITS);
+		lisp_push(vm, c);
+		t = hamt_node_new(vm, ba, 1, 2);
+		lisp_pop(vm, 1);
+		t->items[0] = c;
+		return t;
+	}
+	t = hamt_node_new(vm, ba | bb, 2, 2);
+	t->items[ba < bb ? 0 : 1] = a;
+	t->items[ba < bb ? 1 : 0] = b;
+	return t;
+}
+
+/* h with the entry leaf, h itself if it has the same entry. 
+ * h and leaf must be reachable. */
+static Lisp_Hamt *hamt_put(Lisp_VM *vm, Lisp_Hamt *h, Lisp_Pair *leaf,
+	uint32_t hash, int shift)
+{
+	if (shift >= HAMT_MAX_SHIFT) {
+		for (unsigned i = 0; i < h->n; i++) {
+			Lisp_Pair *p = (Lisp_Pair*)h->items[i];
+			if (hamt_key_eq(p->car, leaf->car)) {
+				if (p->cdr == leaf->cdr)
+					return h;
+				return hamt_with_item(vm, h, i, &leaf->obj, h->size);
+			}
+		}
+		return hamt_with_insert(vm, h, h->n, 0, &leaf->obj);
+	}
+
+	uint32_t bit = 1u << ((hash >> shift) & 31);
+	unsigned i = hamt_index(h->bitmap, bit);
+	if (!(h->bitmap & bit))
+		return hamt_with_insert(vm, h, i, bit, &leaf->obj);
+
+	Lisp_Object *o = h->items[i];
+	if (o->type == O_HAMT) {
+		Lisp_Hamt *c = (Lisp_Hamt*)o;
+		Lisp_Hamt *t = hamt_put(vm, c, leaf, hash, shift + HAMT_BITS);
+		if (t == c)
+			return h;
+		return hamt_with_item(vm, h, i, &t->obj, h->size - c->size + t->size);
+	}
+	Lisp_Pair *p = (Lisp_Pair*)o;
+	if (hamt_key_eq(p->car, leaf->car)) {
+		if (p->cdr == leaf->cdr)
+			return h;
+		return hamt_with_item(vm, h, i, &leaf->obj, h->size);
+	}
+	Lisp_Hamt *t = hamt_join(vm, o, hamt_hash(vm, p->car), &leaf->obj, hash,
+		shift + HAMT_BITS);
+	return hamt_with_item(vm, h, i, &t->obj, h->size + 1);
+}
+
+/*
+ * h without key: h itself if it does not have key, NULL if nothing
+ * is left, or the last entry left, which takes the place of the node.
+ * h must be reachable.
+ */
+static Lisp_Object *hamt_delete(Lisp_VM *vm, Lisp_Hamt *h, Lisp_Object *key,
+	uint32_t hash, int shift)
+{
+	unsigned i;
+	uint32_t bit = 0;
+
+	if (shift >= HAMT_MAX_SHIFT) {
+		for (i = 0; i < h->n; i++) {
+			if (hamt_key_eq(CAR(h->items[i]), key))
+				break;
+		}
+		if (i == h->n)
+			return &h->obj;
+	} else {
+		bit = 1u << ((hash >> shift) & 31);
+		if (!(h->bitmap & bit))
+			return &h->obj;
+		i = hamt_index(h->bitmap, bit);
+		Lisp_Object *o = h->items[i];
+		if (o->type == O_HAMT) {
+			Lisp_Object *t = hamt_delete(vm, (Lisp_Hamt*)o, key, hash, shift + HAMT_BITS);
+			if (t == o)
+				return &h->obj;
+			if (t) {
+				uint32_t size = t->type == O_HAMT ? ((Lisp_Hamt*)t)->size : 1;
+				if (size == 1 && h->n == 1 && shift > 0)
+					return t; // the node only leads to t
+				return (Lisp_Object*)hamt_with_item(vm, h, i, t, h->size - 1);
+			}
+		} else if (!hamt_key_eq(CAR(o), key)) {
+			return &h->obj;
+		}
+	}
+	/* Item i goes */
+	if (h->n == 1)
+		return NULL;
+	if (h->n == 2 && shift > 0) {
+		Lisp_Object *other = h->items[1 - i];
+		if (other->type != O_HAMT)
+			return other;
+	}
+	return (Lisp_Object*)hamt_with_remove(vm, h, i, bit);
+}
+
+Lisp_Pair *lisp_hamt_assoc(Lisp_VM *vm, Lisp_Hamt *h, Lisp_Object *key)
+{
+	uint32_t hash = hamt_hash(vm, key);
+	for (int shift = 0; ; shift += HAMT_BITS) {
+		Lisp_Object *o;
+		if (shift >= HAMT_MAX_SHIFT) {
+			for (unsigned i = 0; i < h->n; i++) {
+				if (hamt_key_eq(CAR(h->items[i]), key))
+					return (Lisp_Pair*)h->items[i];
+			}
+			return NULL;
+		}
+		uint32_t bit = 1u << ((hash >> shift) & 31);
+		if (!(h->bitmap & bit))
+			return NULL;
+		o = h->items[hamt_index(h->bitmap, bit)];
+		if (o->type != O_HAMT)
+			return hamt_key_eq(CAR(o), key) ? (Lisp_Pair*)o : NULL;
+		h = (Lisp_Hamt*)o;
+	}
+}
+
+/*
+ * lisp_hamt_set -- h with key bound to val
+ * h is left as it is. h, key and val must be reachable.
+ */
+Lisp_Hamt *lisp_hamt_set(Lisp_VM *vm, Lisp_Hamt *h, Lisp_Object *key, Lisp_Object *val)
+{
+	uint32_t hash = hamt_hash(vm, key);
+	Lisp_Pair *leaf = lisp_pair_new(vm, key, val);
+	lisp_push(vm, &leaf->obj);
+	h = hamt_put(vm, h, leaf, hash, 0);
+	lisp_pop(vm, 1);
+	return h;
+}
+
+/* h without key. h must be reachable. */
+Lisp_Hamt *lisp_hamt_unset(Lisp_VM *vm, Lisp_Hamt *h, Lisp_Object *key)
+{
+	Lisp_Object *t = hamt_delete(vm, h, key, hamt_hash(vm, key), 0);
+	if (!t)
+		return lisp_hamt_new(vm);
+	return (Lisp_Hamt*)t; // the root is never replaced by an entry
+}
+
+size_t lisp_hamt_count(Lisp_Hamt *h)
+{
+	return h->size;
+}
+
+/* Push the entries of h, return how many */
+static int hamt_push_entries(Lisp_VM *vm, Lisp_Hamt *h, bool copy)
+{
+	int n = 0;
+	for (unsigned i = 0; i < h->n; i++) {
+		Lisp_Object *o = h->items[i];
+		if (o->type == O_HAMT) {
+			n += hamt_push_entries(vm, (Lisp_Hamt*)o, copy);
+		} else {
+			if (copy)
+				o = (Lisp_Object*)lisp_pair_new(vm, CAR(o), CDR(o));
+			lisp_push(vm, o);
+			n++;
+		}
+	}
+	return n;
+}
+
+////////////////////////////////////////////////
+/// Environment
+////////////////////////////////////////////////
+
+Lisp_Env *lisp_env_new(Lisp_VM* vm, Lisp_Env *parent)
+{
+	Lisp_Env *env = new_obj(vm, O_ENV);
+	lisp_push(vm, (Lisp_Object*)env);
+	env->bindings = lisp_dict_new(vm, 8);
+	write_barrier(vm, &env->obj);
+	env->parent = parent;
+	lisp_pop(vm, 1);
+	return env;
+}
+
+void lisp_begin_env(Lisp_VM *vm, Lisp_Env *parent)
+{
+	lisp_push(vm, LISP_FRAME_MARK);
+	lisp_push(vm, (Lisp_Object*)vm->env);
+	vm->env = lisp_env_new(vm, parent);
+}
+
+/* STACK: FRAME-MARK <PREV-ENV> <RESULT> */
+void lisp_end_env(Lisp_VM* vm)
 {
 	assert(vm->stack->count >= 3);
 	Lisp_Object **p = vm->stack->items + vm->stack->count - 3;
@@ -2367,18 +3356,94 @@ void lisp_end_env(Lisp_VM* vm)
 
 static void clear_env(Lisp_VM *vm)
 {
+	if (load_word(&vm->env->cached) && vm->env->bindings->count > 1)
+		bump_word(&cache_epoch);
 	lisp_dict_clear(vm->env->bindings);
+	vm->env->names = 0;
+}
+
+/*
+ * Every environment keeps a bloom filter of the names bound in it,
+ * so that lookups can skip levels without probing their dictionaries.
+ * All bindings must be added through env_bind() to keep it in sync.
+ */
+static inline uint64_t name_bit(Lisp_String *name)
+{
+	return (uint64_t)1 << (lisp_string_hash(name) & 63);
+}
+
+static Lisp_Pair *env_bind(Lisp_Env *env, Lisp_String *name, Lisp_Object *value)
+{
+	env->names |= name_bit(name);
+	return lisp_dict_add(env->bindings, name, value);
 }
 
 Lisp_Pair* lisp_env_assoc(Lisp_Env *env, Lisp_String *name)
 {
+	uint64_t bit = name_bit(name);
 	for (; env; env = env->parent) {
+		if (!(env->names & bit))
+			continue;
 		Lisp_Pair *p = lisp_dict_assoc(env->bindings, name);
 		if (p) return p;
 	}
 	return NULL;
 }
 
+/*
+ * Lexical addressing
+ *
+ * Code is plain list data which macros, quote and printers all see,
+ * so instead of rewriting procedure bodies, a variable reference is
+ * resolved on its first evaluation and the (depth, slot) address is
+ * cached in the pair holding the reference. Procedure frames bind
+ * their parameters in the same order on every call, so the address
+ * stays valid across calls.
+ *
+ * A cached address is used only if the binding at that slot still has
+ * the same name and no nearer level may shadow it, which covers
+ * runtime `define' and `eval' in other environments. Otherwise the
+ * reference is looked up again and the address refreshed.
+ */
+static Lisp_Pair *resolve_var(Lisp_VM *vm, Lisp_Pair *site, Lisp_String *name)
+{
+	uint64_t bit = name_bit(name);
+	Lisp_Env *env = vm->env;
+	unsigned depth = 0;
+	uint32_t addr = load_word(&site->addr);
+	unsigned slot = addr & 0xffff;
+
+	if (slot) {
+		for (depth = addr >> 16; env && depth > 0; depth--) {
+			if (env->names & bit)
+				break;
+			env = env->parent;
+		}
+		if (env && depth == 0 && slot < env->bindings->count) {
+			Lisp_Pair *p = (Lisp_Pair*)env->bindings->items[slot];
+			if (p->car == (Lisp_Object*)name)
+				return p;
+		}
+		env = vm->env;
+		depth = 0;
+	}
+
+	for (; env; env = env->parent, depth++) {
+		if (!(env->names & bit))
+			continue;
+		Lisp_Pair *p = lisp_dict_assoc(env->bindings, name);
+		if (p) {
+			Lisp_Array *b = env->bindings;
+			slot = p->addr;
+			if (depth <= UINT16_MAX && slot && slot < b->count
+			 && b->items[slot] == (Lisp_Object*)p)
+				store_word(&site->addr, (uint32_t)depth << 16 | slot);
+			return p;
+		}
+	}
+	return NULL;
+}
+
 /* Public only. accessing global variables */
 Lisp_Object *lisp_vm_get(Lisp_VM *vm, const char *name)
 {
@@ -2387,10 +3452,8 @@ Lisp_Object *lisp_vm_get(Lisp_VM *vm, const char *name)
 	else return NULL;
 }
 
-Lisp_Object* lisp_getvar(Lisp_VM *vm, Lisp_String *name)
+static Lisp_Object *var_value(Lisp_VM *vm, Lisp_Pair *p, Lisp_String *name)
 {
-	assert(!name->obj.is_const);
-	Lisp_Pair *p = lisp_env_assoc(vm->env, name);
 	if (p == NULL) {
 		if (name->obj.is_primitive)
 			return (Lisp_Object*)name;
@@ -2401,15 +3464,31 @@ Lisp_Object* lisp_getvar(Lisp_VM *vm, Lisp_String *name)
 	return p->cdr;
 }
 
+Lisp_Object* lisp_getvar(Lisp_VM *vm, Lisp_String *name)
+{
+	assert(!name->obj.is_const);
+	return var_value(vm, lisp_env_assoc(vm->env, name), name);
+}
+
+/* Value of variable `name' referenced by the car of `site' */
+static Lisp_Object *ref_var(Lisp_VM *vm, Lisp_Pair *site, Lisp_String *name)
+{
+	assert(!name->obj.is_const);
+	return var_value(vm, resolve_var(vm, site, name), name);
+}
+
 Lisp_Pair* lisp_defvar(Lisp_VM *vm, Lisp_String* name, Lisp_Object *value)
 {
 	assert(!name->obj.is_const);
 	Lisp_Pair *t = lisp_dict_assoc(vm->env->bindings, name);
 	if (t == NULL) {
-		t = lisp_dict_add(vm->env->bindings, name, value);
+		if (load_word(&vm->env->cached))
+			bump_word(&cache_epoch); /* may shadow a cached binding */
+		t = env_bind(vm->env, name, value);
 	} else {
 		if (t->obj.is_const)
 			lisp_err(vm, "Can not redefine constant: %s", name->buf);
+		write_barrier(vm, &t->obj);
 		t->cdr = value;
 	}
 	return t;
@@ -2419,9 +3498,12 @@ void lisp_setvar(Lisp_VM *vm, Lisp_String* name, Lisp_Object *value)
 {
 	assert(!name->obj.is_const);
 	
+	uint64_t bit = name_bit(name);
 	Lisp_Env *env = vm->env;
 	Lisp_Pair *p = NULL;
 	for (; env; env = env->parent) {
+		if (!(env->names & bit))
+			continue;
 		p = lisp_dict_assoc(env->bindings, name);
 		if (p) {
 			if (env->bindings->vm != vm) {
@@ -2433,6 +3515,7 @@ void lisp_setvar(Lisp_VM *vm, Lisp_String* name, Lisp_Object *value)
 	if (p) {
 		if (p->obj.is_const)
 			lisp_err(vm, "Can not modify constant: %s", name->buf);
+		write_barrier(vm, &p->obj);
 		p->cdr = value;
 	} else {
 		lisp_err(vm, "Undefined variable: '%s'", name->buf);
@@ -2445,23 +3528,51 @@ void lisp_setvar(Lisp_VM *vm, Lisp_String* name, Lisp_Object *value)
 
 void lisp_port_print(Lisp_Port *port, Lisp_Object *obj);
 
-static void print_string(Lisp_Port *port, Lisp_String *s)
+/*
+ * Write s in double quotes, escaped for the reader, or for JSON
+ * which wants the other control characters escaped too. Runs of
+ * plain bytes are written at once.
+ */
+static void put_quoted(Lisp_Port *port, const char *s, bool json)
 {
-	const char *p;
+	const char *run = s;
+	char u[8];
 	lisp_port_putc(port, '\"');
-	for (p = s->buf;*p;p++) {
-		switch (*p) {
-			case '\"': lisp_port_puts(port, "\\\""); break;
-			case '\\': lisp_port_puts(port, "\\\\"); break;
-			case '\n': lisp_port_puts(port, "\\n"); break;
-			case '\r': lisp_port_puts(port, "\\r"); break;
-			case '\t': lisp_port_puts(port, "\\t"); break;
-			default: lisp_port_putc(port, *p); break;
+	for (;; s++) {
+		unsigned char c = (unsigned char)*s;
+		const char *esc = NULL;
+		if (c >= 0x20 && c != '\"' && c != '\\')
+			continue;
+		if (c == 0)
+			break;
+		switch (c) {
+		case '\"': esc = "\\\""; break;
+		case '\\': esc = "\\\\"; break;
+		case '\n': esc = "\\n"; break;
+		case '\r': esc = "\\r"; break;
+		case '\t': esc = "\\t"; break;
+		default:
+			if (json) {
+				snprintf(u, sizeof(u), "\\u%04x", c);
+				esc = u;
+			}
+			break;
 		}
+		if (!esc)
+			continue;
+		lisp_port_put_bytes(port, run, s - run);
+		lisp_port_put_bytes(port, esc, strlen(esc));
+		run = s + 1;
 	}
+	lisp_port_put_bytes(port, run, s - run);
 	lisp_port_putc(port, '\"');
 }
 
+static void print_string(Lisp_Port *port, Lisp_String *s)
+{
+	put_quoted(port, s->buf, false);
+}
+
 static void print_quoted(Lisp_Port *port, const char *prefix, Lisp_Object *o)
 {
 	lisp_port_puts(port, prefix);
@@ -2530,6 +3641,27 @@ static void print_dict(Lisp_Port *port, Lisp_Array *a)
 	lisp_port_putc(port, ']');
 }
 
+static void print_hamt_items(Lisp_Port *port, Lisp_Hamt *h, bool *first)
+{
+	for (unsigned i = 0; i < h->n; i++) {
+		if (h->items[i]->type == O_HAMT) {
+			print_hamt_items(port, (Lisp_Hamt*)h->items[i], first);
+		} else {
+			if (!*first) lisp_port_putc(port, ' ');
+			*first = false;
+			lisp_port_print(port, h->items[i]);
+		}
+	}
+}
+
+static void print_hamt(Lisp_Port *port, Lisp_Hamt *h)
+{
+	bool first = true;
+	lisp_port_puts(port, "#%[");
+	print_hamt_items(port, h, &first);
+	lisp_port_putc(port, ']');
+}
+
 static void print_symbol(Lisp_Port *port, Lisp_String *s)
 {
 	if (port->isatty) {
@@ -2592,6 +3724,7 @@ void lisp_port_print(Lisp_Port *port, Lisp_Object *obj)
 	case O_PAIR: print_pair(port, (Lisp_Pair*)obj); break;
 	case O_ARRAY: print_array(port, (Lisp_Array*)obj); break;
 	case O_DICT: print_dict(port, (Lisp_Array*)obj); break;
+	case O_HAMT: print_hamt(port, (Lisp_Hamt*)obj); break;
 	case O_BUFFER: print_buffer(port, (Lisp_Buffer*)obj); break;
 	case O_NUMBER:
 	{
@@ -2672,6 +3805,7 @@ static const char *token_names[] = {
 	[T_DOLLAR] = "DOLLAR", [T_AT] = "AT",
 	[T_CIRCUMFLEX] = "CIRCUMFLEX", [T_BUFFER] = "BUFFER",
 	[T_ARRAY_BEGIN] = "ABEGIN", [T_DICT_BEGIN] = "DBEGIN",
+	[T_HAMT_BEGIN] = "HBEGIN",
 	[T_COLON] = "COLON", [T_STRING_PART]="STRINGPART",
 	[T_COLON_COMPONENT] = "COLONCOMPONENT"
 };
@@ -2995,6 +4129,15 @@ Retry:
 				lisp_err(vm, "invalid dict: ##%c", c);
 			}
 			break;
+		case '%':
+			c = lisp_port_getc(vm->input);
+			if (c == '('|| c == '[' || c == '{') {
+				vm->token_type = T_HAMT_BEGIN;
+				lisp_buffer_add(vm->token, c);
+			} else {
+				lisp_err(vm, "invalid hamt: #%%%c", c);
+			}
+			break;
 		default:
 			lisp_err(vm, "invalid char: #%c", c);
 			break;
@@ -3030,21 +4173,27 @@ Retry:
  *******************************************************************/
 
 /* Construct a symbol object on stack */
-Lisp_String *lisp_make_symbol(Lisp_VM *vm, const char *name)
+/* Intern symbol of len bytes from name, and push it.
+ * Symbols created by a parent vm are shared with its children,
+ * which only read the parent's table.
+ */
+Lisp_String *lisp_make_symbol_len(Lisp_VM *vm, const char *name, size_t len)
 {
-	Lisp_String *t = find_sym(&_symtab[0], S_TOTAL, name);
+	uint32_t h = hash_bytes(name, len);
+	Lisp_String *t = find_sym(name, len, h);
 	if (t) {
 		pushx(vm, t);
 	} else {
-		Lisp_Pair *p = lisp_dict_assoc_cstr(vm->symbols, name);
+		Lisp_Pair *p = dict_assoc_symbol(vm->symbols, name, len, h);
 		if (!p && vm->parent) {
-			p = lisp_dict_assoc_cstr(vm->parent->symbols, name);
+			p = dict_assoc_symbol(vm->parent->symbols, name, len, h);
 		}
 		if (p) {
 			t = (Lisp_String*)p->car;
 			pushx(vm, t);
 		} else {
-			t = lisp_symbol_new(vm, name, strlen(name));
+			t = lisp_symbol_new(vm, name, len);
+			t->hash = h;
 			pushx(vm, t);
 			lisp_dict_add(vm->symbols, t, LISP_NIL);
 		}
@@ -3052,6 +4201,11 @@ Lisp_String *lisp_make_symbol(Lisp_VM *vm, const char *name)
 	return t;
 }
 
+Lisp_String *lisp_make_symbol(Lisp_VM *vm, const char *name)
+{
+	return lisp_make_symbol_len(vm, name, strlen(name));
+}
+
 static void badtok(Lisp_VM *vm)
 {
 	lisp_err(vm, "unexpected token: %s %s",
@@ -3089,7 +4243,9 @@ static void end_expr_mapping(Lisp_VM *vm)
 	if (p != LISP_NIL)
 	{
 		m->end = vm->token_pos.last_pos;
+		write_barrier(vm, &m->obj);
 		m->expr = p;
+		write_barrier(vm, &p->obj);
 		p->mapping = m;
 		lisp_array_push(vm->input->src_file->mappings, (Lisp_Object*)m);
 	}
@@ -3101,9 +4257,18 @@ static void sexps(Lisp_VM *vm);
 static void sexps_without_dots(Lisp_VM *vm);
 static void mklist(Lisp_VM *vm);
 static void mkdict(Lisp_VM *vm, int n);
+static void mkhamt(Lisp_VM *vm, int n);
 static void mkarray(Lisp_VM *vm, int n);
 static int sexp(Lisp_VM *vm);
 
+/* Stacks grow down everywhere we run */
+static inline void check_stack(Lisp_VM *vm)
+{
+	char here;
+	if ((uintptr_t)&here < vm->stack_limit)
+		lisp_err(vm, "out of C stack");
+}
+
 static void quoted(Lisp_VM*vm, Lisp_Object* q)
 {
 	begin_expr_mapping(vm);
@@ -3153,12 +4318,12 @@ static void colon_path(Lisp_VM *vm)
 	begin_expr_mapping(vm);
 	lisp_push(vm, LISP_MARK);
 	pushx(vm, SYM(S_GET));
-	lisp_make_symbol(vm, (char*)vm->token->buf);
+	lisp_make_symbol_len(vm, (char*)vm->token->buf, vm->token->length-1);
 	do {
 		next_token(vm);
 		if (vm->token_type == T_SYMBOL||vm->token_type==T_COLON_COMPONENT) {
 			pushx(vm, SYM(S_QUOTE));
-			lisp_make_symbol(vm, (char*)vm->token->buf);
+			lisp_make_symbol_len(vm, (char*)vm->token->buf, vm->token->length-1);
 			lisp_make_list(vm, 2);
 			if (vm->token_type == T_SYMBOL)
 				break;
@@ -3198,6 +4363,7 @@ static int sexp(Lisp_VM *vm)
 	Lisp_String *s;
 	double d;
 	int tt = vm->token_type;
+	check_stack(vm);
 	switch (tt) {
 	case T_LPAREN:
 	case T_LBRACKET:
@@ -3213,6 +4379,7 @@ static int sexp(Lisp_VM *vm)
 		break;
 	case T_ARRAY_BEGIN:
 	case T_DICT_BEGIN:
+	case T_HAMT_BEGIN:
 	{
 		int c = vm->token->buf[0];
 		size_t cnt = vm->stack->count;
@@ -3228,6 +4395,8 @@ static int sexp(Lisp_VM *vm)
 		}
 		if (tt == T_DICT_BEGIN) {
 			mkdict(vm, (int)cnt);
+		} else if (tt == T_HAMT_BEGIN) {
+			mkhamt(vm, (int)cnt);
 		} else {
 			mkarray(vm, (int)cnt);
 		}
@@ -3240,7 +4409,7 @@ static int sexp(Lisp_VM *vm)
 		break;
 	}
 	case T_SYMBOL:
-		lisp_make_symbol(vm, (char*)vm->token->buf);
+		lisp_make_symbol_len(vm, (char*)vm->token->buf, vm->token->length-1);
 		break;
 	case T_COLON_COMPONENT:
 		colon_path(vm);
@@ -3319,6 +4488,7 @@ static void mklist(Lisp_VM *vm)
 	if (top[-1] != LISP_DOT) {
 		is_list = true;
 		top[0] = cons(vm, top[0], LISP_NIL);
+		write_barrier(vm, &vm->stack->obj);
 	}
 	
 	for (;true;top--) {
@@ -3329,6 +4499,7 @@ static void mklist(Lisp_VM *vm)
 			break;
 		} else {
 			top[-1] = cons(vm, top[-1], top[0]);
+			write_barrier(vm, &vm->stack->obj); /* before the next cons may collect */
 			top[-1]->is_list = is_list;
 		}
 	}
@@ -3361,6 +4532,25 @@ static void mkdict(Lisp_VM *vm, int n)
 	pushx(vm, a);
 }
 
+/* Replace the top n (key . value) pairs by a hamt of them */
+static void mkhamt(Lisp_VM *vm, int n)
+{
+	assert((unsigned)n <= vm->stack->count);
+	size_t base = vm->stack->count - n;
+	pushx(vm, lisp_hamt_new(vm));
+	for (size_t i = base; i < base + n; i++) {
+		Lisp_Object *o = vm->stack->items[i];
+		if (o->type != O_PAIR || o == LISP_NIL)
+			lisp_err(vm, "bad hamt: must be a (key . value) pair");
+		Lisp_Hamt *h = (Lisp_Hamt*)vm->stack->items[vm->stack->count-1];
+		vm->stack->items[vm->stack->count-1] =
+			(Lisp_Object*)lisp_hamt_set(vm, h, CAR(o), CDR(o));
+	}
+	Lisp_Object *h = lisp_pop(vm, 1);
+	vm->stack->count -= n;
+	lisp_push(vm, h);
+}
+
 void lisp_begin_list(Lisp_VM *vm)
 {
 	lisp_push(vm, LISP_MARK);
@@ -3371,328 +4561,2206 @@ void lisp_end_list(Lisp_VM *vm)
 	mklist(vm);
 }
 
-/* lisp_read -- Read a lisp object from input
- * On success, returns the object and also leaves it at the stack top.
- * Otherwise, long jump to current error handler.
- */
-Lisp_Object* lisp_read(Lisp_VM *vm)
-{
-	next_token(vm);
-	if (vm->token_type == T_EOF)
-		lisp_push(vm, LISP_EOF);
-	else if (!sexp(vm))
-		badtok(vm);
-	return vm->stack->items[vm->stack->count-1];
-}
+/**
+ ** Binary encoding
+ **
+ ** A compact form of readable objects, used for passing messages
+ ** between VMs of the same process without printing and parsing.
+ ** An encoded object is framed as
+ **
+ **   BINARY_MARK BINARY_VERSION <u32 size> <payload>
+ **
+ ** and lisp_read() takes it in place of text when it finds the mark
+ ** on a port that accepts it, see lisp_port_set_binary().
+ ** Numbers and sizes are in host byte order, so the encoding is not
+ ** meant for storage or the network.
+ **/
 
+#define BINARY_MARK 0    /* Never starts a token */
+#define BINARY_VERSION 1
 
-/*******************************************************************
- ** Eval & Apply
- *******************************************************************/
+enum {
+	B_NIL, B_NUMBER, B_SYMBOL, B_STRING, B_BUFFER,
+	B_LIST, B_DOTTED, B_ARRAY, B_DICT, B_HAMT
+};
 
-static Lisp_Object *lisp_eval_core(Lisp_VM*, int at_tail);
-#define lisp_eval(vm) lisp_eval_core(vm, 0)
-#define lisp_eval_tail(vm) lisp_eval_core(vm, 1)
+static void put_u32(Lisp_Buffer *b, uint32_t n)
+{
+	lisp_buffer_add_bytes(b, &n, sizeof(n));
+}
 
-void lisp_apply(Lisp_VM *vm, Lisp_Object *proc, Lisp_Pair *args);
-static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args);
+static void put_bytes(Lisp_Buffer *b, int tag, const void *data, size_t n)
+{
+	lisp_buffer_add(b, tag);
+	put_u32(b, (uint32_t)n);
+	lisp_buffer_add_bytes(b, data, n);
+}
 
-/* `args' is a list.
- * Reuse constant pairs.
- */
-static void eval_args(Lisp_VM *vm, Lisp_Pair *args)
+static bool encode(Lisp_Buffer *b, Lisp_Object *o, int depth);
+
+/* The entries of h, in no particular order */
+static bool encode_hamt(Lisp_Buffer *b, Lisp_Hamt *h, int depth)
 {
-	int n = 0;
-	Lisp_Pair *p = args;
-	for (; p != LISP_NIL; p = REST(p), n++)
-		pushx(vm, p);
-	lisp_push(vm, LISP_NIL);
-	for (; n > 0; n--) {
-		Lisp_Object *t = lisp_top(vm, 0);
-		Lisp_Pair* p = (Lisp_Pair*)lisp_top(vm, 1);
-		if (p->cdr == t) {
-			if (p->car->is_const) {
-				lisp_pop(vm, 1);
-				continue;
-			}
+	for (unsigned i = 0; i < h->n; i++) {
+		Lisp_Object *o = h->items[i];
+		if (o->type == O_HAMT) {
+			if (!encode_hamt(b, (Lisp_Hamt*)o, depth))
+				return false;
+		} else if (!encode(b, o, depth)) {
+			return false;
 		}
-		lisp_push(vm, p->car);
-		lisp_eval(vm);
-		p = lisp_pair_new(vm, lisp_top(vm, 0), t);
-		lisp_pop(vm, 3);
-		pushx(vm, p);
 	}
+	return true;
 }
 
-/* `l' must be a list. Checked by caller
- * If at_tail is false, then no tail recursion is allowed.
- * execution will not be delayed.
- */
-static void eval_list(Lisp_VM *vm, Lisp_Pair *l, bool at_tail)
+/* Return false if o contains an object that can not be read back */
+static bool encode(Lisp_Buffer *b, Lisp_Object *o, int depth)
 {
-	for (; l->cdr != LISP_NIL; l = (Lisp_Pair*)l->cdr) {
-		lisp_push(vm, l->car);
-		Lisp_Object *r = lisp_eval(vm);
-		if (r->is_return) return;
-		lisp_pop(vm, 1);
-	}
-	lisp_push(vm, l->car);
-	lisp_eval_core(vm, at_tail);
+	if (depth > MAX_DEPTH)
+		return false;
+	if (o == LISP_NIL) {
+		lisp_buffer_add(b, B_NIL);
+		return true;
+	}
+	switch (o->type) {
+	case O_NUMBER:
+		lisp_buffer_add(b, B_NUMBER);
+		lisp_buffer_add_bytes(b, &((Lisp_Number*)o)->value, sizeof(double));
+		return true;
+	case O_SYMBOL:
+		put_bytes(b, B_SYMBOL, ((Lisp_String*)o)->buf, ((Lisp_String*)o)->length);
+		return true;
+	case O_STRING:
+		put_bytes(b, B_STRING, ((Lisp_String*)o)->buf, ((Lisp_String*)o)->length);
+		return true;
+	case O_BUFFER:
+		put_bytes(b, B_BUFFER, ((Lisp_Buffer*)o)->buf, ((Lisp_Buffer*)o)->length);
+		return true;
+	case O_PAIR: {
+		uint32_t n = 0;
+		Lisp_Object *t = o;
+		for (; t->type == O_PAIR && t != LISP_NIL; t = CDR(t))
+			n++;
+		lisp_buffer_add(b, t == LISP_NIL ? B_LIST : B_DOTTED);
+		put_u32(b, n);
+		for (t = o; t->type == O_PAIR && t != LISP_NIL; t = CDR(t)) {
+			if (!encode(b, CAR(t), depth + 1))
+				return false;
+		}
+		return t == LISP_NIL || encode(b, t, depth + 1);
+	}
+	case O_ARRAY: {
+		Lisp_Array *a = (Lisp_Array*)o;
+		lisp_buffer_add(b, B_ARRAY);
+		put_u32(b, a->count);
+		for (unsigned i = 0; i < a->count; i++) {
+			if (!encode(b, a->items[i], depth + 1))
+				return false;
+		}
+		return true;
+	}
+	case O_DICT: {
+		/* Skip the lookup table and removed entries */
+		Lisp_Array *a = (Lisp_Array*)o;
+		uint32_t n = 0;
+		for (unsigned i = 1; i < a->count; i++)
+			n += a->items[i] != NULL;
+		lisp_buffer_add(b, B_DICT);
+		put_u32(b, n);
+		for (unsigned i = 1; i < a->count; i++) {
+			if (a->items[i] && !encode(b, a->items[i], depth + 1))
+				return false;
+		}
+		return true;
+	}
+	case O_HAMT: {
+		Lisp_Hamt *h = (Lisp_Hamt*)o;
+		lisp_buffer_add(b, B_HAMT);
+		put_u32(b, h->size);
+		return encode_hamt(b, h, depth + 1);
+	}
+	default:
+		return false;
+	}
 }
 
-/* Evaluate procedure body */
-static void eval_body(Lisp_VM *vm, Lisp_Pair *l)
+/*
+ * lisp_serialize -- Encode a readable object
+ * On success push a buffer holding the framed encoding and return
+ * true. If o can not be encoded, push nothing and return false.
+ */
+bool lisp_serialize(Lisp_VM *vm, Lisp_Object *o)
+{
+	Lisp_Buffer *b = lisp_buffer_new(vm, 128);
+	pushx(vm, b);
+	lisp_buffer_add(b, BINARY_MARK);
+	lisp_buffer_add(b, BINARY_VERSION);
+	put_u32(b, 0);
+	if (!encode(b, o, 0)) {
+		lisp_pop(vm, 1);
+		return false;
+	}
+	uint32_t n = (uint32_t)(b->length - 2 - sizeof(n));
+	memcpy(b->buf + 2, &n, sizeof(n));
+	return true;
+}
+
+typedef struct {
+	Lisp_VM *vm;
+	const uint8_t *p, *end;
+} Decoder;
+
+static const uint8_t *take(Decoder *d, size_t n)
 {
-	eval_list(vm, l, 1);
+	if ((size_t)(d->end - d->p) < n)
+		lisp_err(d->vm, "read: truncated binary object");
+	const uint8_t *p = d->p;
+	d->p += n;
+	return p;
 }
 
-/* p is also at stack top
- *
- * Stack Layout during evaluation:
- *
- * 0  p
- * 1  EXPR-MARK
- * 2  op
- * 3  args
- * 4  returned value
+static uint32_t take_u32(Decoder *d)
+{
+	uint32_t n;
+	memcpy(&n, take(d, sizeof(n)), sizeof(n));
+	return n;
+}
+
+/* Rebuild an object on the stack the same way the reader does */
+static void decode(Decoder *d, int depth)
+{
+	Lisp_VM *vm = d->vm;
+	if (depth > MAX_DEPTH)
+		lisp_err(vm, "read: binary object too deep");
+	int tag = *take(d, 1);
+	uint32_t n;
+	switch (tag) {
+	case B_NIL:
+		lisp_push(vm, LISP_NIL);
+		break;
+	case B_NUMBER: {
+		double v;
+		memcpy(&v, take(d, sizeof(v)), sizeof(v));
+		push_num(vm, v);
+		break;
+	}
+	case B_SYMBOL:
+		n = take_u32(d);
+		if (n > MAX_SYMBOL_LENGTH)
+			lisp_err(vm, "read: symbol too long");
+		lisp_make_symbol_len(vm, (const char*)take(d, n), n);
+		break;
+	case B_STRING:
+		n = take_u32(d);
+		pushx(vm, lisp_string_new(vm, (const char*)take(d, n), n));
+		break;
+	case B_BUFFER: {
+		n = take_u32(d);
+		Lisp_Buffer *b = lisp_buffer_copy(vm, take(d, n), n);
+		b->obj.is_const = 1;
+		pushx(vm, b);
+		break;
+	}
+	case B_LIST:
+	case B_DOTTED:
+		n = take_u32(d);
+		lisp_push(vm, LISP_MARK);
+		for (uint32_t i = 0; i < n; i++)
+			decode(d, depth + 1);
+		if (tag == B_DOTTED) {
+			lisp_push(vm, LISP_DOT);
+			decode(d, depth + 1);
+		}
+		mklist(vm);
+		break;
+	case B_ARRAY:
+	case B_DICT:
+		n = take_u32(d);
+		for (uint32_t i = 0; i < n; i++)
+			decode(d, depth + 1);
+		if (tag == B_DICT)
+			mkdict(vm, (int)n);
+		else
+			mkarray(vm, (int)n);
+		break;
+	case B_HAMT:
+		n = take_u32(d);
+		for (uint32_t i = 0; i < n; i++)
+			decode(d, depth + 1);
+		mkhamt(vm, (int)n);
+		break;
+	default:
+		lisp_err(vm, "read: bad binary object");
+	}
+}
+
+/* Read a framed binary object from port. The mark is next. */
+static void read_binary(Lisp_VM *vm, Lisp_Port *port)
+{
+	uint8_t head[2 + sizeof(uint32_t)];
+	uint32_t size;
+	for (size_t i = 0; i < sizeof(head); i++) {
+		int c = lisp_port_getc(port);
+		if (c == EOF)
+			lisp_err(vm, "read: truncated binary object");
+		head[i] = (uint8_t)c;
+	}
+	if (head[1] != BINARY_VERSION)
+		lisp_err(vm, "read: unknown binary version %d", head[1]);
+	memcpy(&size, head + 2, sizeof(size));
+	if (size > port->binary_limit)
+		lisp_err(vm, "read: binary object too large");
+
+	/* Decode in place when the whole payload is buffered */
+	Lisp_Buffer *b = NULL;
+	const uint8_t *p;
+	if (port->iobuf->length - port->input_pos >= size) {
+		p = port->iobuf->buf + port->input_pos;
+		port->input_pos += size;
+		port->src_pos += size;
+	} else {
+		b = lisp_buffer_new(vm, size);
+		pushx(vm, b);
+		while (b->length < size) {
+			size_t avail = lisp_port_fill(port);
+			if (avail == 0)
+				lisp_err(vm, "read: truncated binary object");
+			if (avail > size - b->length)
+				avail = size - b->length;
+			lisp_buffer_add_bytes(b, port->iobuf->buf + port->input_pos, avail);
+			port->input_pos += avail;
+			port->src_pos += avail;
+		}
+		p = b->buf;
+	}
+	Decoder d = { vm, p, p + size };
+	decode(&d, 0);
+	if (d.p != d.end)
+		lisp_err(vm, "read: bad binary object");
+	if (b) {
+		Lisp_Object *o = lisp_pop(vm, 2);
+		lisp_push(vm, o);
+	}
+}
+
+/**
+ ** JSON
+ **
+ ** json-encode writes an object to a port as JSON text:
+ **
+ **   strings, symbols         -> strings
+ **   numbers                  -> numbers, null if not finite
+ **   true, false, undefined   -> true, false, null
+ **   dicts, hamts and lists of
+ **   pairs keyed by symbols   -> objects
+ **   other lists, arrays      -> arrays
+ **
+ ** json-decode reads it back, objects as alists or dicts keyed by
+ ** symbols, and arrays as lists.
+ **/
+
+static void json_put(Lisp_VM *vm, Lisp_Port *port, Lisp_Object *o, int depth);
+
+static void json_put_key(Lisp_VM *vm, Lisp_Port *port, Lisp_Object *k)
+{
+	if (k->type == O_SYMBOL || k->type == O_STRING) {
+		put_quoted(port, ((Lisp_String*)k)->buf, true);
+	} else if (k->type == O_NUMBER) {
+		char buf[DTOA_BUFSIZE];
+		dtoa(NUMVAL(k), buf);
+		lisp_port_putc(port, '\"');
+		lisp_port_put_bytes(port, buf, strlen(buf));
+		lisp_port_putc(port, '\"');
+	} else {
+		lisp_err(vm, "json-encode: bad key");
+	}
+	lisp_port_putc(port, ':');
+}
+
+static void json_put_entry(Lisp_VM *vm, Lisp_Port *port, Lisp_Pair *p,
+	bool *first, int depth)
+{
+	if (!*first)
+		lisp_port_putc(port, ',');
+	*first = false;
+	json_put_key(vm, port, p->car);
+	json_put(vm, port, p->cdr, depth + 1);
+}
+
+static void json_put_hamt(Lisp_VM *vm, Lisp_Port *port, Lisp_Hamt *h,
+	bool *first, int depth)
+{
+	for (unsigned i = 0; i < h->n; i++) {
+		if (h->items[i]->type == O_HAMT)
+			json_put_hamt(vm, port, (Lisp_Hamt*)h->items[i], first, depth);
+		else
+			json_put_entry(vm, port, (Lisp_Pair*)h->items[i], first, depth);
+	}
+}
+
+/*
+ * A list of (symbol . value) pairs. true, false and undefined are
+ * values, so that decoded arrays like [[null, 1]] stay arrays.
  */
-static Lisp_Object *eval_expr(Lisp_VM *vm, Lisp_Pair* p, int at_tail)
+static bool json_is_object(Lisp_Pair *l)
 {
-	if (++vm->eval_level > MAX_DEPTH)
-		lisp_err(vm, "exceeding max depth: %d", MAX_DEPTH);
-	
-	if (vm->cov_trace && p->mapping)
-		p->mapping->cnt++;
-	
-	Lisp_Object *op = p->car;
-	lisp_push(vm, LISP_EXPR_MARK); /* mark callstack */
-	lisp_push(vm, op);
-	op = lisp_eval(vm);
+	for (; l != LISP_NIL; l = REST(l)) {
+		if (l->obj.type != O_PAIR)
+			return false;
+		Lisp_Object *o = l->car;
+		if (o->type != O_PAIR || o == LISP_NIL || CAR(o)->type != O_SYMBOL)
+			return false;
+		Lisp_Object *k = CAR(o);
+		if (k == LISP_TRUE || k == LISP_FALSE || k == LISP_UNDEF)
+			return false;
+	}
+	return true;
+}
 
-	if (!is_list((Lisp_Object*)p))
-		lisp_err(vm, "bad sexp: not a list");
-	if (op->is_special) {
-		lisp_push(vm, p->cdr);
+static void json_put(Lisp_VM *vm, Lisp_Port *port, Lisp_Object *o, int depth)
+{
+	bool first = true;
+	if (depth > MAX_DEPTH)
+		lisp_err(vm, "json-encode: too deep");
+	switch (o->type) {
+	case O_NUMBER: {
+		char buf[DTOA_BUFSIZE];
+		if (isfinite(NUMVAL(o)))
+			dtoa(NUMVAL(o), buf);
+		else
+			strcpy(buf, "null");
+		lisp_port_put_bytes(port, buf, strlen(buf));
+		break;
+	}
+	case O_STRING:
+		put_quoted(port, ((Lisp_String*)o)->buf, true);
+		break;
+	case O_SYMBOL:
+		if (o == LISP_TRUE)
+			lisp_port_put_bytes(port, "true", 4);
+		else if (o == LISP_FALSE)
+			lisp_port_put_bytes(port, "false", 5);
+		else if (o == LISP_UNDEF)
+			lisp_port_put_bytes(port, "null", 4);
+		else
+			put_quoted(port, ((Lisp_String*)o)->buf, true);
+		break;
+	case O_PAIR: {
+		Lisp_Pair *l = (Lisp_Pair*)o;
+		if (l != LISP_NIL && json_is_object(l)) {
+			lisp_port_putc(port, '{');
+			for (; l != LISP_NIL; l = REST(l))
+				json_put_entry(vm, port, (Lisp_Pair*)l->car, &first, depth);
+			lisp_port_putc(port, '}');
+			break;
+		}
+		lisp_port_putc(port, '[');
+		for (; l != LISP_NIL; l = REST(l)) {
+			if (l->obj.type != O_PAIR)
+				lisp_err(vm, "json-encode: dotted list");
+			if (l != (Lisp_Pair*)o)
+				lisp_port_putc(port, ',');
+			json_put(vm, port, l->car, depth + 1);
+		}
+		lisp_port_putc(port, ']');
+		break;
+	}
+	case O_ARRAY: {
+		Lisp_Array *a = (Lisp_Array*)o;
+		lisp_port_putc(port, '[');
+		for (unsigned i = 0; i < a->count; i++) {
+			if (i > 0)
+				lisp_port_putc(port, ',');
+			json_put(vm, port, a->items[i] ? a->items[i] : LISP_UNDEF, depth + 1);
+		}
+		lisp_port_putc(port, ']');
+		break;
+	}
+	case O_DICT: {
+		Lisp_Array *a = (Lisp_Array*)o;
+		lisp_port_putc(port, '{');
+		for (unsigned i = 1; i < a->count; i++) {
+			Lisp_Pair *p = (Lisp_Pair*)a->items[i];
+			if (p->cdr != LISP_UNDEF) // see lisp_dict_remove()
+				json_put_entry(vm, port, p, &first, depth);
+		}
+		lisp_port_putc(port, '}');
+		break;
+	}
+	case O_HAMT:
+		lisp_port_putc(port, '{');
+		json_put_hamt(vm, port, (Lisp_Hamt*)o, &first, depth);
+		lisp_port_putc(port, '}');
+		break;
+	default:
+		lisp_err(vm, "json-encode: can not convert %s", objtypes[o->type].name);
+	}
+}
+
+typedef struct {
+	Lisp_VM *vm;
+	const char *start, *p, *end;
+	bool dicts;     // objects as dicts rather than alists
+	Lisp_Buffer *tmp; // for strings with escapes
+} Json_Reader;
+
+static void json_fail(Json_Reader *r, const char *what)
+{
+	lisp_err(r->vm, "json-decode: %s at %d", what, (int)(r->p - r->start));
+}
+
+static int json_peek(Json_Reader *r)
+{
+	while (r->p < r->end) {
+		switch (*r->p) {
+		case ' ': case '\t': case '\n': case '\r':
+			r->p++;
+			break;
+		default:
+			return (unsigned char)*r->p;
+		}
+	}
+	return EOF;
+}
+
+static void json_expect(Json_Reader *r, const char *word, size_t n)
+{
+	if ((size_t)(r->end - r->p) < n || memcmp(r->p, word, n) != 0)
+		json_fail(r, "bad literal");
+	r->p += n;
+}
+
+static unsigned json_hex4(Json_Reader *r)
+{
+	unsigned v = 0;
+	if (r->end - r->p < 4)
+		json_fail(r, "bad \\u escape");
+	for (int i = 0; i < 4; i++) {
+		int c = (unsigned char)*r->p++;
+		v <<= 4;
+		if (c >= '0' && c <= '9') v |= c - '0';
+		else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+		else json_fail(r, "bad \\u escape");
+	}
+	return v;
+}
+
+static void json_add_utf8(Lisp_Buffer *b, unsigned c)
+{
+	if (c < 0x80) {
+		lisp_buffer_add(b, (int)c);
+	} else if (c < 0x800) {
+		lisp_buffer_add(b, (int)(0xc0 | (c >> 6)));
+		lisp_buffer_add(b, (int)(0x80 | (c & 0x3f)));
+	} else if (c < 0x10000) {
+		lisp_buffer_add(b, (int)(0xe0 | (c >> 12)));
+		lisp_buffer_add(b, (int)(0x80 | ((c >> 6) & 0x3f)));
+		lisp_buffer_add(b, (int)(0x80 | (c & 0x3f)));
 	} else {
-		eval_args(vm, (Lisp_Pair*)p->cdr);
+		lisp_buffer_add(b, (int)(0xf0 | (c >> 18)));
+		lisp_buffer_add(b, (int)(0x80 | ((c >> 12) & 0x3f)));
+		lisp_buffer_add(b, (int)(0x80 | ((c >> 6) & 0x3f)));
+		lisp_buffer_add(b, (int)(0x80 | (c & 0x3f)));
 	}
+}
 
-	if (at_tail) {
-		if (op->type == O_PROC) {
-			/* Tail Call Object: (expr . (op . args))
-			 * EXPR is required to track source location
-			 * for error reporting
-			 */
-			Lisp_Object *args = lisp_top(vm, 0);
-			lisp_push(vm, (Lisp_Object*)p);
-			lisp_push(vm, op);
-			lisp_push(vm, args);
-			lisp_cons(vm);
-			Lisp_Pair *t = lisp_cons(vm);
-			t->obj.tail_call = 1;
-		} else {
-			lisp_apply(vm, op, (Lisp_Pair*)lisp_top(vm, 0));
+/* Push the string that starts after the opening quote, as a symbol if key */
+static void json_string(Json_Reader *r, bool key)
+{
+	const char *s = r->p;
+	while (r->p < r->end && *r->p != '\"' && *r->p != '\\') {
+		if ((unsigned char)*r->p < 0x20)
+			json_fail(r, "control character in string");
+		r->p++;
+	}
+	if (r->p == r->end)
+		json_fail(r, "unterminated string");
+	if (*r->p == '\"') { // Nothing to unescape
+		if (key)
+			lisp_make_symbol_len(r->vm, s, r->p - s);
+		else
+			pushx(r->vm, lisp_string_new(r->vm, s, r->p - s));
+		r->p++;
+		return;
+	}
+
+	Lisp_Buffer *b = r->tmp;
+	b->length = 0;
+	lisp_buffer_add_bytes(b, s, r->p - s);
+	while (1) {
+		if (r->p == r->end)
+			json_fail(r, "unterminated string");
+		int c = (unsigned char)*r->p++;
+		if (c == '\"')
+			break;
+		if (c < 0x20)
+			json_fail(r, "control character in string");
+		if (c != '\\') {
+			lisp_buffer_add(b, c);
+			continue;
+		}
+		if (r->p == r->end)
+			json_fail(r, "unterminated string");
+		switch (*r->p++) {
+		case '\"': lisp_buffer_add(b, '\"'); break;
+		case '\\': lisp_buffer_add(b, '\\'); break;
+		case '/': lisp_buffer_add(b, '/'); break;
+		case 'b': lisp_buffer_add(b, '\b'); break;
+		case 'f': lisp_buffer_add(b, '\f'); break;
+		case 'n': lisp_buffer_add(b, '\n'); break;
+		case 'r': lisp_buffer_add(b, '\r'); break;
+		case 't': lisp_buffer_add(b, '\t'); break;
+		case 'u': {
+			unsigned u = json_hex4(r);
+			if (u >= 0xdc00 && u <= 0xdfff)
+				json_fail(r, "lone surrogate");
+			if (u >= 0xd800 && u <= 0xdbff) {
+				if (r->end - r->p < 2 || r->p[0] != '\\' || r->p[1] != 'u')
+					json_fail(r, "lone surrogate");
+				r->p += 2;
+				unsigned lo = json_hex4(r);
+				if (lo < 0xdc00 || lo > 0xdfff)
+					json_fail(r, "lone surrogate");
+				u = 0x10000 + ((u - 0xd800) << 10) + (lo - 0xdc00);
+			}
+			if (u == 0)
+				json_fail(r, "\\u0000 in string");
+			json_add_utf8(b, u);
+			break;
+		}
+		default:
+			json_fail(r, "bad escape");
 		}
+	}
+	if (key)
+		lisp_make_symbol_len(r->vm, (char*)b->buf, b->length);
+	else
+		pushx(r->vm, lisp_string_new(r->vm, (char*)b->buf, b->length));
+}
+
+static void json_number(Json_Reader *r)
+{
+	const char *s = r->p, *q = r->p;
+	bool integer = true;
+	if (q < r->end && *q == '-')
+		q++;
+	if (q < r->end && *q == '0') {
+		q++;
+	} else if (q < r->end && *q >= '1' && *q <= '9') {
+		while (q < r->end && isdigit((unsigned char)*q))
+			q++;
 	} else {
-		while (true) {
-			lisp_apply(vm, op, (Lisp_Pair*)lisp_top(vm, 0));
-			assert(vm->stack->count > 3);
-			Lisp_Object **t = vm->stack->items + vm->stack->count - 3;
-			if (!t[2]->tail_call) break;
-			assert(t[-1] == LISP_EXPR_MARK);
-			t[-2] = CAR(t[2]);          /* update expression */
-			op = t[0] = CAR(CDR(t[2])); /* new op */
-			t[1] = CDR(CDR(t[2]));      /* new args */
-			vm->stack->count--;
+		json_fail(r, "bad number");
+	}
+	if (q < r->end && *q == '.') {
+		integer = false;
+		if (++q == r->end || !isdigit((unsigned char)*q))
+			json_fail(r, "bad number");
+		while (q < r->end && isdigit((unsigned char)*q))
+			q++;
+	}
+	if (q < r->end && (*q == 'e' || *q == 'E')) {
+		integer = false;
+		if (++q < r->end && (*q == '+' || *q == '-'))
+			q++;
+		if (q == r->end || !isdigit((unsigned char)*q))
+			json_fail(r, "bad number");
+		while (q < r->end && isdigit((unsigned char)*q))
+			q++;
+	}
+	r->p = q;
+
+	/* Short integers are exact without strtod() */
+	size_t n = q - s;
+	if (integer && n <= 15) {
+		int64_t v = 0;
+		for (const char *t = *s == '-' ? s + 1 : s; t < q; t++)
+			v = v * 10 + (*t - '0');
+		push_num(r->vm, *s == '-' ? (v ? (double)-v : -0.0) : (double)v);
+		return;
+	}
+	char buf[400];
+	if (n >= sizeof(buf))
+		json_fail(r, "number too long");
+	memcpy(buf, s, n);
+	buf[n] = 0;
+	push_num(r->vm, strtod(buf, NULL));
+}
+
+/* Like mkdict() but a later value of a key replaces the earlier one */
+static void json_mkdict(Lisp_VM *vm, int n)
+{
+	size_t base = vm->stack->count - n;
+	Lisp_Array *a = lisp_dict_new(vm, n);
+	pushx(vm, a);
+	for (size_t i = base; i < base + n; i++) {
+		Lisp_Pair *p = (Lisp_Pair*)vm->stack->items[i];
+		Lisp_Pair *t = lisp_dict_assoc(a, (Lisp_String*)p->car);
+		if (t) {
+			write_barrier(vm, &t->obj);
+			t->cdr = p->cdr;
+		} else {
+			lisp_dict_add_item(a, p);
 		}
 	}
-	
-	Lisp_Object *ret = lisp_pop(vm, 5);
-	lisp_push(vm, ret);
-	vm->eval_level--;
-	return ret;
+	vm->stack->count -= n + 1;
+	pushx(vm, a);
 }
 
-/* Eval the stack top object and replace it with result. */
-Lisp_Object* lisp_eval_core(Lisp_VM *vm, int at_tail)
+static void json_value(Json_Reader *r, int depth)
 {
-	size_t count = vm->stack->count;
-	Lisp_Object *obj = lisp_top(vm, 0);
-	if (obj->is_const) return obj;
-	switch (obj->type) {
-	case O_SYMBOL:
-		obj = lisp_getvar(vm, (Lisp_String*)obj);
-		lisp_pop(vm, 1);
-		lisp_push(vm, obj);
+	Lisp_VM *vm = r->vm;
+	int n = 0;
+	if (depth > MAX_DEPTH)
+		json_fail(r, "too deep");
+	switch (json_peek(r)) {
+	case '{':
+		r->p++;
+		if (!r->dicts)
+			lisp_push(vm, LISP_MARK);
+		if (json_peek(r) == '}') {
+			r->p++;
+		} else {
+			while (1) {
+				if (json_peek(r) != '\"')
+					json_fail(r, "expect key");
+				r->p++;
+				json_string(r, true);
+				if (json_peek(r) != ':')
+					json_fail(r, "expect ':'");
+				r->p++;
+				json_value(r, depth + 1);
+				lisp_cons(vm);
+				n++;
+				int c = json_peek(r);
+				if (c != ',' && c != '}')
+					json_fail(r, "expect ',' or '}'");
+				r->p++;
+				if (c == '}')
+					break;
+			}
+		}
+		if (r->dicts)
+			json_mkdict(vm, n);
+		else
+			mklist(vm);
 		break;
-	case O_PAIR:
-		obj = eval_expr(vm, (Lisp_Pair*)obj, at_tail);
+	case '[':
+		r->p++;
+		lisp_push(vm, LISP_MARK);
+		if (json_peek(r) == ']') {
+			r->p++;
+		} else {
+			while (1) {
+				json_value(r, depth + 1);
+				int c = json_peek(r);
+				if (c != ',' && c != ']')
+					json_fail(r, "expect ',' or ']'");
+				r->p++;
+				if (c == ']')
+					break;
+			}
+		}
+		mklist(vm);
+		break;
+	case '\"':
+		r->p++;
+		json_string(r, false);
+		break;
+	case 't': json_expect(r, "true", 4); lisp_push(vm, LISP_TRUE); break;
+	case 'f': json_expect(r, "false", 5); lisp_push(vm, LISP_FALSE); break;
+	case 'n': json_expect(r, "null", 4); lisp_push(vm, LISP_UNDEF); break;
+	case EOF:
+		json_fail(r, "unexpected end");
 		break;
 	default:
-		lisp_err(vm, "Can not eval type: '%s'", objtypes[obj->type].name);
+		json_number(r);
 		break;
 	}
-	assert(count == vm->stack->count);
-	return obj;
 }
 
-/* values is a list
- * When we build procedure, arguments is checked to be a list
- * and there is no const symbols except modifiers 
+/* Push the object of the JSON text in s */
+static void json_decode(Lisp_VM *vm, const char *s, size_t n, bool dicts)
+{
+	Lisp_Buffer *tmp = lisp_buffer_new(vm, 64);
+	pushx(vm, tmp);
+	Json_Reader r = { vm, s, s, s + n, dicts, tmp };
+	json_value(&r, 0);
+	if (json_peek(&r) != EOF)
+		json_fail(&r, "trailing characters");
+	Lisp_Object *o = lisp_pop(vm, 2);
+	lisp_push(vm, o);
+}
+
+/* lisp_read -- Read a lisp object from input
+ * On success, returns the object and also leaves it at the stack top.
+ * Otherwise, long jump to current error handler.
  */
-static void bind_args(Lisp_VM *vm, Lisp_Proc *p, Lisp_Pair *values)
+Lisp_Object* lisp_read(Lisp_VM *vm)
 {
-	Lisp_String *modifier = NULL;
-	clear_env(vm);
-	Lisp_Pair *args = (Lisp_Pair*)p->lambda->car;
-	const char *procedure_name = "<unknown-procedure>";
-	for (; args != LISP_NIL; args = (Lisp_Pair*)args->cdr) {
-		Lisp_String *name = (Lisp_String*)args->car;
+	if (vm->input && !vm->input->closed && vm->input->binary_limit > 0
+	 && lisp_port_peekc(vm->input) == BINARY_MARK) {
+		read_binary(vm, vm->input);
+		return vm->stack->items[vm->stack->count-1];
+	}
+	next_token(vm);
+	if (vm->token_type == T_EOF)
+		lisp_push(vm, LISP_EOF);
+	else if (!sexp(vm))
+		badtok(vm);
+	return vm->stack->items[vm->stack->count-1];
+}
+
+
+/*******************************************************************
+ ** Eval & Apply
+ *******************************************************************/
+
+static Lisp_Object *lisp_eval_core(Lisp_VM*, int at_tail);
+#define lisp_eval(vm) lisp_eval_core(vm, 0)
+#define lisp_eval_tail(vm) lisp_eval_core(vm, 1)
+
+void lisp_apply(Lisp_VM *vm, Lisp_Object *proc, Lisp_Pair *args);
+static void apply_env(Lisp_VM *vm, Lisp_Pair *site, Lisp_Env *env, Lisp_Pair *args);
+static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args);
+
+/* Evaluate p->car and push the result.
+ * Variable references go through the address cache in `p'.
+ */
+static Lisp_Object *eval_car(Lisp_VM *vm, Lisp_Pair *p, int at_tail)
+{
+	Lisp_Object *o = p->car;
+	if (o->type == O_SYMBOL && !o->is_const) {
+		o = ref_var(vm, p, (Lisp_String*)o);
+		lisp_push(vm, o);
+		return o;
+	}
+	lisp_push(vm, o);
+	return lisp_eval_core(vm, at_tail);
+}
+
+/* `args' is a list.
+ * Reuse constant pairs.
+ */
+static void eval_args(Lisp_VM *vm, Lisp_Pair *args)
+{
+	int n = 0;
+	Lisp_Pair *p = args;
+	for (; p != LISP_NIL; p = REST(p), n++)
+		pushx(vm, p);
+	lisp_push(vm, LISP_NIL);
+	for (; n > 0; n--) {
+		Lisp_Object *t = lisp_top(vm, 0);
+		Lisp_Pair* p = (Lisp_Pair*)lisp_top(vm, 1);
+		if (p->cdr == t) {
+			if (p->car->is_const) {
+				lisp_pop(vm, 1);
+				continue;
+			}
+		}
+		eval_car(vm, p, 0);
+		p = lisp_pair_new(vm, lisp_top(vm, 0), t);
+		lisp_pop(vm, 3);
+		pushx(vm, p);
+	}
+}
+
+/* Stack argument frame:
+ * n values on the stack from slot `base', the last argument deepest,
+ * as left by evaluating arguments from right to left.
+ */
+#define STACK_ARG(vm, base, n, i) ((vm)->stack->items[(base) + (n) - 1 - (i)])
+
+/* Stack: an ... a1. Replace them with list (a1 ... an) */
+static void make_args(Lisp_VM *vm, int n)
+{
+	if (n == 0) {
+		lisp_push(vm, LISP_NIL);
+		return;
+	}
+	Lisp_Object **t = vm->stack->items + vm->stack->count - n;
+	Lisp_Object *l = LISP_NIL;
+	for (int i = 0; i < n; i++) {
+		l = t[i] = cons(vm, t[i], l);
+		write_barrier(vm, &vm->stack->obj);
+	}
+	t[0] = l;
+	vm->stack->count -= n - 1;
+}
+
+/* Evaluate list `args' from right to left, leaving values
+ * an ... a1 on the stack for apply_stack(). Return n.
+ */
+static int push_args(Lisp_VM *vm, Lisp_Pair *args)
+{
+	size_t base = vm->stack->count;
+	int n = 0;
+	for (Lisp_Pair *p = args; p != LISP_NIL; p = REST(p), n++)
+		lisp_push(vm, LISP_NIL);
+	for (int i = 0; i < n; i++, args = REST(args))
+		STACK_ARG(vm, base, n, i) = (Lisp_Object*)args;
+	for (int i = 0; i < n; i++) {
+		eval_car(vm, (Lisp_Pair*)vm->stack->items[base + i], 0);
+		vm->stack->items[base + i] = lisp_pop(vm, 1);
+	}
+	return n;
+}
+
+/* `l' must be a list. Checked by caller
+ * If at_tail is false, then no tail recursion is allowed.
+ * execution will not be delayed.
+ */
+static void eval_list(Lisp_VM *vm, Lisp_Pair *l, bool at_tail)
+{
+	for (; l->cdr != LISP_NIL; l = (Lisp_Pair*)l->cdr) {
+		Lisp_Object *r = eval_car(vm, l, 0);
+		if (r->is_return) return;
+		lisp_pop(vm, 1);
+	}
+	eval_car(vm, l, at_tail);
+}
+
+/* Evaluate procedure body */
+static void eval_body(Lisp_VM *vm, Lisp_Pair *l)
+{
+	eval_list(vm, l, 1);
+}
+
+/* Sampling profiler
+ *
+ * While profiling, every vm->profile_interval evaluations the
+ * callstack is folded into "frame;...;frame", root first, and the
+ * time elapsed since the previous sample is charged to it. Frames
+ * are taken one per procedure call as in show_callstack() and are
+ * labelled with the operator and the source line being evaluated.
+ * Counting evaluations rather than using a timer signal keeps the
+ * profile private to the VM, which matters when VMs run on threads.
+ */
+static void profile_frame(Lisp_VM *vm, Lisp_Buffer *b, Lisp_Pair *expr)
+{
+	Lisp_Object *op = expr->car;
+	if (op->type == O_SYMBOL)
+		lisp_buffer_adds(b, ((Lisp_String*)op)->buf);
+	else
+		lisp_buffer_adds(b, "(...)");
+	Lisp_SourceMapping *m = expr_mapping(vm, expr);
+	if (m && m->file)
+		lisp_buffer_printf(b, " %s:%u", m->file->path->buf, m->line);
+}
+
+static void reverse_bytes(char *p, char *q)
+{
+	while (p < --q) {
+		char c = *p;
+		*p++ = *q;
+		*q = c;
+	}
+}
+
+static void profile_sample(Lisp_VM *vm)
+{
+	double now = gc_clock();
+	double dt = now - vm->profile_time;
+	vm->profile_time = now;
+	vm->profile_tick = vm->profile_interval;
+
+	/* Frames are found top down. Fold them in that order, then
+	 * reverse the whole string and each frame back again. */
+	Lisp_Buffer *b = vm->profile_buf;
+	b->length = 0;
+	size_t n = vm->stack->count;
+	while (n > 0) {
+		if (vm->stack->items[--n] != LISP_EXPR_MARK)
+			continue;
+		assert(n > 0);
+		if (b->length > 0)
+			lisp_buffer_add(b, ';');
+		profile_frame(vm, b, (Lisp_Pair*)vm->stack->items[n-1]);
+		while (n > 0 && vm->stack->items[--n] != LISP_FRAME_MARK)
+			;
+	}
+	char *s = (char*)b->buf, *end = s + b->length;
+	reverse_bytes(s, end);
+	for (char *p = s; p < end; p++) {
+		if (*p == ';') {
+			reverse_bytes(s, p);
+			s = p + 1;
+		}
+	}
+	reverse_bytes(s, end);
+	lisp_buffer_add(b, 0);
+
+	Lisp_Pair *p = lisp_dict_assoc_cstr(vm->profile, (char*)b->buf);
+	if (p) {
+		p->cdr = (Lisp_Object*)lisp_number_new(vm,
+			((Lisp_Number*)p->cdr)->value + dt);
+		write_barrier(vm, &p->obj);
+	} else {
+		pushx(vm, lisp_string_new(vm, (char*)b->buf, b->length - 1));
+		push_num(vm, dt);
+		lisp_dict_add(vm->profile, (Lisp_String*)lisp_top(vm, 1),
+			lisp_top(vm, 0));
+		lisp_pop(vm, 2);
+	}
+}
+
+/*
+ * Stop the profile clock while the VM does not run, as when its
+ * process waits or is descheduled, and restart it after. Otherwise
+ * the next sample would be charged for the time between.
+ */
+void lisp_vm_pause_profile(Lisp_VM *vm, bool pause)
+{
+	if (vm->profile_interval && vm->profile_paused != pause) {
+		vm->profile_time = gc_clock() - vm->profile_time;
+		vm->profile_paused = pause;
+	}
+}
+
+/* Stack Layout during evaluation:
+ *
+ * 0  p
+ * 1  EXPR-MARK
+ * 2  op
+ * 3  args
+ * 4  returned value
+ */
+
+/* p is at stack top. Open the call frame of p. */
+static void begin_expr(Lisp_VM *vm, Lisp_Pair *p)
+{
+	if (++vm->eval_level > MAX_DEPTH)
+		lisp_err(vm, "exceeding max depth: %d", MAX_DEPTH);
+	check_stack(vm);
+	
+	if (vm->cov_trace && p->mapping)
+		p->mapping->cnt++;
+	
+	lisp_push(vm, LISP_EXPR_MARK); /* mark callstack */
+
+	if (vm->profile_interval && --vm->profile_tick == 0)
+		profile_sample(vm);
+
+	if (vm->yield_budget && --vm->yield_tick == 0) {
+		vm->yield_tick = vm->yield_budget;
+		vm->yield(vm);
+	}
+}
+
+/* Returned value is at stack top. Unless at tail, run pending
+ * tail calls. Then close the frame leaving the result.
+ */
+static Lisp_Object *end_expr(Lisp_VM *vm, int at_tail)
+{
+	if (!at_tail) {
+		while (true) {
+			assert(vm->stack->count > 3);
+			Lisp_Object **t = vm->stack->items + vm->stack->count - 3;
+			if (!t[2]->tail_call) break;
+			assert(t[-1] == LISP_EXPR_MARK);
+			t[-2] = CAR(t[2]);          /* update expression */
+			t[0] = CAR(CDR(t[2]));      /* new op */
+			t[1] = CDR(CDR(t[2]));      /* new args */
+			vm->stack->count--;
+			lisp_apply(vm, t[0], (Lisp_Pair*)t[1]);
+		}
+	}
+	
+	Lisp_Object *ret = lisp_pop(vm, 5);
+	lisp_push(vm, ret);
+	vm->eval_level--;
+	return ret;
+}
+
+/* args is at stack top. Apply op and close the frame of p */
+static Lisp_Object *call_op(Lisp_VM *vm, Lisp_Pair *p, Lisp_Object *op, int at_tail)
+{
+	if (at_tail && op->type == O_PROC) {
+		/* Tail Call Object: (expr . (op . args))
+		 * EXPR is required to track source location
+		 * for error reporting
+		 */
+		Lisp_Object *args = lisp_top(vm, 0);
+		lisp_push(vm, (Lisp_Object*)p);
+		lisp_push(vm, op);
+		lisp_push(vm, args);
+		lisp_cons(vm);
+		Lisp_Pair *t = lisp_cons(vm);
+		t->obj.tail_call = 1;
+	} else if (op->type == O_ENV && !op->tracing) {
+		apply_env(vm, p, (Lisp_Env*)op, (Lisp_Pair*)lisp_top(vm, 0));
+	} else {
+		lisp_apply(vm, op, (Lisp_Pair*)lisp_top(vm, 0));
+	}
+	return end_expr(vm, at_tail);
+}
+
+static bool apply_stack(Lisp_VM *vm, Lisp_Object *op, size_t base, int n);
+static Lisp_Object *end_stack_call(Lisp_VM *vm, size_t base, Lisp_Object *op, int at_tail);
+
+/* p is also at stack top */
+static Lisp_Object *eval_expr(Lisp_VM *vm, Lisp_Pair* p, int at_tail)
+{
+	begin_expr(vm, p);
+	Lisp_Object *op = eval_car(vm, p, 0);
+
+	if (!is_list((Lisp_Object*)p))
+		lisp_err(vm, "bad sexp: not a list");
+	if (op->is_special) {
+		lisp_push(vm, p->cdr);
+	} else if (at_tail && op->type == O_PROC) {
+		eval_args(vm, (Lisp_Pair*)p->cdr);
+	} else {
+		size_t base = vm->stack->count;
+		int n = push_args(vm, (Lisp_Pair*)p->cdr);
+		if (apply_stack(vm, op, base, n))
+			return end_stack_call(vm, base, NULL, at_tail);
+		make_args(vm, n);
+	}
+	return call_op(vm, p, op, at_tail);
+}
+
+/* Eval the stack top object and replace it with result. */
+Lisp_Object* lisp_eval_core(Lisp_VM *vm, int at_tail)
+{
+	size_t count = vm->stack->count;
+	Lisp_Object *obj = lisp_top(vm, 0);
+	if (obj->is_const) return obj;
+	switch (obj->type) {
+	case O_SYMBOL:
+		obj = lisp_getvar(vm, (Lisp_String*)obj);
+		lisp_pop(vm, 1);
+		lisp_push(vm, obj);
+		break;
+	case O_PAIR:
+		obj = eval_expr(vm, (Lisp_Pair*)obj, at_tail);
+		break;
+	default:
+		lisp_err(vm, "Can not eval type: '%s'", objtypes[obj->type].name);
+		break;
+	}
+	assert(count == vm->stack->count);
+	return obj;
+}
+
+/* Search alist in stack arguments from i, like lisp_assoc */
+static Lisp_Pair *stack_assoc(Lisp_VM *vm, size_t base, int n, int i, Lisp_Object *k)
+{
+	for (; i < n; i++) {
+		Lisp_Object *t = STACK_ARG(vm, base, n, i);
+		if (t->type == O_PAIR && lisp_eq(k, CAR(t)))
+			return (Lisp_Pair*)t;
+	}
+	return NULL;
+}
+
+/* Push list of stack arguments from i */
+static void stack_rest(Lisp_VM *vm, size_t base, int n, int i)
+{
+	lisp_push(vm, LISP_NIL);
+	for (int j = n - 1; j >= i; j--) {
+		Lisp_Object **t = vm->stack->items + vm->stack->count - 1;
+		*t = cons(vm, STACK_ARG(vm, base, n, j), *t);
+		write_barrier(vm, &vm->stack->obj);
+	}
+}
+
+/*
+ * Bind name to value, or if slot is given, store value in the
+ * binding at that slot of the env, which must be for name.
+ */
+static void bind_arg(Lisp_VM *vm, unsigned *slot, Lisp_String *name, Lisp_Object *value)
+{
+	if (slot) {
+		Lisp_Pair *b = (Lisp_Pair*)vm->env->bindings->items[(*slot)++];
+		assert(b->car == (Lisp_Object*)name);
+		b->cdr = value;
+		write_barrier(vm, &b->obj);
+	} else {
+		env_bind(vm->env, name, value);
+	}
+}
+
+/* True if env holds nothing but a binding for each argument of p */
+static bool binds_only_args(Lisp_Env *env, Lisp_Proc *p)
+{
+	unsigned n = 1;
+	for (Lisp_Pair *a = (Lisp_Pair*)p->lambda->car; a != LISP_NIL; a = (Lisp_Pair*)a->cdr)
+		if (((Lisp_String*)a->car)->buf[0] != '&')
+			n++;
+	return env->bindings->count == n;
+}
+
+/* values is a list, or NULL for a stack argument frame.
+ * When we build procedure, arguments is checked to be a list
+ * and there is no const symbols except modifiers 
+ * If rebind, the env already binds the arguments of p, which
+ * get their new values in place, see binds_only_args().
+ */
+static void bind_args(Lisp_VM *vm, Lisp_Proc *p, Lisp_Pair *values,
+	size_t base, int n, bool rebind)
+{
+	Lisp_String *modifier = NULL;
+	unsigned first = 1, *slot = rebind ? &first : NULL;
+	if (!rebind)
+		clear_env(vm);
+	Lisp_Pair *args = (Lisp_Pair*)p->lambda->car;
+	const char *procedure_name = "<unknown-procedure>";
+	int i = 0; /* next stack argument */
+	for (; args != LISP_NIL; args = (Lisp_Pair*)args->cdr) {
+		Lisp_String *name = (Lisp_String*)args->car;
 		if (name->buf[0] == '&') {
 			modifier = name;
 		} else if (!modifier) {
-			if (values == LISP_NIL)
+			if (values ? values == LISP_NIL : i >= n)
 				lisp_err(vm, "%s: missing arguments", procedure_name);
-			lisp_dict_add(vm->env->bindings, name, values->car);
-			values = (Lisp_Pair*)values->cdr;
+			if (values) {
+				bind_arg(vm, slot, name, values->car);
+				values = (Lisp_Pair*)values->cdr;
+			} else {
+				bind_arg(vm, slot, name, STACK_ARG(vm, base, n, i++));
+			}
 		} else if (modifier == SYM(S_ARG_LABEL)) {
 			procedure_name = name->buf;
-			lisp_dict_add(vm->env->bindings, name, (Lisp_Object*)p);
+			bind_arg(vm, slot, name, (Lisp_Object*)p);
 			modifier = NULL;
 		} else if (modifier == SYM(S_ARG_OPTIONAL)) {
-			lisp_dict_add(vm->env->bindings, name, values==LISP_NIL?LISP_FALSE:values->car);
-			values = (Lisp_Pair*)values->cdr;
+			if (values) {
+				bind_arg(vm, slot, name, values==LISP_NIL?LISP_FALSE:values->car);
+				values = (Lisp_Pair*)values->cdr;
+			} else {
+				bind_arg(vm, slot, name, i<n?STACK_ARG(vm, base, n, i++):LISP_FALSE);
+			}
 		} else if (modifier == SYM(S_ARG_REST)) {
-			lisp_dict_add(vm->env->bindings, name, (Lisp_Object*)values);
+			if (values) {
+				bind_arg(vm, slot, name, (Lisp_Object*)values);
+			} else {
+				stack_rest(vm, base, n, i);
+				bind_arg(vm, slot, name, lisp_top(vm, 0));
+				lisp_pop(vm, 1);
+			}
 		} else if (modifier == SYM(S_ARG_KEY)) {
-			Lisp_Pair *p = lisp_assoc(values, (Lisp_Object*)name);
-			lisp_dict_add(vm->env->bindings, name, p ? p->cdr : LISP_FALSE);
+			Lisp_Pair *p = values ? lisp_assoc(values, (Lisp_Object*)name)
+				: stack_assoc(vm, base, n, i, (Lisp_Object*)name);
+			bind_arg(vm, slot, name, p ? p->cdr : LISP_FALSE);
 		} else {
 			lisp_err(vm, "%s: invalid argument modifier '%s'",
 				procedure_name,
 				modifier->buf);
 		}
 	}
-	if (values != LISP_NIL && !modifier)
-		lisp_err(vm, "%s: too many arguments", procedure_name);
-}
+	if ((values ? values != LISP_NIL : i < n) && !modifier)
+		lisp_err(vm, "%s: too many arguments", procedure_name);
+}
+
+static void apply_native(Lisp_VM *vm, Lisp_Native_Proc *c, Lisp_Pair *args);
+
+/* Call native procedure with a stack argument frame */
+static void apply_native_stack(Lisp_VM *vm, Lisp_Native_Proc *c, size_t base, int n)
+{
+	lisp_push(vm, (Lisp_Object*)vm->env);
+	vm->env = c->env;
+	c->fn_stack(vm, base + n - 1, n);
+	lisp_exch(vm);
+	vm->env = (Lisp_Env*)lisp_pop(vm, 1);
+	assert(vm->env->obj.type == O_ENV);
+}
+
+static void apply_native(Lisp_VM *vm, Lisp_Native_Proc *c, Lisp_Pair *args)
+{
+	if (c->fn_stack) {
+		size_t base = vm->stack->count;
+		int n = 0;
+		for (Lisp_Pair *l = args; l != LISP_NIL; l = REST(l), n++)
+			lisp_push(vm, LISP_NIL);
+		for (int i = 0; args != LISP_NIL; args = REST(args), i++)
+			STACK_ARG(vm, base, n, i) = args->car;
+		apply_native_stack(vm, c, base, n);
+		lisp_push(vm, lisp_pop(vm, n + 1));
+		return;
+	}
+	lisp_push(vm, (Lisp_Object*)vm->env);
+	vm->env = c->env;
+	c->fn(vm, args);
+	lisp_exch(vm);
+	vm->env = (Lisp_Env*)lisp_pop(vm, 1);
+	assert(vm->env->obj.type == O_ENV);
+}
+
+static void exec_code(Lisp_VM *vm, Lisp_Array *code);
+
+/* Whether evaluating x may keep a reference to the current env
+ * after it returns: making a closure with lambda, define or a named
+ * let, taking (this), evaluating code, or calling a macro whose
+ * expansion we don't know. False positives are harmless.
+ */
+static bool may_capture_env(Lisp_VM *vm, Lisp_Object *x)
+{
+	if (x->type == O_SYMBOL) {
+		if (!x->is_primitive)
+			return false;
+		switch (SYMID((Lisp_String*)x)) {
+		case S_LAMBDA: case S_DEFMACRO: case S_THIS:
+		case S_EVAL: case S_EVALQ: case S_LOAD:
+			return true;
+		default:
+			return false;
+		}
+	}
+	if (x->type != O_PAIR || x == LISP_NIL)
+		return false;
+	Lisp_Object *op = CAR(x);
+	if (op == (Lisp_Object*)SYM(S_QUOTE))
+		return false;
+	if (op == (Lisp_Object*)SYM(S_DEFINE)
+	    || op == (Lisp_Object*)SYM(S_DEFCONST)
+	    || op == (Lisp_Object*)SYM(S_DEFMETHOD)) {
+		if (CADR(x)->type == O_PAIR)
+			return true;
+	} else if (op == (Lisp_Object*)SYM(S_LET)) {
+		if (CADR(x)->type == O_SYMBOL)
+			return true;
+	} else if (op->type == O_SYMBOL && !op->is_primitive) {
+		Lisp_Pair *p = lisp_env_assoc(vm->env, (Lisp_String*)op);
+		if (p && p->cdr->type == O_MACRO)
+			return true;
+	}
+	for (; x->type == O_PAIR && x != LISP_NIL; x = CDR(x)) {
+		if (may_capture_env(vm, CAR(x)))
+			return true;
+	}
+	return may_capture_env(vm, x);
+}
+
+static void eval_procedure_body(Lisp_VM *vm, Lisp_Proc *c, Lisp_Pair *args,
+	size_t base, int n)
+{
+	Lisp_Pair *lbody = (Lisp_Pair*)(c->lambda->cdr);
+	bind_args(vm, c, args, base, n, false);
+	while (true) {
+		if (c->code)
+			exec_code(vm, c->code);
+		else
+			eval_body(vm, lbody);
+		Lisp_Object *t = lisp_top(vm, 0);
+		if (t->is_return) {
+			lisp_pop(vm, 1);
+			t = CAR(t);
+			lisp_push(vm, t);
+		}
+		if (t->tail_call && CADR(t) == (Lisp_Object*)c) {
+			args = (Lisp_Pair*)CDDR(t);
+			/* Need to start in a new environment if the
+			 * body may have exported some closures, so that
+			 * we can't overwrite their enclosed environment.
+			 * Otherwise rebind in place.
+			 * Scanned at the first tail call rather than at
+			 * definition, when macros used by the body are known.
+			 */
+			uint32_t scan = load_word(&c->scan);
+			if (!scan) {
+				scan = may_capture_env(vm, (Lisp_Object*)lbody)
+					? SCANNED|CAPTURES : SCANNED;
+				store_word(&c->scan, scan);
+			}
+			if (scan & CAPTURES) {
+				vm->env = lisp_env_new(vm, c->env);
+				bind_args(vm, c, args, 0, 0, false);
+			} else {
+				bind_args(vm, c, args, 0, 0, binds_only_args(vm->env, c));
+			}
+			lisp_pop(vm, 1);
+		} else {
+			break;
+		}
+	}
+}
+
+static void apply_procedure(Lisp_VM *vm, Lisp_Proc *c, Lisp_Pair *args)
+{
+	lisp_begin_env(vm, c->env);
+	eval_procedure_body(vm, c, args, 0, 0);
+	lisp_end_env(vm);
+}
+
+static void apply_constructor(Lisp_VM *vm, Lisp_Proc *c, Lisp_Pair *args)
+{
+	lisp_begin_env(vm, c->env);
+	eval_procedure_body(vm, c, args, 0, 0);
+	lisp_pop(vm, 1);
+	lisp_push(vm, (Lisp_Object*)vm->env);
+	lisp_end_env(vm);
+}
+
+static bool apply_primitive_stack(Lisp_VM *vm, int sid, size_t base, int n);
+
+/* Apply op to a stack argument frame and push the result.
+ * Return false if op takes an argument list instead.
+ */
+static bool apply_stack(Lisp_VM *vm, Lisp_Object *op, size_t base, int n)
+{
+	if (op->tracing)
+		return false;
+	switch (op->type) {
+	case O_PROC:
+		lisp_begin_env(vm, ((Lisp_Proc*)op)->env);
+		eval_procedure_body(vm, (Lisp_Proc*)op, NULL, base, n);
+		lisp_end_env(vm);
+		return true;
+	case O_SYMBOL:
+		return op->is_primitive
+		    && apply_primitive_stack(vm, SYMID((Lisp_String*)op), base, n);
+	case O_NATIVE_PROC:
+		if (!((Lisp_Native_Proc*)op)->fn_stack)
+			return false;
+		apply_native_stack(vm, (Lisp_Native_Proc*)op, base, n);
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Stack: p EXPR-MARK [op] args... result
+ * Drop the argument frame and close the frame of p.
+ */
+static Lisp_Object *end_stack_call(Lisp_VM *vm, size_t base, Lisp_Object *op, int at_tail)
+{
+	Lisp_Object *ret = lisp_top(vm, 0);
+	vm->stack->count = base;
+	if (op)
+		lisp_push(vm, op);
+	lisp_push(vm, LISP_NIL);
+	lisp_push(vm, ret);
+	return end_expr(vm, at_tail);
+}
+
+static void print_trace(Lisp_VM *vm, Lisp_Object*c,
+	const char* prompt, Lisp_Object *obj)
+{
+	int level = vm->eval_level - 1;
+	if (level > 60) level = 60;
+	while (level-- > 0) lisp_putc(vm, ' ');
+	lisp_printf(vm, "[%d] ", vm->eval_level);
+	lisp_print(vm, c);
+	lisp_printf(vm, " %s = ", prompt);
+	lisp_print(vm, obj);
+	lisp_putc(vm, '\n');
+}
+
+/*
+ * Inline caches
+ *
+ * Method lookups of a call site are remembered in a small table
+ * indexed by the site: the env searched and the binding found.
+ * Updating a binding keeps the same pair, so an entry only goes stale
+ * when a binding is added to, or cleared from, an env on the searched
+ * path. Such envs are flagged `cached', and changing them bumps the
+ * epoch, which invalidates the entries of all VMs at once. The flag
+ * is a word of its own, as child VMs set it on envs of their parent.
+ */
+static Lisp_Pair *cached_assoc(Lisp_VM *vm, Lisp_Pair *site, Lisp_Env *env,
+	Lisp_String *name)
+{
+	Inline_Cache *c = &vm->icache[((uintptr_t)site / sizeof(Lisp_Pair)) % ICACHESIZE];
+	uint32_t epoch = load_word(&cache_epoch);
+	if (c->site == site && c->env == env && c->epoch == epoch
+	    && c->binding->car == (Lisp_Object*)name)
+		return c->binding;
+	Lisp_Pair *p = lisp_env_assoc(env, name);
+	if (p) {
+		for (Lisp_Env *e = env; e && !load_word(&e->cached); e = e->parent)
+			store_word(&e->cached, 1);
+		c->site = site;
+		c->env = env;
+		c->binding = p;
+		c->epoch = epoch;
+	}
+	return p;
+}
+
+/* site is the calling expression to cache the lookup, or NULL */
+static void call_method(Lisp_VM *vm, Lisp_Pair *site, Lisp_Env *env,
+	Lisp_String *method, Lisp_Pair *args)
+{
+	Lisp_Pair *p = site ? cached_assoc(vm, site, env, method)
+		: lisp_env_assoc(env, method);
+	if (p == NULL)
+		lisp_err(vm, "Method undefined: '%s'", method->buf);
+	assert(p != NULL);
+	if (p->cdr->type != O_PROC || !p->obj.is_method)
+		lisp_err(vm, "Not a method: '%s'", method->buf);
+	lisp_push(vm, p->cdr); /* DO WE REALLY NEED THIS PROTECTION? */
+	apply_procedure(vm, (Lisp_Proc*)p->cdr, args);
+	lisp_push(vm, lisp_pop(vm, 2));
+}
+
+static void apply_env(Lisp_VM *vm, Lisp_Pair *site, Lisp_Env *env, Lisp_Pair *args)
+{
+	if (CAR(args)->type != O_SYMBOL)
+		lisp_err(vm, "Invalid method: expecting symbol");
+	call_method(vm, site, env, (Lisp_String*)CAR(args), REST(args));
+}
+
+void lisp_apply(Lisp_VM *vm, Lisp_Object *proc, Lisp_Pair *args)
+{
+	if (proc->tracing)
+		print_trace(vm, proc, ":args", (Lisp_Object*)args);
+	switch (proc->type) {
+		case O_SYMBOL:
+			if (proc->is_primitive)
+				apply_primitive(vm, SYMID((Lisp_String*)proc), args);
+			else
+				lisp_err(vm, "apply: Not a primitive: '%s'",
+					((Lisp_String*)proc)->buf);
+			break;
+		case O_PROC:
+			apply_procedure(vm, (Lisp_Proc*)proc, args);
+			break;
+		case O_MACRO:
+			apply_procedure(vm, (Lisp_Proc*)proc, args);
+			lisp_eval(vm);
+			break;
+		case O_NATIVE_PROC:
+			apply_native(vm, (Lisp_Native_Proc*)proc, args);
+			break;
+		case O_ENV:
+			apply_env(vm, NULL, (Lisp_Env*)proc, args);
+			break;
+		default:
+			lisp_err(vm, "Invalid type for apply: %s",
+				objtypes[proc->type].name);
+			break;
+	}
+	if (proc->tracing)
+		print_trace(vm, proc, ":value", lisp_top(vm,0));
+}
+
+/**
+ ** Bytecode
+ **
+ ** A procedure may be compiled into a code array which exec_code()
+ ** runs in place of walking the body. The first item of the array is
+ ** a buffer of 32-bit instruction words, the rest are constants that
+ ** instructions refer to by index.
+ **
+ ** Only common forms are compiled. Everything else is handed back to
+ ** the interpreter, so compiled procedures behave exactly like
+ ** interpreted ones: arguments are still evaluated from right to left,
+ ** calls still open an EXPR-MARK frame so that errors show the source
+ ** location, and tail calls use the same tail call objects.
+ **
+ ** Primitive operators are bound when the procedure is compiled, and
+ ** coverage tracing counts only calls in compiled code.
+ **/
+
+enum {
+	BC_CONST,      /* k      push constant k */
+	BC_REF,        /* k      push variable referenced by car of pair k */
+	BC_STMT,       /* l      pop, or jump to l if it's a returning result */
+	BC_JUMP,       /* l      jump to l */
+	BC_JUMP_FALSE, /* l      pop and jump to l if false */
+	BC_AND,        /* l      jump to l if false, otherwise pop */
+	BC_OR,         /* l      jump to l if not false, otherwise pop */
+	BC_EVAL,       /* k t    evaluate form k with the interpreter */
+	BC_FRAME,      /* k      open call frame of expression k */
+	BC_SPECIAL,    /* l t    apply special op to unevaluated args, jump to l */
+	BC_CALL,       /* n t    apply op to n arguments */
+	BC_PRIM,       /* n t    apply primitive of the frame to n arguments */
+	BC_LET,        /* k n t  apply closure of lambda k to n values */
+	BC_LAMBDA,     /* k      push closure of lambda k, code k+1 */
+	BC_DEFPROC,    /* k m    define closure of lambda k, name k+2 */
+	BC_NODEF,      /*        prohibit definitions while evaluating value */
+	BC_DEFVAR,     /* k      define variable k */
+	BC_SET,        /* k      set variable k */
+	BC_ADD,        /* t      binary primitives on the frame */
+	BC_SUB,
+	BC_LT,
+	BC_LE,
+	BC_EQ,
+	BC_GT,
+	BC_GE,
+	BC_CAR,        /* t      unary primitives on the frame */
+	BC_CDR,
+	BC_END
+};
+
+typedef struct {
+	Lisp_VM *vm;
+	Lisp_Env *env;      /* environment of definition */
+	Lisp_Array *code;
+	Lisp_Buffer *buf;
+	size_t scope;       /* stack slot of names bound since env */
+} Compiler;
+
+static void compile_expr(Compiler *c, Lisp_Pair *site, int tail);
+static void compile_seq(Compiler *c, Lisp_Pair *l, int tail);
+
+static size_t here(Compiler *c)
+{
+	return c->buf->length / sizeof(int32_t);
+}
+
+/* Append a word and return its position */
+static size_t emit(Compiler *c, size_t w)
+{
+	int32_t t = (int32_t)w;
+	lisp_buffer_add_bytes(c->buf, &t, sizeof(t));
+	return here(c) - 1;
+}
+
+static size_t emit_const(Compiler *c, Lisp_Object *o)
+{
+	lisp_array_push(c->code, o);
+	return c->code->count - 1;
+}
+
+/* Jump operands waiting for the same label are chained through
+ * themselves. Position 0 is always an opcode, so it ends the chain.
+ */
+static void patch(Compiler *c, size_t chain, size_t label)
+{
+	int32_t *w = (int32_t*)c->buf->buf;
+	while (chain) {
+		size_t next = w[chain];
+		w[chain] = (int32_t)label;
+		chain = next;
+	}
+}
+
+static bool in_scope(Compiler *c, Lisp_Object *name)
+{
+	Lisp_Object *l = c->vm->stack->items[c->scope];
+	for (; l != LISP_NIL; l = CDR(l))
+		if (CAR(l) == name)
+			return true;
+	return false;
+}
+
+static void bind_name(Compiler *c, Lisp_Object *name)
+{
+	Lisp_Object *l = c->vm->stack->items[c->scope];
+	c->vm->stack->items[c->scope] = cons(c->vm, name, l);
+	write_barrier(c->vm, &c->vm->stack->obj);
+}
+
+static bool is_definer(Lisp_Object *o)
+{
+	return o == (Lisp_Object*)SYM(S_DEFINE)
+	    || o == (Lisp_Object*)SYM(S_DEFMETHOD)
+	    || o == (Lisp_Object*)SYM(S_DEFCONST)
+	    || o == (Lisp_Object*)SYM(S_DEFMACRO);
+}
+
+/* Collect names which may be defined anywhere in x */
+static void scan_defines(Compiler *c, Lisp_Object *x)
+{
+	for (; x->type == O_PAIR && x != LISP_NIL; x = CDR(x)) {
+		if (is_definer(CAR(x)) && CDR(x)->type == O_PAIR) {
+			Lisp_Object *t = CADR(x);
+			if (t->type == O_PAIR)
+				t = CAR(t);
+			if (t->type == O_SYMBOL)
+				bind_name(c, t);
+		}
+		scan_defines(c, CAR(x));
+	}
+}
+
+/* Primitive id of operator o, or -1 if o may refer to something else */
+static int prim_id(Compiler *c, Lisp_Object *o)
+{
+	if (o->type != O_SYMBOL || !o->is_primitive)
+		return -1;
+	if (in_scope(c, o) || lisp_env_assoc(c->env, (Lisp_String*)o))
+		return -1;
+	return SYMID((Lisp_String*)o);
+}
+
+/* Length of a proper list, or -1 */
+static int list_length(Lisp_Object *o)
+{
+	int n = 0;
+	for (; o != LISP_NIL; o = CDR(o), n++)
+		if (o->type != O_PAIR)
+			return -1;
+	return n;
+}
+
+/* Same checks as op_lambda */
+static bool valid_params(Lisp_Object *params)
+{
+	if (list_length(params) < 0)
+		return false;
+	for (; params != LISP_NIL; params = CDR(params)) {
+		Lisp_String *s = (Lisp_String*)CAR(params);
+		if (s->obj.type != O_SYMBOL)
+			return false;
+		if (s->obj.is_const && s->buf[0] != '&')
+			return false;
+	}
+	return true;
+}
+
+/* Compile body of lambda and push the code */
+static Lisp_Array *compile_lambda(Lisp_VM *vm, Lisp_Env *env,
+	Lisp_Object *scope, Lisp_Pair *lambda)
+{
+	Compiler c = {.vm = vm, .env = env};
+	c.code = lisp_array_new(vm, 8);
+	pushx(vm, c.code);
+	c.buf = lisp_buffer_new(vm, 256);
+	lisp_array_push(c.code, (Lisp_Object*)c.buf);
+	lisp_push(vm, scope);
+	c.scope = vm->stack->count - 1;
+	for (Lisp_Object *p = lambda->car; p != LISP_NIL; p = CDR(p)) {
+		if (((Lisp_String*)CAR(p))->buf[0] != '&')
+			bind_name(&c, CAR(p));
+	}
+	scan_defines(&c, lambda->cdr);
+	compile_seq(&c, (Lisp_Pair*)lambda->cdr, 1);
+	emit(&c, BC_END);
+	lisp_pop(vm, 1);
+	return c.code;
+}
+
+/* Add lambda and its code to constants. Return index of the lambda */
+static size_t compile_closure(Compiler *c, Lisp_Pair *lambda)
+{
+	size_t k = emit_const(c, (Lisp_Object*)lambda);
+	compile_lambda(c->vm, c->env, c->vm->stack->items[c->scope], lambda);
+	emit_const(c, lisp_pop(c->vm, 1));
+	return k;
+}
+
+/* Evaluation order is right to left as in eval_args() */
+static void compile_args(Compiler *c, Lisp_Pair *args)
+{
+	if (args == LISP_NIL)
+		return;
+	compile_args(c, REST(args));
+	compile_expr(c, args, 0);
+}
+
+static void compile_seq(Compiler *c, Lisp_Pair *l, int tail)
+{
+	if (l == LISP_NIL) {
+		emit(c, BC_CONST);
+		emit(c, emit_const(c, LISP_UNDEF));
+		return;
+	}
+	size_t chain = 0;
+	for (; l->cdr != LISP_NIL; l = REST(l)) {
+		compile_expr(c, l, 0);
+		emit(c, BC_STMT);
+		chain = emit(c, chain);
+	}
+	compile_expr(c, l, tail);
+	patch(c, chain, here(c));
+}
+
+/* (if <test> <then> [<else>]) */
+static void compile_if(Compiler *c, Lisp_Pair *args, int tail)
+{
+	compile_expr(c, args, 0);
+	emit(c, BC_JUMP_FALSE);
+	size_t l1 = emit(c, 0);
+	compile_expr(c, REST(args), tail);
+	emit(c, BC_JUMP);
+	size_t l2 = emit(c, 0);
+	patch(c, l1, here(c));
+	if (CDDR(args) != LISP_NIL) {
+		compile_expr(c, REST(REST(args)), tail);
+	} else {
+		emit(c, BC_CONST);
+		emit(c, emit_const(c, LISP_UNDEF));
+	}
+	patch(c, l2, here(c));
+}
+
+/* (cond (<test> <body>) ...) */
+static bool compile_cond(Compiler *c, Lisp_Pair *args, int tail)
+{
+	for (Lisp_Pair *l = args; l != LISP_NIL; l = REST(l)) {
+		if (l->car == LISP_NIL || list_length(l->car) < 0)
+			return false;
+	}
+	size_t chain = 0;
+	for (; args != LISP_NIL; args = REST(args)) {
+		Lisp_Pair *clause = (Lisp_Pair*)args->car;
+		compile_expr(c, clause, 0);
+		emit(c, BC_JUMP_FALSE);
+		size_t next = emit(c, 0);
+		compile_seq(c, REST(clause), tail);
+		emit(c, BC_JUMP);
+		chain = emit(c, chain);
+		patch(c, next, here(c));
+	}
+	emit(c, BC_CONST);
+	emit(c, emit_const(c, LISP_UNDEF));
+	patch(c, chain, here(c));
+	return true;
+}
+
+/* (and ...) (or ...) */
+static void compile_logic(Compiler *c, Lisp_Pair *args, bool is_and)
+{
+	if (args == LISP_NIL) {
+		emit(c, BC_CONST);
+		emit(c, emit_const(c, is_and ? LISP_TRUE : LISP_FALSE));
+		return;
+	}
+	size_t chain = 0;
+	for (; args->cdr != LISP_NIL; args = REST(args)) {
+		compile_expr(c, args, 0);
+		emit(c, is_and ? BC_AND : BC_OR);
+		chain = emit(c, chain);
+	}
+	compile_expr(c, args, 0);
+	patch(c, chain, here(c));
+}
+
+/* (let ((<name> <value>) ...) <body>) */
+static bool compile_let(Compiler *c, Lisp_Pair *p, int tail)
+{
+	Lisp_VM *vm = c->vm;
+	Lisp_Pair *args = REST(p);
+	Lisp_Pair *l = (Lisp_Pair*)args->car;
+	if (list_length((Lisp_Object*)l) < 0)
+		return false;
+	int n = 0;
+	for (; l != LISP_NIL; l = REST(l), n++) {
+		int len = list_length(l->car);
+		if (len < 1 || len > 2 || CAR(l->car)->type != O_SYMBOL
+		 || CAR(l->car)->is_const)
+			return false;
+	}
+	for (l = (Lisp_Pair*)args->car; l != LISP_NIL; l = REST(l))
+		lisp_push(vm, CAR(l->car));
+	lisp_make_list(vm, n);
+	lisp_push(vm, args->cdr); /* body */
+	make_pair(vm);
+	size_t k = compile_closure(c, (Lisp_Pair*)lisp_top(vm, 0));
+	lisp_pop(vm, 1);
+
+	emit(c, BC_FRAME);
+	emit(c, emit_const(c, (Lisp_Object*)p));
+	for (l = (Lisp_Pair*)args->car; l != LISP_NIL; l = REST(l)) {
+		if (CDR(l->car) != LISP_NIL) {
+			compile_expr(c, (Lisp_Pair*)CDR(l->car), 0);
+		} else {
+			emit(c, BC_CONST);
+			emit(c, emit_const(c, LISP_UNDEF));
+		}
+	}
+	emit(c, BC_LET);
+	emit(c, k);
+	emit(c, n);
+	emit(c, tail);
+	return true;
+}
+
+/* (define <name> <value>)
+ * (define (<name> ...) <body>)
+ * (defmethod (<name> ...) <body>)
+ */
+static bool compile_define(Compiler *c, Lisp_Pair *args, bool method)
+{
+	Lisp_VM *vm = c->vm;
+	Lisp_Object *t = args->car;
+	if (t->type == O_SYMBOL) {
+		if (method || t->is_const || list_length((Lisp_Object*)args) != 2)
+			return false;
+		emit(c, BC_NODEF);
+		compile_expr(c, REST(args), 0);
+		emit(c, BC_DEFVAR);
+		emit(c, emit_const(c, t));
+		return true;
+	}
+	if (t->type != O_PAIR || t == LISP_NIL)
+		return false;
+	Lisp_Object *name = CAR(t);
+	if (name->type != O_SYMBOL || name->is_const)
+		return false;
+	/* Same lambda as defproc */
+	pushx(vm, SYM(S_ARG_LABEL));
+	lisp_push(vm, t);
+	make_pair(vm);
+	if (!valid_params(lisp_top(vm, 0))) {
+		lisp_pop(vm, 1);
+		return false;
+	}
+	lisp_push(vm, args->cdr);
+	make_pair(vm);
+	size_t k = compile_closure(c, (Lisp_Pair*)lisp_top(vm, 0));
+	lisp_pop(vm, 1);
+	emit_const(c, name);
+	emit(c, BC_DEFPROC);
+	emit(c, k);
+	emit(c, method);
+	return true;
+}
+
+static void compile_form(Compiler *c, Lisp_Pair *p, int tail)
+{
+	int n = list_length((Lisp_Object*)p) - 1; /* argument count */
+	Lisp_Pair *args = REST(p);
+	int sid = n < 0 ? -1 : prim_id(c, p->car);
+	int op = -1;
+
+	switch (sid) {
+	case S_QUOTE:
+		if (n != 1) break;
+		emit(c, BC_CONST);
+		emit(c, emit_const(c, args->car));
+		return;
+	case S_IF:
+		if (n != 2 && n != 3) break;
+		compile_if(c, args, tail);
+		return;
+	case S_COND:
+		if (compile_cond(c, args, tail))
+			return;
+		break;
+	case S_AND:
+	case S_OR:
+		compile_logic(c, args, sid == S_AND);
+		return;
+	case S_BEGIN:
+		compile_seq(c, args, tail);
+		return;
+	case S_LET:
+		if (n >= 1 && compile_let(c, p, tail))
+			return;
+		break;
+	case S_LAMBDA:
+		if (n < 1 || !valid_params(args->car)) break;
+		emit(c, BC_LAMBDA);
+		emit(c, compile_closure(c, args));
+		return;
+	case S_DEFINE:
+	case S_DEFMETHOD:
+		if (n >= 1 && compile_define(c, args, sid == S_DEFMETHOD))
+			return;
+		break;
+	case S_SET:
+		if (n != 2 || args->car->type != O_SYMBOL || args->car->is_const)
+			break;
+		compile_expr(c, REST(args), 0);
+		emit(c, BC_SET);
+		emit(c, emit_const(c, args->car));
+		return;
+	case S_ADD: op = BC_ADD; break;
+	case S_SUB: op = BC_SUB; break;
+	case S_NUMBER_LT: op = BC_LT; break;
+	case S_NUMBER_LE: op = BC_LE; break;
+	case S_NUMBER_EQ: op = BC_EQ; break;
+	case S_NUMBER_GT: op = BC_GT; break;
+	case S_NUMBER_GE: op = BC_GE; break;
+	case S_CAR: op = BC_CAR; break;
+	case S_CDR: op = BC_CDR; break;
+	default: break;
+	}
 
-static void apply_native(Lisp_VM *vm, Lisp_Native_Proc *c, Lisp_Pair *args)
-{
-	lisp_push(vm, (Lisp_Object*)vm->env);
-	vm->env = c->env;
-	c->fn(vm, args);
-	lisp_exch(vm);
-	vm->env = (Lisp_Env*)lisp_pop(vm, 1);
-	assert(vm->env->obj.type == O_ENV);
-}
+	if (n < 0 || (sid >= 0 && p->car->is_special)) {
+		emit(c, BC_EVAL);
+		emit(c, emit_const(c, (Lisp_Object*)p));
+		emit(c, tail);
+		return;
+	}
 
-static void eval_procedure_body(Lisp_VM *vm, Lisp_Proc *c, Lisp_Pair *args)
-{
-	Lisp_Pair *lbody = (Lisp_Pair*)(c->lambda->cdr);
-	bind_args(vm, c, args);
-	while (true) {
-		eval_body(vm, lbody);
-		Lisp_Object *t = lisp_top(vm, 0);
-		if (t->is_return) {
-			lisp_pop(vm, 1);
-			t = CAR(t);
-			lisp_push(vm, t);
-		}
-		if (t->tail_call && CADR(t) == (Lisp_Object*)c) {
-			args = (Lisp_Pair*)CDDR(t);
-			/* Need to start in a new environment.
-			 * It's possible that the body execution exports
-			 * some closures, so that we can't overwrite their
-			 * enclosed environment.
-			 * TODO optimize if their is no closures generated
-			 *      in the body.
-			 */
-			vm->env = lisp_env_new(vm, c->env);
-			bind_args(vm, c, args);
-			lisp_pop(vm, 1);
+	emit(c, BC_FRAME);
+	emit(c, emit_const(c, (Lisp_Object*)p));
+	if (sid >= 0) {
+		compile_args(c, args);
+		if (op >= 0 && n == (op >= BC_CAR ? 1 : 2)) {
+			emit(c, op);
 		} else {
-			break;
+			emit(c, BC_PRIM);
+			emit(c, n);
 		}
+		emit(c, tail);
+		return;
 	}
-}
 
-static void apply_procedure(Lisp_VM *vm, Lisp_Proc *c, Lisp_Pair *args)
-{
-	lisp_begin_env(vm, c->env);
-	eval_procedure_body(vm, c, args);
-	lisp_end_env(vm);
+	compile_expr(c, p, 0); /* operator */
+	emit(c, BC_SPECIAL);
+	size_t l = emit(c, 0);
+	emit(c, tail);
+	compile_args(c, args);
+	emit(c, BC_CALL);
+	emit(c, n);
+	emit(c, tail);
+	patch(c, l, here(c));
+}
+
+/* Compile car of site */
+static void compile_expr(Compiler *c, Lisp_Pair *site, int tail)
+{
+	Lisp_Object *x = site->car;
+	if (x->is_const) {
+		emit(c, BC_CONST);
+		emit(c, emit_const(c, x));
+	} else if (x->type == O_SYMBOL) {
+		emit(c, BC_REF);
+		emit(c, emit_const(c, (Lisp_Object*)site));
+	} else if (x->type == O_PAIR) {
+		compile_form(c, (Lisp_Pair*)x, tail);
+	} else {
+		emit(c, BC_EVAL);
+		emit(c, emit_const(c, x));
+		emit(c, tail);
+	}
 }
 
-static void apply_constructor(Lisp_VM *vm, Lisp_Proc *c, Lisp_Pair *args)
+static void compile_proc(Lisp_VM *vm, Lisp_Proc *proc)
 {
-	lisp_begin_env(vm, c->env);
-	eval_procedure_body(vm, c, args);
+	Lisp_Array *code = compile_lambda(vm, proc->env, LISP_NIL, proc->lambda);
+	write_barrier(vm, &proc->obj);
+	proc->code = code;
 	lisp_pop(vm, 1);
-	lisp_push(vm, (Lisp_Object*)vm->env);
-	lisp_end_env(vm);
 }
 
-static void print_trace(Lisp_VM *vm, Lisp_Object*c,
-	const char* prompt, Lisp_Object *obj)
+static Lisp_Proc *make_closure(Lisp_VM *vm, Lisp_Object *lambda, Lisp_Object *code)
 {
-	int level = vm->eval_level - 1;
-	if (level > 60) level = 60;
-	while (level-- > 0) lisp_putc(vm, ' ');
-	lisp_printf(vm, "[%d] ", vm->eval_level);
-	lisp_print(vm, c);
-	lisp_printf(vm, " %s = ", prompt);
-	lisp_print(vm, obj);
-	lisp_putc(vm, '\n');
+	Lisp_Proc *proc = new_obj(vm, O_PROC);
+	proc->env = vm->env;
+	proc->lambda = (Lisp_Pair*)lambda;
+	proc->code = (Lisp_Array*)code;
+	pushx(vm, proc);
+	return proc;
 }
 
-static void call_method(Lisp_VM *vm, Lisp_Env *env, Lisp_String *method, Lisp_Pair *args)
+/* Run compiled body and push the result */
+static void exec_code(Lisp_VM *vm, Lisp_Array *code)
 {
-	Lisp_Pair *p = lisp_env_assoc(env, method);
-	if (p == NULL)
-		lisp_err(vm, "Method undefined: '%s'", method->buf);
-	assert(p != NULL);
-	if (p->cdr->type != O_PROC || !p->obj.is_method)
-		lisp_err(vm, "Not a method: '%s'", method->buf);
-	lisp_push(vm, p->cdr); /* DO WE REALLY NEED THIS PROTECTION? */
-	apply_procedure(vm, (Lisp_Proc*)p->cdr, args);
-	lisp_push(vm, lisp_pop(vm, 2));
-}
+	Lisp_Object **k = code->items;
+	const int32_t *base = (const int32_t*)((Lisp_Buffer*)k[0])->buf;
+	const int32_t *ip = base;
+	Lisp_Array *stack = vm->stack;
+	int n;
 
-void lisp_apply(Lisp_VM *vm, Lisp_Object *proc, Lisp_Pair *args)
-{
-	if (proc->tracing)
-		print_trace(vm, proc, ":args", (Lisp_Object*)args);
-	switch (proc->type) {
-		case O_SYMBOL:
-			if (proc->is_primitive)
-				apply_primitive(vm, SYMID((Lisp_String*)proc), args);
-			else
-				lisp_err(vm, "apply: Not a primitive: '%s'",
-					((Lisp_String*)proc)->buf);
-			break;
-		case O_PROC:
-			apply_procedure(vm, (Lisp_Proc*)proc, args);
-			break;
-		case O_MACRO:
-			apply_procedure(vm, (Lisp_Proc*)proc, args);
-			lisp_eval(vm);
-			break;
-		case O_NATIVE_PROC:
-			apply_native(vm, (Lisp_Native_Proc*)proc, args);
-			break;
-		case O_ENV:
-			if (CAR(args)->type != O_SYMBOL)
-				lisp_err(vm, "Invalid method: expecting symbol");
-			call_method(vm, (Lisp_Env*)proc, (Lisp_String*)CAR(args), (Lisp_Pair*)CDR(args));
-			break;
-		default:
-			lisp_err(vm, "Invalid type for apply: %s",
-				objtypes[proc->type].name);
-			break;
+	pushx(vm, code); /* Keep code alive even if procedure is recompiled */
+
+#define TOP(i) (stack->items[stack->count-1-(i)])
+#define FRAME_OP() (((Lisp_Pair*)TOP(n+1))->car)
+/* Replace frame and its n arguments with r */
+#define RETURN_FRAME(r) do { \
+	stack->count -= n + 1; \
+	TOP(0) = (r); \
+	vm->eval_level--; \
+	ip++; \
+} while (0)
+
+#ifdef __GNUC__
+	static const void *labels[] = {
+		&&L_BC_CONST, &&L_BC_REF, &&L_BC_STMT, &&L_BC_JUMP,
+		&&L_BC_JUMP_FALSE, &&L_BC_AND, &&L_BC_OR, &&L_BC_EVAL,
+		&&L_BC_FRAME, &&L_BC_SPECIAL, &&L_BC_CALL, &&L_BC_PRIM,
+		&&L_BC_LET, &&L_BC_LAMBDA, &&L_BC_DEFPROC, &&L_BC_NODEF,
+		&&L_BC_DEFVAR, &&L_BC_SET, &&L_BC_ADD, &&L_BC_SUB,
+		&&L_BC_LT, &&L_BC_LE, &&L_BC_EQ, &&L_BC_GT, &&L_BC_GE,
+		&&L_BC_CAR, &&L_BC_CDR, &&L_BC_END
+	};
+#define CASE(op) L_##op
+#define NEXT() goto *labels[*ip++]
+	NEXT();
+	{
+#else
+#define CASE(op) case op
+#define NEXT() goto next
+next:
+	switch (*ip++) {
+#endif
+	CASE(BC_CONST):
+		lisp_push(vm, k[*ip++]);
+		NEXT();
+	CASE(BC_REF): {
+		Lisp_Pair *site = (Lisp_Pair*)k[*ip++];
+		lisp_push(vm, ref_var(vm, site, (Lisp_String*)site->car));
+		NEXT();
+	}
+	CASE(BC_STMT):
+		if (TOP(0)->is_return)
+			ip = base + *ip;
+		else {
+			stack->count--;
+			ip++;
+		}
+		NEXT();
+	CASE(BC_JUMP):
+		ip = base + *ip;
+		NEXT();
+	CASE(BC_JUMP_FALSE):
+		if (lisp_pop(vm, 1) == LISP_FALSE)
+			ip = base + *ip;
+		else
+			ip++;
+		NEXT();
+	CASE(BC_AND):
+		if (TOP(0) == LISP_FALSE)
+			ip = base + *ip;
+		else {
+			stack->count--;
+			ip++;
+		}
+		NEXT();
+	CASE(BC_OR):
+		if (TOP(0) != LISP_FALSE)
+			ip = base + *ip;
+		else {
+			stack->count--;
+			ip++;
+		}
+		NEXT();
+	CASE(BC_EVAL):
+		lisp_push(vm, k[ip[0]]);
+		lisp_eval_core(vm, ip[1]);
+		ip += 2;
+		NEXT();
+	CASE(BC_FRAME): {
+		Lisp_Pair *p = (Lisp_Pair*)k[*ip++];
+		pushx(vm, p);
+		begin_expr(vm, p);
+		NEXT();
 	}
-	if (proc->tracing)
-		print_trace(vm, proc, ":value", lisp_top(vm,0));
+	CASE(BC_SPECIAL): {
+		Lisp_Object *op = TOP(0);
+		if (op->is_special) {
+			Lisp_Pair *p = (Lisp_Pair*)TOP(2);
+			lisp_push(vm, p->cdr);
+			call_op(vm, p, op, ip[1]);
+			ip = base + ip[0];
+		} else {
+			ip += 2;
+		}
+		NEXT();
+	}
+	CASE(BC_CALL): {
+		size_t from = stack->count - ip[0];
+		Lisp_Object *op = stack->items[from - 1];
+		if (!(ip[1] && op->type == O_PROC)
+		    && apply_stack(vm, op, from, ip[0])) {
+			end_stack_call(vm, from, NULL, ip[1]);
+		} else {
+			make_args(vm, ip[0]);
+			call_op(vm, (Lisp_Pair*)TOP(3), TOP(1), ip[1]);
+		}
+		ip += 2;
+		NEXT();
+	}
+	CASE(BC_PRIM):
+		n = *ip++;
+	prim: {
+		size_t from = stack->count - n;
+		Lisp_Object *op = CAR(stack->items[from - 2]);
+		if (apply_stack(vm, op, from, n)) {
+			end_stack_call(vm, from, op, *ip++);
+			NEXT();
+		}
+		make_args(vm, n);
+		Lisp_Object *args = lisp_pop(vm, 1);
+		Lisp_Pair *p = (Lisp_Pair*)TOP(1);
+		lisp_push(vm, p->car);
+		lisp_push(vm, args);
+		call_op(vm, p, p->car, *ip++);
+		NEXT();
+	}
+	CASE(BC_LET):
+		lisp_make_list(vm, ip[1]);
+		make_closure(vm, k[ip[0]], k[ip[0]+1]);
+		lisp_exch(vm);
+		apply_procedure(vm, (Lisp_Proc*)TOP(1), (Lisp_Pair*)TOP(0));
+		end_expr(vm, ip[2]);
+		ip += 3;
+		NEXT();
+	CASE(BC_LAMBDA):
+		make_closure(vm, k[*ip], k[*ip+1]);
+		ip++;
+		NEXT();
+	CASE(BC_DEFPROC): {
+		if (vm->env->obj.no_def)
+			lisp_err(vm, "define: prohibited");
+		Lisp_String *name = (Lisp_String*)k[ip[0]+2];
+		Lisp_Proc *proc = make_closure(vm, k[ip[0]], k[ip[0]+1]);
+		Lisp_Pair *b = lisp_defvar(vm, name, (Lisp_Object*)proc);
+		if (ip[1])
+			b->obj.is_method = 1;
+		TOP(0) = (Lisp_Object*)name;
+		ip += 2;
+		NEXT();
+	}
+	CASE(BC_NODEF):
+		if (vm->env->obj.no_def)
+			lisp_err(vm, "define: prohibited");
+		vm->env->obj.no_def = 1;
+		NEXT();
+	CASE(BC_DEFVAR): {
+		Lisp_String *name = (Lisp_String*)k[*ip++];
+		vm->env->obj.no_def = 0;
+		lisp_defvar(vm, name, TOP(0));
+		TOP(0) = (Lisp_Object*)name;
+		NEXT();
+	}
+	CASE(BC_SET):
+		lisp_setvar(vm, (Lisp_String*)k[*ip++], TOP(0));
+		TOP(0) = LISP_UNDEF;
+		NEXT();
+
+#define BINARY(op, expr) \
+	CASE(op): { \
+		Lisp_Object *a = TOP(0), *b = TOP(1); \
+		n = 2; \
+		if (a->type != O_NUMBER || b->type != O_NUMBER || FRAME_OP()->tracing) \
+			goto prim; \
+		double x = NUMVAL(a), y = NUMVAL(b); \
+		Lisp_Object *r = (expr); \
+		RETURN_FRAME(r); \
+		NEXT(); \
+	}
+#define NUM(v) (Lisp_Object*)lisp_number_new(vm, (v))
+#define BOOL(v) ((v) ? LISP_TRUE : LISP_FALSE)
+	BINARY(BC_ADD, NUM(x + y))
+	BINARY(BC_SUB, NUM(x - y))
+	BINARY(BC_LT, BOOL(x < y))
+	BINARY(BC_LE, BOOL(x <= y))
+	BINARY(BC_EQ, BOOL(x == y))
+	BINARY(BC_GT, BOOL(x > y))
+	BINARY(BC_GE, BOOL(x >= y))
+#undef BINARY
+#undef NUM
+#undef BOOL
+
+	CASE(BC_CAR):
+		n = 1;
+		if (TOP(0)->type != O_PAIR || FRAME_OP()->tracing)
+			goto prim;
+		{
+			Lisp_Object *r = CAR(TOP(0));
+			RETURN_FRAME(r);
+		}
+		NEXT();
+	CASE(BC_CDR):
+		n = 1;
+		if (TOP(0)->type != O_PAIR || FRAME_OP()->tracing)
+			goto prim;
+		{
+			Lisp_Object *r = CDR(TOP(0));
+			RETURN_FRAME(r);
+		}
+		NEXT();
+	CASE(BC_END):
+		goto done;
+	}
+done:
+#undef CASE
+#undef NEXT
+#undef TOP
+#undef FRAME_OP
+#undef RETURN_FRAME
+
+	lisp_exch(vm);
+	lisp_pop(vm, 1);
 }
 
 /**
@@ -3743,6 +6811,16 @@ void *lisp_safe_bytes(Lisp_VM *vm, Lisp_Object *o, size_t *len)
 	}
 }
 
+void *lisp_safe_mutable_bytes(Lisp_VM *vm, Lisp_Object *o, size_t *len)
+{
+	if (o->type != O_BUFFER)
+		lisp_err(vm, "not a buffer");
+	if (((Lisp_Buffer*)o)->vm != vm)
+		lisp_err(vm, "Can not modify foreign object");
+	*len = ((Lisp_Buffer*)o)->length;
+	return ((Lisp_Buffer*)o)->buf;
+}
+
 const char *lisp_safe_cstring(Lisp_VM *vm, Lisp_Object*o)
 {
 	if (o->type != O_STRING) {
@@ -3904,23 +6982,19 @@ static void op_newline(Lisp_VM*vm, Lisp_Pair* args)
 /* (if <test> <true-expr> <false-expr>) */
 static void op_if(Lisp_VM*vm, Lisp_Pair* args)
 {
-	lisp_push(vm, args->car);
-	lisp_eval(vm);
+	eval_car(vm, args, 0);
 	if (lisp_pop(vm,1) == LISP_FALSE) {
 		Lisp_Pair *p = REST(REST(args)); /* else clause */
-		lisp_push(vm, p->car);
-		lisp_eval_tail(vm);
+		eval_car(vm, p, 1);
 	} else { /* Any other value will be taken as true, including nil */
-		lisp_push(vm, REST(args)->car);
-		lisp_eval_tail(vm);
+		eval_car(vm, REST(args), 1);
 	}
 }
 
 /* (<test> <expression1> ...) */
 static bool exec_cond_clause(Lisp_VM *vm, Lisp_Pair *p)
 {
-	lisp_push(vm, p->car);
-	lisp_eval(vm);
+	eval_car(vm, p, 0);
 	if (lisp_pop(vm,1) != LISP_FALSE) {
 		if (!is_list(p->cdr))
 			lisp_err(vm, "cond: invalid expression");
@@ -3988,8 +7062,7 @@ static void op_and(Lisp_VM*vm, Lisp_Pair* args)
 		return;
 	}
 	while (true) {
-		lisp_push(vm, CAR(args));
-		if (lisp_eval(vm) == LISP_FALSE)
+		if (eval_car(vm, args, 0) == LISP_FALSE)
 			return;
 		args = REST(args);
 		if (args == LISP_NIL)
@@ -4005,8 +7078,7 @@ static void op_or(Lisp_VM*vm, Lisp_Pair* args)
 		return;
 	}
 	while (true) {
-		lisp_push(vm, CAR(args));
-		if (lisp_eval(vm) != LISP_FALSE)
+		if (eval_car(vm, args, 0) != LISP_FALSE)
 			return;
 		args = REST(args);
 		if (args == LISP_NIL)
@@ -4266,6 +7338,7 @@ static Lisp_SourceFile *ensure_source_file(Lisp_VM* vm, Lisp_String* path)
 	pushx(vm, f);
 	f->path = path;
 	f->mappings = lisp_array_new(vm, 64);
+	write_barrier(vm, &f->obj);
 	lisp_make_symbol(vm, path->buf);
 	lisp_dict_add(vm->source_files, (Lisp_String*)lisp_top(vm, 0), (Lisp_Object*)f);
 	lisp_pop(vm, 2);
@@ -4339,56 +7412,416 @@ static Lisp_String* resolve_path(Lisp_VM *vm, Lisp_String *path, Lisp_String *ba
 			} else {
 				lisp_err(vm, "Invalid path");
 			}
-		} else {
-			break;
+		} else {
+			break;
+		}
+	}
+	lisp_buffer_adds(buf, p);
+	path = lisp_string_new(vm, (const char*)buf->buf, buf->length);
+	lisp_pop(vm, 1);
+Done:
+	if (!file_exists(path->buf))
+		return NULL;
+	pushx(vm, path);
+	return path;
+}
+
+static bool find_file(Lisp_VM *vm, Lisp_String *path)
+{
+	if (!is_standard_path(path->buf))
+		lisp_err(vm, "find file: bad path: `%s`", path->buf);
+
+	/* if path is absolute, return it */
+	if (is_absolute_path(path->buf) || file_exists(path->buf)) {
+		pushx(vm, path);
+	} else if (!resolve_path(vm, path, vm->input->name, false, true)) {
+		// Look in list `load_path'
+		Lisp_Pair *t = lisp_env_assoc(vm->env, SYM(S_LOAD_PATH));
+		if (t) {
+			if (!is_list(t->cdr))
+				lisp_err(vm, "load-path is not a list");
+			
+			for (t = REST(t); t != LISP_NIL; t = REST(t)) {
+				if (t->car->type != O_STRING)
+					lisp_err(vm, "load-path must be a list of strings");
+				if (resolve_path(vm, path, (Lisp_String*)t->car, true, false))
+					break;
+			}
+		
+			if (t == LISP_NIL)
+				return false;
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void op_find_file(Lisp_VM *vm, Lisp_Pair *args)
+{
+	Lisp_String *path = safe_ptr(vm, CAR(args), O_STRING);
+	if (!find_file(vm, path))
+		lisp_push(vm, lisp_false);
+}
+
+/*
+ * (compile <procedure>)
+ *   Compile procedure body to bytecode. Returns the procedure.
+ * (compile true|false)
+ *   Turn on or off compiling procedures defined at the top level
+ *   of the file being loaded.
+ */
+static void op_compile(Lisp_VM *vm, Lisp_Pair *args)
+{
+	Lisp_Object *o = CAR(args);
+	if (o == LISP_TRUE || o == LISP_FALSE) {
+		if (vm->input)
+			vm->input->compile = (o == LISP_TRUE);
+		lisp_push(vm, LISP_UNDEF);
+		return;
+	}
+	Lisp_Proc *proc = safe_ptr(vm, o, O_PROC);
+	if (proc->env->bindings->vm != vm)
+		lisp_err(vm, "compile: procedure from foreign vm");
+	compile_proc(vm, proc);
+	lisp_push(vm, o);
+}
+
+/*
+ * Source cache
+ *
+ * Files loaded by path are kept parsed, shared by the VMs of the
+ * process, so that a library loaded again, as by every new process,
+ * is decoded rather than tokenized. An entry is keyed by path, file
+ * id, size and mtime. It holds the binary encoding of each top level
+ * form and the source positions of the lists in it, which become
+ * source mappings only when a message needs them, see expr_mapping().
+ * A cached entry is not changed, ports reading it hold a reference.
+ */
+#define SOURCE_CACHE_SIZE 256
+
+/* A list of a form, by the order of its first pair in walk_mappings() */
+typedef struct {
+	uint32_t cell;
+	uint32_t begin, end, line;
+} Source_Pos;
+
+typedef struct {
+	size_t offset, size; // encoding in data
+	size_t pos, npos;    // its lists
+} Source_Form;
+
+struct Cached_Source {
+	Cached_Source *next;
+	char *path;
+	uint64_t dev, ino, size;
+	int64_t mtime; // ns
+	int refs;
+	bool failed; // a form could not be encoded, while recording
+	uint8_t *data;
+	size_t length, data_cap;
+	Source_Form *forms;
+	size_t nforms, forms_cap;
+	Source_Pos *pos;
+	size_t npos, pos_cap;
+};
+
+static pthread_mutex_t source_lock = PTHREAD_MUTEX_INITIALIZER;
+static Cached_Source *sources; // most recently used first
+static int source_count;
+
+static void delete_source(Cached_Source *c)
+{
+	free(c->path);
+	free(c->data);
+	free(c->forms);
+	free(c->pos);
+	free(c);
+}
+
+static void release_source(Cached_Source *c)
+{
+	pthread_mutex_lock(&source_lock);
+	bool last = --c->refs == 0;
+	pthread_mutex_unlock(&source_lock);
+	if (last)
+		delete_source(c);
+}
+
+static bool same_source(Cached_Source *c, const char *path, struct stat *sb)
+{
+	return c->size == (uint64_t)sb->st_size && c->mtime == ST_MTIME_NS(*sb)
+	    && c->ino == (uint64_t)sb->st_ino && c->dev == (uint64_t)sb->st_dev
+	    && strcmp(c->path, path) == 0;
+}
+
+/* The cached forms of the file, or NULL */
+static Cached_Source *take_source(const char *path, struct stat *sb)
+{
+	Cached_Source **pp, *c = NULL;
+	pthread_mutex_lock(&source_lock);
+	for (pp = &sources; *pp; pp = &(*pp)->next) {
+		if (same_source(*pp, path, sb)) {
+			c = *pp;
+			*pp = c->next;
+			c->next = sources;
+			sources = c;
+			c->refs++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&source_lock);
+	return c;
+}
+
+/* Cache a complete recording in place of older ones of the path */
+static void put_source(Cached_Source *c)
+{
+	Cached_Source **pp, *t, *dead = NULL;
+	pthread_mutex_lock(&source_lock);
+	for (pp = &sources; (t = *pp);) {
+		if (strcmp(t->path, c->path) == 0) {
+			*pp = t->next;
+			source_count--;
+			if (--t->refs == 0) {
+				t->next = dead;
+				dead = t;
+			}
+		} else {
+			pp = &t->next;
+		}
+	}
+	c->next = sources;
+	sources = c;
+	c->refs++;
+	if (++source_count > SOURCE_CACHE_SIZE) {
+		for (pp = &sources; (*pp)->next; pp = &(*pp)->next)
+			;
+		t = *pp;
+		*pp = NULL;
+		source_count--;
+		if (--t->refs == 0) {
+			t->next = dead;
+			dead = t;
+		}
+	}
+	pthread_mutex_unlock(&source_lock);
+	while ((t = dead)) {
+		dead = t->next;
+		delete_source(t);
+	}
+}
+
+/* Make room for n more of *count items. False if out of memory. */
+static bool reserve(void **items, size_t *cap, size_t count, size_t n,
+  size_t size)
+{
+	if (count + n <= *cap)
+		return true;
+	size_t m = *cap ? *cap * 2 : 64;
+	while (m < count + n)
+		m *= 2;
+	void *p = realloc(*items, m * size);
+	if (!p)
+		return false;
+	*items = p;
+	*cap = m;
+	return true;
+}
+
+static bool record_pos(Cached_Source *c, Lisp_Object *o, uint32_t *cell)
+{
+	for (; o->type == O_PAIR && o != LISP_NIL; o = CDR(o)) {
+		uint32_t i = (*cell)++;
+		Lisp_SourceMapping *m = ((Lisp_Pair*)o)->mapping;
+		if (m) {
+			if (!reserve((void**)&c->pos, &c->pos_cap, c->npos, 1,
+			    sizeof(Source_Pos)))
+				return false;
+			Source_Pos *sp = &c->pos[c->npos++];
+			sp->cell = i;
+			sp->begin = m->begin;
+			sp->end = m->end;
+			sp->line = m->line;
+		}
+		if (!record_pos(c, CAR(o), cell))
+			return false;
+	}
+	return true;
+}
+
+/* Add a form just read to the recording of its file */
+static void record_form(Lisp_VM *vm, Cached_Source *c, Lisp_Object *o)
+{
+	const size_t head = 2 + sizeof(uint32_t);
+	if (c->failed)
+		return;
+	if (!lisp_serialize(vm, o)) {
+		c->failed = true;
+		return;
+	}
+	Lisp_Buffer *b = (Lisp_Buffer*)lisp_pop(vm, 1);
+	size_t size = b->length - head;
+	if (!reserve((void**)&c->data, &c->data_cap, c->length, size, 1)
+	 || !reserve((void**)&c->forms, &c->forms_cap, c->nforms, 1,
+	      sizeof(Source_Form))) {
+		c->failed = true;
+		return;
+	}
+	Source_Form *f = &c->forms[c->nforms++];
+	f->offset = c->length;
+	f->size = size;
+	memcpy(c->data + c->length, b->buf + head, size);
+	c->length += size;
+	f->pos = c->npos;
+	uint32_t cell = 0;
+	if (!record_pos(c, o, &cell))
+		c->failed = true;
+	f->npos = c->npos - f->pos;
+}
+
+/*
+ * The pairs of a form are walked cars first, counting them. The
+ * lists of a decoded form get the mapping stub of the form, which
+ * has the position of the first one and the rest in stub->lazy.
+ * Resolving gives them their own mappings.
+ */
+typedef struct {
+	Lisp_VM *vm;
+	Lisp_SourceMapping *stub;
+	const Source_Pos *first, *pos, *end;
+	uint32_t cell;
+	bool resolve;
+} Mapping_Walk;
+
+static void walk_mappings(Mapping_Walk *w, Lisp_Object *o)
+{
+	for (; o->type == O_PAIR && o != LISP_NIL && w->pos < w->end; o = CDR(o)) {
+		Lisp_Pair *p = (Lisp_Pair*)o;
+		if (w->pos->cell == w->cell++) {
+			if (!w->resolve) {
+				p->mapping = w->stub;
+			} else if (p->mapping == w->stub && w->pos != w->first) {
+				Lisp_SourceMapping *m = new_obj(w->vm, O_SOURCE_MAPPING);
+				m->file = w->stub->file;
+				m->expr = p;
+				m->begin = w->pos->begin;
+				m->end = w->pos->end;
+				m->line = w->pos->line;
+				p->mapping = m;
+				write_barrier(w->vm, &p->obj);
+			}
+			w->pos++;
 		}
+		walk_mappings(w, p->car);
 	}
-	lisp_buffer_adds(buf, p);
-	path = lisp_string_new(vm, (const char*)buf->buf, buf->length);
-	lisp_pop(vm, 1);
-Done:
-	if (!file_exists(path->buf))
-		return NULL;
-	pushx(vm, path);
-	return path;
 }
 
-static bool find_file(Lisp_VM *vm, Lisp_String *path)
+/* The mapping of expr, resolved if it was decoded from the cache */
+static Lisp_SourceMapping *expr_mapping(Lisp_VM *vm, Lisp_Pair *expr)
 {
-	if (!is_standard_path(path->buf))
-		lisp_err(vm, "find file: bad path: `%s`", path->buf);
+	Lisp_SourceMapping *m = expr->mapping;
+	if (m && m->lazy) {
+		Lisp_Buffer *b = m->lazy;
+		pushx(vm, b);
+		m->lazy = NULL;
+		const Source_Pos *sp = (Source_Pos*)b->buf;
+		Mapping_Walk w = {vm, m, sp, sp,
+			sp + b->length / sizeof(Source_Pos), 0, true};
+		walk_mappings(&w, (Lisp_Object*)m->expr);
+		lisp_pop(vm, 1);
+	}
+	return expr->mapping;
+}
 
-	/* if path is absolute, return it */
-	if (is_absolute_path(path->buf) || file_exists(path->buf)) {
-		pushx(vm, path);
-	} else if (!resolve_path(vm, path, vm->input->name, false, true)) {
-		// Look in list `load_path'
-		Lisp_Pair *t = lisp_env_assoc(vm->env, SYM(S_LOAD_PATH));
-		if (t) {
-			if (!is_list(t->cdr))
-				lisp_err(vm, "load-path is not a list");
-			
-			for (t = REST(t); t != LISP_NIL; t = REST(t)) {
-				if (t->car->type != O_STRING)
-					lisp_err(vm, "load-path must be a list of strings");
-				if (resolve_path(vm, path, (Lisp_String*)t->car, true, false))
-					break;
-			}
-		
-			if (t == LISP_NIL)
-				return false;
-		} else {
-			return false;
-		}
+/* Push the next form of port->source, as lisp_read() would */
+static Lisp_Object *read_cached(Lisp_VM *vm, Lisp_Port *port)
+{
+	Cached_Source *c = port->source;
+	if (port->source_next == c->nforms) {
+		lisp_push(vm, LISP_EOF);
+		return LISP_EOF;
+	}
+	Source_Form *f = &c->forms[port->source_next++];
+	Decoder d = {vm, c->data + f->offset, c->data + f->offset + f->size};
+	decode(&d, 0);
+	Lisp_Object *o = lisp_top(vm, 0);
+	if (f->npos > 0 && port->src_file) {
+		const Source_Pos *sp = c->pos + f->pos;
+		Lisp_SourceMapping *m = new_obj(vm, O_SOURCE_MAPPING);
+		pushx(vm, m);
+		m->file = port->src_file;
+		m->expr = (Lisp_Pair*)o;
+		m->begin = sp->begin;
+		m->end = sp->end;
+		m->line = sp->line;
+		m->lazy = lisp_buffer_copy(vm, sp, f->npos * sizeof(Source_Pos));
+		write_barrier(vm, &m->obj);
+		Mapping_Walk w = {vm, m, sp, sp, sp + f->npos, 0, false};
+		walk_mappings(&w, o);
+		lisp_pop(vm, 1);
 	}
-	return true;
+	return o;
 }
 
-static void op_find_file(Lisp_VM *vm, Lisp_Pair *args)
+/* lisp_read() for load(), going through the source cache */
+static Lisp_Object *read_form(Lisp_VM *vm)
 {
-	Lisp_String *path = safe_ptr(vm, CAR(args), O_STRING);
-	if (!find_file(vm, path))
-		lisp_push(vm, lisp_false);
+	Lisp_Port *port = vm->input;
+	Cached_Source *c = port->source;
+	if (!c)
+		return lisp_read(vm);
+	if (!port->recording)
+		return read_cached(vm, port);
+	Lisp_Object *o = lisp_read(vm);
+	if (o != LISP_EOF) {
+		record_form(vm, c, o);
+		return o;
+	}
+	if (!c->failed)
+		put_source(c);
+	port->source = NULL;
+	port->recording = 0;
+	release_source(c);
+	return o;
+}
+
+/*
+ * An input port to load path from. A file that did not change since
+ * it was read is taken from the source cache, unless coverage is
+ * traced. Otherwise its forms are recorded as they are read.
+ */
+static Lisp_Port *open_source(Lisp_VM *vm, Lisp_String *path)
+{
+	struct stat sb;
+	bool cacheable = stat(path->buf, &sb) == 0 && S_ISREG(sb.st_mode);
+	Cached_Source *c = NULL;
+	Lisp_Port *p;
+	if (cacheable && !vm->cov_trace)
+		c = take_source(path->buf, &sb);
+	if (c) {
+		pushx(vm, lisp_buffer_new(vm, 0));
+		p = lisp_open_input_buffer(vm, (Lisp_Buffer*)lisp_top(vm, 0), path);
+		lisp_pop(vm, 1);
+		p->line = 1;
+		p->source = c;
+		return p;
+	}
+	p = lisp_open_input_file(vm, path);
+	if (cacheable && (c = calloc(1, sizeof(Cached_Source)))) {
+		if (!(c->path = strdup(path->buf))) {
+			free(c);
+			return p;
+		}
+		c->dev = (uint64_t)sb.st_dev;
+		c->ino = (uint64_t)sb.st_ino;
+		c->size = (uint64_t)sb.st_size;
+		c->mtime = ST_MTIME_NS(sb);
+		c->refs = 1;
+		p->source = c;
+		p->recording = 1;
+	}
+	return p;
 }
 
 static void op_load(Lisp_VM *vm, Lisp_Pair *args)
@@ -4402,7 +7835,7 @@ static void op_load(Lisp_VM *vm, Lisp_Pair *args)
 		assert(path->obj.type == O_STRING);
 	}
 	lisp_push(vm, (Lisp_Object*)vm->input);
-	vm->input = lisp_open_input_file(vm, path);
+	vm->input = open_source(vm, path);
 	vm->input->src_file = ensure_source_file(vm, path);
 	load(vm);
 	lisp_exch(vm);
@@ -4422,6 +7855,7 @@ static void op_catch(Lisp_VM *vm, Lisp_Pair *args)
 	jmp_buf *prev = vm->catch;
 	jmp_buf jbuf;
 	unsigned old_level = vm->eval_level;
+	int old_region = vm->region;
 	size_t cnt = vm->stack->count;
 	Lisp_Env *old_env = vm->env;
 	vm->catch = &jbuf;
@@ -4429,6 +7863,8 @@ static void op_catch(Lisp_VM *vm, Lisp_Pair *args)
 		eval_list(vm, args, 0);
 	assert(vm->stack->count > cnt);
 	vm->eval_level = old_level;
+	while (vm->region > old_region)
+		lisp_vm_end_region(vm);
 	vm->catch = prev;
 	vm->env = old_env;
 	vm->stack->items[cnt] = lisp_top(vm, 0);
@@ -4556,6 +7992,186 @@ static void op_format(Lisp_VM *vm, Lisp_Pair *args)
 	}
 }
 
+static void push_stat(Lisp_VM *vm, const char *name, double value)
+{
+	lisp_make_symbol(vm, name);
+	push_num(vm, value);
+	lisp_cons(vm);
+}
+
+/*
+ * (gc-stats)
+ * Return collector statistics as an alist. Pause times are in seconds.
+ */
+static void op_gc_stats(Lisp_VM *vm, Lisp_Pair *args)
+{
+	lisp_gc_stats_t st;
+	lisp_vm_get_gc_stats(vm, &st);
+	lisp_begin_list(vm);
+	push_stat(vm, "minor", (double)st.minor_count);
+	push_stat(vm, "major", (double)st.major_count);
+	push_stat(vm, "last-pause", st.last_pause);
+	push_stat(vm, "max-pause", st.max_pause);
+	push_stat(vm, "total-pause", st.total_pause);
+	push_stat(vm, "young", (double)st.young_count);
+	push_stat(vm, "old", (double)st.old_count);
+	push_stat(vm, "memsize", (double)st.memsize);
+	lisp_end_list(vm);
+}
+
+/*
+ * (profile-start [interval])
+ * Discard earlier samples and sample the callstack once every
+ * <interval> evaluations. See profile_sample().
+ */
+static void op_profile_start(Lisp_VM *vm, Lisp_Pair *args)
+{
+	double interval = PROFILEINTERVAL;
+	if (CAR(args) != LISP_UNDEF)
+		interval = lisp_safe_number(vm, CAR(args));
+	if (interval < 1 || interval > UINT_MAX)
+		lisp_err(vm, "profile-start: bad interval");
+	vm->profile = lisp_dict_new(vm, 64);
+	if (!vm->profile_buf)
+		vm->profile_buf = lisp_buffer_new(vm, 256);
+	vm->profile_time = gc_clock();
+	vm->profile_paused = false;
+	vm->profile_interval = (unsigned)interval;
+	vm->profile_tick = vm->profile_interval;
+	lisp_push(vm, LISP_UNDEF);
+}
+
+/*
+ * (profile-stop)
+ * Stop sampling. Return a list of (frame self total) with times in
+ * seconds, where self is spent in the frame itself and total also
+ * counts its callees. Recursive frames are counted once per sample.
+ * The samples are kept for profile-dump.
+ */
+static void op_profile_stop(Lisp_VM *vm, Lisp_Pair *args)
+{
+	vm->profile_interval = 0;
+	if (!vm->profile) {
+		lisp_push(vm, LISP_NIL);
+		return;
+	}
+
+	struct { double self, total; unsigned seen; } *acc = NULL;
+	size_t cap = 0;
+	Lisp_Array *frames = lisp_dict_new(vm, 64);
+	pushx(vm, frames);
+
+	Lisp_Buffer *b = vm->profile_buf;
+	for (unsigned i = 1; i < vm->profile->count; i++) {
+		Lisp_Pair *e = (Lisp_Pair*)vm->profile->items[i];
+		Lisp_String *stack = (Lisp_String*)e->car;
+		double t = ((Lisp_Number*)e->cdr)->value;
+		const char *s = stack->buf;
+		while (true) {
+			const char *end = strchr(s, ';');
+			size_t len = end ? (size_t)(end - s) : strlen(s);
+			b->length = 0;
+			lisp_buffer_add_bytes(b, s, len);
+			lisp_buffer_add(b, 0);
+			Lisp_Pair *f = lisp_dict_assoc_cstr(frames, (char*)b->buf);
+			if (!f) {
+				if (frames->count > cap) {
+					size_t n = cap ? cap * 2 : 64;
+					void *a = realloc(acc, n * sizeof(*acc));
+					if (!a) {
+						free(acc);
+						lisp_err(vm, "profile-stop: out of memory");
+					}
+					acc = a;
+					memset(acc + cap, 0, (n - cap) * sizeof(*acc));
+					cap = n;
+				}
+				pushx(vm, lisp_string_new(vm, (char*)b->buf, len));
+				push_num(vm, frames->count - 1);
+				f = lisp_dict_add(frames, (Lisp_String*)lisp_top(vm, 1),
+					lisp_top(vm, 0));
+				lisp_pop(vm, 2);
+			}
+			unsigned k = (unsigned)((Lisp_Number*)f->cdr)->value;
+			if (acc[k].seen != i) {
+				acc[k].seen = i;
+				acc[k].total += t;
+			}
+			if (!end) {
+				acc[k].self += t;
+				break;
+			}
+			s = end + 1;
+		}
+	}
+
+	lisp_begin_list(vm);
+	for (unsigned i = 1; i < frames->count; i++) {
+		Lisp_Pair *f = (Lisp_Pair*)frames->items[i];
+		lisp_begin_list(vm);
+		lisp_push(vm, f->car);
+		push_num(vm, acc[i-1].self);
+		push_num(vm, acc[i-1].total);
+		lisp_end_list(vm);
+	}
+	lisp_end_list(vm);
+	free(acc);
+	Lisp_Object *ret = lisp_pop(vm, 2);
+	lisp_push(vm, ret);
+}
+
+/*
+ * (profile-dump [port])
+ * Write the samples as folded stacks, "frame;...;frame <usecs>"
+ * per line, which is the input format of flamegraph.pl.
+ */
+static void op_profile_dump(Lisp_VM *vm, Lisp_Pair *args)
+{
+	Lisp_Port *output = vm->output;
+	if (CAR(args)->type == O_PORT)
+		output = (Lisp_Port*)CAR(args);
+	if (vm->profile) {
+		for (unsigned i = 1; i < vm->profile->count; i++) {
+			Lisp_Pair *e = (Lisp_Pair*)vm->profile->items[i];
+			lisp_port_printf(output, "%s %.0f\n",
+				((Lisp_String*)e->car)->buf,
+				((Lisp_Number*)e->cdr)->value * 1e6);
+		}
+	}
+	lisp_push(vm, LISP_UNDEF);
+}
+
+/*
+ * From a file to a stream that can send files itself, the bytes need
+ * not come through the ports. Return the bytes sent this way.
+ */
+static size_t pump_file(Lisp_Port *source, Lisp_Port *sink, size_t size)
+{
+	if (source->closed || sink->closed || !source->stream || !sink->stream
+	 || source->stream->cls != &lisp_file_stream || !source->stream->context
+	 || !sink->stream->cls->sendfile || !sink->stream->context
+	 || sink->max_output > 0)
+		return 0;
+
+	// Bytes read ahead into the source buffer go first
+	size_t n = MIN(source->iobuf->length - source->input_pos, size);
+	lisp_port_put_bytes(sink, source->iobuf->buf + source->input_pos, n);
+	source->input_pos += n;
+	lisp_port_flush(sink);
+
+	FILE *fp = source->stream->context;
+	long offset = ftell(fp);
+	if (n == size || offset < 0)
+		return n;
+	size_t k = sink->stream->cls->sendfile(sink->stream->context,
+		fileno(fp), offset, size - n);
+	if (k > 0) {
+		fseek(fp, offset + (long)k, SEEK_SET);
+		sink->byte_count += k;
+	}
+	return n + k;
+}
+
 /*
  * (pump <source> <sink> <size>)
  */
@@ -4578,7 +8194,7 @@ static void op_pump(Lisp_VM *vm, Lisp_Pair *args)
 		lisp_err(vm, "bad sink");
 	}
 	
-	size_t n = 0;
+	size_t n = pump_file(source, sink, size);
 	while (n < size && lisp_port_fill(source) > 0) {
 		size_t len = source->iobuf->length - source->input_pos;
 		uint8_t *bytes = source->iobuf->buf + source->input_pos;
@@ -4615,6 +8231,19 @@ static void op_exists(Lisp_VM *vm, Lisp_Pair *args, bool method)
 		op_p(vm, p && p->obj.is_method);
 }
 
+/* Strings and symbols go as they are, other objects are printed */
+static void port_append(Lisp_Port *port, Lisp_Pair *args)
+{
+	for (Lisp_Pair *p = args; p != LISP_NIL; p = REST(p)) {
+		Lisp_Object *o = CAR(p);
+		if (o->type == O_STRING || o->type == O_SYMBOL)
+			lisp_port_put_bytes(port, ((Lisp_String*)o)->buf,
+				((Lisp_String*)o)->length);
+		else
+			lisp_port_print(port, o);
+	}
+}
+
 static void op_concat(Lisp_VM*vm, Lisp_Pair *args)
 {
 	bool all_strings = true;
@@ -4639,7 +8268,7 @@ static void op_concat(Lisp_VM*vm, Lisp_Pair *args)
 		for (Lisp_Pair *p = args; p != LISP_NIL; p = REST(p))
 		{
 			Lisp_String *s =  (Lisp_String*)CAR(p);
-			strcpy(t, s->buf);
+			memcpy(t, s->buf, s->length);
 			t += s->length;
 		}
 		return;
@@ -4649,14 +8278,7 @@ static void op_concat(Lisp_VM*vm, Lisp_Pair *args)
 	pushx(vm, buf);
 	Lisp_Port *port = lisp_open_output_buffer(vm, buf);
 	pushx(vm, port);
-	for (Lisp_Pair *p = args; p != LISP_NIL; p = REST(p))
-	{
-		Lisp_Object *o = CAR(p);
-		if (o->type == O_STRING || o->type == O_SYMBOL)
-			lisp_port_puts(port, ((Lisp_String*)o)->buf);
-		else
-			lisp_port_print(port, o);
-	}
+	port_append(port, args);
 	pushx(vm, lisp_string_new(vm, (char*)buf->buf, buf->length));
 	lisp_push(vm, lisp_pop(vm, 3));
 }
@@ -4694,6 +8316,68 @@ static void op_concat(Lisp_VM*vm, Lisp_Pair *args)
  * Push the result onto stack.
  * - sid: The primitive symbol id
  */
+/* Common primitives on a stack argument frame, without building
+ * the argument list. Return false for others before doing anything.
+ * Must agree with apply_primitive().
+ */
+static bool apply_primitive_stack(Lisp_VM *vm, int sid, size_t base, int n)
+{
+#define ARG(i) ((i) < n ? STACK_ARG(vm, base, n, i) : LISP_UNDEF)
+#define NUM(i) ((Lisp_Number*)safe_ptr(vm, STACK_ARG(vm, base, n, i), O_NUMBER))->value
+	bool (*test)(Lisp_VM*,double,double) = NULL;
+	double t;
+	int i;
+	switch (sid) {
+	case S_ADD:
+		for (t = 0, i = 0; i < n; i++)
+			t += NUM(i);
+		push_num(vm, t);
+		return true;
+	case S_MUL:
+		for (t = 1, i = 0; i < n; i++)
+			t *= NUM(i);
+		push_num(vm, t);
+		return true;
+	case S_SUB:
+		t = 0, i = 0;
+		if (n > 1)
+			t = NUM(i++);
+		for (; i < n; i++)
+			t -= NUM(i);
+		push_num(vm, t);
+		return true;
+	case S_NUMBER_LT: test = numeric_lt; break;
+	case S_NUMBER_LE: test = numeric_le; break;
+	case S_NUMBER_EQ: test = numeric_eq; break;
+	case S_NUMBER_GT: test = numeric_gt; break;
+	case S_NUMBER_GE: test = numeric_ge; break;
+	case S_NOT: op_p(vm, ARG(0)==LISP_FALSE); return true;
+	case S_NULLP: op_p(vm, ARG(0)==LISP_NIL); return true;
+	case S_PAIRP: op_p(vm, ARG(0)->type == O_PAIR); return true;
+	case S_EQP: op_p(vm, lisp_eq(ARG(0), ARG(1))); return true;
+	case S_CONS:
+		pushx(vm, lisp_pair_new(vm, ARG(0), ARG(1)));
+		return true;
+	case S_CAR: case S_CDR:
+		if (ARG(0)->type != O_PAIR)
+			return false;
+		lisp_push(vm, sid == S_CAR ? CAR(ARG(0)) : CDR(ARG(0)));
+		return true;
+	default:
+		return false;
+	}
+	for (i = 0; i + 1 < n; i++) {
+		if (!test(vm, NUM(i), NUM(i+1))) {
+			lisp_push(vm, LISP_FALSE);
+			return true;
+		}
+	}
+	lisp_push(vm, LISP_TRUE);
+	return true;
+#undef NUM
+#undef ARG
+}
+
 static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 {
 	switch (sid) {
@@ -4946,6 +8630,40 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 		}
 		break;
 	}
+	case S_HAMT: { /* (hamt (<key> . <value>) ...) */
+		int n = 0;
+		for (Lisp_Pair *p = args; p != LISP_NIL; p = REST(p), n++)
+			lisp_push(vm, p->car);
+		mkhamt(vm, n);
+		break;
+	}
+	case S_HAMT_GET: { /* (hamt-get <hamt> <key>) */
+		Lisp_Hamt *h = safe_ptr(vm, CAR(args), O_HAMT);
+		Lisp_Pair *p = lisp_hamt_assoc(vm, h, CADR(args));
+		lisp_push(vm, p ? p->cdr : LISP_UNDEF);
+		break;
+	}
+	case S_HAMT_SET: { /* (hamt-set <hamt> <key> <value>) */
+		Lisp_Hamt *h = safe_ptr(vm, CAR(args), O_HAMT);
+		pushx(vm, lisp_hamt_set(vm, h, CADR(args), CAR(CDR(CDR(args)))));
+		break;
+	}
+	case S_HAMT_UNSET: { /* (hamt-unset <hamt> <key>) */
+		Lisp_Hamt *h = safe_ptr(vm, CAR(args), O_HAMT);
+		pushx(vm, lisp_hamt_unset(vm, h, CADR(args)));
+		break;
+	}
+	case S_HAMT_COUNT: {
+		Lisp_Hamt *h = safe_ptr(vm, CAR(args), O_HAMT);
+		push_num(vm, (double)lisp_hamt_count(h));
+		break;
+	}
+	case S_HAMT_TO_LIST: {
+		Lisp_Hamt *h = safe_ptr(vm, CAR(args), O_HAMT);
+		lisp_make_list(vm, hamt_push_entries(vm, h, true));
+		break;
+	}
+	case S_HAMTP: op_p(vm, CAR(args)->type == O_HAMT); break;
 	case S_NTH: { /* (nth <l> <index>) */
 		Lisp_Pair *l = safe_ptr(vm, CAR(args), O_PAIR);
 		int index = safe_int(vm, CADR(args));
@@ -4974,6 +8692,7 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 		int index = safe_int(vm, CADR(args));
 		if (index < 0 || (unsigned)index >= a->count)
 			lisp_err(vm, "array-set: out of bound");
+		write_barrier(vm, &a->obj);
 		a->items[index] = CAR(CDR(CDR(args)));
 		lisp_push(vm, LISP_UNDEF);
 		break;
@@ -5003,6 +8722,7 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 		Lisp_String*k = safe_ptr(vm,CADR(args),O_SYMBOL);
 		Lisp_Pair *p = lisp_dict_assoc(a, k);
 		if (p) {
+			write_barrier(vm, &p->obj);
 			p->cdr = CAR(CDR(CDR(args)));
 		} else {
 			lisp_dict_add(a, k, CAR(CDR(CDR(args))));
@@ -5068,6 +8788,15 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 				}
 				break;
 			}
+			case O_HAMT: {
+				Lisp_Pair *t = lisp_hamt_assoc(vm, (Lisp_Hamt*)o, k);
+				if (t) {
+					o = t->cdr;
+				} else {
+					lisp_err(vm, "Bad key");
+				}
+				break;
+			}
 			case O_ENV: {
 				Lisp_String *name = safe_ptr(vm, k, O_SYMBOL);
 				Lisp_Pair *t = lisp_env_assoc((Lisp_Env*)o, name);
@@ -5200,6 +8929,11 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 		}
 		break;
 	}
+	case S_WITH_ARENA:
+		lisp_vm_begin_region(vm);
+		eval_list(vm, args, 0);
+		lisp_vm_end_region(vm);
+		break;
 	case S_WITH_INPUT: {
 		pushx(vm, vm->input);
 		lisp_push(vm, CAR(args));
@@ -5295,7 +9029,7 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 			offset = lisp_safe_int(vm, o);
 		}
 		if (offset >= 0 && (unsigned)offset < s->length)
-			p = strstr(s->buf+offset, sub->buf);
+			p = find_bytes(s->buf+offset, s->length-offset, sub->buf, sub->length);
 		if (p == NULL)
 			lisp_push(vm, LISP_FALSE);
 		else
@@ -5318,12 +9052,7 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 		if (offset >= 0 && (unsigned)offset < s->length && sub->length <= s->length) {
 			if ((unsigned)offset > s->length - sub->length)
 				offset = (int)(s->length - sub->length);
-			for (;offset >= 0;offset--) {
-				if (strncmp(s->buf+offset, sub->buf, sub->length)==0) {
-					p = s->buf+offset;
-					break;
-				}
-			}
+			p = find_last_bytes(s->buf, offset + sub->length, sub->buf, sub->length);
 		}
 		if (p == NULL)
 			lisp_push(vm, LISP_FALSE);
@@ -5352,6 +9081,8 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 			n = (int)((Lisp_String*)o)->length;
 		} else if (o->type == O_ARRAY) {
 			n = (int)((Lisp_Array*)o)->count;
+		} else if (o->type == O_HAMT) {
+			n = (int)((Lisp_Hamt*)o)->size;
 		} else {
 			lisp_err(vm, "no length");
 		}
@@ -5364,10 +9095,10 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 		int n = 0;
 		if (delim->length == 0)
 			lisp_err(vm, "split: delim must not be empty");
-		const char *t = s->buf;
+		const char *t = s->buf, *end = s->buf + s->length;
 		const char *p;
 		
-		while ((p = strstr(t, delim->buf))) {
+		while ((p = find_bytes(t, end-t, delim->buf, delim->length))) {
 			pushx(vm, lisp_string_new(vm, t, p-t));
 			n++;
 			t = p + delim->length;
@@ -5376,7 +9107,7 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 		if (t == s->buf) {
 			pushx(vm, s);
 		} else {
-			pushx(vm, lisp_string_new(vm, t, s->length-(t-s->buf)));
+			pushx(vm, string_tail(vm, s, t-s->buf));
 		}
 		lisp_make_list(vm, n+1);
 		break;
@@ -5398,9 +9129,14 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 			// by using (substring s pos (+ pos 1))
 			while ((s->buf[end] & 0xc0) == 0x80)
 				end++;
+			if (start > end)
+				lisp_err(vm, "bad range");
 			if ((unsigned)start < s->length && (s->buf[start] & 0xc0) == 0x80)
 				lisp_err(vm, "bad first byte");
-			lisp_push(vm, (Lisp_Object*)lisp_string_new(vm, s->buf+start, end-start));
+			if ((unsigned)end == s->length)
+				pushx(vm, string_tail(vm, s, start));
+			else
+				pushx(vm, lisp_string_new(vm, s->buf+start, end-start));
 		} else {
 			lisp_err(vm, "bad range");
 		}
@@ -5434,7 +9170,9 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 			Lisp_String *s = (Lisp_String*)o;
 			if (end == -1)
 				end = (int)s->length;
-			if (begin >= 0 && begin <= end && end <= (int)s->length) {
+			if (begin >= 0 && begin <= end && (unsigned)end == s->length) {
+				pushx(vm, string_tail(vm, s, begin));
+			} else if (begin >= 0 && begin <= end && end <= (int)s->length) {
 				pushx(vm, lisp_string_new(vm, s->buf+begin, end-begin));
 			} else {
 				lisp_err(vm, "slice: invalid range");
@@ -5465,6 +9203,56 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 		break;
 	}
 	case S_CONCAT: op_concat(vm, args); break;
+	/* (json-encode obj &optional port)
+	 * Write obj to port as JSON, or return the text if there is no port.
+	 */
+	case S_JSON_ENCODE: {
+		Lisp_Object *o = CADR(args);
+		if (o != LISP_UNDEF) {
+			Lisp_Port *port = safe_ptr(vm, o, O_PORT);
+			if (!port->out)
+				lisp_err(vm, "Not output port");
+			json_put(vm, port, CAR(args), 0);
+			lisp_push(vm, LISP_UNDEF);
+		} else {
+			Lisp_Port *port = lisp_open_output_buffer(vm, NULL);
+			pushx(vm, port);
+			json_put(vm, port, CAR(args), 0);
+			pushx(vm, lisp_string_new(vm, (char*)port->iobuf->buf, port->iobuf->length));
+			lisp_push(vm, lisp_pop(vm, 2));
+		}
+		break;
+	}
+	/* (json-decode <string|buffer> &optional 'dict)
+	 * Objects come as alists, or as dicts if 'dict is given.
+	 */
+	case S_JSON_DECODE: {
+		Lisp_Object *o = CAR(args);
+		Lisp_Object *as = CADR(args);
+		bool dicts = false;
+		if (as != LISP_UNDEF) {
+			if (as->type != O_SYMBOL)
+				lisp_err(vm, "json-decode: expect 'dict or 'alist");
+			if (strcmp(((Lisp_String*)as)->buf, "dict") == 0)
+				dicts = true;
+			else if (strcmp(((Lisp_String*)as)->buf, "alist") != 0)
+				lisp_err(vm, "json-decode: expect 'dict or 'alist");
+		}
+		if (o->type == O_STRING) {
+			Lisp_String *s = (Lisp_String*)o;
+			json_decode(vm, s->buf, s->length, dicts);
+		} else if (o->type == O_BUFFER) {
+			Lisp_Buffer *b = (Lisp_Buffer*)o;
+			int pos = check_utf8((char*)b->buf, b->length);
+			if (pos != -1)
+				lisp_err(vm, "json-decode: invalid UTF-8 at %d", pos);
+			json_decode(vm, (char*)b->buf, b->length, dicts);
+		} else {
+			lisp_err(vm, "json-decode: expect string or buffer");
+		}
+		break;
+	}
+	case S_COMPILE: op_compile(vm, args); break;
 	case S_JOIN: {
 		// TODO Optimize: the destination buffer size can be determined 
 		// by going through the list. We don't need the buffer
@@ -5539,9 +9327,16 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 		break;
 	}
 	case S_FORMAT: op_format(vm, args); break;
-	case S_OPEN_INPUT_FILE: { // (open-input-file path)
+	case S_GC_STATS: op_gc_stats(vm, args); break;
+	case S_PROFILE_START: op_profile_start(vm, args); break;
+	case S_PROFILE_STOP: op_profile_stop(vm, args); break;
+	case S_PROFILE_DUMP: op_profile_dump(vm, args); break;
+	case S_OPEN_INPUT_FILE: { // (open-input-file path &optional map)
 		Lisp_String *path = safe_ptr(vm, CAR(args), O_STRING);
-		pushx(vm, lisp_open_input_file(vm, path));
+		if (CADR(args) == LISP_TRUE)
+			pushx(vm, lisp_open_input_map(vm, path));
+		else
+			pushx(vm, lisp_open_input_file(vm, path));
 		break;
 	}
 	case S_SEEK: /* (seek <port> <offset>) */
@@ -5549,6 +9344,14 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 		Lisp_Port *port = safe_ptr(vm, CAR(args), O_PORT);
 		vm_check(port->vm);
 		long offset = (long)lisp_safe_number(vm, CADR(args));
+		if (!port->closed && !port->out && !port->stream) {
+			// Input buffer, possibly a mapped file
+			if (offset < 0 || (size_t)offset > port->iobuf->length)
+				lisp_err(vm, "seek: failed");
+			port->input_pos = offset;
+			lisp_push(vm, LISP_TRUE);
+			break;
+		}
 		if (port->closed || !port->stream || !port->stream->cls->seek)
 			lisp_err(vm, "Bad port: seek not supported");
 		if (port->out) {
@@ -5607,6 +9410,31 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 		pushx(vm, lisp_open_output_buffer(vm, (Lisp_Buffer*)o));
 		break;
 	}
+	/*
+	 * A string port builds a string in place, without one
+	 * for every piece like concat.
+	 * (open-output-string)
+	 * (string-append! port x ...) like concat, returns port
+	 * (get-output-string port)
+	 */
+	case S_OPEN_OUTPUT_STRING:
+		pushx(vm, lisp_open_output_buffer(vm, NULL));
+		break;
+	case S_STRING_APPEND: {
+		Lisp_Port *port = safe_ptr(vm, CAR(args), O_PORT);
+		if (!port->out || port->stream || !port->iobuf)
+			lisp_err(vm, "not string output port");
+		port_append(port, REST(args));
+		pushx(vm, port);
+		break;
+	}
+	case S_GET_OUTPUT_STRING: {
+		Lisp_Port *port = safe_ptr(vm, CAR(args), O_PORT);
+		if (!port->out || port->stream || !port->iobuf)
+			lisp_err(vm, "not string output port");
+		pushx(vm, lisp_string_new(vm, (char*)port->iobuf->buf, port->iobuf->length));
+		break;
+	}
 	case S_GET_OUTPUT_BUFFER: {
 		Lisp_Port *port = safe_ptr(vm, CAR(args), O_PORT);
 		if (port->iobuf==NULL)
@@ -5731,12 +9559,16 @@ static void apply_primitive(Lisp_VM*vm, int sid, Lisp_Pair* args)
 Lisp_VM *lisp_vm_new()
 {
 	jmp_buf jbuf;
+	index_symtab();
 	Lisp_VM *vm = calloc(1, sizeof(Lisp_VM));
 	if (vm == NULL)
 		return NULL;
 	vm->catch = &jbuf;
 	if (setjmp(jbuf) == 0) {
-		vm->pool = lisp_pool_new(vm, INIPOOLSIZE);
+		vm->pool = lisp_pool_new(vm, MIN(MINPOOLSIZE, INIPOOLSIZE));
+		vm->old_pool = lisp_pool_new(vm, INIOLDPOOLSIZE);
+		vm->remembered = lisp_pool_new(vm, 64);
+		vm->major_threshold = MINMAJORGCSIZE;
 		vm->stack = lisp_array_new(vm, INISTACKSIZE);
 		vm->symbols = lisp_dict_new(vm, INISYMLISTSIZE);
 		vm->source_files = lisp_dict_new(vm, INIFILELISTSIZE);
@@ -5771,16 +9603,24 @@ void lisp_vm_delete(Lisp_VM *vm)
 		delete_obj(vm, (Lisp_Object*)vm->pool);
 		vm->pool = NULL;
 	}
-	for (int i = 0; i < MAX_CACHED_OBJECT_SIZE/BLKSIZE; i++) {
-		lisp_memblock_t *p, *next;
-		size_t bsize = (i + 1) * BLKSIZE;
-		for (p = vm->freelist[i]; p != NULL; p = next) {
-			next = p->next;
-			assert(vm->memsize >= bsize);
-			vm->memsize -= bsize;
-			free(p);
-		}
+	if (vm->old_pool) {
+		for (unsigned i = 0; i < vm->old_pool->count; i++)
+			delete_obj(vm, vm->old_pool->items[i]);
+		delete_obj(vm, (Lisp_Object*)vm->old_pool);
+		vm->old_pool = NULL;
+	}
+	if (vm->remembered) {
+		delete_obj(vm, (Lisp_Object*)vm->remembered);
+		vm->remembered = NULL;
+	}
+	for (int i = 0; i < MAX_CACHED_OBJECT_SIZE/BLKSIZE; i++)
 		vm->freelist[i] = NULL;
+	while (vm->chunks) {
+		lisp_chunk_t *next = vm->chunks->next;
+		assert(vm->memsize >= vm->chunks->size);
+		vm->memsize -= vm->chunks->size;
+		free(vm->chunks);
+		vm->chunks = next;
 	}
 	assert(vm->memsize == 0);
 	free(vm);
@@ -5791,12 +9631,43 @@ void lisp_keep_alive(Lisp_VM *vm, Lisp_Object* obj)
 	lisp_array_push(vm->keep_alive_pool, obj);
 }
 
+/*
+ * Chain the root env of vm to that of parent, so that vm sees what
+ * parent has defined and loaded without a copy. This is what makes
+ * spawning a process cheap; there is no heap image to clone a VM
+ * from. Parent must not run while vm may reach its objects.
+ */
 void lisp_vm_set_parent(Lisp_VM *vm, Lisp_VM *parent)
 {
 	vm->parent = parent;
+	write_barrier(vm, &vm->root_env->obj);
 	vm->root_env->parent = parent->root_env;
 }
 
+/*
+ * Have yield() called after every budget expressions evaluated, so
+ * that the client can suspend a long computation. A budget of zero
+ * turns it off.
+ */
+void lisp_vm_set_yield(Lisp_VM *vm, unsigned budget, void (*yield)(Lisp_VM*))
+{
+	vm->yield_budget = yield ? budget : 0;
+	vm->yield_tick = budget;
+	vm->yield = yield;
+}
+
+/*
+ * Let eval and read use at most size bytes of C stack below the
+ * caller, so that deep recursion ends in an error rather than a
+ * crash. 0 turns the check off.
+ */
+void lisp_vm_set_stack_size(Lisp_VM *vm, size_t size)
+{
+	char here;
+	uintptr_t top = (uintptr_t)&here;
+	vm->stack_limit = size && size < top ? top - size : 0;
+}
+
 void lisp_vm_set_client(Lisp_VM* vm, void *client)
 {
 	vm->client = client;
@@ -5807,6 +9678,27 @@ void* lisp_vm_client(Lisp_VM* vm)
 }
 
 
+/* (define (<name> ...) ...) or (defmethod (<name> ...) ...) */
+static bool is_defproc_form(Lisp_Object *o)
+{
+	if (o->type != O_PAIR || o == LISP_NIL)
+		return false;
+	if (CAR(o) != (Lisp_Object*)SYM(S_DEFINE)
+	 && CAR(o) != (Lisp_Object*)SYM(S_DEFMETHOD))
+		return false;
+	return CDR(o)->type == O_PAIR && CADR(o)->type == O_PAIR
+	    && CADR(o) != LISP_NIL;
+}
+
+static void compile_defined(Lisp_VM *vm, Lisp_Object *name)
+{
+	if (name->type != O_SYMBOL)
+		return;
+	Lisp_Pair *p = lisp_dict_assoc(vm->env->bindings, (Lisp_String*)name);
+	if (p && p->cdr->type == O_PROC && !((Lisp_Proc*)p->cdr)->code)
+		compile_proc(vm, (Lisp_Proc*)p->cdr);
+}
+
 // REPL
 static void load(Lisp_VM *vm)
 {
@@ -5825,7 +9717,7 @@ static void load(Lisp_VM *vm)
 			lisp_port_flush(vm->output);
 		}
 		vm->reading = 1;
-		obj = lisp_read(vm);
+		obj = read_form(vm);
 		vm->reading = 0;
 		if (vm->debugging) {
 			if (obj->type == O_SYMBOL && strcmp(((Lisp_String*)obj)->buf, "/quit")==0)
@@ -5841,7 +9733,10 @@ static void load(Lisp_VM *vm)
 		}
 		if (n > 0) // Pop previous result
 			lisp_push(vm, lisp_pop(vm, 2));
+		bool compile = vm->input->compile && is_defproc_form(obj);
 		obj = lisp_eval(vm);
+		if (compile)
+			compile_defined(vm, obj);
 		if (obj != LISP_UNDEF) {
 			if (interactive) {
 				lisp_port_puts(vm->output, "=> ");
@@ -5956,6 +9851,8 @@ Lisp_Object* lisp_try(Lisp_VM *vm, void (*fn)(Lisp_VM*, void *), void *data)
 	Lisp_Object *ret = NULL;
 	jmp_buf jbuf;
 	jmp_buf *prev = vm->catch;
+	unsigned old_level = vm->eval_level;
+	int old_region = vm->region;
 	vm->catch = &jbuf;
 	size_t oldcnt = vm->stack->count;
 	if (setjmp(jbuf) == 0) {
@@ -5963,6 +9860,10 @@ Lisp_Object* lisp_try(Lisp_VM *vm, void (*fn)(Lisp_VM*, void *), void *data)
 		assert(vm->stack->count == oldcnt+1);
 		ret = lisp_pop(vm, 1);
 	}
+	/* Unwind what an error skipped, as op_catch() does */
+	vm->eval_level = old_level;
+	while (vm->region > old_region)
+		lisp_vm_end_region(vm);
 	vm->catch = prev;
 	vm->stack->count = oldcnt;
 	return ret;
@@ -6092,7 +9993,7 @@ void lisp_load_file(Lisp_VM *vm, const char *path)
 {
 	Lisp_String *s = lisp_string_new(vm, path, strlen(path));
 	pushx(vm, s);
-	vm->input = lisp_open_input_file(vm, s);
+	vm->input = open_source(vm, s);
 	vm->input->src_file = ensure_source_file(vm, vm->input->name);
 	load(vm);
 	lisp_exch(vm);
@@ -6153,11 +10054,36 @@ void lisp_defn(Lisp_VM *vm, const char *name, lisp_func fn)
 	lisp_pop(vm, 2);
 }
 
+/* Define a native procedure which reads its arguments from stack
+ * with lisp_arg() instead of receiving a list. No list is
+ * built for calls to it.
+ */
+void lisp_defn_stack(Lisp_VM *vm, const char *name, lisp_stack_func fn)
+{
+	Lisp_String *s = lisp_make_symbol(vm, name);
+	Lisp_Native_Proc *proc = new_obj(vm, O_NATIVE_PROC);
+	pushx(vm, proc);
+	proc->fn_stack = fn;
+	proc->env = vm->env;
+	proc->name = s;
+	lisp_defvar(vm, s, (Lisp_Object*)proc);
+	lisp_pop(vm, 2);
+}
+
+/* Argument i of a native procedure defined by lisp_defn_stack(),
+ * argv as passed to it. Caller checks i against argc.
+ */
+Lisp_Object *lisp_arg(Lisp_VM *vm, size_t argv, int i)
+{
+	assert(argv - i < vm->stack->count);
+	return vm->stack->items[argv - i];
+}
+
 void lisp_vm_gc(Lisp_VM *vm, bool clear_keep_alive)
 {
 	if (clear_keep_alive)
 		vm->keep_alive_pool->count = 0;
-    gc(vm);
+    gc(vm, true);
 }
 
 void lisp_vm_enable_debug(Lisp_VM *vm, bool enabled)
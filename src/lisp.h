@@ -44,6 +44,12 @@ struct lisp_object_ex_class_t {
 	void (*mark)(void *ptr);
 };
 
+/* A piece of a gather write, see writev below */
+struct lisp_iovec {
+    const void *base;
+    size_t len;
+};
+
 struct lisp_stream_class_t {
     const char *name;
     size_t context_size; /* Allocate context if non zero */
@@ -53,6 +59,11 @@ struct lisp_stream_class_t {
     void (*mark)(void *context);
     bool (*ready)(void *context, int mode); /* mode: 0 - read, 1 : write */
     int (*seek)(void *context, long offset); /* return 0 if ok */
+    /* Write size bytes of file fd from offset without copying them
+       through the port, see pump. Return bytes written, 0 if not done. */
+    size_t (*sendfile)(void *context, int fd, long offset, size_t size);
+    /* Write the pieces in order, at once if possible. Return bytes written. */
+    size_t (*writev)(void *context, const struct lisp_iovec *iov, int count);
 };
 
 typedef struct lisp_vm_state_t {
@@ -62,7 +73,16 @@ typedef struct lisp_vm_state_t {
 	Lisp_Port *input, *output, *error;
 } lisp_vm_state_t;
 
+/* Collector statistics. Pause times are in seconds. */
+typedef struct lisp_gc_stats_t {
+	size_t minor_count, major_count;
+	double last_pause, max_pause, total_pause;
+	size_t young_count, old_count;
+	size_t memsize; /* bytes allocated by the VM */
+} lisp_gc_stats_t;
+
 typedef void (*lisp_func)(Lisp_VM*, Lisp_Pair* args);
+typedef void (*lisp_stack_func)(Lisp_VM*, size_t argv, int argc);
 
 extern Lisp_Object *lisp_nil;
 extern Lisp_Object *lisp_true;
@@ -97,6 +117,7 @@ Lisp_String *lisp_string_new(Lisp_VM *vm, const char *buf, size_t length);
 
 Lisp_Buffer *lisp_buffer_new(Lisp_VM *vm, size_t cap);
 Lisp_Buffer *lisp_buffer_copy(Lisp_VM *vm, const void *data, size_t size);
+Lisp_Buffer *lisp_buffer_map_file(Lisp_VM *vm, const char *path, size_t min_size);
 void *lisp_buffer_bytes(Lisp_Buffer *b);
 #define lisp_buffer_data lisp_buffer_bytes
 size_t lisp_buffer_cap(Lisp_Buffer *b);
@@ -121,6 +142,7 @@ Lisp_Object *lisp_cdr(Lisp_Pair *p);
 Lisp_Object *lisp_nth(Lisp_Pair *p, int index);
 Lisp_Pair *lisp_cons(Lisp_VM *vm);
 void lisp_make_list(Lisp_VM *vm, int n);
+void lisp_make_array(Lisp_VM *vm, int n);
 const char *lisp_string_cstr(Lisp_String *s);
 size_t lisp_string_length(Lisp_String *s);
 Lisp_String *lisp_push_string(Lisp_VM *vm, const char *buf, size_t length);
@@ -132,11 +154,15 @@ int lisp_safe_int(Lisp_VM *vm, Lisp_Object* o);
 Lisp_Pair* lisp_safe_list(Lisp_VM *vm, Lisp_Object* o);
 double lisp_safe_number(Lisp_VM *vm, Lisp_Object* o);
 void *lisp_safe_bytes(Lisp_VM *vm, Lisp_Object *o, size_t *len);
+/* Bytes of a buffer owned by vm, for updating in place */
+void *lisp_safe_mutable_bytes(Lisp_VM *vm, Lisp_Object *o, size_t *len);
 const char* lisp_safe_cstring(Lisp_VM *vm, Lisp_Object* o);
 const char* lisp_safe_csymbol(Lisp_VM *vm, Lisp_Object* o);
 Lisp_Object *lisp_vm_get(Lisp_VM *vm, const char *name);
 void lisp_def(Lisp_VM *vm, const char *name, Lisp_Object *o);
 void lisp_defn(Lisp_VM *vm, const char *name, lisp_func fn);
+void lisp_defn_stack(Lisp_VM *vm, const char *name, lisp_stack_func fn);
+Lisp_Object *lisp_arg(Lisp_VM *vm, size_t argv, int i);
 //bool lisp_vm_defn(Lisp_VM *vm, const char *name, lisp_func fn);
 bool lisp_vm_load(Lisp_VM *vm, const char *filename);
 bool lisp_vm_run(Lisp_VM *vm);
@@ -153,6 +179,7 @@ void lisp_exch(Lisp_VM *vm);
 Lisp_Env *lisp_vm_get_root_env(Lisp_VM *vm);
 
 Lisp_String *lisp_make_symbol(Lisp_VM *vm, const char *name);
+Lisp_String *lisp_make_symbol_len(Lisp_VM *vm, const char *name, size_t len);
 void lisp_begin_list(Lisp_VM *vm);
 void lisp_end_list(Lisp_VM *vm);
 Lisp_Stream *lisp_stream_new(Lisp_VM *vm, struct lisp_stream_class_t *cls, void *context);
@@ -175,6 +202,8 @@ void lisp_port_print(Lisp_Port *p, Lisp_Object *obj);
 bool lisp_port_set_output_stream(Lisp_Port *port, Lisp_Stream *stream);
 bool lisp_port_set_input_stream(Lisp_Port *port, Lisp_Stream *stream);
 Lisp_Stream *lisp_port_get_stream(Lisp_Port*port);
+void lisp_port_set_full_buf(Lisp_Port *port, bool on);
+void lisp_port_set_binary(Lisp_Port *port, size_t limit);
 
 int lisp_port_getc(Lisp_Port *port);
 void lisp_port_putc(Lisp_Port *port, int c);
@@ -198,10 +227,17 @@ void lisp_vm_delete(Lisp_VM *vm);
 void lisp_vm_set_client(Lisp_VM* vm, void *client);
 void* lisp_vm_client(Lisp_VM* vm);
 void lisp_vm_set_parent(Lisp_VM *vm, Lisp_VM *parent);
+void lisp_vm_set_yield(Lisp_VM *vm, unsigned budget, void (*yield)(Lisp_VM*));
+void lisp_vm_pause_profile(Lisp_VM *vm, bool pause);
+void lisp_vm_set_stack_size(Lisp_VM *vm, size_t size);
+void lisp_vm_begin_region(Lisp_VM *vm);
+void lisp_vm_end_region(Lisp_VM *vm);
+void lisp_vm_get_gc_stats(Lisp_VM *vm, lisp_gc_stats_t *stats);
 void lisp_vm_gc(Lisp_VM *vm, bool clear_keep_alive);
 Lisp_Object* lisp_try(Lisp_VM *vm, void (*func)(Lisp_VM*, void *), void *data);
 Lisp_Env *lisp_vm_root_env(Lisp_VM *vm);
 Lisp_VM *lisp_procedure_owner(Lisp_Object *obj);
 void lisp_keep_alive(Lisp_VM *vm, Lisp_Object* obj);
 void lisp_stringify(Lisp_VM *vm, Lisp_Object *obj);
+bool lisp_serialize(Lisp_VM *vm, Lisp_Object *obj);
 
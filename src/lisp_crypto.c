@@ -34,11 +34,14 @@
 #include <openssl/buffer.h>
 #include <openssl/rand.h>
 #include <openssl/bn.h>
+#include <pthread.h>
 
 #include "base64.h"
 #include "base58.h"
+#include "bytes.h"
 #include "lisp_crypto.h"
 #include "common.h"
+#include "twk-internal.h"
 
 #define MAX_KEY_BUF 1024
 
@@ -195,19 +198,11 @@ static int on_keygen(void *ctx, EVP_PKEY *pkey)
 	return 0;
 }
 
-static int hex(int i)
-{
-	return i < 10? '0'+i : 'a'+(i-10);
-}
-
 /* out size should >= nbytes*2+1 */
 static void hexify(const unsigned char *buf, size_t nbytes, char *out)
 {
-	for (unsigned i = 0; i < nbytes; i++) {
-		*out++ = hex(buf[i]>>4);
-		*out++ = hex(buf[i]&0xf);
-	}
-	*out = 0; 
+	bytes_hex_encode(out, buf, nbytes);
+	out[nbytes*2] = 0;
 }
 
 
@@ -235,8 +230,203 @@ KDF_SHA256(const void *in, size_t inlen, void *out, size_t * outlen)
 	return SHA256(in, inlen, out);
 }
 
+/*
+ * Parsed keys
+ *
+ * Turning raw key bytes into an EC_KEY costs about as much as using
+ * it, so keys are parsed once: (secp256k1-key <bytes>) makes a key
+ * object, and bytes passed as keys are looked up among the recently
+ * used ones. All keys share a group with the multiples of the
+ * generator precomputed, which verification uses.
+ *
+ * Keys are read-only once made and may be used by several threads
+ * at once, as by a batch verification. refs is under key_lock.
+ */
+#define KEY_CACHE_SIZE 64
+#define MAX_RAW_KEY 65
+
+struct parsed_key {
+	struct parsed_key *next; // in key_cache
+	int refs;
+	bool private;
+	size_t len;
+	uint8_t raw[MAX_RAW_KEY];
+	EC_KEY *ec;
+	EC_POINT *point; // of a public key
+};
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t key_lock = PTHREAD_MUTEX_INITIALIZER;
+static EC_GROUP *key_group;
+static struct parsed_key *key_cache; // most recently used first
+static int key_cache_count;
+
+static void key_init(void)
+{
+	key_group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+}
+
+/* Public keys are points, 65 bytes or 33 compressed, 
+ * private ones are numbers of up to 32 bytes. */
+static bool public_key_bytes(const uint8_t *k, size_t len)
+{
+	return (len == 65 && k[0] == 4) || (len == 33 && (k[0] == 2 || k[0] == 3));
+}
+
+static void key_free(struct parsed_key *key)
+{
+	if (key->ec)
+		EC_KEY_free(key->ec);
+	if (key->point)
+		EC_POINT_free(key->point);
+	OPENSSL_cleanse(key->raw, sizeof(key->raw));
+	free(key);
+}
+
+static void key_release(struct parsed_key *key)
+{
+	if (!key)
+		return;
+	pthread_mutex_lock(&key_lock);
+	bool last = --key->refs == 0;
+	pthread_mutex_unlock(&key_lock);
+	if (last)
+		key_free(key);
+}
+
+static struct parsed_key *key_parse(const uint8_t *k, size_t len)
+{
+	struct parsed_key *key = calloc(1, sizeof(struct parsed_key));
+	BIGNUM *bn = NULL;
+
+	assert_e(key != NULL && key_group != NULL);
+	assert_e(len > 0 && len <= MAX_RAW_KEY);
+	key->private = !public_key_bytes(k, len);
+	assert_e(!key->private || len <= 32);
+	key->len = len;
+	memcpy(key->raw, k, len);
+	assert_e(NULL != (key->ec = EC_KEY_new_by_curve_name(NID_secp256k1)));
+	if (key->private) {
+		assert_e(NULL != (bn = BN_bin2bn(k, (int)len, NULL)));
+		assert_e(1 == EC_KEY_set_private_key(key->ec, bn));
+	} else {
+		assert_e(NULL != (key->point = EC_POINT_new(key_group)));
+		if (!EC_POINT_oct2point(key_group, key->point, k, len, NULL))
+			goto Error; // not on the curve
+		assert_e(1 == EC_KEY_set_public_key(key->ec, key->point));
+	}
+	if (bn)
+		BN_clear_free(bn);
+	key->refs = 1;
+	return key;
+
+Error:
+	if (bn)
+		BN_clear_free(bn);
+	if (key)
+		key_free(key);
+	return NULL;
+}
+
+/*
+ * Return the key for bytes k, taking a reference for the caller,
+ * or NULL if k is not a key, or not of the kind wanted.
+ */
+static struct parsed_key *key_get(const uint8_t *k, size_t len, bool private)
+{
+	struct parsed_key **pp, *key = NULL, *evicted = NULL;
+
+	pthread_once(&key_once, key_init);
+	if (len == 0 || len > MAX_RAW_KEY || public_key_bytes(k, len) == private)
+		return NULL;
+
+	pthread_mutex_lock(&key_lock);
+	for (pp = &key_cache; *pp; pp = &(*pp)->next) {
+		if ((*pp)->len == len && memcmp((*pp)->raw, k, len) == 0) {
+			key = *pp;
+			*pp = key->next; // to the front
+			key->next = key_cache;
+			key_cache = key;
+			key->refs++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&key_lock);
+	if (key)
+		return key;
+
+	if (!(key = key_parse(k, len)))
+		return NULL;
+	pthread_mutex_lock(&key_lock);
+	key->refs++; // the cache has one
+	key->next = key_cache;
+	key_cache = key;
+	if (++key_cache_count > KEY_CACHE_SIZE) {
+		for (pp = &key_cache; (*pp)->next; pp = &(*pp)->next)
+			;
+		evicted = *pp;
+		*pp = NULL;
+		key_cache_count--;
+	}
+	pthread_mutex_unlock(&key_lock);
+	key_release(evicted);
+	return key;
+}
+
+struct key_object {
+	struct parsed_key *key;
+};
+
+static void key_object_finalize(Lisp_VM *vm, void *ctx)
+{
+	struct key_object *o = ctx;
+	if (o && o->key) {
+		key_release(o->key);
+		o->key = NULL;
+	}
+}
+
+static lisp_object_ex_class_t key_class = {
+	.name = "secp256k1-key",
+	.size = sizeof(struct key_object),
+	.finalize = key_object_finalize
+};
+
+/*
+ * The key for a key object, or for bytes, or NULL unless it is
+ * a key of the kind wanted. The caller releases it.
+ */
+static struct parsed_key *object_key(Lisp_VM *vm, Lisp_Object *o, bool private)
+{
+	struct parsed_key *key = NULL;
+	if (lisp_object_ex_class(o) == &key_class) {
+		struct key_object *x = lisp_object_ex_ptr(o);
+		if ((key = x->key) && key->private == private) {
+			pthread_mutex_lock(&key_lock);
+			key->refs++;
+			pthread_mutex_unlock(&key_lock);
+			return key;
+		}
+	} else if (lisp_buffer_p(o)) {
+		size_t len = 0;
+		const uint8_t *k = lisp_safe_bytes(vm, o, &len);
+		return key_get(k, len, private);
+	}
+	return NULL;
+}
+
 //http://stackoverflow.com/questions/18155559/how-does-one-access-the-raw-ecdh-public-key-private-key-and-params-inside-opens
 
+static int ecdh_keys(uint8_t outbuf[], size_t outlen, 
+	struct parsed_key *pub, struct parsed_key *pri)
+{
+	if (outlen < 20)
+		return 0;
+	int n = ECDH_compute_key(outbuf, outlen, 
+		pub->point, pri->ec, KDF_SHA256);
+	return n > 0 ? n : 0;
+}
+
 /*
  * ECDH: given two keys: A_pub, B_priv, and we should be able to
  * compute a shared secret between A, B.
@@ -249,59 +439,19 @@ int ecdh_shared_secret(uint8_t outbuf[], size_t outlen,
 	const uint8_t *pubkey, size_t pubkey_len,
 	const uint8_t *prikey, size_t prikey_len)
 {
-	EC_POINT *pub = NULL;
-	EC_KEY *pri = EC_KEY_new_by_curve_name(NID_secp256k1);	
-	EC_GROUP *ec_group = EC_GROUP_new_by_curve_name(NID_secp256k1);
-	int n = 0;
-	BIGNUM *bn = NULL;
-
-	assert_e(pri != NULL && ec_group != NULL);
-	assert_e(outlen >= 20);
-	assert_e(NULL != (pub = EC_POINT_new(ec_group)));
-	assert_e(0 != EC_POINT_oct2point(ec_group, pub, pubkey, pubkey_len, NULL));
-
-	bn = BN_bin2bn(prikey, (int)prikey_len, NULL);
-	assert_e(bn != NULL);
-	assert_e(1 == EC_KEY_set_private_key(pri, bn));
-	
-	n = ECDH_compute_key(outbuf, outlen, pub, pri, KDF_SHA256);
-	
-Error:
-	if (ec_group) {
-		EC_GROUP_free(ec_group);
-	}
-	if (pub) {
-		EC_POINT_free(pub);
-	}
-	if (pri) {
-		EC_KEY_free(pri);
-	}
-	if (bn) {
-		BN_free(bn);
-	}
+	struct parsed_key *pub = key_get(pubkey, pubkey_len, false);
+	struct parsed_key *pri = key_get(prikey, prikey_len, true);
+	int n = pub && pri ? ecdh_keys(outbuf, outlen, pub, pri) : 0;
+	key_release(pub);
+	key_release(pri);
 	return n;
 }
 
-static ECDSA_SIG *sign(const uint8_t *k, size_t klen, unsigned char *buf, size_t len)
+static ECDSA_SIG *sign(struct parsed_key *pri, unsigned char *buf, size_t len)
 {
-	EC_KEY *pri = EC_KEY_new_by_curve_name(NID_secp256k1);	
-	BIGNUM *bn = NULL;
-	ECDSA_SIG *sig = NULL;
 	unsigned char digest[SHA_DIGEST_LENGTH];
-	
-	bn = BN_bin2bn(k, (int)klen, NULL);
-	assert_e(bn != NULL);
-	assert_e(1 == EC_KEY_set_private_key(pri, bn));
-
 	SHA1(buf, len, digest);
-	sig = ECDSA_do_sign(digest, SHA_DIGEST_LENGTH, pri);
-	assert_e(sig != NULL);
-Error:
-	if (pri)
-		EC_KEY_free(pri);
-	if (bn)
-		BN_free(bn);
-	return sig;	
+	return ECDSA_do_sign(digest, SHA_DIGEST_LENGTH, pri->ec);
 }
 
 static int hex_value(unsigned char c)
@@ -318,40 +468,94 @@ static int hex_value(unsigned char c)
 	}
 }
 
-static int verify(const uint8_t *k, size_t klen, unsigned char *buf, size_t len, const char *hex_sig)
+#define MAX_DER_SIG 80
+
+/* A DER signature in hex to bytes, return the size or 0 */
+static size_t decode_sig(const char *hex_sig, uint8_t raw[MAX_DER_SIG])
 {
-	ECDSA_SIG *sig = NULL;
-	int ret = 0;
-	unsigned char digest[SHA_DIGEST_LENGTH];
-	unsigned char * raw_sig = NULL;
-	size_t i, n;
-	EC_POINT *pub = NULL;
-	EC_KEY *ec_key = EC_KEY_new_by_curve_name(NID_secp256k1);	
-	EC_GROUP *ec_group = EC_GROUP_new_by_curve_name(NID_secp256k1);
-	
-	SHA1(buf, len, digest);
+	size_t n = strlen(hex_sig);
+	if (n == 0 || n % 2 != 0 || n / 2 > MAX_DER_SIG)
+		return 0;
+	for (size_t i = 0; i < n; i++) {
+		if (!isxdigit((unsigned char)hex_sig[i]))
+			return 0;
+	}
+	for (size_t i = 0; i < n / 2; i++, hex_sig += 2)
+		raw[i] = hex_value(hex_sig[0]) * 16 + hex_value(hex_sig[1]);
+	return n / 2;
+}
 
-	n = strlen(hex_sig) / 2;
+/*
+ * A signature to be checked. The digest is SHA1 of the message as
+ * for sign(). The vm is left alone while the checks run.
+ */
+struct verify_job {
+	struct parsed_key *pub;
+	uint8_t digest[SHA_DIGEST_LENGTH];
+	uint8_t sig[MAX_DER_SIG];
+	size_t siglen;
+	bool ok;
+};
 
-	assert_e(n > 0 && n * 2 == strlen(hex_sig));
-	raw_sig = malloc(n);
-	assert_e(raw_sig != NULL);
-	
-	for (i = 0; i < n; i++, hex_sig+=2) {
-		raw_sig[i] = hex_value(hex_sig[0]) * 16 + hex_value(hex_sig[1]);
+static bool verify_prepare(struct verify_job *job, struct parsed_key *pub,
+	const void *msg, size_t len, const char *hex_sig)
+{
+	job->pub = pub;
+	job->ok = false;
+	SHA1(msg, len, job->digest);
+	job->siglen = decode_sig(hex_sig, job->sig);
+	return job->siglen > 0;
+}
+
+static bool verify_run(struct verify_job *job)
+{
+	if (!job->pub || job->siglen == 0)
+		return false;
+	const unsigned char *p = job->sig;
+	ECDSA_SIG *sig = d2i_ECDSA_SIG(NULL, &p, (long)job->siglen);
+	if (!sig)
+		return false;
+	int ret = ECDSA_do_verify(job->digest, SHA_DIGEST_LENGTH, sig, job->pub->ec);
+	ECDSA_SIG_free(sig);
+	return ret == 1;
+}
+
+/*
+ * Batches are shared among threads, each taking the next job, once
+ * it is big enough to pay for starting them.
+ */
+#define VERIFY_MAX_THREADS 8
+#define VERIFY_JOBS_PER_THREAD 16
+
+struct verify_batch {
+	struct verify_job *jobs;
+	int count;
+	int threads;
+	volatile int next;
+};
+
+static void *verify_worker(void *arg)
+{
+	struct verify_batch *b = arg;
+	int i;
+	while ((i = __sync_fetch_and_add(&b->next, 1)) < b->count)
+		b->jobs[i].ok = verify_run(&b->jobs[i]);
+	return NULL;
+}
+
+static void verify_batch_run(void *arg)
+{
+	struct verify_batch *b = arg;
+	pthread_t tids[VERIFY_MAX_THREADS];
+	int n = 0;
+	int threads = MIN(b->threads, b->count / VERIFY_JOBS_PER_THREAD);
+	for (; n < threads - 1; n++) {
+		if (pthread_create(&tids[n], NULL, verify_worker, b) != 0)
+			break;
 	}
-	
-	assert_e(NULL != (sig=d2i_ECDSA_SIG(NULL, (const unsigned char **)&raw_sig, n)));
-
-	assert_e(NULL != (pub = EC_POINT_new(ec_group)));
-	assert_e(0 != EC_POINT_oct2point(ec_group, pub, k, klen, NULL));
-	assert_e(1 == EC_KEY_set_public_key(ec_key, pub));
-	         
-	ret = ECDSA_do_verify(digest, SHA_DIGEST_LENGTH, sig, ec_key);
-	         
-Error:
-	         
-	return ret;
+	verify_worker(b);
+	while (n > 0)
+		pthread_join(tids[--n], NULL);
 }
 
 /* Only string and buffer */
@@ -513,19 +717,37 @@ static void op_secp256k1_keygen(Lisp_VM *vm, Lisp_Pair *args)
 	lisp_cons(vm);
 }
 
+/*
+ * (secp256k1-key <key>) => key object
+ *
+ * Parse a public or private key once, to be used for ecdh, ecdsa-sign
+ * and ecdsa-verify in place of its bytes.
+ */
+static void op_secp256k1_key(Lisp_VM *vm, Lisp_Pair *args)
+{
+	size_t len = 0;
+	const uint8_t *k = lisp_safe_bytes(vm, CAR(args), &len);
+	struct parsed_key *key = key_get(k, len, !public_key_bytes(k, len));
+	CHECK(vm, key != NULL, "Bad key");
+	struct key_object *o = lisp_object_ex_ptr(lisp_make_object_ex(vm, &key_class));
+	o->key = key;
+}
+
 /* (ecdh <private-key> <public-kye>) */
 static void op_ecdh(Lisp_VM *vm, Lisp_Pair *args)
 {
-	Lisp_Buffer *pri = (Lisp_Buffer*)CAR(args);
-	Lisp_Buffer *pub = (Lisp_Buffer*)CADR(args);
+	CHECK(vm, CDR(args) != lisp_nil, "Expect keys");
+	struct parsed_key *pri = object_key(vm, CAR(args), true);
+	struct parsed_key *pub = object_key(vm, CADR(args), false);
 
 	unsigned char secret[64];
-	int n = ecdh_shared_secret(secret, sizeof(secret),
-			lisp_buffer_bytes(pub), lisp_buffer_size(pub),
-			lisp_buffer_bytes(pri), lisp_buffer_size(pri));
+	int n = pri && pub ? ecdh_keys(secret, sizeof(secret), pub, pri) : 0;
+	key_release(pri);
+	key_release(pub);
 	if (n == 0)
 		lisp_err(vm, "Invalid shared secret");
 	lisp_push_buffer(vm, secret, n);
+	OPENSSL_cleanse(secret, sizeof(secret));
 }
 
 /*
@@ -536,13 +758,17 @@ static void op_ecdsa_sign(Lisp_VM *vm, Lisp_Pair *args)
 {
 	unsigned char *p = NULL;
 	const char *md = lisp_safe_cstring(vm, CAR(args));
-	Lisp_Buffer *pri = (Lisp_Buffer*)CADR(args);
-	CHECK(vm, lisp_buffer_p(CADR(args)), "Not buffer");
-	ECDSA_SIG *sig = sign(lisp_buffer_bytes(pri), lisp_buffer_size(pri), (void*)md, strlen(md));
+	CHECK(vm, CDR(args) != lisp_nil, "Expect private key");
+	struct parsed_key *pri = object_key(vm, CADR(args), true);
+	CHECK(vm, pri != NULL, "Bad private key");
+	ECDSA_SIG *sig = sign(pri, (void*)md, strlen(md));
+	key_release(pri);
+	CHECK(vm, sig != NULL, "Can not sign");
 	int len = i2d_ECDSA_SIG(sig, &p);
 	char buf[256];
 	hexify(p, len, buf);
-    ECDSA_SIG_free(sig);
+	OPENSSL_free(p);
+	ECDSA_SIG_free(sig);
 	lisp_push(vm, (Lisp_Object*)lisp_string_new(vm, buf, strlen(buf)));
 }
 
@@ -551,27 +777,72 @@ static void op_ecdsa_sign(Lisp_VM *vm, Lisp_Pair *args)
  */
 static void op_ecdsa_verify(Lisp_VM *vm, Lisp_Pair *args)
 {
-		const char *sig = lisp_safe_cstring(vm, CAR(args));
-		const char *md = lisp_safe_cstring(vm, CADR(args));
-		size_t publen = 0;
-		const uint8_t *pub = lisp_safe_bytes(vm, CADDR(args), &publen);
+	struct verify_job job;
+	const char *sig = lisp_safe_cstring(vm, CAR(args));
+	const char *md = lisp_safe_cstring(vm, CADR(args));
+	struct parsed_key *pub = object_key(vm, CADDR(args), false);
 
-		if (verify(pub, publen, (void*)md, strlen(md), sig)) {
-			lisp_push(vm, lisp_true);
-		} else {
-			lisp_push(vm, lisp_false);
-		}
+	bool ok = verify_prepare(&job, pub, md, strlen(md), sig) && verify_run(&job);
+	key_release(pub);
+	lisp_push(vm, ok ? lisp_true : lisp_false);
+}
+
+/*
+ * (ecdsa-verify-batch <list of (signature message-digest pub)> [threads])
+ * => list of boolean
+ *
+ * Check signatures as ecdsa-verify does, in order. The checks run
+ * off the process, spread over threads (4 by default) once there
+ * are enough of them.
+ */
+static void op_ecdsa_verify_batch(Lisp_VM *vm, Lisp_Pair *args)
+{
+	struct verify_batch b = {NULL, 0, 4, 0};
+	Lisp_Object *p;
+	int i;
+
+	for (p = CAR(args); lisp_pair_p(p) && p != lisp_nil; p = CDR(p)) {
+		Lisp_Object *t = CAR(p);
+		CHECK(vm, lisp_pair_p(t) && t != lisp_nil && CDR(t) != lisp_nil && CDDR(t) != lisp_nil,
+			"Expect (signature message-digest pub)");
+		lisp_safe_cstring(vm, CAR(t));
+		lisp_safe_cstring(vm, CADR(t));
+		b.count++;
+	}
+	if (CDR(args) != lisp_nil) {
+		b.threads = (int)lisp_safe_int(vm, CADR(args));
+		b.threads = MAX(1, MIN(b.threads, VERIFY_MAX_THREADS));
+	}
+
+	if (b.count > 0) {
+		b.jobs = calloc(b.count, sizeof(struct verify_job));
+		CHECK(vm, b.jobs != NULL, "Out of memory");
+	}
+	for (i = 0, p = CAR(args); i < b.count; i++, p = CDR(p)) {
+		Lisp_Object *t = CAR(p);
+		const char *sig = lisp_safe_cstring(vm, CAR(t));
+		const char *md = lisp_safe_cstring(vm, CADR(t));
+		struct parsed_key *pub = object_key(vm, CADDR(t), false);
+		verify_prepare(&b.jobs[i], pub, md, strlen(md), sig);
+	}
+
+	if (b.count > 0)
+		twk_run_blocking(lisp_vm_client(vm), verify_batch_run, &b);
+
+	for (i = 0; i < b.count; i++) {
+		lisp_push(vm, b.jobs[i].ok ? lisp_true : lisp_false);
+		key_release(b.jobs[i].pub);
+	}
+	free(b.jobs);
+	lisp_make_list(vm, b.count);
 }
 
 static void op_hex_encode(Lisp_VM *vm, Lisp_Pair *args)
 {
 	size_t len = 0;
 	const void *data = get_object_bytes(vm, CAR(args), &len);
-	Lisp_Buffer *b = lisp_buffer_new(vm, len*2+1);
-	lisp_push(vm, (Lisp_Object*)b);
-	hexify(data, len, lisp_buffer_data(b));
-	lisp_push(vm, (Lisp_Object*)lisp_string_new(vm, lisp_buffer_data(b), len*2));
-	lisp_push(vm, lisp_pop(vm, 2));
+	Lisp_String *s = lisp_push_string(vm, NULL, len*2);
+	hexify(data, len, (char*)lisp_string_cstr(s));
 }
 
 // TODO should ignore whitespaces
@@ -603,12 +874,10 @@ static void op_hex_decode(Lisp_VM *vm, Lisp_Pair *args)
 
 	Lisp_Buffer *b = lisp_buffer_new(vm, len/2);
 	lisp_push(vm, (Lisp_Object*)b);
-
-	for (unsigned i = 0; i < len; i+=2) {
-		int h = hex_value(s[i]);
-		int l = hex_value(s[i+1]);
-		lisp_buffer_add_byte(b, (h<<4)|l);
-	}
+	long pos = bytes_hex_decode(lisp_buffer_bytes(b), s, len);
+	if (pos >= 0)
+		lisp_err(vm, "hex-decode: bad digit at %ld", pos);
+	lisp_buffer_set_size(b, len/2);
 }
 
 /*
@@ -1299,31 +1568,76 @@ static void op_bitwise_clz(Lisp_VM *vm, Lisp_Pair *args)
 	PUSHX(vm, lisp_number_new(vm, n));
 }
 
-static void op_bitwise_not(Lisp_VM *vm, Lisp_Pair *args)
+/*
+ * (bitwise-not <buffer>)
+ * (bitwise-not! <buffer>) updates <buffer> and returns it.
+ */
+static void bitwise_not(Lisp_VM *vm, Lisp_Pair *args, bool in_place)
 {
 	size_t a_len=0;
-	uint8_t *a = lisp_safe_bytes(vm, CAR(args), &a_len);
-	Lisp_Buffer *r = lisp_buffer_new(vm, a_len);
-	for (unsigned i = 0; i < a_len; i++) {
-		lisp_buffer_add_byte(r, ~a[i]);
+	uint8_t *a;
+	Lisp_Buffer *r;
+	if (in_place) {
+		a = lisp_safe_mutable_bytes(vm, CAR(args), &a_len);
+		r = (Lisp_Buffer*)CAR(args);
+	} else {
+		a = lisp_safe_bytes(vm, CAR(args), &a_len);
+		r = lisp_buffer_new(vm, a_len);
+		lisp_buffer_set_size(r, a_len);
 	}
+	bytes_not(lisp_buffer_bytes(r), a, a_len);
 	PUSHX(vm, r);
 }
 
-static void op_bitwise_and(Lisp_VM *vm, Lisp_Pair *args)
+static void op_bitwise_not(Lisp_VM *vm, Lisp_Pair *args)
+{
+	bitwise_not(vm, args, false);
+}
+
+static void op_bitwise_not_x(Lisp_VM *vm, Lisp_Pair *args)
+{
+	bitwise_not(vm, args, true);
+}
+
+/*
+ * (bitwise-and <a> <b>), likewise for or and xor.
+ * (bitwise-and! <a> <b>) stores the result in <a> and returns it.
+ */
+static void bitwise_binary(Lisp_VM *vm, size_t argv, int argc, const char *name,
+	void (*op)(uint8_t*, const uint8_t*, const uint8_t*, size_t), bool in_place)
 {
 	size_t a_len=0,b_len=0;
-	uint8_t *a = lisp_safe_bytes(vm, CAR(args), &a_len);
-	uint8_t *b = lisp_safe_bytes(vm, CADR(args), &b_len);
+	uint8_t *a;
+	Lisp_Buffer *r;
+	if (argc != 2)
+		lisp_err(vm, "%s: expecting 2 arguments", name);
+	if (in_place)
+		a = lisp_safe_mutable_bytes(vm, lisp_arg(vm, argv, 0), &a_len);
+	else
+		a = lisp_safe_bytes(vm, lisp_arg(vm, argv, 0), &a_len);
+	uint8_t *b = lisp_safe_bytes(vm, lisp_arg(vm, argv, 1), &b_len);
 	if (a_len != b_len)
 		lisp_err(vm, "Not equal bytes: %ld %ld", a_len, b_len);
-	Lisp_Buffer *r = lisp_buffer_new(vm, a_len);
-	for (unsigned i = 0; i < a_len; i++) {
-		lisp_buffer_add_byte(r, a[i] & b[i]);
+	if (in_place) {
+		r = (Lisp_Buffer*)lisp_arg(vm, argv, 0);
+	} else {
+		r = lisp_buffer_new(vm, a_len);
+		lisp_buffer_set_size(r, a_len);
 	}
+	op(lisp_buffer_bytes(r), a, b, a_len);
 	PUSHX(vm, r);
 }
 
+static void op_bitwise_and(Lisp_VM *vm, size_t argv, int argc)
+{
+	bitwise_binary(vm, argv, argc, "bitwise-and", bytes_and, false);
+}
+
+static void op_bitwise_and_x(Lisp_VM *vm, size_t argv, int argc)
+{
+	bitwise_binary(vm, argv, argc, "bitwise-and!", bytes_and, true);
+}
+
 static void op_bitwise_add(Lisp_VM *vm, Lisp_Pair *args)
 {
 	size_t a_len=0,b_len=0;
@@ -1343,67 +1657,38 @@ static void op_bitwise_add(Lisp_VM *vm, Lisp_Pair *args)
 	PUSHX(vm, r);
 }
 
-static void op_bitwise_or(Lisp_VM *vm, Lisp_Pair *args)
+static void op_bitwise_or(Lisp_VM *vm, size_t argv, int argc)
 {
-	size_t a_len=0,b_len=0;
-	uint8_t *a = lisp_safe_bytes(vm, CAR(args), &a_len);
-	uint8_t *b = lisp_safe_bytes(vm, CADR(args), &b_len);
-	if (a_len != b_len)
-		lisp_err(vm, "Not equal bytes: %ld %ld", a_len, b_len);
-	Lisp_Buffer *r = lisp_buffer_new(vm, a_len);
-	for (unsigned i = 0; i < a_len; i++) {
-		lisp_buffer_add_byte(r, a[i] | b[i]);
-	}
-	PUSHX(vm, r);
+	bitwise_binary(vm, argv, argc, "bitwise-or", bytes_or, false);
 }
 
+static void op_bitwise_or_x(Lisp_VM *vm, size_t argv, int argc)
+{
+	bitwise_binary(vm, argv, argc, "bitwise-or!", bytes_or, true);
+}
 
-static void op_bitwise_xor(Lisp_VM *vm, Lisp_Pair *args)
+static void op_bitwise_xor(Lisp_VM *vm, size_t argv, int argc)
 {
-	size_t a_len=0,b_len=0;
-	uint8_t *a = lisp_safe_bytes(vm, CAR(args), &a_len);
-	uint8_t *b = lisp_safe_bytes(vm, CADR(args), &b_len);
-	if (a_len != b_len)
-		lisp_err(vm, "Not equal bytes: %ld %ld", a_len, b_len);
-	Lisp_Buffer *r = lisp_buffer_new(vm, a_len);
-	for (unsigned i = 0; i < a_len; i++) {
-		lisp_buffer_add_byte(r, a[i] ^ b[i]);
-	}
-	PUSHX(vm, r);
+	bitwise_binary(vm, argv, argc, "bitwise-xor", bytes_xor, false);
 }
 
-static void setbits(uint8_t *s, size_t n, int begin, int end, int bit_value)
+static void op_bitwise_xor_x(Lisp_VM *vm, size_t argv, int argc)
 {
-	int i = (begin & ~7);
-	int mask;
-	for (; i < end; i += 8) {
-		if (i < begin)
-		{
-			if (i + 8 <= end) {
-				mask = (0xff >> (begin - i));
-			} else {
-				mask = ((0xff >> (begin-i)) & (0xff << (i+8-end)));
-			}
-		}
-		else
-		{
-			if (i+8 <= end) {
-				mask = 0xff;
-			} else {
-				mask = (0xff <<  (i+8-end));
-			}
-		}
-		if (bit_value == 0)
-			s[i>>3] &= ~mask;
-		else
-			s[i>>3] |= mask;
-	}
+	bitwise_binary(vm, argv, argc, "bitwise-xor!", bytes_xor, true);
 }
 
-static void op_bitwise_setbits(Lisp_VM *vm, Lisp_Pair *args, int bit_value)
+/*
+ * (bitwise-set <buffer> [start] [length]), likewise bitwise-clear.
+ * bitwise-set! and bitwise-clear! update <buffer> and return it.
+ */
+static void op_bitwise_setbits(Lisp_VM *vm, Lisp_Pair *args, int bit_value, bool in_place)
 {
 	size_t a_len=0;
-	uint8_t *a = lisp_safe_bytes(vm, CAR(args), &a_len);
+	uint8_t *a;
+	if (in_place)
+		a = lisp_safe_mutable_bytes(vm, CAR(args), &a_len);
+	else
+		a = lisp_safe_bytes(vm, CAR(args), &a_len);
 	Lisp_Object *oStart = CADR(args);
 	Lisp_Object *oLength = CAR(CDDR(args));
 	int start;
@@ -1421,82 +1706,86 @@ static void op_bitwise_setbits(Lisp_VM *vm, Lisp_Pair *args, int bit_value)
 	if (start < 0 || start >= (int)a_len*8 || len < 0 || len > (int)a_len*8)
 		lisp_err(vm, "Invalid start or length");
 
-	Lisp_Buffer *r = lisp_buffer_copy(vm, a, a_len);
-	setbits(lisp_buffer_bytes(r), lisp_buffer_size(r), start, start+len, bit_value);
+	Lisp_Buffer *r = in_place ? (Lisp_Buffer*)CAR(args) : lisp_buffer_copy(vm, a, a_len);
+	bytes_setbits(lisp_buffer_bytes(r), start, MIN((size_t)start+len, a_len*8), bit_value);
 	PUSHX(vm, r);
 }
 
 static void op_bitwise_clear(Lisp_VM *vm, Lisp_Pair *args)
 {
-	op_bitwise_setbits(vm, args, 0);
+	op_bitwise_setbits(vm, args, 0, false);
 }
 
 static void op_bitwise_set(Lisp_VM *vm, Lisp_Pair *args)
 {
-	op_bitwise_setbits(vm, args, 1);
+	op_bitwise_setbits(vm, args, 1, false);
 }
 
-static uint8_t extract8b(const uint8_t *s, size_t n, int bit_index, int default_bit)
+static void op_bitwise_clear_x(Lisp_VM *vm, Lisp_Pair *args)
 {
-	unsigned i = (bit_index & ~7) / 8;
-	int w = 0;
-	
-	if (i < 0 || i >= n) {
-		w = (default_bit ? 0xff00 : 0x0000);
-	} else {
-		w = ((int)s[i] << 8);
-	}
-	
-	i++;
-	if (i < 0 || i >= n) {
-		w |= (default_bit ? 0x00ff : 0x0000);
-	} else {
-		w |= s[i];
-	}
+	op_bitwise_setbits(vm, args, 0, true);
+}
 
-	w <<= (bit_index & 7);
-	return (uint8_t)(w >> 8);
+static void op_bitwise_set_x(Lisp_VM *vm, Lisp_Pair *args)
+{
+	op_bitwise_setbits(vm, args, 1, true);
 }
 
-// (bitwise-lsl bit-buffer count)
-// Logical shift to left
-static void op_bitwise_lsl(Lisp_VM *vm, Lisp_Pair *args)
+/*
+ * (bitwise-lsl <buffer> <count>)
+ * Logical shift to left, bitwise-lsr to right. bitwise-asr shifts
+ * to right copying the msb. The ! variants update <buffer> and
+ * return it.
+ */
+enum { LSL, LSR, ASR };
+
+static void bitwise_shift(Lisp_VM *vm, Lisp_Pair *args, int how, bool in_place)
 {
 	size_t a_len=0;
-	uint8_t *a = lisp_safe_bytes(vm, CAR(args), &a_len);
-	int n = lisp_safe_int(vm, CADR(args));
-	Lisp_Buffer *r = lisp_buffer_new(vm, a_len);
-	for (unsigned i = 0; i < a_len; i++) {
-		lisp_buffer_add_byte(r, extract8b(a, a_len, i*8+n, 0));
+	uint8_t *a;
+	Lisp_Buffer *r;
+	if (in_place) {
+		a = lisp_safe_mutable_bytes(vm, CAR(args), &a_len);
+		r = (Lisp_Buffer*)CAR(args);
+	} else {
+		a = lisp_safe_bytes(vm, CAR(args), &a_len);
+		r = lisp_buffer_new(vm, a_len);
+		lisp_buffer_set_size(r, a_len);
 	}
+	long n = lisp_safe_int(vm, CADR(args));
+	int fill = how == ASR && a_len > 0 ? (a[0] >> 7) & 1 : 0;
+	bytes_shift(lisp_buffer_bytes(r), a, a_len, how == LSL ? n : -n, fill);
 	PUSHX(vm, r);
 }
 
+static void op_bitwise_lsl(Lisp_VM *vm, Lisp_Pair *args)
+{
+	bitwise_shift(vm, args, LSL, false);
+}
+
 static void op_bitwise_lsr(Lisp_VM *vm, Lisp_Pair *args)
 {
-	size_t a_len=0;
-	uint8_t *a = lisp_safe_bytes(vm, CAR(args), &a_len);
-	int n = lisp_safe_int(vm, CADR(args));
-	Lisp_Buffer *r = lisp_buffer_new(vm, a_len);
-	for (unsigned i = 0; i < a_len; i++) {
-		lisp_buffer_add_byte(r, extract8b(a, a_len, i*8-n, 0));
-	}
-	PUSHX(vm, r);
+	bitwise_shift(vm, args, LSR, false);
 }
 
 static void op_bitwise_asr(Lisp_VM *vm, Lisp_Pair *args)
 {
-	size_t a_len=0;
-	uint8_t *a = lisp_safe_bytes(vm, CAR(args), &a_len);
-	int n = lisp_safe_int(vm, CADR(args));
-	int msb = 0;
-	if (a_len > 0)
-		msb = ((a[0] >> 7) & 1);
-	Lisp_Buffer *r = lisp_buffer_new(vm, a_len);
-	for (unsigned i = 0; i < a_len; i++) {
-		lisp_buffer_add_byte(r, extract8b(a, a_len, i*8-n, msb));
-	}
-	PUSHX(vm, r);
+	bitwise_shift(vm, args, ASR, false);
+}
+
+static void op_bitwise_lsl_x(Lisp_VM *vm, Lisp_Pair *args)
+{
+	bitwise_shift(vm, args, LSL, true);
+}
+
+static void op_bitwise_lsr_x(Lisp_VM *vm, Lisp_Pair *args)
+{
+	bitwise_shift(vm, args, LSR, true);
+}
+
+static void op_bitwise_asr_x(Lisp_VM *vm, Lisp_Pair *args)
+{
+	bitwise_shift(vm, args, ASR, true);
 }
 
 static void op_bitwise_compare(Lisp_VM *vm, Lisp_Pair *args)
@@ -1538,9 +1827,8 @@ static void op_fill_bytes(Lisp_VM *vm, Lisp_Pair *args)
 		b = lisp_safe_int(vm, CADR(args));
 	}
 	Lisp_Buffer *r = lisp_buffer_new(vm, n);
-	for (int i = 0; i < n; i++) {
-		lisp_buffer_add_byte(r, b);
-	}
+	memset(lisp_buffer_bytes(r), b, n);
+	lisp_buffer_set_size(r, n);
 	PUSHX(vm, r);
 }
 
@@ -1552,6 +1840,8 @@ bool lisp_crypto_init(Lisp_VM *vm)
 	lisp_defn(vm, "sha1",                op_sha1);
 	lisp_defn(vm, "ecdsa-sign",          op_ecdsa_sign);
 	lisp_defn(vm, "ecdsa-verify",        op_ecdsa_verify);
+	lisp_defn(vm, "ecdsa-verify-batch",  op_ecdsa_verify_batch);
+	lisp_defn(vm, "secp256k1-key",       op_secp256k1_key);
 	lisp_defn(vm, "ecdh",                op_ecdh);
 	lisp_defn(vm, "hex-encode",          op_hex_encode);
 	lisp_defn(vm, "hex-decode",          op_hex_decode);
@@ -1568,10 +1858,10 @@ bool lisp_crypto_init(Lisp_VM *vm)
 	lisp_defn(vm, "aes-cbc-encrypt",     op_aes_cbc_encrypt);
 	lisp_defn(vm, "aes-cbc-decrypt",     op_aes_cbc_decrypt);
 	lisp_defn(vm, "bitwise-not",         op_bitwise_not);
-	lisp_defn(vm, "bitwise-and",         op_bitwise_and);
+	lisp_defn_stack(vm, "bitwise-and",   op_bitwise_and);
 	lisp_defn(vm, "bitwise-add",         op_bitwise_add);
-	lisp_defn(vm, "bitwise-or",          op_bitwise_or);
-	lisp_defn(vm, "bitwise-xor",         op_bitwise_xor);
+	lisp_defn_stack(vm, "bitwise-or",    op_bitwise_or);
+	lisp_defn_stack(vm, "bitwise-xor",   op_bitwise_xor);
 	lisp_defn(vm, "bitwise-set",         op_bitwise_set);
 	lisp_defn(vm, "bitwise-clear",       op_bitwise_clear);
 	lisp_defn(vm, "bitwise-compare",     op_bitwise_compare);
@@ -1579,6 +1869,15 @@ bool lisp_crypto_init(Lisp_VM *vm)
 	lisp_defn(vm, "bitwise-asr",         op_bitwise_asr);
 	lisp_defn(vm, "bitwise-lsl",         op_bitwise_lsl);
 	lisp_defn(vm, "bitwise-clz",         op_bitwise_clz);
+	lisp_defn(vm, "bitwise-not!",        op_bitwise_not_x);
+	lisp_defn_stack(vm, "bitwise-and!",  op_bitwise_and_x);
+	lisp_defn_stack(vm, "bitwise-or!",   op_bitwise_or_x);
+	lisp_defn_stack(vm, "bitwise-xor!",  op_bitwise_xor_x);
+	lisp_defn(vm, "bitwise-set!",        op_bitwise_set_x);
+	lisp_defn(vm, "bitwise-clear!",      op_bitwise_clear_x);
+	lisp_defn(vm, "bitwise-lsr!",        op_bitwise_lsr_x);
+	lisp_defn(vm, "bitwise-asr!",        op_bitwise_asr_x);
+	lisp_defn(vm, "bitwise-lsl!",        op_bitwise_lsl_x);
 	lisp_defn(vm, "bin-encode",          op_bin_encode);
 	lisp_defn(vm, "bin-decode",          op_bin_decode);
 	lisp_defn(vm, "random-bytes",        op_random_bytes);
@@ -16,9 +16,14 @@
  */
 #include "lisp_fs.h"
 #include "common.h"
+#include "base58.h"
+#include "twk-internal.h"
 #ifndef WIN32
 #include <unistd.h>
 #endif
+#include <pthread.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
 
 struct dir_reader {
 	DIR *dir;
@@ -85,59 +90,733 @@ static bool should_ignore(const char *filename)
     return false;
 }
 
-/* Return base58 encoded sha256 hash of the file at path */
-static void hash_file(Lisp_VM *vm, const char *path)
+/*
+ * Tree scanning
+ *
+ * A scan walks a directory and hashes its files with a few threads,
+ * off the process. Directories and files are jobs of one queue, the
+ * threads take them until none is left or running. Each directory
+ * job only adds to its own node, so the tree needs no lock.
+ *
+ * Hashes are kept by (device, inode, size, mtime), so that files that
+ * did not change are not read again. A scan with a repo directory
+ * loads <repo-dir>/scan-cache once and saves the hashes of the files
+ * it saw when done.
+ */
+#define SCAN_MAX_THREADS 8
+#define SCAN_PATH_MAX 1024
+#define SCAN_READ_SIZE (64*1024)
+#define HASH_CACHE_FILE "scan-cache"
+#define HASH_CACHE_MAGIC "TWKSCAN1"
+#define HASH_CACHE_MAX (1<<20) /* entries kept if not seen by the last scan */
+#define HASH_CACHE_LOADED 16
+
+#ifdef _WIN32
+# define lstat stat
+#endif
+
+struct file_id {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime; // ns
+};
+
+struct hash_cache_entry {
+	struct hash_cache_entry *next;
+	struct file_id id;
+	unsigned scan; // the last scan that saw the file
+	uint8_t hash[SHA256_DIGEST_LENGTH];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct hash_cache_entry **buckets;
+	size_t mask;
+	size_t count;
+	unsigned scans;
+	char *loaded[HASH_CACHE_LOADED]; // cache files read in already
+} hash_cache = {PTHREAD_MUTEX_INITIALIZER};
+
+static size_t file_id_hash(const struct file_id *id)
+{
+	uint64_t h = id->ino * 0x9E3779B97F4A7C15ULL;
+	h ^= id->dev + (h << 6) + (h >> 2);
+	h ^= (uint64_t)id->mtime + (h << 6) + (h >> 2);
+	h ^= id->size + (h << 6) + (h >> 2);
+	return (size_t)(h ^ (h >> 29));
+}
+
+static bool file_id_eq(const struct file_id *a, const struct file_id *b)
 {
+	return a->ino == b->ino && a->dev == b->dev
+	    && a->size == b->size && a->mtime == b->mtime;
+}
 
+/* Under hash_cache.lock */
+static struct hash_cache_entry **hash_cache_find(const struct file_id *id)
+{
+	struct hash_cache_entry **pp;
+	if (!hash_cache.buckets)
+		return NULL;
+	pp = &hash_cache.buckets[file_id_hash(id) & hash_cache.mask];
+	while (*pp && !file_id_eq(&(*pp)->id, id))
+		pp = &(*pp)->next;
+	return pp;
 }
 
-static void build_tree(Lisp_VM *vm, const char *path, const char *repo_dir)
+/* Under hash_cache.lock */
+static void hash_cache_grow(void)
 {
-        int n = 0;
-        printf("build tree: %s\n", path);
-        DIR *dir = opendir(path);
-        if (!dir)
-            goto Done;
-        struct dirent *entry;
-        char buf[256];
-        strcpy(buf, path);
-        strcat(buf, "/");
-        size_t parent_len = strlen(buf);
-
-        while ((entry = readdir(dir))!=NULL) {
-            if (should_ignore(entry->d_name))
-                continue;
-            strcpy(buf+parent_len, entry->d_name);
-            if (entry->d_type == DT_DIR) {
-                build_tree(vm, buf, repo_dir);
-                n++;
-            } else if (entry->d_type == DT_REG){
-                struct stat statbuf;
-                stat(buf, &statbuf);
-
-                PUSHX(vm, lisp_string_new(vm, entry->d_name, strlen(entry->d_name)));
-                hash_file(vm, buf);
-                lisp_cons(vm);
-                
-                n++;
-            }
-        }
+	size_t n = hash_cache.buckets ? (hash_cache.mask + 1) * 2 : 1024;
+	struct hash_cache_entry **b = calloc(n, sizeof(*b));
+	if (!b)
+		return;
+	if (hash_cache.buckets) {
+		for (size_t i = 0; i <= hash_cache.mask; i++) {
+			struct hash_cache_entry *e = hash_cache.buckets[i], *next;
+			for (; e; e = next) {
+				next = e->next;
+				size_t k = file_id_hash(&e->id) & (n - 1);
+				e->next = b[k];
+				b[k] = e;
+			}
+		}
+		free(hash_cache.buckets);
+	}
+	hash_cache.buckets = b;
+	hash_cache.mask = n - 1;
+}
+
+/* Under hash_cache.lock */
+static void hash_cache_put_locked(const struct file_id *id, const uint8_t *hash, unsigned scan)
+{
+	struct hash_cache_entry **pp = hash_cache_find(id);
+	if (pp && *pp) {
+		memcpy((*pp)->hash, hash, SHA256_DIGEST_LENGTH);
+		(*pp)->scan = scan;
+		return;
+	}
+	if (!hash_cache.buckets || hash_cache.count > hash_cache.mask) {
+		hash_cache_grow();
+		if (!hash_cache.buckets)
+			return;
+		pp = hash_cache_find(id);
+	}
+	struct hash_cache_entry *e = malloc(sizeof(*e));
+	if (!e)
+		return;
+	e->next = NULL;
+	e->id = *id;
+	e->scan = scan;
+	memcpy(e->hash, hash, SHA256_DIGEST_LENGTH);
+	*pp = e;
+	hash_cache.count++;
+}
+
+static bool hash_cache_get(const struct file_id *id, uint8_t *hash, unsigned scan)
+{
+	bool found = false;
+	if (id->ino == 0) // no inodes on this file system
+		return false;
+	pthread_mutex_lock(&hash_cache.lock);
+	struct hash_cache_entry **pp = hash_cache_find(id);
+	if (pp && *pp) {
+		memcpy(hash, (*pp)->hash, SHA256_DIGEST_LENGTH);
+		(*pp)->scan = scan;
+		found = true;
+	}
+	pthread_mutex_unlock(&hash_cache.lock);
+	return found;
+}
+
+static void hash_cache_put(const struct file_id *id, const uint8_t *hash, unsigned scan)
+{
+	if (id->ino == 0)
+		return;
+	pthread_mutex_lock(&hash_cache.lock);
+	hash_cache_put_locked(id, hash, scan);
+	pthread_mutex_unlock(&hash_cache.lock);
+}
+
+/* A record of the cache file, native byte order */
+struct hash_cache_record {
+	struct file_id id;
+	uint8_t hash[SHA256_DIGEST_LENGTH];
+};
+
+/* Read in a cache file unless done before. Entries from it are not
+ * counted as seen by the scan. */
+static void hash_cache_load(const char *path)
+{
+	struct hash_cache_record r;
+	char magic[8];
+	int i;
+
+	pthread_mutex_lock(&hash_cache.lock);
+	for (i = 0; i < HASH_CACHE_LOADED && hash_cache.loaded[i]; i++) {
+		if (strcmp(hash_cache.loaded[i], path) == 0)
+			break;
+	}
+	if (i == HASH_CACHE_LOADED || hash_cache.loaded[i]) {
+		pthread_mutex_unlock(&hash_cache.lock);
+		return;
+	}
+	hash_cache.loaded[i] = strdup(path);
+	pthread_mutex_unlock(&hash_cache.lock);
+
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return;
+	if (fread(magic, 1, sizeof(magic), fp) == sizeof(magic)
+	 && memcmp(magic, HASH_CACHE_MAGIC, sizeof(magic)) == 0) {
+		pthread_mutex_lock(&hash_cache.lock);
+		while (fread(&r, sizeof(r), 1, fp) == 1) {
+			struct hash_cache_entry **pp = hash_cache_find(&r.id);
+			if (!pp || !*pp)
+				hash_cache_put_locked(&r.id, r.hash, 0);
+		}
+		pthread_mutex_unlock(&hash_cache.lock);
+	}
+	fclose(fp);
+}
+
+/* Write the entries seen by scan to path, then drop the others if
+ * there are too many. */
+static void hash_cache_save(const char *path, unsigned scan)
+{
+	char tmp[SCAN_PATH_MAX + 8];
+	struct hash_cache_record r;
+	bool ok = true;
+
+	pthread_mutex_lock(&hash_cache.lock);
+	if (path) {
+		snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+		FILE *fp = fopen(tmp, "wb");
+		ok = fp && fwrite(HASH_CACHE_MAGIC, 1, 8, fp) == 8;
+		for (size_t i = 0; ok && hash_cache.buckets && i <= hash_cache.mask; i++) {
+			struct hash_cache_entry *e = hash_cache.buckets[i];
+			for (; ok && e; e = e->next) {
+				if (e->scan != scan)
+					continue;
+				memset(&r, 0, sizeof(r));
+				r.id = e->id;
+				memcpy(r.hash, e->hash, SHA256_DIGEST_LENGTH);
+				ok = fwrite(&r, sizeof(r), 1, fp) == 1;
+			}
+		}
+		if (fp && fclose(fp) != 0)
+			ok = false;
+	}
+	if (hash_cache.count > HASH_CACHE_MAX) {
+		for (size_t i = 0; i <= hash_cache.mask; i++) {
+			struct hash_cache_entry **pp = &hash_cache.buckets[i];
+			while (*pp) {
+				struct hash_cache_entry *e = *pp;
+				if (e->scan != scan) {
+					*pp = e->next;
+					free(e);
+					hash_cache.count--;
+				} else {
+					pp = &e->next;
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&hash_cache.lock);
+	if (path) {
+		if (ok)
+			rename(tmp, path);
+		else
+			unlink(tmp);
+	}
+}
+
+struct scan_node {
+	struct scan_node *parent;
+	struct scan_node *children; // in no order
+	struct scan_node *sibling;
+	struct scan_node *next; // in the job queue, then in the output
+	bool dir;
+	bool hashed;
+	struct file_id id;
+	uint8_t hash[SHA256_DIGEST_LENGTH];
+	char name[1];
+};
+
+struct scan {
+	pthread_mutex_t lock;
+	pthread_cond_t notify;      // jobs, output or done
+	struct scan_node *jobs;
+	int pending;                // jobs queued or running
+	bool cancel;
+	bool done;
+	bool stream;                // found files go to output
+	struct scan_node *output;
+	struct scan_node **output_tail;
+	unsigned stamp;             // to mark the cache entries seen
+	int nthreads;
+	int started;
+	pthread_t tids[SCAN_MAX_THREADS];
+	struct scan_node *root;
+	char *cache_path;           // NULL if not saved
+	char root_path[SCAN_PATH_MAX];
+};
+
+static struct scan_node *scan_node_new(struct scan_node *parent, const char *name,
+	bool dir, const struct stat *sb)
+{
+	size_t len = strlen(name);
+	struct scan_node *node = calloc(1, sizeof(struct scan_node) + len);
+	if (!node)
+		return NULL;
+	node->parent = parent;
+	node->dir = dir;
+	if (sb) {
+		node->id.dev = (uint64_t)sb->st_dev;
+		node->id.ino = (uint64_t)sb->st_ino;
+		node->id.size = (uint64_t)sb->st_size;
+		node->id.mtime = ST_MTIME_NS(*sb);
+	}
+	memcpy(node->name, name, len + 1);
+	if (parent) {
+		node->sibling = parent->children;
+		parent->children = node;
+	}
+	return node;
+}
+
+static void scan_node_free(struct scan_node *node)
+{
+	struct scan_node *c, *next;
+	for (c = node->children; c; c = next) {
+		next = c->sibling;
+		scan_node_free(c);
+	}
+	free(node);
+}
+
+/* The path of node under the root, or with the root if full.
+ * Return its length or -1 if it does not fit. */
+static int scan_node_path(struct scan *s, struct scan_node *node, char *buf, size_t size, bool full)
+{
+	size_t len = 0;
+	struct scan_node *n;
+
+	for (n = node; n->parent; n = n->parent)
+		len += strlen(n->name) + 1;
+	if (full)
+		len += strlen(s->root_path);
+	else if (len > 0)
+		len--; // no leading '/'
+	if (len + 1 > size)
+		return -1;
+	buf[len] = 0;
+	size_t end = len;
+	for (n = node; n->parent; n = n->parent) {
+		size_t k = strlen(n->name);
+		memcpy(buf + end - k, n->name, k);
+		end -= k;
+		if (end > 0)
+			buf[--end] = '/';
+	}
+	if (full)
+		memcpy(buf, s->root_path, strlen(s->root_path));
+	return (int)len;
+}
+
+static void scan_queue(struct scan *s, struct scan_node *node)
+{
+	pthread_mutex_lock(&s->lock);
+	node->next = s->jobs;
+	s->jobs = node;
+	s->pending++;
+	pthread_cond_signal(&s->notify);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void scan_found(struct scan *s, struct scan_node *node)
+{
+	if (!s->stream)
+		return;
+	pthread_mutex_lock(&s->lock);
+	node->next = NULL;
+	*s->output_tail = node;
+	s->output_tail = &node->next;
+	pthread_cond_broadcast(&s->notify);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static bool hash_file(struct scan *s, const char *path, uint8_t *hash)
+{
+	EVP_MD_CTX *md = EVP_MD_CTX_new();
+	FILE *fp = fopen(path, "rb");
+	unsigned char *buf = malloc(SCAN_READ_SIZE);
+	size_t n;
+	bool ok = false;
+
+	if (!md || !fp || !buf || !EVP_DigestInit_ex(md, EVP_sha256(), NULL))
+		goto Done;
+	while (!s->cancel && (n = fread(buf, 1, SCAN_READ_SIZE, fp)) > 0)
+		EVP_DigestUpdate(md, buf, n);
+	if (!s->cancel && !ferror(fp))
+		ok = EVP_DigestFinal_ex(md, hash, NULL) == 1;
 Done:
-        lisp_push(vm, lisp_nil);
-        while (n > 0) {
-            lisp_cons(vm);
-            n--;
-        }
-        if (dir)
-            closedir(dir);
+	EVP_MD_CTX_free(md);
+	if (fp)
+		fclose(fp);
+	free(buf);
+	return ok;
+}
+
+static void scan_dir(struct scan *s, struct scan_node *node)
+{
+	char path[SCAN_PATH_MAX];
+	struct dirent *entry;
+	struct stat sb;
+	int len = scan_node_path(s, node, path, sizeof(path) - 1, true);
+	DIR *dir = len < 0 ? NULL : opendir(path);
+
+	if (node == s->root && s->cache_path)
+		hash_cache_load(s->cache_path); // before any lookup
+	if (!dir)
+		return;
+	path[len++] = '/';
+	while (!s->cancel && (entry = readdir(dir)) != NULL) {
+		if (should_ignore(entry->d_name))
+			continue;
+		if (len + strlen(entry->d_name) + 1 > sizeof(path))
+			continue;
+		strcpy(path + len, entry->d_name);
+		if (lstat(path, &sb) != 0)
+			continue;
+		if (S_ISDIR(sb.st_mode)) {
+			struct scan_node *child = scan_node_new(node, entry->d_name, true, NULL);
+			if (child)
+				scan_queue(s, child);
+		} else if (S_ISREG(sb.st_mode)) {
+			struct scan_node *child = scan_node_new(node, entry->d_name, false, &sb);
+			if (!child)
+				continue;
+			if (hash_cache_get(&child->id, child->hash, s->stamp)) {
+				child->hashed = true;
+				scan_found(s, child);
+			} else {
+				scan_queue(s, child);
+			}
+		}
+	}
+	closedir(dir);
+}
+
+static void scan_file(struct scan *s, struct scan_node *node)
+{
+	char path[SCAN_PATH_MAX];
+	if (scan_node_path(s, node, path, sizeof(path), true) < 0)
+		return;
+	if (hash_file(s, path, node->hash)) {
+		node->hashed = true;
+		hash_cache_put(&node->id, node->hash, s->stamp);
+	}
+	scan_found(s, node);
+}
+
+static void *scan_worker(void *arg)
+{
+	struct scan *s = arg;
+	pthread_mutex_lock(&s->lock);
+	while (!s->cancel && s->pending > 0) {
+		struct scan_node *node = s->jobs;
+		if (!node) {
+			pthread_cond_wait(&s->notify, &s->lock);
+			continue;
+		}
+		s->jobs = node->next;
+		pthread_mutex_unlock(&s->lock);
+
+		if (node->dir)
+			scan_dir(s, node);
+		else
+			scan_file(s, node);
+
+		pthread_mutex_lock(&s->lock);
+		if (--s->pending == 0 && !s->cancel) {
+			pthread_mutex_unlock(&s->lock);
+			hash_cache_save(s->cache_path, s->stamp);
+			pthread_mutex_lock(&s->lock);
+			s->done = true;
+			pthread_cond_broadcast(&s->notify);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+static void scan_start_threads(struct scan *s, int n)
+{
+	for (; n > 0 && s->started < SCAN_MAX_THREADS; n--) {
+		if (pthread_create(&s->tids[s->started], NULL, scan_worker, s) != 0)
+			break;
+		s->started++;
+	}
+}
+
+static void scan_join_threads(struct scan *s)
+{
+	while (s->started > 0)
+		pthread_join(s->tids[--s->started], NULL);
+}
+
+/* The whole scan, on the calling thread and nthreads-1 more */
+static void scan_run(void *arg)
+{
+	struct scan *s = arg;
+	scan_start_threads(s, s->nthreads - 1);
+	scan_worker(s);
+	scan_join_threads(s);
+}
+
+/* Start the scan on threads of its own */
+static void scan_start(struct scan *s)
+{
+	scan_start_threads(s, s->nthreads);
+	if (s->started == 0)
+		scan_worker(s);
+}
+
+/* Wait for output or the end of the scan */
+static void scan_wait(void *arg)
+{
+	struct scan *s = arg;
+	pthread_mutex_lock(&s->lock);
+	while (!s->output && !s->done && !s->cancel)
+		pthread_cond_wait(&s->notify, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void scan_delete(struct scan *s)
+{
+	pthread_mutex_lock(&s->lock);
+	s->cancel = true;
+	pthread_cond_broadcast(&s->notify);
+	pthread_mutex_unlock(&s->lock);
+	scan_join_threads(s);
+	if (s->root)
+		scan_node_free(s->root);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->notify);
+	free(s->cache_path);
+	free(s);
+}
+
+/* (<dir> [repo-dir] [threads]) to a scan, not started */
+static struct scan *scan_new(Lisp_VM *vm, Lisp_Pair *args, bool stream)
+{
+	const char *dir = lisp_safe_cstring(vm, CAR(args));
+	const char *repo_dir = NULL;
+	long nproc = 1;
+	int nthreads = 0;
+	struct stat sb;
+
+	if (CDR(args) != lisp_nil) {
+		Lisp_Object *o = CADR(args);
+		if (o != lisp_nil && o != lisp_false && o != lisp_undef)
+			repo_dir = lisp_safe_cstring(vm, o);
+		if (CDDR(args) != lisp_nil)
+			nthreads = lisp_safe_int(vm, CADDR(args));
+	}
+	if (stat(dir, &sb) != 0 || !S_ISDIR(sb.st_mode))
+		lisp_err(vm, "scan-tree: can not open directory: %s", dir);
+	if (strlen(dir) + 1 > SCAN_PATH_MAX
+	 || (repo_dir && strlen(repo_dir) + sizeof(HASH_CACHE_FILE) + 1 > SCAN_PATH_MAX))
+		lisp_err(vm, "scan-tree: path too long");
+#ifndef _WIN32
+	nproc = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (nthreads <= 0)
+		nthreads = (int)MAX(2, nproc); // some of them wait for the disk
+
+	struct scan *s = calloc(1, sizeof(struct scan));
+	CHECK(vm, s != NULL, "Out of memory");
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->notify, NULL);
+	s->stream = stream;
+	s->output_tail = &s->output;
+	s->nthreads = MIN(nthreads, SCAN_MAX_THREADS);
+	strcpy(s->root_path, dir);
+	for (size_t n = strlen(dir); n > 1 && s->root_path[n-1] == '/'; n--)
+		s->root_path[n-1] = 0;
+	if (repo_dir) {
+		s->cache_path = malloc(SCAN_PATH_MAX);
+		if (s->cache_path)
+			snprintf(s->cache_path, SCAN_PATH_MAX, "%s/%s", repo_dir, HASH_CACHE_FILE);
+	}
+	pthread_mutex_lock(&hash_cache.lock);
+	s->stamp = ++hash_cache.scans;
+	pthread_mutex_unlock(&hash_cache.lock);
+	s->root = scan_node_new(NULL, "", true, NULL);
+	if (!s->root) {
+		scan_delete(s);
+		lisp_err(vm, "Out of memory");
+	}
+	s->root->next = NULL;
+	s->jobs = s->root;
+	s->pending = 1;
+	return s;
 }
 
+static void push_hash(Lisp_VM *vm, struct scan_node *node)
+{
+	char b58[64];
+	if (node->hashed) {
+		size_t n = base58_encode(node->hash, SHA256_DIGEST_LENGTH, b58, sizeof(b58));
+		PUSHX(vm, lisp_string_new(vm, b58, n));
+	} else {
+		lisp_push(vm, lisp_false);
+	}
+}
 
+static int scan_node_cmp(const void *a, const void *b)
+{
+	return strcmp((*(struct scan_node**)a)->name, (*(struct scan_node**)b)->name);
+}
+
+/* The entries of node by name. The caller frees the scan on error. */
+static void build_tree(Lisp_VM *vm, struct scan_node *node)
+{
+	struct scan_node *c, **v;
+	int n = 0, i;
+
+	for (c = node->children; c; c = c->sibling)
+		n++;
+	v = malloc(sizeof(*v) * (n + 1));
+	CHECK(vm, v != NULL, "Out of memory");
+	for (i = 0, c = node->children; c; c = c->sibling)
+		v[i++] = c;
+	qsort(v, n, sizeof(*v), scan_node_cmp);
+	// Children are kept in order now, v can go
+	node->children = NULL;
+	while (i > 0) {
+		v[--i]->sibling = node->children;
+		node->children = v[i];
+	}
+	free(v);
+
+	for (c = node->children; c; c = c->sibling) {
+		PUSHX(vm, lisp_string_new(vm, c->name, strlen(c->name)));
+		if (c->dir)
+			build_tree(vm, c);
+		else
+			push_hash(vm, c);
+		lisp_cons(vm);
+	}
+	lisp_make_list(vm, n);
+}
+
+/*
+ * (fs-scan-tree <dir> [repo-dir] [threads])
+ *
+ * Return the entries of dir by name, (name . hash) for a file, with
+ * hash the base58 encoded SHA-256 of its content or false if it can
+ * not be read, and (name . entries) for a directory. Hashes are saved
+ * in repo-dir if given.
+ */
 static void op_scan_tree(Lisp_VM*vm, Lisp_Pair*args)
 {
-    const char *dir = lisp_safe_cstring(vm, CAR(args));
-    const char *repo_dir = lisp_safe_cstring(vm, CADR(args));
-    build_tree(vm, dir, repo_dir);
+	jmp_buf jbuf;
+	struct scan *s = scan_new(vm, args, false);
+
+	twk_run_blocking(lisp_vm_client(vm), scan_run, s);
+
+	jmp_buf *old = lisp_vm_set_error_trap(vm, &jbuf);
+	if (setjmp(jbuf) == 0) {
+		build_tree(vm, s->root);
+	} else {
+		scan_delete(s);
+		lisp_vm_resume_error(vm, old);
+	}
+	lisp_vm_set_error_trap(vm, old);
+	scan_delete(s);
+}
+
+struct scanner {
+	struct scan *scan;
+};
+
+static void scanner_close(Lisp_VM *vm, void *ctx)
+{
+	struct scanner *x = ctx;
+	if (x->scan) {
+		scan_delete(x->scan);
+		x->scan = NULL;
+	}
+}
+
+static struct lisp_object_ex_class_t scanner_class = {
+	.name = "scanner",
+	.size = sizeof(struct scanner),
+	.finalize = scanner_close
+};
+
+/*
+ * (fs-open-scan <dir> [repo-dir] [threads])
+ *
+ * Scan like fs-scan-tree, in the background. Files are returned
+ * by fs-scan-next as they are done.
+ */
+static void op_open_scan(Lisp_VM *vm, Lisp_Pair *args)
+{
+	struct scan *s = scan_new(vm, args, true);
+	struct scanner *x = lisp_object_ex_ptr(lisp_make_object_ex(vm, &scanner_class));
+	x->scan = s;
+	scan_start(s);
+}
+
+/*
+ * (fs-scan-next <scanner>)
+ *
+ * Return the next file found as (path size mtime . hash), with path
+ * under dir, or nil when the scan is done.
+ */
+static void op_scan_next(Lisp_VM *vm, Lisp_Pair *args)
+{
+	char path[SCAN_PATH_MAX];
+	Lisp_Object *o = CAR(args);
+	struct scan_node *node;
+
+	if (lisp_object_ex_class(o) != &scanner_class)
+		lisp_err(vm, "not scanner object");
+	struct scan *s = ((struct scanner*)lisp_object_ex_ptr(o))->scan;
+	if (!s) {
+		lisp_push(vm, lisp_nil);
+		return;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	while (!(node = s->output) && !s->done) {
+		pthread_mutex_unlock(&s->lock);
+		twk_run_blocking(lisp_vm_client(vm), scan_wait, s);
+		pthread_mutex_lock(&s->lock);
+	}
+	if (node) {
+		s->output = node->next;
+		if (!s->output)
+			s->output_tail = &s->output;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if (!node) {
+		lisp_push(vm, lisp_nil);
+		return;
+	}
+	int len = scan_node_path(s, node, path, sizeof(path), false);
+	PUSHX(vm, lisp_string_new(vm, path, MAX(len, 0)));
+	lisp_push_number(vm, (double)node->id.size);
+	lisp_push_number(vm, (double)(node->id.mtime / 1000000000));
+	push_hash(vm, node);
+	lisp_cons(vm);
+	lisp_cons(vm);
+	lisp_cons(vm);
 }
 
 static void op_opendir(Lisp_VM *vm, Lisp_Pair *args)
@@ -427,6 +1106,8 @@ void lisp_fs_init(Lisp_VM *vm)
 	lisp_defn(vm, "read-file", op_read_file);
 	lisp_defn(vm, "filesize", op_file_size);
 	lisp_defn(vm, "rename", op_rename);
-    lisp_defn(vm, "fs-scan-tree", op_scan_tree);
+	lisp_defn(vm, "fs-scan-tree", op_scan_tree);
+	lisp_defn(vm, "fs-open-scan", op_open_scan);
+	lisp_defn(vm, "fs-scan-next", op_scan_next);
 	lisp_defn(vm, "unlink", op_unlink);
 }
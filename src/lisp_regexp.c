@@ -14,24 +14,114 @@
  * You should have received a copy of the GNU Affero General Public License
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
+#include <pthread.h>
 #include "common.h"
 #include "regexp.h"
 
+#define REGEXP_MAX_GROUPS 16
+#define REGEXP_MAX_ERROR  256
+
+/*
+ * Compiled patterns are cached by their text and options, so code
+ * compiling the same patterns for every request or line, or passing
+ * them as strings to regexp-match, gets the program back with the
+ * DFA it has built so far. An entry is taken out while a regexp
+ * object or a match uses it and put back after; a run on another
+ * thread wanting the same pattern meanwhile compiles its own copy.
+ */
+#define REGEXP_CACHE_SIZE 64
+
+struct cached_regexp {
+	struct cached_regexp *next;
+	char *pattern;
+	int opts;
+	struct regexp_vm *re_vm;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cached_regexp *cache; // most recently used first
+static int cache_count;
+
+static void delete_cached(struct cached_regexp *c)
+{
+	regexp_vm_delete(c->re_vm); // and the program
+	free(c->pattern);
+	free(c);
+}
+
+/* Take the pattern from the cache or compile it. NULL on errors,
+ * which are described in msg. */
+static struct cached_regexp *take_regexp(const char *pattern, int opts,
+  char *msg)
+{
+	struct cached_regexp **pp, *c = NULL;
+	pthread_mutex_lock(&cache_lock);
+	for (pp = &cache; *pp; pp = &(*pp)->next) {
+		if ((*pp)->opts == opts && strcmp((*pp)->pattern, pattern) == 0) {
+			c = *pp;
+			*pp = c->next;
+			cache_count--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	if (c)
+		return c;
+
+	char *errmsg = NULL;
+	struct regexp_program *prog = regexp_compile(pattern, opts, &errmsg);
+	if (!prog) {
+		snprintf(msg, REGEXP_MAX_ERROR, "Bad regexp: %s",
+			errmsg ? errmsg : "Unkown error");
+		free(errmsg);
+		return NULL;
+	}
+	c = calloc(1, sizeof(struct cached_regexp));
+	if (c && (c->pattern = strdup(pattern)))
+		c->re_vm = regexp_vm_create(prog);
+	if (!c || !c->re_vm) {
+		if (c)
+			free(c->pattern);
+		free(c);
+		regexp_program_delete(prog);
+		snprintf(msg, REGEXP_MAX_ERROR, "Can not create regexp vm");
+		return NULL;
+	}
+	c->opts = opts;
+	return c;
+}
+
+static void put_regexp(struct cached_regexp *c)
+{
+	struct cached_regexp *evicted = NULL;
+	pthread_mutex_lock(&cache_lock);
+	c->next = cache;
+	cache = c;
+	if (++cache_count > REGEXP_CACHE_SIZE) {
+		struct cached_regexp **pp = &cache;
+		while ((*pp)->next)
+			pp = &(*pp)->next;
+		evicted = *pp;
+		*pp = NULL;
+		cache_count--;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	if (evicted)
+		delete_cached(evicted);
+}
 
 struct regexp_object {
 	Lisp_VM *vm;
-	struct regexp_program *re_prog;
-	struct regexp_vm *re_vm;
+	struct cached_regexp *re;
 };
 
 static void regexp_object_finalize(Lisp_VM *vm, void *ctx)
 {
 	struct regexp_object *o = ctx;
 	if (o) {
-		if (o->re_vm) {
-			regexp_vm_delete(o->re_vm);
-			o->re_vm = NULL;
-			o->re_prog = NULL; // Auto deleted
+		if (o->re) {
+			put_regexp(o->re);
+			o->re = NULL;
 		}
 	}	
 }
@@ -54,32 +144,36 @@ static struct regexp_object* re_obj(Lisp_Object *o)
 static void op_regexp_compile(Lisp_VM *vm, Lisp_Pair *args)
 {
 	const char *s = lisp_safe_cstring(vm, CAR(args));
+	char msg[REGEXP_MAX_ERROR];
+	struct cached_regexp *re = take_regexp(s, REGEXP_COMPOPT_UNANCHORED, msg);
+	if (!re)
+		lisp_err(vm, "%s", msg);
 	Lisp_Object *o = lisp_make_object_ex(vm, &regexp_class);
 	struct regexp_object *x = re_obj(o);
-	char *errmsg = NULL;
 	x->vm = vm;
-	x->re_prog = regexp_compile(s, REGEXP_COMPOPT_UNANCHORED, &errmsg);
-	if (x->re_prog == NULL) {
-		lisp_err(vm, "Bad regexp: %s", errmsg?errmsg:"Unkown error");
-	}
-	x->re_vm = regexp_vm_create(x->re_prog);
-	if (x->re_vm == NULL) {
-		lisp_err(vm, "Can not create regexp vm");
-	}
+	x->re = re;
 }
 
-// (regexp-match <regexp-object|string> input-string &optional start-pos)
-static void op_regexp_match(Lisp_VM *vm, Lisp_Pair *args)
+/*
+ * Run on the regexp of (<regexp-object|string> input-string &optional
+ * start-pos), taken from the cache for a string. With groups, the
+ * match and its groups are written to (pos . len) pairs of m, and
+ * their count returned, 0 if there is no match. Without, return 1
+ * for a match.
+ */
+static int match(Lisp_VM *vm, Lisp_Pair *args, int (*m)[2])
 {
 	struct regexp_object *x = NULL;
+	struct cached_regexp *re;
 	int start_pos = 0;
+	const char *pattern = NULL;
 	if (lisp_string_p(CAR(args))) {
-		op_regexp_compile(vm, args);
-		x = re_obj(lisp_top(vm, 0));
+		pattern = lisp_string_cstr((Lisp_String*)CAR(args));
 	} else if ((x=re_obj(CAR(args)))) {
 		if (x->vm != vm)
 			lisp_err(vm, "Not in same vm");
-		lisp_push(vm, CAR(args));
+		if (!x->re)
+			lisp_err(vm, "Bad regexp");
 	} else {
 		lisp_err(vm, "Bad argument");
 	}
@@ -88,34 +182,69 @@ static void op_regexp_match(Lisp_VM *vm, Lisp_Pair *args)
 	if (lisp_nil != CDR(args)) {
 		start_pos = lisp_safe_int(vm, CADR(args));
 	}
-	assert(x != NULL);
-	regexp_vm_set_string_input(x->re_vm, s);
-	regexp_vm_reset(x->re_vm);
-	regexp_vm_set_current_pos(x->re_vm, start_pos);
-	int ret = regexp_vm_exec(x->re_vm);
-	if (ret == REGEXP_VM_MATCH) {
-		int i;
-		for (i = 0; true; i++) {
-			int len;
-			int pos = regexp_vm_get_match(x->re_vm, i, &len);
-			if (pos < 0) 
+	if (start_pos < 0 || (size_t)start_pos > strlen(s))
+		lisp_err(vm, "Bad start position: %d", start_pos);
+
+	if (pattern) {
+		char msg[REGEXP_MAX_ERROR];
+		if (!(re = take_regexp(pattern, REGEXP_COMPOPT_UNANCHORED, msg)))
+			lisp_err(vm, "%s", msg);
+	} else {
+		re = x->re;
+	}
+
+	// Nothing may raise errors until re is back
+	int n = 0;
+	regexp_vm_set_string_input(re->re_vm, s);
+	regexp_vm_reset(re->re_vm);
+	regexp_vm_set_current_pos(re->re_vm, start_pos);
+	int ret = regexp_vm_test(re->re_vm);
+	if (ret == REGEXP_VM_MATCH && m) {
+		// Now find out where
+		regexp_vm_reset(re->re_vm);
+		regexp_vm_set_current_pos(re->re_vm, start_pos);
+		ret = regexp_vm_exec(re->re_vm);
+		for (; ret == REGEXP_VM_MATCH && n < REGEXP_MAX_GROUPS; n++) {
+			m[n][0] = regexp_vm_get_match(re->re_vm, n, &m[n][1]);
+			if (m[n][0] < 0) 
 				break;
-			lisp_push_number(vm, pos);
-			lisp_push_number(vm, len);
-			lisp_cons(vm);
-		}
-		if (i > 0) {
-			lisp_make_list(vm, i);
-		} else {
-			lisp_push(vm, lisp_false);
 		}
-	} else if (ret == REGEXP_VM_ERROR) {
+	} else if (ret == REGEXP_VM_MATCH) {
+		n = 1;
+	}
+	if (pattern)
+		put_regexp(re);
+
+	if (ret == REGEXP_VM_ERROR)
 		lisp_err(vm, "Fatal regexp vm error");
+	return n;
+}
+
+// (regexp-match <regexp-object|string> input-string &optional start-pos)
+static void op_regexp_match(Lisp_VM *vm, Lisp_Pair *args)
+{
+	int m[REGEXP_MAX_GROUPS][2];
+	int n = match(vm, args, m);
+	for (int i = 0; i < n; i++) {
+		lisp_push_number(vm, m[i][0]);
+		lisp_push_number(vm, m[i][1]);
+		lisp_cons(vm);
+	}
+	if (n > 0) {
+		lisp_make_list(vm, n);
 	} else {
 		lisp_push(vm, lisp_false);
 	}
-	lisp_exch(vm);
-	lisp_pop(vm, 1);
+}
+
+/*
+ * (regexp-match? <regexp-object|string> input-string &optional start-pos)
+ * True if there is a match. Cheaper than regexp-match, which has to
+ * find out where the match and its groups are.
+ */
+static void op_regexp_match_p(Lisp_VM *vm, Lisp_Pair *args)
+{
+	lisp_push(vm, match(vm, args, NULL) > 0 ? lisp_true : lisp_false);
 }
 
 static void op_regexp_p(Lisp_VM *vm, Lisp_Pair *args)
@@ -129,5 +258,6 @@ bool lisp_regexp_init(Lisp_VM *vm)
 	lisp_defn(vm, "regexp?", op_regexp_p);
 	lisp_defn(vm, "regexp-compile", op_regexp_compile);
 	lisp_defn(vm, "regexp-match", op_regexp_match);
+	lisp_defn(vm, "regexp-match?", op_regexp_match_p);
 	return true;
 }
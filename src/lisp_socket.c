@@ -14,6 +14,9 @@
  * You should have received a copy of the GNU Affero General Public License
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
+#if defined(__linux__)
+# define _GNU_SOURCE /* accept4 */
+#endif
 #include <stdio.h>
 #include <fcntl.h>
 
@@ -39,6 +42,12 @@
 # include <arpa/inet.h>
 # include <netdb.h>
 
+#endif
+#if defined(__linux__)
+# include <sys/sendfile.h>
+# define HAVE_MMSG /* recvmmsg() and sendmmsg() */
+#elif defined(__APPLE__)
+# include <sys/uio.h>
 #endif
 #include <openssl/evp.h>
 
@@ -55,13 +64,35 @@
 	sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6))
 
 #define UDP_BUFFER_SIZE 4096
+#define UDP_BATCH_SIZE 64 /* Datagrams per recvmmsg() or sendmmsg() */
 #define SECURE_SOCKET_BUFFER_SIZE 4096
+#define RECORD_HEADER_SIZE 4 /* Big endian length of the ciphertext */
+#define RECORD_TAG_SIZE 16
+#define RECORD_OVERHEAD (RECORD_HEADER_SIZE + RECORD_TAG_SIZE)
+#define RECORD_NONCE_SIZE 12
+#define DEFAULT_RECORD_SIZE 16384
+#define MIN_RECORD_SIZE 1024
+#define MAX_RECORD_SIZE 65536
+#define RECORD_BATCH_SIZE (128*1024) /* Records gathered per send */
+#define SENDFILE_CHUNK_SIZE (1024*1024) /* Bytes sent per sendfile() call */
+#define MAX_IOVECS 8 /* Pieces of a gather write */
+#define ACCEPT_BUFFER_SIZE 4096 /* Clients accepted per read */
+#define ACCEPT_ENTRY_SIZE 80 /* (<fd> "<ipv6>" <port>) */
 
 struct socket_stream {
 	int sockfd;
 	struct timeval timeout;
 	EVP_CIPHER_CTX *ctx;
 	uint8_t *buf;
+	struct twk_process *proc; // waits in twk_wait_fd() for sockfd
+	/* Records, see set-stream-cipher */
+	size_t record_size; // plaintext bytes per record written
+	size_t cap;         // of buf
+	size_t pending;     // decrypted bytes in buf not read yet
+	size_t pending_pos;
+	uint64_t seq;       // records done so far, forms the nonce
+	uint8_t iv[RECORD_NONCE_SIZE];
+	bool failed;        // bad record, or cut in the middle
 };
 
 /* ----------------------------------------- */
@@ -146,30 +177,64 @@ static bool ss_init(struct sockaddr_storage* ss, const char *ip, uint16_t port)
  * --------------------------------------------------------
  */
 
+/*
+ * Socket ports are non-blocking. Instead of blocking in recv() or
+ * send(), the process waits in twk_wait_fd() and retries once the
+ * socket is ready, until the stream timeout is over.
+ */
+static void set_nonblocking(int sockfd)
+{
+#ifdef _WIN32
+	u_long on = 1;
+	ioctlsocket(sockfd, FIONBIO, &on);
+#else
+	int flags = fcntl(sockfd, F_GETFL);
+	if (flags >= 0)
+		fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+static bool would_block(void)
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+static bool wait_socket(struct socket_stream *stream, bool write, double deadline)
+{
+	double secs = deadline - microtime();
+	if (secs <= 0)
+		return false;
+	twk_wait_fd(stream->proc, stream->sockfd, write, secs);
+	return true;
+}
+
+static double stream_deadline(struct socket_stream *stream)
+{
+	return microtime() + stream->timeout.tv_sec + stream->timeout.tv_usec / 1e6;
+}
+
 static size_t socket_read(void *context, void *buf, size_t size)
 {
 	struct socket_stream *stream = context;
-	fd_set rset;
-	int sockfd = stream->sockfd;
-	int maxfd = sockfd + 1;
-	int n = 0;
-	struct timeval timeout;
-	FD_ZERO(&rset);
-	FD_SET(sockfd, &rset);
-	memcpy(&timeout, &stream->timeout, sizeof(timeout));
-	select(maxfd, &rset, NULL, NULL, &timeout);
-	if (FD_ISSET(sockfd, &rset)) {
-		n = (int)recv(sockfd, buf, size, 0);
-		//fprintf(stderr, "[%d]", n);
-		if (n < 0)
-			n = 0;
+	double deadline = stream_deadline(stream);
+	while (true) {
+		int n = (int)recv(stream->sockfd, buf, size, 0);
+		if (n >= 0)
+			return n;
+		if (!would_block() || !wait_socket(stream, false, deadline))
+			return 0;
 	}
-	return n;
 }
 
 static size_t socket_write(void *context, const void *buf, size_t size)
 {
 	struct socket_stream *stream = context;
+	double deadline = stream_deadline(stream);
+	size_t nsent = 0;
 #if 0
 	fprintf(stderr, "socket writer: %d: %d bytes\n", stream->sockfd, (int)size);
 	if (size < 32) {
@@ -184,10 +249,102 @@ static size_t socket_write(void *context, const void *buf, size_t size)
 		printf("\n");
 	}
 #endif
-	int n = (int)send(stream->sockfd, buf, size, MSG_NOSIGNAL);
-	if (n < 0)
-		n = 0;
-	return n;
+	// Callers do not retry short writes, so send all of it
+	while (nsent < size) {
+		int n = (int)send(stream->sockfd, (const char*)buf + nsent,
+			size - nsent, MSG_NOSIGNAL);
+		if (n > 0)
+			nsent += n;
+		else if (n == 0 || !would_block() || !wait_socket(stream, true, deadline))
+			return 0;
+	}
+	return nsent;
+}
+
+/*
+ * Gather write, so that a response buffered in the port and a body
+ * it refers to leave in one call.
+ */
+static size_t socket_writev(void *context, const struct lisp_iovec *iov, int count)
+{
+	size_t total = 0;
+#ifndef _WIN32
+	struct socket_stream *stream = context;
+	double deadline = stream_deadline(stream);
+	struct iovec v[MAX_IOVECS];
+	struct msghdr msg;
+
+	if (count <= MAX_IOVECS) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = v;
+		for (int i = 0; i < count; i++) {
+			if (iov[i].len == 0)
+				continue;
+			v[msg.msg_iovlen].iov_base = (void*)iov[i].base;
+			v[msg.msg_iovlen].iov_len = iov[i].len;
+			msg.msg_iovlen++;
+		}
+		while (msg.msg_iovlen > 0) {
+			ssize_t n = sendmsg(stream->sockfd, &msg, MSG_NOSIGNAL);
+			if (n > 0) {
+				total += n;
+				// Skip what went out
+				while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+					n -= msg.msg_iov->iov_len;
+					msg.msg_iov++;
+					msg.msg_iovlen--;
+				}
+				if (msg.msg_iovlen > 0) {
+					msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + n;
+					msg.msg_iov->iov_len -= n;
+				}
+			} else if (n == 0 || !would_block() || !wait_socket(stream, true, deadline)) {
+				break;
+			}
+		}
+		return total;
+	}
+#endif
+	for (int i = 0; i < count; i++) {
+		size_t n = socket_write(context, iov[i].base, iov[i].len);
+		total += n;
+		if (n < iov[i].len)
+			break;
+	}
+	return total;
+}
+
+/*
+ * Let the kernel send file bytes, for pump. The timeout restarts
+ * whenever some bytes went out, a large file may take longer.
+ */
+static size_t socket_sendfile(void *context, int fd, long offset, size_t size)
+{
+#if defined(__linux__) || defined(__APPLE__)
+	struct socket_stream *stream = context;
+	double deadline = stream_deadline(stream);
+	size_t nsent = 0;
+	while (nsent < size) {
+		size_t len = MIN(size - nsent, SENDFILE_CHUNK_SIZE);
+#if defined(__linux__)
+		off_t off = offset + (off_t)nsent;
+		ssize_t n = sendfile(stream->sockfd, fd, &off, len);
+#else
+		off_t m = (off_t)len;
+		int rc = sendfile(fd, stream->sockfd, offset + (off_t)nsent, &m, NULL, 0);
+		ssize_t n = m > 0 ? (ssize_t)m : (rc == 0 ? 0 : -1);
+#endif
+		if (n > 0) {
+			nsent += n;
+			deadline = stream_deadline(stream);
+		} else if (n == 0 || !would_block() || !wait_socket(stream, true, deadline)) {
+			break; // end of file, or an error
+		}
+	}
+	return nsent;
+#else
+	return 0;
+#endif
 }
 
 static bool socket_ready(void *context, int mode)
@@ -219,17 +376,27 @@ struct lisp_stream_class_t socket_stream_class = {
 	.context_size = sizeof(struct socket_stream),
 	.read = socket_read,
 	.write = socket_write,
-    .ready = socket_ready
+    .ready = socket_ready,
+	.sendfile = socket_sendfile,
+	.writev = socket_writev
 };
 
+/*
+ * Output is fully buffered and leaves on flush, or when the buffer
+ * fills up, rather than line by line.
+ */
 Lisp_Port* lisp_open_socket_output(Lisp_VM *vm, int sockfd, int timeout)
 {
-	lisp_push_buffer(vm, NULL, 512);
+	lisp_push_buffer(vm, NULL, 4096);
 	Lisp_Stream *stream = lisp_push_stream(vm, &socket_stream_class, NULL);
 	struct socket_stream *t = lisp_stream_context(stream);
 	t->sockfd = sockfd;
 	t->timeout.tv_sec = timeout;
-	return lisp_make_output_port(vm);
+	t->proc = lisp_vm_client(vm);
+	set_nonblocking(sockfd);
+	Lisp_Port *port = lisp_make_output_port(vm);
+	lisp_port_set_full_buf(port, true);
+	return port;
 }
 
 Lisp_Port* lisp_open_socket_input(Lisp_VM *vm, int sockfd, int timeout)
@@ -239,6 +406,8 @@ Lisp_Port* lisp_open_socket_input(Lisp_VM *vm, int sockfd, int timeout)
 	struct socket_stream *t = lisp_stream_context(stream);
 	t->sockfd = sockfd;
 	t->timeout.tv_sec = timeout;
+	t->proc = lisp_vm_client(vm);
+	set_nonblocking(sockfd);
 	return lisp_make_input_port(vm);
 }
 
@@ -314,6 +483,216 @@ struct lisp_stream_class_t secure_socket_stream_class = {
     .ready = socket_ready
 };
 
+/* --------------------------------------------------------
+ * Records
+ *
+ * With an AEAD cipher the stream is cut into records:
+ *
+ *     <length:4> <ciphertext:length> <tag:16>
+ *
+ * The length is authenticated along with the record. The nonce is
+ * the iv xor'ed with the record number, and with a direction bit in
+ * its first byte for records sent by the server side, so that both
+ * directions can share a key and iv. Records are decrypted in place
+ * in the port buffer, when it can hold them, and encrypted straight
+ * into the batch that goes to send().
+ * --------------------------------------------------------
+ */
+static void record_nonce(struct socket_stream *stream, uint8_t *nonce)
+{
+	memcpy(nonce, stream->iv, RECORD_NONCE_SIZE);
+	for (int i = 0; i < 8; i++)
+		nonce[RECORD_NONCE_SIZE - 1 - i] ^= (uint8_t)(stream->seq >> (i * 8));
+	stream->seq++;
+}
+
+static bool read_all(struct socket_stream *stream, uint8_t *buf, size_t size)
+{
+	size_t n = 0;
+	while (n < size) {
+		size_t k = socket_read(stream, buf + n, size - n);
+		if (k == 0)
+			return false;
+		n += k;
+	}
+	return true;
+}
+
+/* Decrypt the next record into buf, return its length */
+static size_t read_record(struct socket_stream *stream, uint8_t *buf, size_t size)
+{
+	uint8_t hdr[RECORD_HEADER_SIZE];
+	uint8_t nonce[RECORD_NONCE_SIZE];
+	int outlen = 0;
+
+	if (!read_all(stream, hdr, RECORD_HEADER_SIZE))
+		return 0;
+	size_t len = ((size_t)hdr[0] << 24) | ((size_t)hdr[1] << 16)
+		| ((size_t)hdr[2] << 8) | hdr[3];
+	if (len == 0 || len > MAX_RECORD_SIZE || len + RECORD_TAG_SIZE > size)
+		goto Fail;
+	if (!read_all(stream, buf, len + RECORD_TAG_SIZE))
+		goto Fail;
+
+	record_nonce(stream, nonce);
+	if (!EVP_DecryptInit_ex(stream->ctx, NULL, NULL, NULL, nonce)
+	    || !EVP_DecryptUpdate(stream->ctx, NULL, &outlen, hdr, RECORD_HEADER_SIZE)
+	    || !EVP_DecryptUpdate(stream->ctx, buf, &outlen, buf, (int)len)
+	    || !EVP_CIPHER_CTX_ctrl(stream->ctx, EVP_CTRL_AEAD_SET_TAG,
+	                            RECORD_TAG_SIZE, buf + len)
+	    || EVP_DecryptFinal_ex(stream->ctx, buf + outlen, &outlen) <= 0)
+		goto Fail;
+	return len;
+Fail:
+	stream->failed = true;
+	return 0;
+}
+
+static size_t record_socket_read(void *context, void *buf, size_t size)
+{
+	struct socket_stream *stream = context;
+
+	if (stream->pending_pos == stream->pending && !stream->failed) {
+		// Whole record in the port buffer, the usual case
+		if (size >= MAX_RECORD_SIZE + RECORD_TAG_SIZE)
+			return read_record(stream, buf, size);
+		stream->pending = read_record(stream, stream->buf, stream->cap);
+		stream->pending_pos = 0;
+	}
+	size_t n = MIN(size, stream->pending - stream->pending_pos);
+	memcpy(buf, stream->buf + stream->pending_pos, n);
+	stream->pending_pos += n;
+	return n;
+}
+
+static bool flush_records(struct socket_stream *stream)
+{
+	size_t n = stream->pending;
+	stream->pending = 0;
+	return n == 0 || socket_write(stream, stream->buf, n) == n;
+}
+
+/*
+ * Encrypt the pieces into records of at most record_size bytes.
+ * A record may span pieces. Records are sent in batches.
+ */
+static size_t write_records(struct socket_stream *stream,
+  const struct lisp_iovec *iov, int count)
+{
+	size_t total = 0;
+	size_t left = 0;
+	const uint8_t *p = NULL;
+	int i = 0;
+
+	for (int j = 0; j < count; j++)
+		left += iov[j].len;
+
+	while (left > 0) {
+		size_t len = MIN(left, stream->record_size);
+		if (stream->cap - stream->pending < len + RECORD_OVERHEAD
+		    && !flush_records(stream))
+			return total;
+
+		uint8_t *hdr = stream->buf + stream->pending;
+		uint8_t *out = hdr + RECORD_HEADER_SIZE;
+		uint8_t nonce[RECORD_NONCE_SIZE];
+		int outlen = 0;
+		hdr[0] = (uint8_t)(len >> 24);
+		hdr[1] = (uint8_t)(len >> 16);
+		hdr[2] = (uint8_t)(len >> 8);
+		hdr[3] = (uint8_t)len;
+		record_nonce(stream, nonce);
+		if (!EVP_EncryptInit_ex(stream->ctx, NULL, NULL, NULL, nonce)
+		    || !EVP_EncryptUpdate(stream->ctx, NULL, &outlen, hdr, RECORD_HEADER_SIZE))
+			return total;
+		for (size_t k = 0; k < len; ) {
+			while (p == NULL || p == (const uint8_t*)iov[i].base + iov[i].len) {
+				if (p != NULL)
+					i++;
+				p = iov[i].base;
+			}
+			size_t m = MIN(len - k, (size_t)((const uint8_t*)iov[i].base + iov[i].len - p));
+			if (!EVP_EncryptUpdate(stream->ctx, out + k, &outlen, p, (int)m))
+				return total;
+			p += m;
+			k += m;
+		}
+		if (EVP_EncryptFinal_ex(stream->ctx, out + len, &outlen) <= 0
+		    || !EVP_CIPHER_CTX_ctrl(stream->ctx, EVP_CTRL_AEAD_GET_TAG,
+		                            RECORD_TAG_SIZE, out + len))
+			return total;
+		stream->pending += len + RECORD_OVERHEAD;
+		left -= len;
+		total += len;
+	}
+	return flush_records(stream) ? total : 0;
+}
+
+static size_t record_socket_write(void *context, const void *buf, size_t size)
+{
+	struct lisp_iovec iov = {buf, size};
+	return write_records(context, &iov, 1);
+}
+
+static size_t record_socket_writev(void *context, const struct lisp_iovec *iov, int count)
+{
+	return write_records(context, iov, count);
+}
+
+static bool record_socket_ready(void *context, int mode)
+{
+	struct socket_stream *stream = context;
+	if (mode == 0 && stream->pending_pos < stream->pending)
+		return true;
+	return socket_ready(context, mode);
+}
+
+struct lisp_stream_class_t record_socket_stream_class = {
+	.context_size = sizeof(struct socket_stream),
+	.read = record_socket_read,
+	.write = record_socket_write,
+	.writev = record_socket_writev,
+	.close = secure_socket_close,
+	.ready = record_socket_ready
+};
+
+#define RECORD_SERVER_BIT 0x80 /* In nonce[0] of records the server sends */
+
+/* Make room for a whole record in the port buffer */
+static void set_record_cipher(Lisp_VM *vm, Lisp_Port *p, struct socket_stream *s,
+  const EVP_CIPHER *cipher, const uint8_t *key, const uint8_t *iv,
+  size_t record_size, bool server)
+{
+	bool input = lisp_input_port_p((Lisp_Object*)p);
+	Lisp_Buffer *b = lisp_port_get_buffer(p);
+	s->ctx = EVP_CIPHER_CTX_new();
+	assert(s->ctx);
+	if (!EVP_CipherInit_ex(s->ctx, cipher, NULL, NULL, NULL, input ? 0 : 1)
+	    || !EVP_CIPHER_CTX_ctrl(s->ctx, EVP_CTRL_AEAD_SET_IVLEN, RECORD_NONCE_SIZE, NULL)
+	    || !EVP_CipherInit_ex(s->ctx, NULL, NULL, key, NULL, input ? 0 : 1)) {
+		EVP_CIPHER_CTX_free(s->ctx);
+		s->ctx = NULL;
+		lisp_err(vm, "Bad stream cipher");
+	}
+	memcpy(s->iv, iv, RECORD_NONCE_SIZE);
+	if (server != input)
+		s->iv[0] ^= RECORD_SERVER_BIT;
+	s->seq = 0;
+	s->record_size = record_size;
+	s->pending = s->pending_pos = 0;
+	s->failed = false;
+	if (input) {
+		s->cap = MAX_RECORD_SIZE + RECORD_TAG_SIZE;
+		lisp_buffer_grow(b, s->cap);
+	} else {
+		s->cap = MAX(RECORD_BATCH_SIZE, record_size + RECORD_OVERHEAD);
+		lisp_buffer_grow(b, record_size);
+	}
+	s->buf = calloc(1, s->cap);
+	assert(s->buf);
+	lisp_stream_set_class(lisp_port_get_stream(p), &record_socket_stream_class);
+}
+
 static Lisp_Port* safe_port(Lisp_VM *vm, Lisp_Object *o)
 {
 	if (lisp_output_port_p(o) || lisp_input_port_p(o))
@@ -330,8 +709,14 @@ static struct socket_stream *get_socket_stream(Lisp_Port* port)
 	return lisp_stream_context(s);
 }
 
-/* (set-stream-cipher <port> <type> <key> <iv>)
- * key and salt are buffers of length >= 8.
+/* (set-stream-cipher <port> <type> <key> <iv> [<record-size>] [<side>])
+ * key and salt are buffers of length >= 32.
+ *
+ * <type> is aes-256-cfb8, or one of the AEAD ciphers aes-256-gcm and
+ * chacha20-poly1305, which send records of <record-size> bytes,
+ * 16KB by default and 64KB at most. These need <side>, client or
+ * server, which the two ends must give differently, so that their
+ * records never share a nonce.
  */
 static void op_set_stream_cipher(Lisp_VM *vm, Lisp_Pair *args)
 {
@@ -347,8 +732,16 @@ static void op_set_stream_cipher(Lisp_VM *vm, Lisp_Pair *args)
 	size_t ivlen=0;
 	const char *cipher_name = lisp_safe_csymbol(vm, CADR(args));
 	const EVP_CIPHER *cipher = NULL;
+	bool aead = true;
 	if (strcmp(cipher_name, "aes-256-cfb8") == 0) {
 		cipher = EVP_aes_256_cfb8();
+		aead = false;
+	} else if (strcmp(cipher_name, "aes-256-gcm") == 0) {
+		cipher = EVP_aes_256_gcm();
+#ifndef OPENSSL_NO_CHACHA
+	} else if (strcmp(cipher_name, "chacha20-poly1305") == 0) {
+		cipher = EVP_chacha20_poly1305();
+#endif
 	} else {
 		lisp_err(vm, "Unsupported stream cipher");
 	}
@@ -357,7 +750,23 @@ static void op_set_stream_cipher(Lisp_VM *vm, Lisp_Pair *args)
 	uint8_t *iv = lisp_safe_bytes(vm, CADR(params), &ivlen);
 	if (keylen < 32 || ivlen < 32)
 		lisp_err(vm, "Bad key or salt");
-	if (lisp_input_port_p(CAR(args))) {
+	if (s->ctx)
+		lisp_err(vm, "Cipher already set");
+	if (aead) {
+		size_t record_size = DEFAULT_RECORD_SIZE;
+		Lisp_Pair *opts = (Lisp_Pair*)CDDR(params);
+		if (lisp_number_p(CAR(opts))) {
+			record_size = lisp_safe_int(vm, CAR(opts));
+			opts = (Lisp_Pair*)CDR(opts);
+		}
+		if (record_size < MIN_RECORD_SIZE || record_size > MAX_RECORD_SIZE)
+			lisp_err(vm, "Bad record size");
+		const char *side = lisp_symbol_p(CAR(opts)) ? lisp_safe_csymbol(vm, CAR(opts)) : "";
+		if (strcmp(side, "client") != 0 && strcmp(side, "server") != 0)
+			lisp_err(vm, "set-stream-cipher: side must be client or server");
+		set_record_cipher(vm, p, s, cipher, key, iv, record_size,
+		  strcmp(side, "server") == 0);
+	} else if (lisp_input_port_p(CAR(args))) {
 		s->ctx = EVP_CIPHER_CTX_new();
 		assert(s->ctx);
 		EVP_DecryptInit_ex(s->ctx, cipher, NULL, key, iv);
@@ -383,79 +792,16 @@ static void op_set_stream_cipher(Lisp_VM *vm, Lisp_Pair *args)
  * --------------------------------------------------------
  */
 
-int open_tcp_server_socket(uint32_t addr, uint16_t port)
-{
-	int sockfd, val;
-	struct sockaddr_in sa;
-
-	/* Initialize socket address */
-	memset((void*) &sa, 0, sizeof(sa));
-	sa.sin_family = AF_INET;
-	sa.sin_addr.s_addr = htonl(addr);
-	sa.sin_port = htons(port);
-	#if !(defined(_WIN32) || defined(__linux))
-	sa.sin_len = sizeof(sa);
-	#endif
-
-	sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (sockfd < 0)
-	{
-		perror("open_server_socket: socket()");
-		return -1;
-	}
-	
-	/* Allow us to reuse address after restart */
-	val = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (void*)&val, sizeof(int)) < 0)
-    {
-        perror("open_server_socket: setsockopt(SO_REUSEADDR)");
-        close(sockfd);
-        return -1;
-    }
-	
-    /* No SIGPIPE on select() */
-    val = 1;
-#ifdef SO_NOSIGPIPE
-    if (setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&val, sizeof(int)) < 0)
-
-    {
-        perror("open_server_socket: setsockopt(SO_NOSIGPIPE)");
-        close(sockfd);
-        return -1;
-    }
-#endif
-	
-	if (bind(sockfd, (struct sockaddr *) &sa, sizeof(sa)) < 0)
-	{
-		fprintf(stderr, "open_server_socket: bind() failed at %d: %s\n",
-			port, strerror(errno));
-		perror("open_server_socket: bind()");
-		close(sockfd);
-		return -1;
-	}
-	
-	/*
-	 * Use backlog=32. When pending queue size
-	 * reaches this number, new incoming connection will
-	 * be refused.
-	 */
-	if (listen(sockfd, 32) < 0)
-	{
-		perror("open_server_socket: listen()");
-		close(sockfd);
-		return -1;
-	}
-	
-	return sockfd;
-}
-
-static int open_tcp_server(struct sockaddr *sa)
+/*
+ * Listen on sa. With reuse_port, several sockets, each in a process
+ * of its own, can listen on the same port, and the kernel spreads new
+ * connections among them. The socket is non-blocking, accept until
+ * there is nothing left.
+ */
+int open_tcp_server_socket(struct sockaddr *sa, int backlog, bool reuse_port)
 {
 	int sockfd, val;
 
-	//struct sockaddr_in in;
-	//memcpy(&in, sa, sizeof(struct sockaddr_in));
-	
 	if (sa->sa_family != PF_INET && sa->sa_family != PF_INET6)
 	{
 		fprintf(stderr, "open_tcp_server: bad address family");
@@ -490,6 +836,16 @@ static int open_tcp_server(struct sockaddr *sa)
         return -1;
     }
 #endif	
+#ifdef SO_REUSEPORT
+	val = 1;
+	if (reuse_port
+	    && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (void*)&val, sizeof(int)) < 0)
+	{
+		perror("open_tcp_server: setsockopt(SO_REUSEPORT)");
+		close(sockfd);
+		return -1;
+	}
+#endif
     /* No SIGPIPE on select() */
     val = 1;
 #ifdef SO_NOSIGPIPE
@@ -510,20 +866,61 @@ static int open_tcp_server(struct sockaddr *sa)
 	}
 	
 	/*
-	 * Use backlog=32. When pending queue size
-	 * reaches this number, new incoming connection will
-	 * be refused.
+	 * When the pending queue reaches backlog, new incoming
+	 * connections are refused.
 	 */
-	if (listen(sockfd, 32) < 0)
+	if (listen(sockfd, backlog > 0 ? backlog : TCP_SERVER_BACKLOG) < 0)
 	{
 		perror("open_server_socket: listen()");
 		close(sockfd);
 		return -1;
 	}
+	set_nonblocking(sockfd);
 	
 	return sockfd;
 }
 
+/*
+ * Accept a client of the non-blocking socket sockfd. Return -1 with
+ * errno set, EAGAIN or EWOULDBLOCK once there are no more. The client
+ * socket is non-blocking and not inherited by exec'ed programs.
+ */
+int accept_tcp_client(int sockfd, struct sockaddr_storage *sa, uint32_t *sa_len)
+{
+	int val = 1;
+	socklen_t len = sizeof(struct sockaddr_storage);
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+	int fd = accept4(sockfd, (struct sockaddr*)sa, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return -1;
+#else
+	int fd = (int)accept(sockfd, (struct sockaddr*)sa, &len);
+	if (fd < 0)
+		return -1;
+	set_nonblocking(fd);
+# ifndef _WIN32
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+# endif
+#endif
+	*sa_len = (uint32_t)len;
+
+#ifdef SO_NOSIGPIPE
+	if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&val, sizeof(int)) < 0)
+	{
+		perror("client socket: setsockopt(SO_NOSIGPIPE)");
+		close(fd);
+		return -1;
+	}
+#endif
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void*)&val, sizeof(int)) < 0)
+	{
+		perror("client socket: setsockopt(SO_KEEPALIVE)");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
 int open_udp_server(struct sockaddr *sa)
 {
 	int sock;
@@ -609,54 +1006,36 @@ static void op_open_socket_input(Lisp_VM *vm, Lisp_Pair *args)
 }
 
 
+/*
+ * Accept all the clients waiting, each is read as (<fd> <ip> <port>).
+ * The ones that do not fit stay in the backlog for the next read.
+ */
 static size_t server_socket_read(void *context, void *buf, size_t size)
 {
-	bool ok = false;
 	struct socket_stream *stream = context;
 	int sockfd = stream->sockfd;
-	int n = 0;
-	int val = 1;
+	size_t n = 0;
 	uint32_t clilen;
 	char ip[INET6_ADDRSTRLEN];
 	int port = 0;
 	struct sockaddr_storage cli_addr;
 	assert(size >= 256);
-	clilen = sizeof(cli_addr);
-	int cli_fd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
-	if (cli_fd == -1)
-	{
-		#ifndef _WIN32
-		if (errno == EWOULDBLOCK)
-			goto Error;
-		#endif
-		perror("socket server: accept()");
-		goto Error;
-	}
-
-#ifdef SO_NOSIGPIPE
-	if (setsockopt(cli_fd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&val, sizeof(int)) < 0)
-	{
-		perror("client socket: setsockopt(SO_NOSIGPIPE)");
-		goto Error;
-	}
-#endif
-
-	if (setsockopt(cli_fd, SOL_SOCKET, SO_KEEPALIVE, (void*)&val, sizeof(int)) < 0)
-	{
-		perror("client socket: setsockopt(SO_KEEPALIVE)");
-		goto Error;
+	while (size - n >= ACCEPT_ENTRY_SIZE) {
+		int cli_fd = accept_tcp_client(sockfd, &cli_addr, &clilen);
+		if (cli_fd == -1)
+		{
+			if (!would_block())
+				perror("socket server: accept()");
+			break;
+		}
+		ss_decode(&cli_addr, ip, sizeof(ip), &port);
+		int k = snprintf((char*)buf + n, size - n, "(%d \"%s\" %d)", cli_fd, ip, port);
+		assert(k > 0 && (size_t)k < size - n);
+		n += k;
 	}
-	
-	ss_decode(&cli_addr, ip, sizeof(ip), &port);
-	n = snprintf(buf, size, "(%d \"%s\" %d)", cli_fd, ip, port);
-	assert(n > 0);
-	ok = true;
-Error:
-	if (!ok) {
+	if (n == 0) {
 		n = 2;
 		memcpy(buf, "()", n);
-		if (cli_fd >= 0)
-			close(cli_fd);
 	}
 	return n;
 }
@@ -668,9 +1047,11 @@ struct lisp_stream_class_t server_socket_stream_class = {
 };
 
 /*
-(open-tcp-server <addr> <port>)
+(open-tcp-server <addr> <port> [<backlog>] [<reuse-port>])
 open and start a server.
 set process's fd.
+With <reuse-port>, other processes may listen on the same port
+and share the incoming connections.
 */
 static void op_open_tcp_server(Lisp_VM *vm, Lisp_Pair *args)
 {
@@ -678,15 +1059,25 @@ static void op_open_tcp_server(Lisp_VM *vm, Lisp_Pair *args)
 	struct sockaddr_storage sa;
 	const char *ip = lisp_safe_cstring(vm, CAR(args));
 	int port = lisp_safe_int(vm, CADR(args));
+	int backlog = TCP_SERVER_BACKLOG;
+	bool reuse_port = false;
+	Lisp_Object *opts = CDDR(args);
+
+	if (opts != lisp_nil) {
+		if (CAR(opts) != lisp_false)
+			backlog = lisp_safe_int(vm, CAR(opts));
+		if (CDR(opts) != lisp_nil)
+			reuse_port = CADR(opts) != lisp_false;
+	}
 
 	if (ss_init(&sa, ip, port))
 	{
-		proc->fd = open_tcp_server((struct sockaddr*)&sa);
+		proc->fd = open_tcp_server_socket((struct sockaddr*)&sa, backlog, reuse_port);
 		if (proc->fd < 0) {
 			lisp_push(vm, lisp_false);
 			return;
 		}
-		lisp_push_buffer(vm, NULL, 256);
+		lisp_push_buffer(vm, NULL, ACCEPT_BUFFER_SIZE);
 		Lisp_Stream *stream = lisp_push_stream(vm, &server_socket_stream_class, NULL);
 		struct socket_stream *t = lisp_stream_context(stream);
 		t->sockfd = proc->fd;
@@ -831,6 +1222,183 @@ static void op_send_datagram(Lisp_VM *vm, Lisp_Pair* args)
 	lisp_push(vm, n==nsent?lisp_true:lisp_false);
 }
 
+static struct socket_stream *udp_stream(Lisp_VM *vm, Lisp_Object *o)
+{
+	if (!lisp_input_port_p(o))
+		lisp_err(vm, "datagram: not input port");
+	Lisp_Stream *s = lisp_port_get_stream((Lisp_Port*)o);
+	if (!s || lisp_stream_class(s) != &udp_stream_class)
+		lisp_err(vm, "datagram: bad stream");
+	return lisp_stream_context(s);
+}
+
+static void push_datagram(Lisp_VM *vm, const void *data, size_t size,
+  struct sockaddr_storage *ss, bool truncated)
+{
+	char buf[64] = {0};
+	int port = 0;
+	lisp_push_buffer(vm, data, size);
+	ss_decode(ss, buf, sizeof(buf), &port);
+	lisp_push_cstr(vm, buf);
+	lisp_push_number(vm, port);
+	if (truncated)
+		lisp_make_symbol(vm, "truncated");
+	lisp_make_list(vm, truncated ? 4 : 3);
+}
+
+/* (fetch-datagrams <udp-client|udp-server> [<max>])
+ * Wait for a datagram like fetch-datagram, then take the others that
+ * are already waiting, up to <max>. Return a list of (buffer ip port),
+ * or (buffer ip port truncated) for a datagram longer than the buffer
+ * of the port, of which only the start is kept, like fetch-datagram.
+ */
+static void op_fetch_datagrams(Lisp_VM *vm, Lisp_Pair* args)
+{
+	struct socket_stream *sstream = udp_stream(vm, CAR(args));
+	Lisp_Buffer *b = lisp_port_get_buffer((Lisp_Port*)CAR(args));
+	int max = UDP_BATCH_SIZE;
+	if (CDR(args) != lisp_nil)
+		max = lisp_safe_int(vm, CADR(args));
+	if (max <= 0)
+		lisp_err(vm, "fetch-datagrams: bad max");
+	
+	struct sockaddr_storage ss[UDP_BATCH_SIZE];
+	int count = 0;
+	size_t size = lisp_buffer_cap(b); // per datagram, as fetch-datagram
+#ifdef HAVE_MMSG
+	// Left to the collector rather than kept by the port
+	uint8_t *data = lisp_buffer_bytes(lisp_push_buffer(vm, NULL,
+		MIN(max, UDP_BATCH_SIZE) * size));
+#else
+	uint8_t *data = lisp_buffer_bytes(b);
+#endif
+	
+	lisp_begin_list(vm);
+	while (count < max) {
+		int batch = MIN(max - count, UDP_BATCH_SIZE);
+		int flags = count == 0 ? 0 : MSG_DONTWAIT;
+		int n = 0;
+#ifdef HAVE_MMSG
+		struct mmsghdr msgs[UDP_BATCH_SIZE];
+		struct iovec iov[UDP_BATCH_SIZE];
+		memset(msgs, 0, sizeof(struct mmsghdr) * batch);
+		for (int i = 0; i < batch; i++) {
+			iov[i].iov_base = data + i * size;
+			iov[i].iov_len = size;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &ss[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(ss[i]);
+		}
+		n = recvmmsg(sstream->sockfd, msgs, batch,
+			flags | (count == 0 ? MSG_WAITFORONE : 0), NULL);
+		for (int i = 0; i < n; i++)
+			push_datagram(vm, data + i * size, msgs[i].msg_len, &ss[i],
+				msgs[i].msg_hdr.msg_flags & MSG_TRUNC);
+#else
+		while (n < batch && (count + n == 0 || socket_ready(sstream, 0))) {
+			uint32_t sa_len = sizeof(ss[0]);
+			int k = (int)recvfrom(sstream->sockfd, data, size,
+				0, (struct sockaddr*)&ss[0], &sa_len);
+			if (k < 0)
+				break;
+			push_datagram(vm, data, k, &ss[0], false);
+			n++;
+		}
+		(void)flags;
+#endif
+		if (n <= 0)
+			break;
+		count += n;
+		if (n < batch)
+			break;
+	}
+	lisp_end_list(vm);
+#ifdef HAVE_MMSG
+	lisp_exch(vm);
+	lisp_pop(vm, 1);
+#endif
+}
+
+static const void *datagram_bytes(Lisp_VM *vm, Lisp_Object *m, size_t *n)
+{
+	if (lisp_string_p(m)) {
+		*n = lisp_string_length((Lisp_String*)m);
+		return lisp_string_cstr((Lisp_String*)m);
+	} else if (lisp_buffer_p(m)) {
+		*n = lisp_buffer_size((Lisp_Buffer *)m);
+		return lisp_buffer_bytes((Lisp_Buffer *)m);
+	}
+	lisp_err(vm, "Bad message type");
+	return NULL;
+}
+
+/*
+ * Send each message of the list to sa, in batches. Return how many
+ * went out. With sa NULL, messages are (<ip> <port> <message>).
+ */
+static int send_datagrams(Lisp_VM *vm, int sockfd, struct sockaddr *sa, Lisp_Object *list)
+{
+	struct sockaddr_storage ss[UDP_BATCH_SIZE];
+	int total = 0;
+	
+	while (list != lisp_nil && lisp_pair_p(list)) {
+		int batch = 0;
+#ifdef HAVE_MMSG
+		struct mmsghdr msgs[UDP_BATCH_SIZE];
+		struct iovec iov[UDP_BATCH_SIZE];
+		memset(msgs, 0, sizeof(msgs));
+#endif
+		for (; batch < UDP_BATCH_SIZE && list != lisp_nil && lisp_pair_p(list);
+		     list = CDR(list), batch++) {
+			Lisp_Object *m = CAR(list);
+			struct sockaddr *to = sa;
+			if (!to) {
+				const char *ip = lisp_safe_cstring(vm, CAR(m));
+				int port = lisp_safe_int(vm, CADR(m));
+				if (!ss_init(&ss[batch], ip, port))
+					lisp_err(vm, "Bad address");
+				to = (struct sockaddr*)&ss[batch];
+				m = CAR(CDDR(m));
+			}
+			size_t n = 0;
+			const void *ptr = datagram_bytes(vm, m, &n);
+#ifdef HAVE_MMSG
+			iov[batch].iov_base = (void*)ptr;
+			iov[batch].iov_len = n;
+			msgs[batch].msg_hdr.msg_iov = &iov[batch];
+			msgs[batch].msg_hdr.msg_iovlen = 1;
+			msgs[batch].msg_hdr.msg_name = to;
+			msgs[batch].msg_hdr.msg_namelen = SOCKADDR_LEN(to);
+#else
+			if ((size_t)sendto(sockfd, ptr, n, 0, to, SOCKADDR_LEN(to)) != n)
+				return total;
+			total++;
+#endif
+		}
+#ifdef HAVE_MMSG
+		int i = 0;
+		while (i < batch) {
+			int k = sendmmsg(sockfd, msgs + i, batch - i, 0);
+			if (k <= 0)
+				return total;
+			i += k;
+			total += k;
+		}
+#endif
+	}
+	return total;
+}
+
+/* (send-datagrams <udp-server|udp-client> <messages>)
+ * Each message is (<ip> <port> <message>). Return how many were sent.
+ */
+static void op_send_datagrams(Lisp_VM *vm, Lisp_Pair* args)
+{
+	struct socket_stream *sstream = udp_stream(vm, CAR(args));
+	lisp_push_number(vm, send_datagrams(vm, sstream->sockfd, NULL, CADR(args)));
+}
+
 int tcp_connect(struct sockaddr *sa)
 {
 	int sockfd;
@@ -862,26 +1430,154 @@ int tcp_connect(struct sockaddr *sa)
 	return sockfd;
 }
 
+/* --------------------------------------------------------
+ * Name Resolution
+ * --------------------------------------------------------
+ *
+ * getaddrinfo() may wait seconds for a slow DNS server, so lookups
+ * run on a helper thread, see twk_run_blocking(), and the answers
+ * are shared by all processes. The system resolver does not tell
+ * the TTL of the records, they are kept for RESOLVER_TTL seconds,
+ * failures for RESOLVER_FAIL_TTL. The cache is direct mapped by
+ * name, a name pushes out whatever was in its slot.
+ */
+#define RESOLVER_TTL 60.0
+#define RESOLVER_FAIL_TTL 5.0
+#define RESOLVER_SLOTS 256
+#define RESOLVER_MAX_NAME 256
+#define RESOLVER_MAX_ADDRS 16
+
+struct resolved_addr
+{
+	union {
+		struct sockaddr sa;
+		struct sockaddr_in sin;
+		struct sockaddr_in6 sin6;
+	} u;
+	int protocol;
+};
+
+struct resolver_entry
+{
+	char name[RESOLVER_MAX_NAME];
+	double expires;
+	int count; // 0 if the name did not resolve
+	struct resolved_addr addrs[RESOLVER_MAX_ADDRS];
+};
+
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct resolver_entry resolver_cache[RESOLVER_SLOTS];
+
+static struct resolver_entry *resolver_slot(const char *name)
+{
+	uint32_t h = 2166136261u;
+	for (const unsigned char *p = (const unsigned char*)name; *p; p++)
+		h = (h ^ *p) * 16777619u;
+	return &resolver_cache[h % RESOLVER_SLOTS];
+}
+
+static void resolve_blocking(void *data)
+{
+	struct resolver_entry *e = data;
+	struct addrinfo hints = {0};
+	struct addrinfo *ai, *res = NULL;
+
+	e->count = 0;
+	hints.ai_flags = AI_CANONNAME;
+	if (0 != getaddrinfo(e->name, NULL, &hints, &res))
+		return;
+	for (ai = res; ai && e->count < RESOLVER_MAX_ADDRS; ai = ai->ai_next)
+	{
+		if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+		 || ai->ai_addrlen > sizeof(e->addrs[0].u))
+			continue;
+		struct resolved_addr *a = &e->addrs[e->count++];
+		memcpy(&a->u, ai->ai_addr, ai->ai_addrlen);
+		a->protocol = ai->ai_protocol;
+	}
+	freeaddrinfo(res);
+}
+
+/*
+ * Fill e with the addresses of name, from the cache if they have
+ * not expired. Return false if name does not resolve.
+ */
+static bool resolve_name(struct twk_process *proc, const char *name,
+  struct resolver_entry *e)
+{
+	bool cached = strlen(name) < RESOLVER_MAX_NAME;
+	struct resolver_entry *slot = cached ? resolver_slot(name) : NULL;
+	if (cached)
+	{
+		pthread_mutex_lock(&resolver_lock);
+		if (strcmp(slot->name, name) == 0 && slot->expires > microtime())
+		{
+			*e = *slot;
+			pthread_mutex_unlock(&resolver_lock);
+			return e->count > 0;
+		}
+		pthread_mutex_unlock(&resolver_lock);
+	}
+	else
+	{
+		// Names can not be that long, let getaddrinfo() say so
+		name = "";
+	}
+
+	snprintf(e->name, sizeof(e->name), "%s", name);
+	twk_run_blocking(proc, resolve_blocking, e);
+	e->expires = microtime() + (e->count > 0 ? RESOLVER_TTL : RESOLVER_FAIL_TTL);
+	if (cached)
+	{
+		pthread_mutex_lock(&resolver_lock);
+		*slot = *e;
+		pthread_mutex_unlock(&resolver_lock);
+	}
+	return e->count > 0;
+}
+
 /*
- * (connect <ip> <port>)
+ * (connect <host> <port>)
  *
- * Connect to remote tcp server.
+ * Connect to remote tcp server. <host> is an ip or a name, whose
+ * addresses are tried in turn.
  * Return true if success, otherwise false.
  */
 static void op_connect(Lisp_VM *vm, Lisp_Pair *args)
 {
 	struct twk_process *proc = lisp_vm_client(vm);
-	const char *ip = lisp_safe_cstring(vm, CAR(args));
+	const char *host = lisp_safe_cstring(vm, CAR(args));
 	int port = lisp_safe_int(vm, CADR(args));
 	struct sockaddr_storage ss;
 	
 	if (proc->fd >= 0)
 			lisp_err(vm, "process socket already used");
 	
-	if (!ss_init(&ss, ip, port))
-		lisp_err(vm, "Bad address");
+	if (ss_init(&ss, host, port))
+	{
+		proc->fd = tcp_connect((struct sockaddr*)&ss);
+	}
+	else
+	{
+		struct resolver_entry e;
+		if (!resolve_name(proc, host, &e))
+		{
+			lisp_push(vm, lisp_false);
+			return;
+		}
+		for (int i = 0; i < e.count && proc->fd < 0; i++)
+		{
+			struct resolved_addr *a = &e.addrs[i];
+			// One of each socket type is listed for every address
+			if (a->protocol != 0 && a->protocol != IPPROTO_TCP)
+				continue;
+			memset(&ss, 0, sizeof(ss));
+			memcpy(&ss, &a->u, sizeof(a->u));
+			ss_set_port(&ss, (uint16_t)port);
+			proc->fd = tcp_connect((struct sockaddr*)&ss);
+		}
+	}
 
-	proc->fd = tcp_connect((struct sockaddr*)&ss);
 	if (proc->fd < 0) {
 		lisp_push(vm, lisp_false);
 	} else {
@@ -903,6 +1599,7 @@ static void op_set_process_socket(Lisp_VM *vm, Lisp_Pair *args)
 			lisp_err(vm, "process %d has socket already", pid);
 		}
 		proc->fd = sockfd;
+		twk_wake_sched(proc);
 		lisp_push(vm, lisp_true);
 	} else {
 		lisp_err(vm, "Process %d not found", pid);
@@ -1012,7 +1709,7 @@ static void op_broadcast_address(Lisp_VM *vm, Lisp_Pair* args)
 }
 
 
-static bool broadcast(struct sockaddr* sa, const char *message)
+static bool broadcast(Lisp_VM *vm, struct sockaddr* sa, Lisp_Object *message)
 {
 	int sock = -1;                         /* Socket */
 	bool ok = false;
@@ -1032,13 +1729,24 @@ static bool broadcast(struct sockaddr* sa, const char *message)
 		goto Error;
 	}
 	
-	int len = (int)strlen(message);  /* Find length of sendString */
-	size_t nsent = sendto(sock, message, len, 0,
-		sa, SOCKADDR_LEN(sa));
-	
-	if (nsent != len) {
-		perror("broadcast: sendto() sent a different number of bytes than expected");
-		goto Error;
+	if (lisp_pair_p(message)) {
+		int count = 0;
+		for (Lisp_Object *o = message; o != lisp_nil && lisp_pair_p(o); o = CDR(o))
+			count++;
+		if (send_datagrams(vm, sock, sa, message) != count) {
+			perror("broadcast: sendmmsg() did not send all messages");
+			goto Error;
+		}
+	} else {
+		const char *s = lisp_safe_cstring(vm, message);
+		int len = (int)strlen(s);  /* Find length of sendString */
+		size_t nsent = sendto(sock, s, len, 0,
+			sa, SOCKADDR_LEN(sa));
+		
+		if (nsent != len) {
+			perror("broadcast: sendto() sent a different number of bytes than expected");
+			goto Error;
+		}
 	}
 
 	ok = true;
@@ -1049,26 +1757,30 @@ Error:
 }
 
 // (broadcast <ip> <port> <message>)
+// <message> can be a list of messages, sent from one socket.
 static void op_broadcast(Lisp_VM *vm, Lisp_Pair *args)
 {
 	const char *ip = lisp_safe_cstring(vm, CAR(args));
 	int port = lisp_safe_int(vm, CADR(args));
-	const char *message = lisp_safe_cstring(vm, CAR(CDDR(args)));
+	Lisp_Object *message = CAR(CDDR(args));
 	struct sockaddr_storage ss;
+	size_t n;
+	// Check them before there is a socket to close
+	for (Lisp_Object *o = message; lisp_pair_p(o) && o != lisp_nil; o = CDR(o))
+		datagram_bytes(vm, CAR(o), &n);
 	ss_init(&ss, ip, port);
-	if (broadcast((struct sockaddr*)&ss, message))
+	if (broadcast(vm, (struct sockaddr*)&ss, message))
 		lisp_push(vm, lisp_true);
 	else
 		lisp_push(vm, lisp_false);
 }
 
-static void extract_addrinfo(Lisp_VM *vm, void *data)
+static void extract_addrinfo(Lisp_VM *vm, struct resolver_entry *e)
 {
-	struct addrinfo *ai, *res = data;
 	lisp_begin_list(vm);
-	for (ai = res; ai; ai = ai->ai_next)
+	for (int i = 0; i < e->count; i++)
 	{
-		struct sockaddr *sa = ai->ai_addr;
+		struct sockaddr *sa = &e->addrs[i].u.sa;
 		char buf[INET6_ADDRSTRLEN];
 		lisp_begin_list(vm);
 	
@@ -1078,7 +1790,7 @@ static void extract_addrinfo(Lisp_VM *vm, void *data)
 		lisp_cons(vm);
 		
 		lisp_make_symbol(vm, "family");
-		switch (ai->ai_family) {
+		switch (sa->sa_family) {
 			case AF_INET:
 				lisp_make_symbol(vm, "inet");
 				break;
@@ -1092,7 +1804,7 @@ static void extract_addrinfo(Lisp_VM *vm, void *data)
 		lisp_cons(vm);
 
 		lisp_make_symbol(vm, "protocol");
-		switch (ai->ai_protocol) {
+		switch (e->addrs[i].protocol) {
 		case IPPROTO_TCP:
 			lisp_make_symbol(vm, "tcp");
 			break;
@@ -1110,24 +1822,22 @@ static void extract_addrinfo(Lisp_VM *vm, void *data)
 	lisp_end_list(vm);
 }
 
+/*
+ * (getaddrinfo <name>)
+ *
+ * The addresses of <name> as ((ip . <ip>) (family . inet|inet6)
+ * (protocol . tcp|udp)) lists, or nil if it does not resolve.
+ */
 static void op_getaddrinfo(Lisp_VM *vm, Lisp_Pair *args)
 {
 	const char *name = lisp_safe_cstring(vm, CAR(args));
-	struct addrinfo hints = {0};
-	struct addrinfo *res = NULL;
+	struct resolver_entry e;
 
-	hints.ai_flags = AI_CANONNAME;
-	if (0 != getaddrinfo(name, NULL, &hints, &res)) {
+	if (!resolve_name(lisp_vm_client(vm), name, &e)) {
 		lisp_push(vm, lisp_nil);
 		return;
 	}
-	
-	Lisp_Object* o = lisp_try(vm, extract_addrinfo, res);
-	if (res)
-		freeaddrinfo(res);
-	if (!o)
-		lisp_err(vm, "getaddrinfo: error");
-	lisp_push(vm, o);
+	extract_addrinfo(vm, &e);
 }
 
 bool lisp_socket_init(Lisp_VM *vm)
@@ -1143,6 +1853,8 @@ bool lisp_socket_init(Lisp_VM *vm)
 	lisp_defn(vm, "broadcast", op_broadcast);
 	lisp_defn(vm, "fetch-datagram", op_fetch_datagram);
 	lisp_defn(vm, "send-datagram", op_send_datagram);
+	lisp_defn(vm, "fetch-datagrams", op_fetch_datagrams);
+	lisp_defn(vm, "send-datagrams", op_send_datagrams);
 	lisp_defn(vm, "getaddrinfo", op_getaddrinfo);
 	lisp_defn(vm, "get-address-info", op_getaddrinfo);
 	lisp_defn(vm, "set-stream-cipher", op_set_stream_cipher);
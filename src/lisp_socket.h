@@ -22,7 +22,12 @@
 Lisp_Port* lisp_open_socket_output(Lisp_VM *vm, int sockfd, int timeout);
 Lisp_Port* lisp_open_socket_input(Lisp_VM *vm, int sockfd, int timeout);
 
-int open_tcp_server_socket(uint32_t addr, uint16_t port);
+#define TCP_SERVER_BACKLOG 128 /* Default length of the accept queue */
+
+struct sockaddr;
+struct sockaddr_storage;
+int open_tcp_server_socket(struct sockaddr *sa, int backlog, bool reuse_port);
+int accept_tcp_client(int sockfd, struct sockaddr_storage *sa, uint32_t *sa_len);
 int open_udp_server_socket(uint32_t addr, uint16_t port);
 
 bool lisp_socket_init(Lisp_VM *vm);
@@ -16,13 +16,49 @@
  */
 #include "lisp_sqlite3.h"
 #include "common.h"
+#include <pthread.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+/*
+ * Statements prepared with (sqlite3-prepare db sql true) go back to
+ * db's cache when they are closed or collected, reset and with their
+ * bindings cleared, and are handed out again for the same SQL text.
+ * Least recently used ones are finalized past STMT_CACHE_SIZE.
+ */
+#define STMT_CACHE_SIZE 32
+
+struct cached_stmt {
+    struct cached_stmt *next; // next less recently used
+    sqlite3_stmt *stmt;
+    uint32_t hash;
+};
 
 struct sqlite3_db {
     sqlite3 *instance;
     Lisp_VM *vm;
     int refcnt;
+    struct shared_db *pool; // instance goes back to it, see op_sqlite3_open_shared()
+    struct cached_stmt *cache; // idle statements, most recent first
+    int cache_size;
+    int cache_capacity;
+    long cache_hits;
+    long cache_misses;
+};
+
+struct sqlite3_statement {
+    struct sqlite3_db *db; // only if checked out of db's cache
+    sqlite3_stmt *stmt;
+    uint32_t hash;
+    int ncolumns;
+    Lisp_Object *columns; // symbols for the result columns
+    bool done; // stepped to the end, see op_sqlite3_fetch()
 };
 
+struct shared_db;
+static void put_reader(struct shared_db *sd, sqlite3 *db);
+
 static struct sqlite3_db* sqlite3_db_new()
 {
     struct sqlite3_db *db;
@@ -30,6 +66,7 @@ static struct sqlite3_db* sqlite3_db_new()
     db = calloc(1, sizeof(struct sqlite3_db));
     assert(db != NULL);
     db->refcnt = 1;
+    db->cache_capacity = STMT_CACHE_SIZE;
     return db;
 }
 
@@ -42,11 +79,28 @@ static struct sqlite3_db* sqlite3_db_ref(struct sqlite3_db *db)
     return db;
 }
 
+static void trim_cache(struct sqlite3_db *db, int capacity)
+{
+    struct cached_stmt **pp = &db->cache;
+    for (int i = 0; *pp && i < capacity; i++)
+        pp = &(*pp)->next;
+    while (*pp) {
+        struct cached_stmt *c = *pp;
+        *pp = c->next;
+        sqlite3_finalize(c->stmt);
+        free(c);
+        db->cache_size--;
+    }
+}
+
 static void sqlite3_db_unref(struct sqlite3_db *db)
 {
     assert(db->refcnt > 0);
     if (--db->refcnt == 0) {
-        if (db->instance) {
+        trim_cache(db, 0);
+        if (db->instance && db->pool) {
+            put_reader(db->pool, db->instance);
+        } else if (db->instance) {
             /* GC friendly */
             sqlite3_close_v2(db->instance);
         }
@@ -62,11 +116,16 @@ static void sqlite3_db_close(Lisp_VM *vm, void *ctx)
 
 static void sqlite3_stmt_close(Lisp_VM *vm, void *ctx)
 {
-    if (ctx)
-    {
-        sqlite3_stmt *stmt = (sqlite3_stmt*)ctx;
-        sqlite3_finalize(stmt);
-    }
+    struct sqlite3_statement *st = ctx;
+    sqlite3_finalize(st->stmt);
+    st->stmt = NULL;
+}
+
+static void sqlite3_stmt_mark(void *ctx)
+{
+    struct sqlite3_statement *st = ctx;
+    if (st->columns)
+        lisp_mark(st->columns);
 }
 
 static void sqlite_err(Lisp_VM* vm, sqlite3* db)
@@ -76,6 +135,43 @@ static void sqlite_err(Lisp_VM* vm, sqlite3* db)
         sqlite3_errstr(code), code, sqlite3_errmsg(db));
 }
 
+static uint32_t sql_hash(const char *sql)
+{
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char*)sql; *p; p++)
+        h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+static void sqlite3_cached_stmt_close(Lisp_VM *vm, void *ctx)
+{
+    struct sqlite3_statement *cs = ctx;
+    if (!cs->stmt) {
+        if (cs->db)
+            sqlite3_db_unref(cs->db);
+        return;
+    }
+    struct sqlite3_db *db = cs->db;
+    struct cached_stmt *c = malloc(sizeof(struct cached_stmt));
+    if (!c || db->cache_capacity <= 0) {
+        free(c);
+        sqlite3_finalize(cs->stmt);
+    } else {
+        // Bound text and blobs point into lisp objects
+        sqlite3_reset(cs->stmt);
+        sqlite3_clear_bindings(cs->stmt);
+        c->stmt = cs->stmt;
+        c->hash = cs->hash;
+        c->next = db->cache;
+        db->cache = c;
+        db->cache_size++;
+        trim_cache(db, db->cache_capacity);
+    }
+    cs->stmt = NULL;
+    cs->db = NULL;
+    sqlite3_db_unref(db);
+}
+
 struct lisp_object_ex_class_t sqlite3_db_class =
 {
     .name = "sqlite3",
@@ -85,7 +181,17 @@ struct lisp_object_ex_class_t sqlite3_db_class =
 struct lisp_object_ex_class_t sqlite3_stmt_class =
 {
     .name = "sqlite3-statement",
-    .finalize = sqlite3_stmt_close
+    .size = sizeof(struct sqlite3_statement),
+    .finalize = sqlite3_stmt_close,
+    .mark = sqlite3_stmt_mark
+};
+
+struct lisp_object_ex_class_t sqlite3_cached_stmt_class =
+{
+    .name = "sqlite3-statement",
+    .size = sizeof(struct sqlite3_statement),
+    .finalize = sqlite3_cached_stmt_close,
+    .mark = sqlite3_stmt_mark
 };
 
 static struct sqlite3_db *safe_db(Lisp_VM *vm, Lisp_Object *o)
@@ -102,40 +208,332 @@ static sqlite3 *safe_db_instance(Lisp_VM *vm, Lisp_Object *o)
     return safe_db(vm, o)->instance;
 }
 
-static sqlite3_stmt *safe_stmt(Lisp_VM *vm, Lisp_Object *o)
+static struct sqlite3_statement *safe_statement(Lisp_VM *vm, Lisp_Object *o)
 {
-    if (lisp_object_ex_class(o) != &sqlite3_stmt_class)
+    const lisp_object_ex_class_t *cls = lisp_object_ex_class(o);
+    if (cls != &sqlite3_stmt_class && cls != &sqlite3_cached_stmt_class)
     {
         lisp_err(vm, "not sqlite3 statement");
     }
-    return lisp_object_ex_ptr(o);
+    struct sqlite3_statement *st = lisp_object_ex_ptr(o);
+    if (!st || !st->stmt)
+        lisp_err(vm, "sqlite3 statement closed");
+    return st;
+}
+
+static sqlite3_stmt *safe_stmt(Lisp_VM *vm, Lisp_Object *o)
+{
+    return safe_statement(vm, o)->stmt;
+}
+
+
+/*
+ * Keys
+ *
+ * SQLCipher runs PBKDF2 for every connection given a passphrase.
+ * We derive the key the way it does and keep it per file, so that
+ * every later connection gets the raw key and salt: x'<key><salt>'.
+ * The salt is the first bytes of the file, or new for a new file.
+ */
+#define KDF_ITER 256000
+#define KDF_KEY_SIZE 32
+#define KDF_SALT_SIZE 16
+#define KEYSPEC_SIZE (3 + (KDF_KEY_SIZE + KDF_SALT_SIZE) * 2 + 1)
+
+struct derived_key {
+    struct derived_key *next;
+    char *path;
+    unsigned char pass_hash[SHA256_DIGEST_LENGTH];
+    char keyspec[KEYSPEC_SIZE];
+};
+
+static pthread_mutex_t keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct derived_key *keys;
+
+static bool read_salt(const char *path, unsigned char *salt)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+    size_t n = fread(salt, 1, KDF_SALT_SIZE, fp);
+    fclose(fp);
+    return n == KDF_SALT_SIZE;
+}
+
+/* Fill keyspec for the database at path with passphrase pass */
+static bool derive_key(const char *path, const char *pass, char *keyspec)
+{
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    unsigned char key[KDF_KEY_SIZE + KDF_SALT_SIZE];
+    unsigned char *salt = key + KDF_KEY_SIZE;
+    char salt_hex[KDF_SALT_SIZE * 2 + 1];
+    bool has_salt = read_salt(path, salt);
+    struct derived_key *k;
+
+    for (int i = 0; i < KDF_SALT_SIZE; i++)
+        sprintf(salt_hex + i * 2, "%02X", salt[i]);
+    SHA256((const unsigned char*)pass, strlen(pass), hash);
+    pthread_mutex_lock(&keys_lock);
+    for (k = keys; k; k = k->next) {
+        // The file may have been made again since
+        if (strcmp(k->path, path) == 0 && memcmp(k->pass_hash, hash, sizeof(hash)) == 0
+         && (!has_salt || memcmp(k->keyspec + 2 + KDF_KEY_SIZE * 2, salt_hex,
+                KDF_SALT_SIZE * 2) == 0)) {
+            memcpy(keyspec, k->keyspec, KEYSPEC_SIZE);
+            pthread_mutex_unlock(&keys_lock);
+            return true;
+        }
+    }
+    pthread_mutex_unlock(&keys_lock);
+
+    if (!has_salt && RAND_bytes(salt, KDF_SALT_SIZE) != 1)
+        return false;
+    if (!PKCS5_PBKDF2_HMAC(pass, (int)strlen(pass), salt, KDF_SALT_SIZE,
+            KDF_ITER, EVP_sha512(), KDF_KEY_SIZE, key))
+        return false;
+    strcpy(keyspec, "x'");
+    for (int i = 0; i < (int)sizeof(key); i++)
+        sprintf(keyspec + 2 + i * 2, "%02X", key[i]);
+    strcat(keyspec, "'");
+
+    k = calloc(1, sizeof(struct derived_key));
+    if (k && (k->path = strdup(path)) != NULL) {
+        memcpy(k->pass_hash, hash, sizeof(hash));
+        memcpy(k->keyspec, keyspec, KEYSPEC_SIZE);
+        pthread_mutex_lock(&keys_lock);
+        k->next = keys;
+        keys = k;
+        pthread_mutex_unlock(&keys_lock);
+    } else {
+        free(k);
+    }
+    return true;
+}
+
+#define MAX_OPEN_ERROR 256
+
+/*
+ * Open a connection, keyed if pass is not NULL. Return false with
+ * why in msg, which has MAX_OPEN_ERROR bytes.
+ */
+static bool open_connection(const char *path, int flags,
+    const char *pass, sqlite3 **pdb, char *msg)
+{
+    char keyspec[KEYSPEC_SIZE];
+    sqlite3 *db = NULL;
+    int rc = sqlite3_open_v2(path, &db, flags, NULL);
+    if (rc != SQLITE_OK) {
+        sqlite3_close_v2(db);
+        snprintf(msg, MAX_OPEN_ERROR, "%s[%d]", sqlite3_errstr(rc), rc);
+        return false;
+    }
+    if (pass) {
+        if (!derive_key(path, pass, keyspec)) {
+            sqlite3_close_v2(db);
+            snprintf(msg, MAX_OPEN_ERROR, "can not derive key");
+            return false;
+        }
+#ifdef SQLITE_HAS_CODEC
+        rc = sqlite3_key(db, keyspec, (int)strlen(keyspec));
+#else
+        rc = SQLITE_MISUSE;
+#endif
+        // A wrong key only shows on the first read
+        if (rc == SQLITE_OK)
+            rc = sqlite3_exec(db, "SELECT count(*) FROM sqlite_master", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) {
+            sqlite3_close_v2(db);
+            snprintf(msg, MAX_OPEN_ERROR, "%s[%d]", sqlite3_errstr(rc), rc);
+            return false;
+        }
+    }
+    sqlite3_busy_timeout(db, 10*1000); /* 10 seconds */
+    *pdb = db;
+    return true;
 }
 
+static const char *optional_key(Lisp_VM *vm, Lisp_Pair *args)
+{
+    if (CDDR(args) == lisp_nil || !lisp_string_p(CADDR(args)))
+        return NULL;
+    return lisp_safe_cstring(vm, CADDR(args));
+}
 
-/* (sqlite3-open <path> &optional ro) */
+/* (sqlite3-open <path> &optional ro key) */
 static void op_sqlite3_open(Lisp_VM *vm, Lisp_Pair*args)
 {
     const char *path = lisp_safe_cstring(vm, CAR(args));
     int ro = (CADR(args) == lisp_true);
+    const char *key = optional_key(vm, args);
     Lisp_Object *o = lisp_make_object_ex(vm, &sqlite3_db_class);
     struct sqlite3_db *db = sqlite3_db_new();
+    char msg[MAX_OPEN_ERROR];
     db->vm = vm;
-    int rc = sqlite3_open_v2(
-        path,
-        &db->instance,
+    if (!open_connection(path,
         ro ? SQLITE_OPEN_READONLY
            : (SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE),
-        NULL);
-    if (rc != SQLITE_OK)
+        key, &db->instance, msg))
     {
         sqlite3_db_unref(db);
-        lisp_err(vm, "can not open file `%s': %s[%d]",
-            path, sqlite3_errstr(rc), rc);
+        lisp_err(vm, "can not open file `%s': %s", path, msg);
+    }
+    lisp_object_ex_set_ptr(o, db);
+}
+
+/*
+ * Shared databases
+ *
+ * Read-only opens of a database opened with sqlite3-open-shared take
+ * a connection from a pool, and give it back when they are closed.
+ * A connection is used by one db object at a time, so a cursor or
+ * transaction left open by one process never holds the snapshot of
+ * another. Up to SHARED_DB_READERS idle connections are kept for the
+ * life of the program. The database is put in WAL mode so that
+ * readers go on while a writer commits. Connections are opened
+ * serialized because runs move between workers.
+ *
+ * Pools are per path and passphrase, so that a wrong passphrase must
+ * open a connection of its own, and fails like sqlite3-open does.
+ *
+ * Writers get a connection of their own: a connection carries its
+ * transaction, which other processes must not step into.
+ */
+#define SHARED_DB_READERS 4
+
+struct shared_db {
+    struct shared_db *next;
+    char *path;
+    bool keyed;
+    unsigned char pass_hash[SHA256_DIGEST_LENGTH];
+    char *key; // passphrase to open more readers with
+    sqlite3 *idle[SHARED_DB_READERS];
+    int nidle;
+};
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shared_db *shared_dbs;
+
+static bool open_wal(const char *path, const char *key, sqlite3 **pdb, char *msg)
+{
+    if (!open_connection(path,
+        SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE|SQLITE_OPEN_FULLMUTEX, key, pdb, msg))
+        return false;
+    if (sqlite3_exec(*pdb, "PRAGMA journal_mode=WAL", NULL, NULL, NULL) != SQLITE_OK) {
+        snprintf(msg, MAX_OPEN_ERROR, "%s", sqlite3_errmsg(*pdb));
+        sqlite3_close_v2(*pdb);
+        *pdb = NULL;
+        return false;
+    }
+    return true;
+}
+
+static struct shared_db *find_pool(const char *path, const char *key)
+{
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    struct shared_db *sd;
+    if (key)
+        SHA256((const unsigned char*)key, strlen(key), hash);
+    for (sd = shared_dbs; sd; sd = sd->next) {
+        if (strcmp(sd->path, path) == 0 && sd->keyed == (key != NULL)
+         && (!key || memcmp(sd->pass_hash, hash, sizeof(hash)) == 0))
+            break;
+    }
+    return sd;
+}
+
+/* Make the pool for path and key. Its first writer sets WAL mode for good,
+ * readers can not, and tells whether the key is right. */
+static struct shared_db *new_pool(const char *path, const char *key, char *msg)
+{
+    sqlite3 *w = NULL;
+    struct shared_db *sd = calloc(1, sizeof(struct shared_db));
+    if (!sd || !(sd->path = strdup(path)) || (key && !(sd->key = strdup(key)))) {
+        if (sd)
+            free(sd->path);
+        free(sd);
+        snprintf(msg, MAX_OPEN_ERROR, "out of memory");
+        return NULL;
+    }
+    if (!open_wal(path, key, &w, msg)) {
+        free(sd->key);
+        free(sd->path);
+        free(sd);
+        return NULL;
+    }
+    sqlite3_close_v2(w);
+    if (key) {
+        sd->keyed = true;
+        SHA256((const unsigned char*)key, strlen(key), sd->pass_hash);
+    }
+    sd->next = shared_dbs;
+    shared_dbs = sd;
+    return sd;
+}
+
+/* A reader connection of its own for path, making the pool if needed */
+static bool shared_reader(const char *path, const char *key,
+    struct shared_db **psd, sqlite3 **pdb, char *msg)
+{
+    struct shared_db *sd;
+
+    pthread_mutex_lock(&shared_lock);
+    if (!(sd = find_pool(path, key)) && !(sd = new_pool(path, key, msg))) {
+        pthread_mutex_unlock(&shared_lock);
+        return false;
+    }
+    *psd = sd;
+    if (sd->nidle > 0) {
+        *pdb = sd->idle[--sd->nidle];
+        pthread_mutex_unlock(&shared_lock);
+        return true;
+    }
+    pthread_mutex_unlock(&shared_lock);
+    return open_connection(path, SQLITE_OPEN_READONLY|SQLITE_OPEN_FULLMUTEX,
+        sd->key, pdb, msg);
+}
+
+/*
+ * Give a reader back to its pool, once no statement
+ * or transaction of the last user is left on it.
+ */
+static void put_reader(struct shared_db *sd, sqlite3 *db)
+{
+    if (!sqlite3_get_autocommit(db))
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    if (sqlite3_next_stmt(db, NULL) == NULL) {
+        pthread_mutex_lock(&shared_lock);
+        if (sd->nidle < SHARED_DB_READERS) {
+            sd->idle[sd->nidle++] = db;
+            db = NULL;
+        }
+        pthread_mutex_unlock(&shared_lock);
+    }
+    if (db)
+        sqlite3_close_v2(db);
+}
+
+/*
+ * (sqlite3-open-shared <path> &optional ro key)
+ * Like sqlite3-open, in WAL mode. Read-only opens reuse pooled
+ * connections opened with the same key.
+ */
+static void op_sqlite3_open_shared(Lisp_VM *vm, Lisp_Pair *args)
+{
+    const char *path = lisp_safe_cstring(vm, CAR(args));
+    int ro = (CADR(args) == lisp_true);
+    const char *key = optional_key(vm, args);
+    Lisp_Object *o = lisp_make_object_ex(vm, &sqlite3_db_class);
+    struct sqlite3_db *db = sqlite3_db_new();
+    char msg[MAX_OPEN_ERROR];
+    db->vm = vm;
+    if (!(ro ? shared_reader(path, key, &db->pool, &db->instance, msg)
+        : open_wal(path, key, &db->instance, msg)))
+    {
+        db->instance = NULL;
+        sqlite3_db_unref(db);
+        lisp_err(vm, "can not open file `%s': %s", path, msg);
     }
     lisp_object_ex_set_ptr(o, db);
-    rc = sqlite3_busy_timeout(db->instance, 10*1000); /* 10 seconds */
-    if (rc != SQLITE_OK)
-        sqlite_err(vm, db->instance);
 }
 
 /* (sqlite3-exec db sql) */
@@ -163,17 +561,82 @@ static void op_sqlite3_last_insert_rowid(Lisp_VM *vm, Lisp_Pair *args)
     PUSHX(vm, lisp_number_new(vm, (double)sqlite3_last_insert_rowid(db)));
 }
 
-/* (sqlite3-prepare db src) */
+/* Take a statement for src out of db's cache, or prepare a new one */
+static void prepare_cached(Lisp_VM *vm, struct sqlite3_db *db, const char *src)
+{
+    Lisp_Object *oStmt = lisp_make_object_ex(vm, &sqlite3_cached_stmt_class);
+    struct sqlite3_statement *cs = lisp_object_ex_ptr(oStmt);
+    uint32_t hash = sql_hash(src);
+    struct cached_stmt **pp = &db->cache;
+
+    for (; *pp; pp = &(*pp)->next) {
+        struct cached_stmt *c = *pp;
+        if (c->hash == hash && strcmp(sqlite3_sql(c->stmt), src) == 0) {
+            *pp = c->next;
+            db->cache_size--;
+            db->cache_hits++;
+            cs->db = sqlite3_db_ref(db);
+            cs->stmt = c->stmt;
+            cs->done = false;
+            cs->hash = hash;
+            free(c);
+            return;
+        }
+    }
+
+    db->cache_misses++;
+    cs->db = sqlite3_db_ref(db);
+    cs->hash = hash;
+    int rc = sqlite3_prepare_v2(db->instance, src, -1, &cs->stmt, NULL);
+    if (rc != SQLITE_OK)
+        sqlite_err(vm, db->instance);
+}
+
+/*
+ * (sqlite3-prepare db src &optional cached)
+ * A cached statement returns to db's statement cache when closed.
+ */
 static void op_sqlite3_prepare(Lisp_VM *vm, Lisp_Pair *args)
 {
+    if (CDDR(args) != lisp_nil && CADDR(args) == lisp_true)
+    {
+        prepare_cached(vm, safe_db(vm, CAR(args)),
+            lisp_safe_cstring(vm, CADR(args)));
+        return;
+    }
     struct sqlite3 *db = safe_db_instance(vm, CAR(args));
     const char *src = lisp_safe_cstring(vm, CADR(args));
     Lisp_Object *oStmt = lisp_make_object_ex(vm, &sqlite3_stmt_class);
-    struct sqlite3_stmt *stmt = NULL;
-    int rc = sqlite3_prepare_v2(db, src, -1, &stmt, NULL);
+    struct sqlite3_statement *st = lisp_object_ex_ptr(oStmt);
+    int rc = sqlite3_prepare_v2(db, src, -1, &st->stmt, NULL);
     if (rc != SQLITE_OK)
         sqlite_err(vm, db);
-    lisp_object_ex_set_ptr(oStmt, stmt);
+}
+
+/* Bind o to parameter index of stmt. Return false if o can not be bound. */
+static bool bind_value(sqlite3_stmt *stmt, int index, Lisp_Object *o)
+{
+    if (o == lisp_undef||o == lisp_nil) {
+        sqlite3_bind_null(stmt, index);
+    } else if (o == lisp_true) {
+        sqlite3_bind_int(stmt, index, 1);
+    } else if (o == lisp_false) {
+        sqlite3_bind_int(stmt, index, 0);
+    } else if (lisp_string_p(o)||lisp_symbol_p(o)) {
+        sqlite3_bind_text(stmt, index,
+            lisp_string_cstr((Lisp_String*)o), -1,
+            SQLITE_STATIC);
+    } else if (lisp_integer_p(o)) {
+        sqlite3_bind_int64(stmt, index, (int64_t)lisp_number_value((Lisp_Number*)o));
+    } else if (lisp_number_p(o)) {
+        sqlite3_bind_double(stmt, index, lisp_number_value((Lisp_Number*)o));
+    } else if (lisp_buffer_p(o)) {
+        Lisp_Buffer *b = (void*)o;
+        sqlite3_bind_blob(stmt, index, lisp_buffer_bytes(b), (int)lisp_buffer_size(b), NULL);
+    } else {
+        return false;
+    }
+    return true;
 }
 
 /* (sqlite3-bind stmt args) */
@@ -183,122 +646,232 @@ static void op_sqlite3_bind(Lisp_VM *vm, Lisp_Pair *args)
     args = (Lisp_Pair*)CADR(args);
     int index = 1;
     for (; args != (void*)lisp_nil; args = (Lisp_Pair*)CDR(args)) {
-        Lisp_Object *o = CAR(args);
-        if (o == lisp_undef||o == lisp_nil) {
-            sqlite3_bind_null(stmt, index);
-        } else if (o == lisp_true) {
-            sqlite3_bind_int(stmt, index, 1);
-        } else if (o == lisp_false) {
-            sqlite3_bind_int(stmt, index, 0);
-        } else if (lisp_string_p(o)||lisp_symbol_p(o)) {
-            sqlite3_bind_text(stmt, index,
-                lisp_string_cstr((Lisp_String*)o), -1,
-                SQLITE_STATIC);
-        } else if (lisp_integer_p(o)) {
-            sqlite3_bind_int64(stmt, index, (int64_t)lisp_number_value((Lisp_Number*)o));
-        } else if (lisp_number_p(o)) {
-            sqlite3_bind_double(stmt, index, lisp_number_value((Lisp_Number*)o));
-        } else if (lisp_buffer_p(o)) {
-            Lisp_Buffer *b = (void*)o;
-            sqlite3_bind_blob(stmt, index, lisp_buffer_bytes(b), (int)lisp_buffer_size(b), NULL);
-        } else {
+        if (!bind_value(stmt, index, CAR(args)))
             lisp_err(vm, "sqlite3-bind: bad arguments");
-        }
         index++;
     }
     lisp_push(vm, lisp_true);
 }
 
-static void fetch_row(Lisp_VM *vm, sqlite3_stmt *stmt)
+/*
+ * Bind row to stmt and step it. Return NULL on success, or else
+ * why the row failed.
+ */
+static const char *insert_row(sqlite3_stmt *stmt, Lisp_Object *row)
 {
-    int cnt = sqlite3_column_count(stmt);
-    for (int i = 0; i < cnt; i++)
+    int index = 1;
+    for (; row != lisp_nil; row = CDR(row), index++) {
+        if (!lisp_pair_p(row))
+            return "not a list";
+        if (!bind_value(stmt, index, CAR(row)))
+            return "bad value";
+    }
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE || rc == SQLITE_ROW)
+        return NULL;
+    return sqlite3_errmsg(sqlite3_db_handle(stmt));
+}
+
+/*
+ * (sqlite3-insert-many stmt rows)
+ *
+ * Step stmt once for each list of values in rows, all in one
+ * savepoint, so that they are committed together. A row that fails
+ * does not stop the others. Return ((inserted . n) (errors . l)),
+ * where l lists (<index> . <message>) for the rows that failed.
+ */
+static void op_sqlite3_insert_many(Lisp_VM *vm, Lisp_Pair *args)
+{
+    struct sqlite3_statement *st = safe_statement(vm, CAR(args));
+    Lisp_Object *rows = CADR(args);
+    sqlite3 *db = sqlite3_db_handle(st->stmt);
+    int inserted = 0, failed = 0, index = 0;
+
+    sqlite3_reset(st->stmt);
+    sqlite3_clear_bindings(st->stmt);
+    st->done = false;
+    if (sqlite3_exec(db, "SAVEPOINT insert_many", NULL, NULL, NULL) != SQLITE_OK)
+        sqlite_err(vm, db);
+
+    lisp_make_symbol(vm, "errors");
+    for (; rows != lisp_nil && lisp_pair_p(rows); rows = CDR(rows), index++) {
+        const char *msg = insert_row(st->stmt, CAR(rows));
+        if (msg) {
+            PUSHX(vm, lisp_number_new(vm, index));
+            lisp_push_cstr(vm, msg);
+            lisp_cons(vm);
+            failed++;
+        } else {
+            inserted++;
+        }
+        sqlite3_reset(st->stmt);
+        sqlite3_clear_bindings(st->stmt);
+    }
+    lisp_make_list(vm, failed);
+    lisp_cons(vm);
+
+    if (sqlite3_exec(db, "RELEASE insert_many", NULL, NULL, NULL) != SQLITE_OK) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "%s", sqlite3_errmsg(db));
+        lisp_pop(vm, 1);
+        sqlite3_exec(db, "ROLLBACK TO insert_many", NULL, NULL, NULL);
+        sqlite3_exec(db, "RELEASE insert_many", NULL, NULL, NULL);
+        lisp_err(vm, "sqlite3: %s", msg);
+    }
+
+    lisp_make_symbol(vm, "inserted");
+    PUSHX(vm, lisp_number_new(vm, inserted));
+    lisp_cons(vm);
+    lisp_exch(vm);
+    lisp_make_list(vm, 2);
+}
+
+static void push_column(Lisp_VM *vm, sqlite3_stmt *stmt, int i)
+{
+    switch (sqlite3_column_type(stmt, i))
     {
-        const char *name = sqlite3_column_name(stmt, i);
-        lisp_make_symbol(vm, name);
-        switch (sqlite3_column_type(stmt, i))
+        case SQLITE_INTEGER:
+            PUSHX(vm, lisp_number_new(vm, (double)sqlite3_column_int64(stmt, i)));
+            break;
+        case SQLITE_FLOAT:
+            PUSHX(vm, lisp_number_new(vm, sqlite3_column_double(stmt, i)));
+            break;
+        case SQLITE_TEXT:
         {
-            case SQLITE_INTEGER:
-                PUSHX(vm, lisp_number_new(vm, (double)sqlite3_column_int64(stmt, i)));
-                break;
-            case SQLITE_FLOAT:
-                PUSHX(vm, lisp_number_new(vm, sqlite3_column_double(stmt, i)));
-                break;
-            case SQLITE_TEXT:
-            {
-                const char *s = (const char*)sqlite3_column_text(stmt, i);
-                int n = sqlite3_column_bytes(stmt, i);
-                PUSHX(vm, lisp_string_new(vm, s, n));
-                break;
-            }
-            case SQLITE_BLOB:
-            {
-                const void *d = sqlite3_column_blob(stmt, i);
-                int n = sqlite3_column_bytes(stmt, i);
-                PUSHX(vm, lisp_buffer_copy(vm, d, n));
-                break;
-            }
-            case SQLITE_NULL:
-                // We don't return NULL because it can not
-                // preserve the alist structure
-                //  (k . undefined)
-                // => (k)
-                lisp_push(vm, lisp_undef);
-                break;
-            default:
-                lisp_err(vm, "Bad result type");
-                break;
+            const char *s = (const char*)sqlite3_column_text(stmt, i);
+            int n = sqlite3_column_bytes(stmt, i);
+            PUSHX(vm, lisp_string_new(vm, s, n));
+            break;
+        }
+        case SQLITE_BLOB:
+        {
+            const void *d = sqlite3_column_blob(stmt, i);
+            int n = sqlite3_column_bytes(stmt, i);
+            PUSHX(vm, lisp_buffer_copy(vm, d, n));
+            break;
         }
-        lisp_cons(vm);
+        case SQLITE_NULL:
+            // We don't return NULL because it can not
+            // preserve the alist structure
+            //  (k . undefined)
+            // => (k)
+            lisp_push(vm, lisp_undef);
+            break;
+        default:
+            lisp_err(vm, "Bad result type");
+            break;
+    }
+}
+
+/*
+ * The column names of st as a list of symbols, made once for the
+ * statement and shared by its rows.
+ */
+static Lisp_Object *statement_columns(Lisp_VM *vm, struct sqlite3_statement *st)
+{
+    int cnt = sqlite3_column_count(st->stmt);
+    if (st->columns && st->ncolumns == cnt)
+        return st->columns;
+    for (int i = 0; i < cnt; i++)
+        lisp_make_symbol(vm, sqlite3_column_name(st->stmt, i));
+    lisp_make_list(vm, cnt);
+    st->columns = lisp_pop(vm, 1);
+    st->ncolumns = cnt;
+    return st->columns;
+}
+
+/*
+ * Push the current row as an alist of columns, or if compact as
+ * an array of the values in the order of (sqlite3-columns stmt).
+ */
+static void fetch_row(Lisp_VM *vm, struct sqlite3_statement *st, bool compact)
+{
+    Lisp_Object *col = statement_columns(vm, st);
+    int cnt = st->ncolumns;
+    for (int i = 0; i < cnt; i++, col = lisp_cdr((Lisp_Pair*)col))
+    {
+        if (!compact)
+            lisp_push(vm, lisp_car((Lisp_Pair*)col));
+        push_column(vm, st->stmt, i);
+        if (!compact)
+            lisp_cons(vm);
+    }
+    if (compact)
+        lisp_make_array(vm, cnt);
+    else
+        lisp_make_list(vm, cnt);
+}
+
+/* Step st, return SQLITE_ROW or SQLITE_DONE, or raise an error */
+static int step(Lisp_VM *vm, struct sqlite3_statement *st, int pushed)
+{
+    int rc = sqlite3_step(st->stmt);
+    if (rc == SQLITE_DONE)
+        st->done = true;
+    else if (rc != SQLITE_ROW)
+    {
+        lisp_pop(vm, pushed);
+        lisp_err(vm, "sqlite3: %s", sqlite3_errstr(rc));
     }
-    lisp_push(vm, lisp_nil);
-    while (cnt-- > 0)
-        lisp_cons(vm);
+    return rc;
 }
 
 /* (sqlite3-step stmt) */
 static void op_sqlite3_step(Lisp_VM *vm, Lisp_Pair *args)
 {
-    struct sqlite3_stmt * stmt = safe_stmt(vm, CAR(args));
-    int rc = sqlite3_step(stmt);
-    if (rc == SQLITE_DONE) {
+    struct sqlite3_statement *st = safe_statement(vm, CAR(args));
+    if (step(vm, st, 0) == SQLITE_DONE) {
         lisp_push(vm, lisp_nil);
-    } else if (rc == SQLITE_ROW) {
-        fetch_row(vm, stmt);
     } else {
-        lisp_err(vm, "sqlite3: %s", sqlite3_errstr(rc));
-//        lisp_push(vm, lisp_false);
+        fetch_row(vm, st, false);
     }
 }
 
-/* (sqlite3-run stmt) */
+/* (sqlite3-run stmt &optional compact) */
 static void op_sqlite3_run(Lisp_VM *vm, Lisp_Pair *args)
 {
-    struct sqlite3_stmt * stmt = safe_stmt(vm, CAR(args));
+    struct sqlite3_statement *st = safe_statement(vm, CAR(args));
+    bool compact = CDR(args) != lisp_nil && CADR(args) == lisp_true;
     int rows = 0;
-    while (true)
+    while (step(vm, st, rows) == SQLITE_ROW)
     {
-        int rc = sqlite3_step(stmt);
-        if (rc == SQLITE_DONE) {
-            lisp_make_list(vm, rows);
-            return;
-        } else if (rc == SQLITE_ROW) {
-            fetch_row(vm, stmt);
-            rows++;
-        } else {
-            lisp_pop(vm, rows);
-            lisp_err(vm, "sqlite3: %s", sqlite3_errstr(rc));
-            //lisp_push(vm, lisp_false);
-            return;
-        }
+        fetch_row(vm, st, compact);
+        rows++;
+    }
+    lisp_make_list(vm, rows);
+}
+
+/*
+ * (sqlite3-fetch stmt n &optional compact)
+ * Step stmt for up to n more rows. Return () once it is done,
+ * until it is reset.
+ */
+static void op_sqlite3_fetch(Lisp_VM *vm, Lisp_Pair *args)
+{
+    struct sqlite3_statement *st = safe_statement(vm, CAR(args));
+    int n = lisp_safe_int(vm, CADR(args));
+    bool compact = CDDR(args) != lisp_nil && CADDR(args) == lisp_true;
+    int rows = 0;
+    while (rows < n && !st->done && step(vm, st, rows) == SQLITE_ROW)
+    {
+        fetch_row(vm, st, compact);
+        rows++;
     }
+    lisp_make_list(vm, rows);
+}
+
+/* (sqlite3-columns stmt) */
+static void op_sqlite3_columns(Lisp_VM *vm, Lisp_Pair *args)
+{
+    lisp_push(vm, statement_columns(vm, safe_statement(vm, CAR(args))));
 }
 
 /* (sqlite3-reset stmt) */
 static void op_sqlite3_reset(Lisp_VM *vm, Lisp_Pair *args)
 {
-    struct sqlite3_stmt * stmt = safe_stmt(vm, CAR(args));
-    int rc = sqlite3_reset(stmt);
+    struct sqlite3_statement *st = safe_statement(vm, CAR(args));
+    int rc = sqlite3_reset(st->stmt);
+    st->done = false;
     if (rc == SQLITE_OK)
         lisp_push(vm, lisp_true);
     else
@@ -417,6 +990,37 @@ static void op_open_blob_output(Lisp_VM *vm, Lisp_Pair *args)
     lisp_make_output_port(vm);
 }
 
+/*
+ * (sqlite3-statement-cache db &optional capacity)
+ * Return ((hits . n) (misses . n) (size . n) (capacity . n)) of db's
+ * statement cache, after setting its capacity if given.
+ */
+static void op_sqlite3_statement_cache(Lisp_VM *vm, Lisp_Pair *args)
+{
+    struct sqlite3_db *db = safe_db(vm, CAR(args));
+    if (CDR(args) != lisp_nil)
+    {
+        int capacity = lisp_safe_int(vm, CADR(args));
+        if (capacity < 0)
+            lisp_err(vm, "sqlite3-statement-cache: bad capacity");
+        db->cache_capacity = capacity;
+        trim_cache(db, capacity);
+    }
+    lisp_make_symbol(vm, "hits");
+    PUSHX(vm, lisp_number_new(vm, (double)db->cache_hits));
+    lisp_cons(vm);
+    lisp_make_symbol(vm, "misses");
+    PUSHX(vm, lisp_number_new(vm, (double)db->cache_misses));
+    lisp_cons(vm);
+    lisp_make_symbol(vm, "size");
+    PUSHX(vm, lisp_number_new(vm, db->cache_size));
+    lisp_cons(vm);
+    lisp_make_symbol(vm, "capacity");
+    PUSHX(vm, lisp_number_new(vm, db->cache_capacity));
+    lisp_cons(vm);
+    lisp_make_list(vm, 4);
+}
+
 static void op_version(Lisp_VM *vm, Lisp_Pair *args)
 {
     lisp_push_cstr(vm, sqlite3_version);
@@ -425,16 +1029,21 @@ static void op_version(Lisp_VM *vm, Lisp_Pair *args)
 void lisp_sqlite3_init(Lisp_VM *vm)
 {
     lisp_defn(vm, "sqlite3-open",    op_sqlite3_open);
+    lisp_defn(vm, "sqlite3-open-shared", op_sqlite3_open_shared);
     lisp_defn(vm, "sqlite3-exec",    op_sqlite3_exec);
     lisp_defn(vm, "sqlite3-prepare", op_sqlite3_prepare);
     lisp_defn(vm, "sqlite3-bind",    op_sqlite3_bind);
     lisp_defn(vm, "sqlite3-step",    op_sqlite3_step);
     lisp_defn(vm, "sqlite3-run",     op_sqlite3_run);
+    lisp_defn(vm, "sqlite3-fetch",   op_sqlite3_fetch);
+    lisp_defn(vm, "sqlite3-insert-many", op_sqlite3_insert_many);
+    lisp_defn(vm, "sqlite3-columns", op_sqlite3_columns);
     lisp_defn(vm, "sqlite3-reset",   op_sqlite3_reset);
     lisp_defn(vm, "sqlite3-errmsg",  op_sqlite3_errmsg);
     lisp_defn(vm, "sqlite3-last-insert-rowid", op_sqlite3_last_insert_rowid);
     lisp_defn(vm, "sqlite3-open-blob-input", op_open_blob_input);
     lisp_defn(vm, "sqlite3-open-blob-output", op_open_blob_output);
+    lisp_defn(vm, "sqlite3-statement-cache", op_sqlite3_statement_cache);
     lisp_defn(vm, "sqlite3-version", op_version);
 }
 
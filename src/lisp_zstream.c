@@ -19,12 +19,122 @@
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <zlib.h>
 
 #include "lisp_zstream.h"
 #include "common.h"
 
-#define ZBUF_SIZE (1024*128)
+#define ZCHUNK_SIZE (16*1024)
+
+/*
+ * zlib states are big, about 256KB for deflate, so the ones of ended
+ * streams are kept for the next stream of the same kind and reset,
+ * rather than set up for every response or message. A state taken on
+ * one worker may be given back on another as runs move, so the pool
+ * is shared under a lock rather than kept per thread.
+ */
+#define ZSTATE_POOL_SIZE 16
+
+struct zstate {
+	struct zstate *next;
+	bool compress;
+	int level;
+	int bits; // windowBits as for deflateInit2(), see zformat_bits()
+	z_stream zs;
+};
+
+static pthread_mutex_t zstate_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct zstate *zstate_pool;
+static int zstate_count;
+
+/* A deflate or inflate state reset for a new stream, or NULL */
+static z_stream *zstate_get(bool compress, int level, int bits)
+{
+	struct zstate **pp, *z = NULL;
+	pthread_mutex_lock(&zstate_lock);
+	for (pp = &zstate_pool; *pp; pp = &(*pp)->next) {
+		if ((*pp)->compress == compress && (*pp)->bits == bits
+		 && (!compress || (*pp)->level == level)) {
+			z = *pp;
+			*pp = z->next;
+			zstate_count--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&zstate_lock);
+
+	if (z) {
+		int zerr = compress ? deflateReset(&z->zs) : inflateReset(&z->zs);
+		if (zerr == Z_OK)
+			return &z->zs;
+		compress ? deflateEnd(&z->zs) : inflateEnd(&z->zs);
+		free(z);
+	}
+
+	z = calloc(1, sizeof(struct zstate));
+	if (!z)
+		return NULL;
+	z->compress = compress;
+	z->level = level;
+	z->bits = bits;
+	int zerr = compress
+		? deflateInit2(&z->zs, level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY)
+		: inflateInit2(&z->zs, bits);
+	if (zerr != Z_OK) {
+		free(z);
+		return NULL;
+	}
+	return &z->zs;
+}
+
+static void zstate_put(z_stream *zs)
+{
+	struct zstate *z = (struct zstate*)((char*)zs - offsetof(struct zstate, zs));
+	pthread_mutex_lock(&zstate_lock);
+	if (zstate_count < ZSTATE_POOL_SIZE) {
+		z->next = zstate_pool;
+		zstate_pool = z;
+		zstate_count++;
+		z = NULL;
+	}
+	pthread_mutex_unlock(&zstate_lock);
+	if (z) {
+		z->compress ? deflateEnd(&z->zs) : inflateEnd(&z->zs);
+		free(z);
+	}
+}
+
+/*
+ * windowBits for a format symbol: deflate is the zlib format, which
+ * HTTP calls deflate, raw has no header at all. Inflating takes gzip
+ * and zlib alike.
+ */
+static int zformat_bits(Lisp_VM *vm, Lisp_Pair *args, bool compress)
+{
+	if (args == (void*)lisp_nil || CAR(args) == lisp_nil)
+		return compress ? 15 : 15 + 32;
+	const char *s = lisp_safe_csymbol(vm, CAR(args));
+	if (strcmp(s, "raw") == 0)
+		return -15;
+	if (strcmp(s, "gzip") == 0)
+		return compress ? 15 + 16 : 15 + 32;
+	if (strcmp(s, "deflate") == 0)
+		return compress ? 15 : 15 + 32;
+	lisp_err(vm, "bad compression format: %s", s);
+	return 0;
+}
+
+static int zlevel(Lisp_VM *vm, Lisp_Pair *args)
+{
+	if (args == (void*)lisp_nil || CDR(args) == lisp_nil)
+		return Z_DEFAULT_COMPRESSION;
+	int level = lisp_safe_int(vm, CADR(args));
+	if (level < 0 || level > 9)
+		lisp_err(vm, "bad compression level: %d", level);
+	return level;
+}
 
 enum {
 	ZSTREAM_NONE,
@@ -35,9 +145,8 @@ enum {
 
 struct zstream_context {
 	Lisp_VM *vm;
-	z_stream zs;
-	Lisp_Buffer *zbuf; /* Holding source data */
-	Lisp_Port *source;
+	z_stream *zs; /* from the pool, see zstate_get() */
+	Lisp_Port *source; /* or the sink of an output stream */
 	int mode;
 };
 
@@ -45,7 +154,7 @@ static size_t zstream_read(void *stream, void *buffer, size_t cap)
 {
 	int zerr = Z_OK;
 	struct zstream_context *zctx = stream;
-	z_stream *zs = &zctx->zs;
+	z_stream *zs = zctx->zs;
 	size_t in_size = 0;
 	
 	if (zctx->mode == ZSTREAM_NONE || zctx->mode == ZSTREAM_ENDED)
@@ -85,24 +194,47 @@ static void zstream_mark(void *stream)
 	if (zctx->source) {
 		lisp_mark((Lisp_Object*)zctx->source);
 	}
-	if (zctx->zbuf) {
-		lisp_mark((Lisp_Object*)zctx->zbuf);
-	}
 }
 
+/* Collected or closed, it must not touch the port any more */
 static void zstream_close(void *stream)
 {
 	struct zstream_context *zctx = stream;
-	z_stream *zs = &zctx->zs;
-	
-	if (zctx->mode == ZSTREAM_UNCOMPRESS) {
-		inflateEnd(zs);
-	} else if (zctx->mode == ZSTREAM_COMPRESS) {
-		deflateEnd(zs);
+	if (zctx->zs) {
+		zstate_put(zctx->zs);
+		zctx->zs = NULL;
 	}
 	zctx->mode = ZSTREAM_NONE;
 }
 
+/* Deflate into the sink port until all input is taken, or with
+ * Z_FINISH until the end has been written. */
+static bool zstream_deflate(struct zstream_context *zctx, const void *buf,
+  size_t size, int flush)
+{
+	z_stream *zs = zctx->zs;
+	uint8_t chunk[ZCHUNK_SIZE];
+	int zerr;
+	zs->next_in = (Bytef*)buf;
+	zs->avail_in = (uInt)size;
+	do {
+		zs->next_out = chunk;
+		zs->avail_out = sizeof(chunk);
+		zerr = deflate(zs, flush);
+		lisp_port_put_bytes(zctx->source, chunk, sizeof(chunk) - zs->avail_out);
+	} while (zerr == Z_OK && (zs->avail_in > 0 || zs->avail_out == 0));
+	return zerr == Z_OK || zerr == Z_STREAM_END || zerr == Z_BUF_ERROR;
+}
+
+static size_t zstream_write(void *stream, const void *buf, size_t size)
+{
+	struct zstream_context *zctx = stream;
+	if (zctx->mode != ZSTREAM_COMPRESS
+	 || !zstream_deflate(zctx, buf, size, Z_NO_FLUSH))
+		return 0;
+	return size;
+}
+
 static struct lisp_stream_class_t zstream_class = {
 	.context_size = sizeof(struct zstream_context),
 	.read = zstream_read,
@@ -110,47 +242,168 @@ static struct lisp_stream_class_t zstream_class = {
 	.mark = zstream_mark
 };
 
+static struct lisp_stream_class_t zstream_output_class = {
+	.context_size = sizeof(struct zstream_context),
+	.write = zstream_write,
+	.close = zstream_close,
+	.mark = zstream_mark
+};
+
 
-/* (open-deflate <source-port>) */
+/* (open-deflate <source-port> &optional format level)
+ * <format> is deflate (the default), gzip or raw. */
 static void op_open_deflate(Lisp_VM*vm, Lisp_Pair* args)
 {
 	if (!lisp_input_port_p(CAR(args)))
 		lisp_err(vm, "deflate: source not input port");
+	int bits = zformat_bits(vm, (Lisp_Pair*)CDR(args), true);
+	int level = zlevel(vm, (Lisp_Pair*)CDR(args));
 	lisp_push_buffer(vm, NULL, 512);
 	Lisp_Stream *zstream = lisp_push_stream(vm, &zstream_class, NULL);
 	struct zstream_context *zctx = lisp_stream_context(zstream);
-	int zerr = deflateInit(&zctx->zs, Z_DEFAULT_COMPRESSION);
-	if (zerr != Z_OK) {
-		lisp_err(vm, "deflateInit error: %d", zerr);
-	}
+	if (!(zctx->zs = zstate_get(true, level, bits)))
+		lisp_err(vm, "deflateInit error");
 	zctx->vm = vm;
 	zctx->mode = ZSTREAM_COMPRESS;
 	zctx->source = (Lisp_Port*)CAR(args);
 	lisp_make_input_port(vm);
 }
 
-/* (open-inflate <source-port>) */
+/* (open-inflate <source-port> &optional format)
+ * Without <format> either zlib or gzip data is taken. */
 static void op_open_inflate(Lisp_VM*vm, Lisp_Pair* args)
 {
 	if (!lisp_input_port_p(CAR(args)))
 		lisp_err(vm, "inflate: not input port");
+	int bits = zformat_bits(vm, (Lisp_Pair*)CDR(args), false);
 	lisp_push_buffer(vm, NULL, 512);
 	Lisp_Stream *zstream = lisp_push_stream(vm, &zstream_class, NULL);
 	struct zstream_context *zctx = lisp_stream_context(zstream);
-	int zerr = inflateInit(&zctx->zs);
-	if (zerr != Z_OK) {
-		lisp_err(vm, "inflateInit error: %d", zerr);
-	}
+	if (!(zctx->zs = zstate_get(false, 0, bits)))
+		lisp_err(vm, "inflateInit error");
 	zctx->vm = vm;
 	zctx->mode = ZSTREAM_UNCOMPRESS;
 	zctx->source = (Lisp_Port*)CAR(args);
 	lisp_make_input_port(vm);
 }
 
+/*
+ * (open-deflate-output <sink-port> &optional format level)
+ * Bytes written are compressed into <sink-port>, as they fill the
+ * port and on each flush. The data is only complete after
+ * (deflate-output-finish <port>), closing <port> drops the rest.
+ */
+static void op_open_deflate_output(Lisp_VM*vm, Lisp_Pair* args)
+{
+	if (!lisp_output_port_p(CAR(args)))
+		lisp_err(vm, "deflate: sink not output port");
+	int bits = zformat_bits(vm, (Lisp_Pair*)CDR(args), true);
+	int level = zlevel(vm, (Lisp_Pair*)CDR(args));
+	lisp_push_buffer(vm, NULL, ZCHUNK_SIZE);
+	Lisp_Stream *zstream = lisp_push_stream(vm, &zstream_output_class, NULL);
+	struct zstream_context *zctx = lisp_stream_context(zstream);
+	if (!(zctx->zs = zstate_get(true, level, bits)))
+		lisp_err(vm, "deflateInit error");
+	zctx->vm = vm;
+	zctx->mode = ZSTREAM_COMPRESS;
+	zctx->source = (Lisp_Port*)CAR(args);
+	lisp_make_output_port(vm);
+}
+
+/*
+ * (deflate-output-finish <port>)
+ * Write the end of the compressed data, with the gzip footer if any,
+ * to the sink and flush it. The sink is left open.
+ */
+static void op_deflate_output_finish(Lisp_VM*vm, Lisp_Pair* args)
+{
+	if (!lisp_output_port_p(CAR(args)))
+		lisp_err(vm, "deflate-output-finish: not output port");
+	Lisp_Port *port = (Lisp_Port*)CAR(args);
+	Lisp_Stream *stream = lisp_port_get_stream(port);
+	if (!stream || lisp_stream_class(stream) != &zstream_output_class)
+		lisp_err(vm, "deflate-output-finish: not deflate output");
+	lisp_port_flush(port);
+	struct zstream_context *zctx = lisp_stream_context(stream);
+	if (!zctx || zctx->mode != ZSTREAM_COMPRESS)
+		lisp_err(vm, "deflate-output-finish: finished already");
+	bool ok = zstream_deflate(zctx, NULL, 0, Z_FINISH);
+	zctx->mode = ZSTREAM_ENDED;
+	lisp_port_flush(zctx->source);
+	lisp_push(vm, ok ? lisp_true : lisp_false);
+}
+
+#define MESSAGE_CHUNK_SIZE (16*1024)
+
+static const uint8_t sync_tail[4] = {0, 0, 0xff, 0xff};
+
+bool lisp_zstream_deflate_message(Lisp_Buffer *out, const void *data, size_t size)
+{
+	z_stream *zs = zstate_get(true, Z_DEFAULT_COMPRESSION, -15);
+	uint8_t chunk[MESSAGE_CHUNK_SIZE];
+	int zerr;
+
+	if (!zs)
+		return false;
+	zs->next_in = (Bytef*)data;
+	zs->avail_in = (uInt)size;
+	size_t start = lisp_buffer_size(out);
+	do {
+		zs->next_out = chunk;
+		zs->avail_out = sizeof(chunk);
+		zerr = deflate(zs, Z_SYNC_FLUSH);
+		lisp_buffer_add_bytes(out, chunk, sizeof(chunk) - zs->avail_out);
+	} while (zerr == Z_OK && zs->avail_out == 0);
+	zstate_put(zs);
+	if (zerr == Z_BUF_ERROR)
+		zerr = Z_OK; // nothing was left to flush
+
+	size_t n = lisp_buffer_size(out) - start;
+	if (zerr != Z_OK || n < 4)
+		return false;
+	lisp_buffer_set_size(out, lisp_buffer_size(out) - 4);
+	return true;
+}
+
+bool lisp_zstream_inflate_message(Lisp_Buffer *out, const void *data, size_t size,
+  size_t max)
+{
+	z_stream *zs = zstate_get(false, 0, -15);
+	uint8_t chunk[MESSAGE_CHUNK_SIZE];
+	int zerr = Z_OK;
+	size_t total = 0;
+
+	if (!zs)
+		return false;
+	for (int i = 0; i < 2 && zerr == Z_OK; i++) {
+		// The message, then the tail it was sent without
+		zs->next_in = i == 0 ? (Bytef*)data : (Bytef*)sync_tail;
+		zs->avail_in = i == 0 ? (uInt)size : sizeof(sync_tail);
+		do {
+			zs->next_out = chunk;
+			zs->avail_out = sizeof(chunk);
+			zerr = inflate(zs, Z_SYNC_FLUSH);
+			size_t n = sizeof(chunk) - zs->avail_out;
+			total += n;
+			if (total > max) {
+				zerr = Z_MEM_ERROR;
+				break;
+			}
+			lisp_buffer_add_bytes(out, chunk, n);
+		} while (zerr == Z_OK && (zs->avail_in > 0 || zs->avail_out == 0));
+		if (zerr == Z_BUF_ERROR && zs->avail_in == 0)
+			zerr = Z_OK; // needs more input
+	}
+	zstate_put(zs);
+	return zerr == Z_OK || zerr == Z_STREAM_END;
+}
+
 void lisp_zstream_init(Lisp_VM* vm)
 {
 	lisp_defn(vm, "open-deflate", op_open_deflate);
 	lisp_defn(vm, "open-inflate", op_open_inflate);
+	lisp_defn(vm, "open-deflate-output", op_open_deflate_output);
+	lisp_defn(vm, "deflate-output-finish", op_deflate_output_finish);
 }
 
 #if 0
@@ -21,3 +21,13 @@
 #include "lisp.h"
 
 void lisp_zstream_init(Lisp_VM*vm);
+
+/*
+ * Messages of permessage-deflate (RFC 7692). Raw deflate data without
+ * the 00 00 ff ff that ends a sync flush, each message on its own as
+ * there is no context takeover. The result is added to out. Return
+ * false on bad data, or if inflating would add more than max bytes.
+ */
+bool lisp_zstream_deflate_message(Lisp_Buffer *out, const void *data, size_t size);
+bool lisp_zstream_inflate_message(Lisp_Buffer *out, const void *data, size_t size,
+  size_t max);
@@ -44,6 +44,9 @@ int main(int argc, char *argv[])
 	twk_set_dist_path(s?s:".");
 	s = getenv("TWK_VAR");
 	twk_set_var_path(s?s:"./var");
+	s = getenv("TWK_WORKERS");
+	if (s)
+		twk_set_worker_count(atoi(s));
 	
 	twk_start_threads(NULL);
 	return 0;
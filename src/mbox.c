@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2020, Twinkle Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "mbox.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef _WIN32
+# include <windows.h>
+# define atomic_add(p, n) InterlockedExchangeAdd((volatile LONG*)(p), (LONG)(n))
+# define atomic_xchg(p, v) InterlockedExchangePointer((PVOID volatile*)(p), (v))
+# define atomic_cas(p, old, v) (InterlockedCompareExchange((volatile LONG*)(p), (LONG)(v), (LONG)(old)) == (LONG)(old))
+# define store_release(p, v) (MemoryBarrier(), *(p) = (v))
+# define load_acquire(p) (*(p))
+# define memory_barrier() MemoryBarrier()
+# define yield() Sleep(0)
+#else
+# include <sched.h>
+# define atomic_add(p, n) __sync_fetch_and_add((p), (n))
+# define atomic_xchg(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+# define atomic_cas(p, old, v) __sync_bool_compare_and_swap((p), (old), (v))
+# define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+# define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define memory_barrier() __sync_synchronize()
+# define yield() sched_yield()
+#endif
+
+void mbox_init(struct mbox *mb, size_t limit)
+{
+	memset(mb, 0, sizeof(struct mbox));
+	mb->tail = &mb->stub;
+	mb->head = &mb->stub;
+	mb->limit = limit;
+}
+
+static void free_msg(struct mbox *mb, struct mbox_msg *m)
+{
+	if (m != &mb->stub)
+		free(m);
+}
+
+void mbox_close(struct mbox *mb)
+{
+	mb->closed = 1;
+	memory_barrier();
+	while (mb->writers > 0)
+		yield();
+
+	struct mbox_msg *m = mb->head;
+	while (m) {
+		struct mbox_msg *next = m->next;
+		free_msg(mb, m);
+		m = next;
+	}
+	mb->head = mb->tail = &mb->stub;
+	mb->stub.next = NULL;
+	mb->offset = 0;
+	mb->bytes = 0;
+}
+
+struct mbox_msg *mbox_msg_new(size_t cap)
+{
+	struct mbox_msg *m = malloc(offsetof(struct mbox_msg, data) + cap);
+	if (m) {
+		m->next = NULL;
+		m->size = 0;
+		m->cap = cap;
+	}
+	return m;
+}
+
+struct mbox_msg *mbox_msg_add(struct mbox_msg *m, const void *buf, size_t size)
+{
+	if (m->size + size > m->cap) {
+		size_t cap = m->cap * 2;
+		if (cap < m->size + size)
+			cap = m->size + size;
+		struct mbox_msg *t = realloc(m, offsetof(struct mbox_msg, data) + cap);
+		if (!t) {
+			free(m);
+			return NULL;
+		}
+		m = t;
+		m->cap = cap;
+	}
+	memcpy(m->data + m->size, buf, size);
+	m->size += size;
+	return m;
+}
+
+static void update_high(struct mbox *mb, long bytes)
+{
+	long high = mb->high;
+	while (bytes > high && !atomic_cas(&mb->high, high, bytes))
+		high = mb->high;
+}
+
+bool mbox_post(struct mbox *mb, struct mbox_msg *m, bool *wake)
+{
+	bool ok = false;
+
+	*wake = false;
+	atomic_add(&mb->writers, 1);
+	if (!mb->closed) {
+		// Reserve room first, so that the reader never
+		// sees more than limit bytes.
+		long old = atomic_add(&mb->bytes, (long)m->size);
+		if ((size_t)old + m->size <= mb->limit) {
+			m->next = NULL;
+			struct mbox_msg *prev = atomic_xchg(&mb->tail, m);
+			store_release(&prev->next, m);
+			atomic_add(&mb->total, (long)m->size);
+			update_high(mb, old + (long)m->size);
+			*wake = old == 0;
+			ok = true;
+		} else {
+			atomic_add(&mb->bytes, -(long)m->size);
+			atomic_add(&mb->dropped, 1);
+		}
+	}
+	atomic_add(&mb->writers, -1);
+
+	if (!ok)
+		free(m);
+	return ok;
+}
+
+bool mbox_write(struct mbox *mb, const void *buf, size_t size, bool *wake)
+{
+	struct mbox_msg *m = mbox_msg_new(size);
+	*wake = false;
+	if (!m)
+		return false;
+	m = mbox_msg_add(m, buf, size);
+	return m && mbox_post(mb, m, wake);
+}
+
+size_t mbox_read(struct mbox *mb, void *buf, size_t size)
+{
+	size_t n = 0;
+	while (n < size) {
+		struct mbox_msg *m = load_acquire(&mb->head->next);
+		if (!m)
+			break;
+		size_t k = m->size - mb->offset;
+		if (k > size - n)
+			k = size - n;
+		if (buf)
+			memcpy((char*)buf + n, m->data + mb->offset, k);
+		n += k;
+		mb->offset += k;
+		if (mb->offset == m->size) {
+			// Writers only link to tail, which is m or a later
+			// message, so the old head can be freed.
+			free_msg(mb, mb->head);
+			mb->head = m;
+			mb->offset = 0;
+		}
+	}
+	if (n > 0)
+		atomic_add(&mb->bytes, -(long)n);
+	return n;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2020, Twinkle Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * MBOX -- Lock free multiple writer/single reader message queue
+ *
+ * Messages are linked in the order they are posted, so the queue
+ * grows without copying. The reader sees the messages as one byte
+ * stream. A message is either posted in its entirety or not at all.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+struct mbox_msg
+{
+	struct mbox_msg *volatile next;
+	size_t size;
+	size_t cap;
+	unsigned char data[1];
+};
+
+/*
+ * struct mbox
+ * tail is shared by the writers. head is the last message consumed
+ * by the reader, the first unread one is head->next.
+ */
+struct mbox
+{
+	struct mbox_msg *volatile tail;
+	struct mbox_msg *head;
+	size_t offset;          // bytes already read from head->next
+	size_t limit;           // maximal bytes waiting to be read
+	volatile long bytes;    // bytes posted but not read yet
+	volatile long total;    // bytes ever posted
+	volatile long writers;  // writers inside mbox_post()
+	volatile long high;     // most bytes ever waiting
+	volatile long dropped;  // messages rejected for want of room
+	volatile int closed;
+	struct mbox_msg stub;
+};
+
+void mbox_init(struct mbox *mb, size_t limit);
+
+/* Reject further posts and free the unread messages. */
+void mbox_close(struct mbox *mb);
+
+/* A message of at most cap bytes, to be filled by mbox_msg_add(). */
+struct mbox_msg *mbox_msg_new(size_t cap);
+
+/* Append to m, growing it if needed. Return NULL if out of memory,
+ * m is freed in that case. */
+struct mbox_msg *mbox_msg_add(struct mbox_msg *m, const void *buf, size_t size);
+
+/*
+ * Queue m. The mbox takes ownership whether or not it succeeds.
+ * Return false if the mbox is closed or m does not fit under limit.
+ * *wake is set if the mbox was empty, the reader should be woken
+ * then. Writers of a burst arriving later need not wake it again.
+ */
+bool mbox_post(struct mbox *mb, struct mbox_msg *m, bool *wake);
+
+/* Like mbox_post() but for a message in buf */
+bool mbox_write(struct mbox *mb, const void *buf, size_t size, bool *wake);
+
+/* Reader only */
+size_t mbox_read(struct mbox *mb, void *buf, size_t size);
+
+/* Reader only. True if mbox_read() would return some bytes. */
+static inline bool mbox_ready(struct mbox *mb)
+{
+	return mb->head->next != NULL;
+}
+
+/*
+ * Bytes not read yet, including messages still being linked
+ * by their writers. Can be called from any thread.
+ */
+static inline size_t mbox_bytes(struct mbox *mb)
+{
+	return (size_t)mb->bytes;
+}
@@ -17,5 +17,16 @@
 
 #pragma once
 
+#include <stdint.h>
+
 double microtime(void);
 
+/* Modification time of struct stat sb in nanoseconds */
+#ifdef _WIN32
+# define ST_MTIME_NS(sb) ((int64_t)(sb).st_mtime * 1000000000)
+#elif defined(__APPLE__)
+# define ST_MTIME_NS(sb) ((int64_t)(sb).st_mtimespec.tv_sec * 1000000000 + (sb).st_mtimespec.tv_nsec)
+#else
+# define ST_MTIME_NS(sb) ((int64_t)(sb).st_mtim.tv_sec * 1000000000 + (sb).st_mtim.tv_nsec)
+#endif
+
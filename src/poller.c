@@ -0,0 +1,318 @@
+/*    
+ * Copyright (C) 2020, Twinkle Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "poller.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#if defined(__linux__)
+# define POLLER_EPOLL
+# include <sys/epoll.h>
+# include <sys/timerfd.h>
+# include <unistd.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) \
+   || defined(__NetBSD__) || defined(__DragonFly__)
+# define POLLER_KQUEUE
+# include <sys/types.h>
+# include <sys/event.h>
+# include <sys/time.h>
+# include <unistd.h>
+#elif defined(_WIN32)
+# include <winsock2.h>
+#else
+# include <sys/select.h>
+#endif
+
+#define MAXEVENTS 256 /* Events fetched per wait */
+
+#if defined(POLLER_EPOLL)
+
+/*
+ * epoll_wait() only takes milliseconds, so finer waits go through a
+ * timer fd, which is reported with the poller itself as data.
+ */
+struct poller {
+	int epfd;
+	int tfd;
+};
+
+struct poller *poller_new(void)
+{
+	struct poller *p = malloc(sizeof(struct poller));
+	if (!p)
+		return NULL;
+	p->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (p->epfd < 0) {
+		free(p);
+		return NULL;
+	}
+	p->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (p->tfd >= 0) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = p;
+		if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->tfd, &ev) != 0) {
+			close(p->tfd);
+			p->tfd = -1;
+		}
+	}
+	return p;
+}
+
+void poller_delete(struct poller *p)
+{
+	if (p->tfd >= 0)
+		close(p->tfd);
+	close(p->epfd);
+	free(p);
+}
+
+static bool watch(struct poller *p, int fd, uint32_t events, void *data)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = data;
+	if (epoll_ctl(p->epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+		return true;
+	return errno == ENOENT && epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+bool poller_watch(struct poller *p, int fd, void *data)
+{
+	return watch(p, fd, EPOLLIN, data);
+}
+
+bool poller_watch_write(struct poller *p, int fd, void *data)
+{
+	return watch(p, fd, EPOLLOUT, data);
+}
+
+void poller_forget(struct poller *p, int fd)
+{
+	struct epoll_event ev; /* non-null for kernels before 2.6.9 */
+	epoll_ctl(p->epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int poller_wait(struct poller *p, double secs, void **ready, int max)
+{
+	struct epoll_event evs[MAXEVENTS];
+	int timeout = -1, k = 0;
+	if (max > MAXEVENTS)
+		max = MAXEVENTS;
+	if (secs > 0 && p->tfd >= 0) {
+		/* Setting the timer also clears an earlier expiry */
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = (time_t)secs;
+		its.it_value.tv_nsec = (long)((secs - its.it_value.tv_sec) * 1000000000L);
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1;
+		if (timerfd_settime(p->tfd, 0, &its, NULL) != 0)
+			timeout = (int)ceil(secs * 1000);
+	} else if (secs >= 0) {
+		timeout = (int)ceil(secs * 1000);
+	}
+	int n = epoll_wait(p->epfd, evs, max, timeout);
+	for (int i = 0; i < n; i++) {
+		if (evs[i].data.ptr != p)
+			ready[k++] = evs[i].data.ptr;
+	}
+	return n < 0 ? n : k;
+}
+
+#elif defined(POLLER_KQUEUE)
+
+struct poller {
+	int kq;
+};
+
+struct poller *poller_new(void)
+{
+	struct poller *p = malloc(sizeof(struct poller));
+	if (!p)
+		return NULL;
+	p->kq = kqueue();
+	if (p->kq < 0) {
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+void poller_delete(struct poller *p)
+{
+	close(p->kq);
+	free(p);
+}
+
+/* Read and write are separate filters, the other one is disabled */
+static bool watch(struct poller *p, int fd, short filter, short other, void *data)
+{
+	struct kevent kev;
+	EV_SET(&kev, fd, other, EV_DISABLE, 0, 0, NULL);
+	kevent(p->kq, &kev, 1, NULL, 0, NULL); /* ENOENT if never added */
+	EV_SET(&kev, fd, filter, EV_ADD | EV_ENABLE | EV_DISPATCH, 0, 0, data);
+	return kevent(p->kq, &kev, 1, NULL, 0, NULL) == 0;
+}
+
+bool poller_watch(struct poller *p, int fd, void *data)
+{
+	return watch(p, fd, EVFILT_READ, EVFILT_WRITE, data);
+}
+
+bool poller_watch_write(struct poller *p, int fd, void *data)
+{
+	return watch(p, fd, EVFILT_WRITE, EVFILT_READ, data);
+}
+
+void poller_forget(struct poller *p, int fd)
+{
+	struct kevent kev;
+	EV_SET(&kev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	kevent(p->kq, &kev, 1, NULL, 0, NULL);
+	EV_SET(&kev, fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+	kevent(p->kq, &kev, 1, NULL, 0, NULL);
+}
+
+int poller_wait(struct poller *p, double secs, void **ready, int max)
+{
+	struct kevent evs[MAXEVENTS];
+	struct timespec ts;
+	if (max > MAXEVENTS)
+		max = MAXEVENTS;
+	ts.tv_sec = (time_t)secs;
+	ts.tv_nsec = (long)((secs - ts.tv_sec) * 1000000000L);
+	int n = kevent(p->kq, NULL, 0, evs, max, &ts);
+	for (int i = 0; i < n; i++)
+		ready[i] = evs[i].udata;
+	return n;
+}
+
+#else
+
+/*
+ * select() fallback. Keeps its own table of watches and rebuilds
+ * the fd_set from the armed ones on each wait.
+ */
+struct watch {
+	int fd;
+	int armed;
+	int write;
+	void *data;
+};
+
+struct poller {
+	struct watch *watches;
+	int count, cap;
+};
+
+struct poller *poller_new(void)
+{
+	return calloc(1, sizeof(struct poller));
+}
+
+void poller_delete(struct poller *p)
+{
+	free(p->watches);
+	free(p);
+}
+
+static struct watch *find_watch(struct poller *p, int fd)
+{
+	for (int i = 0; i < p->count; i++)
+		if (p->watches[i].fd == fd)
+			return &p->watches[i];
+	return NULL;
+}
+
+static bool watch(struct poller *p, int fd, int write, void *data)
+{
+	struct watch *w = find_watch(p, fd);
+	if (!w) {
+#ifndef _WIN32
+		if (fd >= FD_SETSIZE)
+			return false;
+#endif
+		if (p->count == p->cap) {
+			int cap = p->cap ? p->cap * 2 : 64;
+			struct watch *a = realloc(p->watches, cap * sizeof(struct watch));
+			if (!a)
+				return false;
+			p->watches = a;
+			p->cap = cap;
+		}
+		w = &p->watches[p->count++];
+		w->fd = fd;
+	}
+	w->data = data;
+	w->write = write;
+	w->armed = 1;
+	return true;
+}
+
+bool poller_watch(struct poller *p, int fd, void *data)
+{
+	return watch(p, fd, 0, data);
+}
+
+bool poller_watch_write(struct poller *p, int fd, void *data)
+{
+	return watch(p, fd, 1, data);
+}
+
+void poller_forget(struct poller *p, int fd)
+{
+	struct watch *w = find_watch(p, fd);
+	if (w)
+		*w = p->watches[--p->count];
+}
+
+int poller_wait(struct poller *p, double secs, void **ready, int max)
+{
+	fd_set rset, wset;
+	struct timeval tv;
+	int maxfd = 0, n = 0;
+
+	FD_ZERO(&rset);
+	FD_ZERO(&wset);
+	for (int i = 0; i < p->count; i++) {
+		struct watch *w = &p->watches[i];
+		if (!w->armed)
+			continue;
+		FD_SET(w->fd, w->write ? &wset : &rset);
+		if (w->fd > maxfd)
+			maxfd = w->fd;
+	}
+	tv.tv_sec = (long)secs;
+	tv.tv_usec = (long)((secs - tv.tv_sec) * 1000000);
+	int rc = select(maxfd + 1, &rset, &wset, NULL, &tv);
+	if (rc <= 0)
+		return rc;
+	for (int i = 0; i < p->count && n < max; i++) {
+		struct watch *w = &p->watches[i];
+		if (w->armed && FD_ISSET(w->fd, w->write ? &wset : &rset)) {
+			w->armed = 0;
+			ready[n++] = w->data;
+		}
+	}
+	return n;
+}
+
+#endif
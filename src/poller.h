@@ -0,0 +1,51 @@
+/*    
+ * Copyright (C) 2020, Twinkle Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Poller -- wait for readable or writable descriptors
+ *
+ * Backed by epoll on Linux, kqueue on BSD and macOS, and select()
+ * elsewhere. A watch is one-shot: once a descriptor is reported it
+ * stays registered but is not reported again until watched again.
+ * Not thread safe; meant to be owned by the scheduler thread.
+ */
+#pragma once
+
+#include <stdbool.h>
+
+struct poller;
+
+struct poller *poller_new(void);
+
+void poller_delete(struct poller *p);
+
+/* Register fd, or re-arm it if already registered. data is reported
+ * back by poller_wait() when fd becomes readable. */
+bool poller_watch(struct poller *p, int fd, void *data);
+
+/* Like poller_watch(), but report fd when it becomes writable. A
+ * descriptor is watched one way at a time, the last call wins. */
+bool poller_watch_write(struct poller *p, int fd, void *data);
+
+/* Unregister fd. Must be called before fd is closed. */
+void poller_forget(struct poller *p, int fd);
+
+/*
+ * Wait at most secs for readable descriptors. Store the data of up to
+ * max of them into ready. Return the count, 0 on timeout or -1 on error.
+ */
+int poller_wait(struct poller *p, double secs, void **ready, int max);
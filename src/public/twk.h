@@ -28,6 +28,13 @@ void twk_set_dist_path(const char *path);
  */
 void twk_set_var_path(const char *path);
 
+/*
+ * Define the number of worker threads running processes.
+ * Defaults to the number of online CPUs. TWK_WORKERS is examined
+ * if not set programatically. Has no effect once started.
+ */
+void twk_set_worker_count(int n);
+
 /*
  * twk_start() -- Start the twinkle runtime.
  *
@@ -48,6 +48,7 @@
 #include <ctype.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdarg.h>
 #include <limits.h>
@@ -62,6 +63,11 @@
 #define REGEXP_VM_STACK_MAX 128
 #define REGEXP_VM_CHECK_MAX 64
 
+#define REGEXP_MAX_PREFIX   32  /* bytes of literal prefix kept for scanning */
+
+#define REGEXP_DFA_MAX_STATES 256
+#define REGEXP_DFA_BUCKETS    64
+
 enum {
 	REGEXP_OP_BACKREF,
 	REGEXP_OP_BOL,
@@ -253,7 +259,7 @@ enum {
 	REGEXP_CCLASS_COUNT
 };
 
-static struct regexp_crange regexp_crange_not_ascii = {0x128, 0x7fffffff};
+static struct regexp_crange regexp_crange_not_ascii = {128, 0x7fffffff};
 
 static const char* regexp_cclass_names[] = {
 	[REGEXP_CCLASS_DIGIT  ] = "DIGIT",
@@ -387,6 +393,12 @@ struct regexp_program {
 	int save_index;
 	int check_index;
 	// jump tables
+
+	/* Set by regexp_program_analyze() */
+	bool unanchored; /* starts with the SPLIT2, CCLASS ALL, JMP loop */
+	bool dfa_ok;     /* no backreferences */
+	int prefix_len;
+	char prefix[REGEXP_MAX_PREFIX+1]; /* UTF8 every match starts with */
 };
 
 
@@ -567,6 +579,60 @@ regexp_program_look_ahead(struct regexp_program *prog, int i)
 	return 0;
 }
 
+/*
+ * Find out what the matchers can use: the literal chars any match
+ * must begin with, so an unanchored search can scan for them, and
+ * whether the DFA can run the program.
+ */
+static void
+regexp_program_analyze(struct regexp_program *prog)
+{
+	struct regexp_inst *code = prog->code.buf;
+	int n = (int)prog->code.count;
+	int i = 0;
+
+	prog->unanchored = n >= 3
+		&& code[0].op == REGEXP_OP_SPLIT2 && code[0].b.i16 == 2
+		&& code[1].op == REGEXP_OP_CCLASS && code[1].a == REGEXP_CCLASS_ALL
+		&& code[2].op == REGEXP_OP_JMP && code[2].b.i16 == -3;
+
+	prog->dfa_ok = true;
+	for (i = 0; i < n; i++) {
+		if (code[i].op == REGEXP_OP_BACKREF)
+			prog->dfa_ok = false;
+	}
+
+	prog->prefix_len = 0;
+	if (!prog->unanchored)
+		return;
+	/* Zero width instructions may come first, they are checked
+	 * at each place the prefix is found. */
+	for (i = 3; i < n; i++) {
+		int op = code[i].op;
+		if (op != REGEXP_OP_SAVE && op != REGEXP_OP_BOL
+		 && op != REGEXP_OP_BOUNDARY && op != REGEXP_OP_NBOUNDARY)
+			break;
+	}
+	for (; i < n; i++) {
+		uint32_t ch;
+		char buf[8];
+		if (code[i].op == REGEXP_OP_CHAR) {
+			ch = code[i].b.u16;
+		} else if (code[i].op == REGEXP_OP_CHAR32 && i + 1 < n) {
+			ch = code[i].b.u16 + ((uint32_t)code[i+1].b.u16<<16);
+			i++;
+		} else {
+			break;
+		}
+		int k = Utf8_encode(ch, buf, sizeof(buf));
+		if (ch == 0 || k <= 0 || prog->prefix_len + k > REGEXP_MAX_PREFIX)
+			break;
+		memcpy(prog->prefix + prog->prefix_len, buf, k);
+		prog->prefix_len += k;
+	}
+	prog->prefix[prog->prefix_len] = 0;
+}
+
 static void
 regexp_program_optimize(struct regexp_program *prog)
 {
@@ -591,6 +657,7 @@ regexp_program_optimize(struct regexp_program *prog)
 
 /* ------------------------------------------------------- */
 
+struct regexp_dfa;
 
 struct regexp_vmstate {
 	int next_ip;
@@ -677,8 +744,13 @@ struct regexp_vm {
 		size_t    count; 
 		size_t    cap; 
 	} input;
+
+	/* Built by regexp_vm_test() as needed */
+	struct regexp_dfa *dfa;
 };
 
+static void regexp_dfa_delete(struct regexp_dfa *dfa);
+
 struct regexp_vm * regexp_vm_create(struct regexp_program *prog)
 {
 	struct regexp_vm *vm = calloc(1, sizeof(struct regexp_vm));
@@ -693,6 +765,8 @@ void regexp_vm_delete(struct regexp_vm *vm)
 		regexp_program_delete(vm->prog);
 	if (vm->input.streaming)
 		free(vm->input.buf);
+	if (vm->dfa)
+		regexp_dfa_delete(vm->dfa);
 	free(vm);
 }
 
@@ -1067,6 +1141,21 @@ regexp_vm_exec(struct regexp_vm *vm)
 			return (vm->status = REGEXP_VM_ERROR);
 		}
 
+		/*
+		 * Back at the unanchored loop with nothing to backtrack to.
+		 * A match can only start where the prefix is, so scan for it
+		 * rather than try the pattern at each char in between.
+		 */
+		if (vm->ip == 0 && vm->sp == 0 && prog->prefix_len > 0
+		 && !vm->input.streaming) {
+			const char *p = vm->input.buf + vm->input.pos;
+			p = prog->prefix_len == 1 ? strchr(p, prog->prefix[0])
+				: strstr(p, prog->prefix);
+			if (!p)
+				return (vm->status = REGEXP_VM_UNMATCH);
+			vm->input.pos = (int)(p - vm->input.buf);
+		}
+
 		struct regexp_inst *inst = code + (vm->ip++);
 		int ch;
 		int op = inst->op;
@@ -1293,6 +1382,332 @@ regexp_vm_exec(struct regexp_vm *vm)
 	return vm->status;
 }
 
+/* ------------------------------------------------------- */
+
+/*
+ * Lazy DFA
+ *
+ * A DFA state is the set of instructions waiting for the next char,
+ * and the kind of char before it, which the assertions look at.
+ * States, and their transitions on ASCII chars, are only made when
+ * the input gets there, then kept in the vm for the next strings.
+ * Other chars are stepped without keeping the result.
+ *
+ * All threads of the program run at once, so there is no stack to
+ * overflow, but there is no telling which one would have won either.
+ * The DFA only finds out whether there is a match; the positions of
+ * it and its groups are left to regexp_vm_exec().
+ */
+
+enum {
+	REGEXP_PREV_START, /* nothing before */
+	REGEXP_PREV_LF,
+	REGEXP_PREV_CR,
+	REGEXP_PREV_WORD,
+	REGEXP_PREV_OTHER
+};
+
+struct regexp_dfa_state {
+	struct regexp_dfa_state *chain; /* in the hash bucket */
+	struct regexp_dfa_state *next[128];
+	unsigned hash;
+	int prev;
+	bool idle; /* only the unanchored loop is waiting */
+	int count;
+	int pcs[1];
+};
+
+/* Transitions other than to a state */
+#define REGEXP_DFA_MATCH ((struct regexp_dfa_state*)1)
+#define REGEXP_DFA_DEAD  ((struct regexp_dfa_state*)2)
+
+struct regexp_dfa {
+	struct regexp_dfa_state *buckets[REGEXP_DFA_BUCKETS];
+	int nstates;
+	bool failed; /* too many states, leave it to the vm */
+	unsigned gen; /* instructions marked with gen were visited */
+	unsigned *mark;
+	int *stack;
+	int *kernel;
+};
+
+static void 
+regexp_dfa_delete(struct regexp_dfa *dfa)
+{
+	for (int i = 0; i < REGEXP_DFA_BUCKETS; i++) {
+		struct regexp_dfa_state *s = dfa->buckets[i];
+		while (s) {
+			struct regexp_dfa_state *next = s->chain;
+			free(s);
+			s = next;
+		}
+	}
+	free(dfa->mark);
+	free(dfa->stack);
+	free(dfa->kernel);
+	free(dfa);
+}
+
+static struct regexp_dfa *
+regexp_dfa_new(struct regexp_program *prog)
+{
+	size_t n = prog->code.count + 1;
+	struct regexp_dfa *dfa = calloc(1, sizeof(struct regexp_dfa));
+	if (!dfa)
+		return NULL;
+	dfa->mark = calloc(n, sizeof(unsigned));
+	dfa->stack = calloc(n, sizeof(int));
+	dfa->kernel = calloc(n, sizeof(int));
+	if (!dfa->mark || !dfa->stack || !dfa->kernel) {
+		regexp_dfa_delete(dfa);
+		return NULL;
+	}
+	return dfa;
+}
+
+/* isword() for chars beyond ASCII is false, as in the C locale */
+static int
+regexp_char_kind(int ch)
+{
+	if (ch < 0)
+		return REGEXP_PREV_START;
+	if (ch == '\n')
+		return REGEXP_PREV_LF;
+	if (ch == '\r')
+		return REGEXP_PREV_CR;
+	if (ch < 128 && isword(ch))
+		return REGEXP_PREV_WORD;
+	return REGEXP_PREV_OTHER;
+}
+
+static struct regexp_dfa_state *
+regexp_dfa_state(struct regexp_vm *vm, const int *pcs, int count, int prev)
+{
+	struct regexp_dfa *dfa = vm->dfa;
+	unsigned hash = 2166136261u ^ (unsigned)prev;
+	for (int i = 0; i < count; i++)
+		hash = (hash ^ (unsigned)pcs[i]) * 16777619u;
+
+	struct regexp_dfa_state **bucket = dfa->buckets + hash % REGEXP_DFA_BUCKETS;
+	for (struct regexp_dfa_state *s = *bucket; s; s = s->chain) {
+		if (s->hash == hash && s->prev == prev && s->count == count
+		 && memcmp(s->pcs, pcs, count * sizeof(int)) == 0)
+			return s;
+	}
+
+	if (dfa->nstates >= REGEXP_DFA_MAX_STATES) {
+		dfa->failed = true;
+		return NULL;
+	}
+	struct regexp_dfa_state *s = calloc(1, 
+		offsetof(struct regexp_dfa_state, pcs) + (count + 1) * sizeof(int));
+	if (!s) {
+		dfa->failed = true;
+		return NULL;
+	}
+	s->hash = hash;
+	s->prev = prev;
+	s->count = count;
+	memcpy(s->pcs, pcs, count * sizeof(int));
+	s->idle = vm->prog->unanchored && count == 1
+		&& (pcs[0] == 0 || pcs[0] == 2);
+	s->chain = *bucket;
+	*bucket = s;
+	dfa->nstates++;
+	return s;
+}
+
+/*
+ * Follow the instructions of s up to those taking a char, and
+ * feed them ch, -1 being the end of input. Return the state after
+ * ch, REGEXP_DFA_MATCH if a match ends before ch, REGEXP_DFA_DEAD
+ * if nothing is left to match, or NULL if the DFA failed.
+ */
+static struct regexp_dfa_state *
+regexp_dfa_step(struct regexp_vm *vm, struct regexp_dfa_state *s, int ch)
+{
+	struct regexp_dfa *dfa = vm->dfa;
+	struct regexp_program *prog = vm->prog;
+	struct regexp_inst *code = prog->code.buf;
+	int n = (int)prog->code.count;
+	int prev = s->prev;
+	int sp = 0, nk = 0;
+
+	if (++dfa->gen == 0) {
+		memset(dfa->mark, 0, (n + 1) * sizeof(unsigned));
+		dfa->gen = 1;
+	}
+	unsigned gen = dfa->gen;
+
+#define REGEXP_DFA_PUSH(pc) do { \
+		int pc_ = (pc); \
+		if (pc_ >= 0 && pc_ < n && dfa->mark[pc_] != gen) { \
+			dfa->mark[pc_] = gen; \
+			dfa->stack[sp++] = pc_; \
+		} \
+	} while (0)
+
+	for (int i = s->count - 1; i >= 0; i--)
+		REGEXP_DFA_PUSH(s->pcs[i]);
+
+	while (sp > 0) {
+		int pc = dfa->stack[--sp];
+		struct regexp_inst *ip = code + pc;
+		bool taken = false;
+
+		switch (ip->op) {
+		case REGEXP_OP_MATCH:
+			return REGEXP_DFA_MATCH;
+
+		case REGEXP_OP_JMP:
+			REGEXP_DFA_PUSH(pc + 1 + ip->b.i16);
+			break;
+
+		/* The look ahead byte only saves the vm a dead end */
+		case REGEXP_OP_SPLIT1:
+		case REGEXP_OP_SPLIT2:
+			REGEXP_DFA_PUSH(pc + 1 + ip->b.i16);
+			REGEXP_DFA_PUSH(pc + 1);
+			break;
+
+		case REGEXP_OP_SAVE:
+		case REGEXP_OP_NOP:
+		case REGEXP_OP_PROGRESS:
+			REGEXP_DFA_PUSH(pc + 1);
+			break;
+
+		/* As in regexp_vm_exec() */
+		case REGEXP_OP_BOL:
+			if (prev == REGEXP_PREV_START || prev == REGEXP_PREV_LF
+			 || (prev == REGEXP_PREV_CR && ch != '\n'))
+				REGEXP_DFA_PUSH(pc + 1);
+			break;
+
+		case REGEXP_OP_EOL:
+			if (ch == -1 || ch == '\r' || (ch == '\n' && prev != REGEXP_PREV_CR))
+				REGEXP_DFA_PUSH(pc + 1);
+			break;
+
+		case REGEXP_OP_BOUNDARY:
+		case REGEXP_OP_NBOUNDARY: {
+			bool w0 = prev == REGEXP_PREV_WORD;
+			bool w1 = regexp_char_kind(ch) == REGEXP_PREV_WORD;
+			if ((w0 != w1) == (ip->op == REGEXP_OP_BOUNDARY))
+				REGEXP_DFA_PUSH(pc + 1);
+			break;
+		}
+
+		case REGEXP_OP_CHAR:
+			taken = ch == ip->b.u16;
+			break;
+
+		case REGEXP_OP_CHAR32:
+			if (ch == ip->b.u16 + (ip[1].b.u16<<16) && nk < n)
+				dfa->kernel[nk++] = pc + 2;
+			break;
+
+		case REGEXP_OP_CCLASS:
+			taken = ch >= 0 
+				&& regexp_cclass_has(regexp_program_get_cclass(prog, ip->a), ch);
+			break;
+
+		case REGEXP_OP_NCCLASS:
+			taken = ch >= 0 
+				&& !regexp_cclass_has(regexp_program_get_cclass(prog, ip->a), ch);
+			break;
+
+		default:
+			dfa->failed = true;
+			return NULL;
+		}
+		if (taken)
+			dfa->kernel[nk++] = pc + 1;
+	}
+#undef REGEXP_DFA_PUSH
+
+	if (nk == 0 || ch < 0)
+		return REGEXP_DFA_DEAD;
+
+	/* A set, in the order the hash expects */
+	int *k = dfa->kernel;
+	for (int i = 1; i < nk; i++) {
+		int t = k[i], j = i;
+		for (; j > 0 && k[j-1] > t; j--)
+			k[j] = k[j-1];
+		k[j] = t;
+	}
+	return regexp_dfa_state(vm, k, nk, regexp_char_kind(ch));
+}
+
+int
+regexp_vm_test(struct regexp_vm *vm)
+{
+	struct regexp_program *prog = vm->prog;
+
+	if (vm->input.streaming || !prog->dfa_ok)
+		goto fallback;
+	if (!vm->dfa && !(vm->dfa = regexp_dfa_new(prog)))
+		goto fallback;
+	if (vm->dfa->failed)
+		goto fallback;
+
+	const char *buf = vm->input.buf;
+	int pos = vm->input.pos;
+	int start = 0;
+	int prev = pos > 0 ? regexp_char_kind((uint8_t)buf[pos-1]) : REGEXP_PREV_START;
+	struct regexp_dfa_state *s = regexp_dfa_state(vm, &start, 1, prev);
+
+	while (s) {
+		if (s->idle && prog->prefix_len > 0) {
+			const char *p = prog->prefix_len == 1 
+				? strchr(buf + pos, prog->prefix[0])
+				: strstr(buf + pos, prog->prefix);
+			if (!p)
+				return REGEXP_VM_UNMATCH;
+			if (p != buf + pos) {
+				pos = (int)(p - buf);
+				prev = regexp_char_kind((uint8_t)buf[pos-1]);
+				s = regexp_dfa_state(vm, &start, 1, prev);
+				if (!s)
+					break;
+			}
+		}
+
+		int b = (uint8_t)buf[pos];
+		int ch = b, len = 1;
+		struct regexp_dfa_state *next;
+		if (b == 0) {
+			ch = -1;
+			len = 0;
+			next = regexp_dfa_step(vm, s, ch);
+		} else if (b < 128) {
+			next = s->next[b];
+			if (!next) {
+				next = regexp_dfa_step(vm, s, ch);
+				s->next[b] = next;
+			}
+		} else {
+			char *end;
+			ch = Utf8_decode_buffer(buf + pos, SIZE_MAX, &end);
+			if (ch < 0)
+				return REGEXP_VM_UNMATCH;
+			len = (int)(end - (buf + pos));
+			next = regexp_dfa_step(vm, s, ch);
+		}
+
+		if (next == REGEXP_DFA_MATCH)
+			return REGEXP_VM_MATCH;
+		if (next == REGEXP_DFA_DEAD)
+			return REGEXP_VM_UNMATCH;
+		pos += len;
+		s = next;
+	}
+
+fallback:
+	regexp_vm_reset(vm);
+	return regexp_vm_exec(vm);
+}
+
 int 
 regexp_vm_get_match(struct regexp_vm *vm, int index, int *len)
 {
@@ -1958,6 +2373,7 @@ regexp_compile_start(struct regexp_comp *ctx)
 	}
 	regexp_emit(ctx, REGEXP_OP_MATCH);
 	regexp_program_optimize(ctx->prog);
+	regexp_program_analyze(ctx->prog);
 }
 
 
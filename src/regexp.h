@@ -81,6 +81,15 @@ regexp_vm_set_current_pos(struct regexp_vm *vm, int pos);
 int 
 regexp_vm_exec(struct regexp_vm *vm);
 
+/*
+ * Like regexp_vm_exec() on string input, but only find out whether
+ * there is a match, not where. A DFA is built in the vm as it goes,
+ * unless the program has backreferences. Matches found this way
+ * have no positions.
+ */
+int 
+regexp_vm_test(struct regexp_vm *vm);
+
 /*
  * Return the position of the matched string.
  * If index = 0, then it is the overall match.
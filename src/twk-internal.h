@@ -22,13 +22,12 @@
 #include <pthread.h>
 #include <stdarg.h>
 
-#include "fifo.h"
+#include "mbox.h"
 #include "lisp_sqlite3.h"
 
 #define TWK_DEFAULT_PORT 6767
 #define TWK_DEFAULT_BROADCAST_PORT 6766
 #define TWK_MAX_NAME 32
-#define TWK_INI_MBOX_SIZE (4096*2)
 #define TWK_MAX_MBOX_SIZE (65536*4)
 
 enum twk_process_state
@@ -51,6 +50,21 @@ enum twk_logging_level {
 	TWK_LOGGING_VERBOSE = 2
 };
 
+// Updated by the worker running the process, see process-stats
+struct twk_process_stats
+{
+	int preempts;         // runs suspended to let others run
+	double queued_time;   // when it became runnable last
+	double run_time;      // seconds spent on a worker
+	double max_run_time;  // longest time on a worker at once
+	double wait_time;     // seconds spent runnable but not running
+	double max_wait_time;
+	size_t gc_count;      // collections, as of the last run
+	double gc_pause;      // seconds spent collecting
+	double gc_max_pause;
+	size_t memsize;       // bytes allocated by the VM
+};
+
 struct twk_process
 {
 	int pid;
@@ -58,6 +72,15 @@ struct twk_process
 	char *instance_name;
 	struct Lisp_VM *vm;
 	int fd;
+	int poll_fd; // fd registered with the scheduler's poller, or -1
+	unsigned poll_armed: 1; // poll_fd will be reported when ready
+	unsigned poll_write: 1; // poll_fd is watched for writing
+	unsigned sched_listed: 1; // on the scheduler's list, see wake_sched()
+	struct twk_process *sched_next;
+	int worker; // worker thread that ran us last, or -1
+	unsigned generation; // bumped when the slot is reused, see pid
+	int next_free_slot; // free list of the process table
+	int timer_index; // position in the scheduler's timer heap, or -1
 	int runcnt;
 	double start_time;
 	volatile double sched_time;
@@ -65,12 +88,21 @@ struct twk_process
 	void (*finalize)(struct twk_process*);
 	void (*run)(struct twk_process*);
 	volatile enum twk_process_state state;
-	struct FIFO *mbox;
-	unsigned mbox_last_wpos;
-	unsigned mbox_overflow :1;
+	struct mbox mbox;
+	struct twk_process_stats stats;
+	struct coro *coro; // stack of the current run, see thread_main()
+	bool preempted; // the run yielded, resume it on coro
+	bool run_failed; // the last run ended with an error
+	bool parking; // the run yielded to wait for room in parked_on's mbox
+	struct twk_process *parked_on; // receiver we wait for, see post_message_wait()
+	struct twk_process *parked_next; // senders waiting for the same receiver
+	struct twk_process *parked; // senders waiting for room in our mbox
+	bool io_wait; // the run yielded until fd is ready, see twk_wait_fd()
+	bool io_write; // io_wait is for writing
+	volatile bool blocked; // the run yielded for a call in twk_run_blocking()
+	int pinned; // the run must not yield, see twk_pin_process()
 	unsigned sys: 1; // a system process, can be trusted.
 	unsigned logging_level: 8;
-	pthread_mutex_t mbox_lock;
 	pthread_mutex_t parental_lock;
 	struct twk_process *parent;   // our parent
 	struct twk_process *children; // all child processes
@@ -81,12 +113,32 @@ struct twk_process * twk_create_process(const char *name);
 struct twk_process *twk_get_process(int pid);
 
 void twk_sched(struct twk_process *proc, bool immediate);
+void twk_wake_sched(struct twk_process *proc);
 bool twk_post_message(struct twk_process *proc, const void *mbuf, size_t size);
+
+// A message built in pieces, see twk_begin_message()
+struct twk_message
+{
+	struct twk_process *proc;
+	struct mbox_msg *msg;
+};
+
+bool twk_begin_message(struct twk_message *m, struct twk_process *proc);
+void twk_add_message(struct twk_message *m, const void *buf, size_t size);
+void twk_add_message_cstr(struct twk_message *m, const char *s);
+void twk_add_message_qstr(struct twk_message *m, const char *s, size_t len);
+bool twk_end_message(struct twk_message *m);
+
+struct sockaddr;
 typedef void (*twk_client_callback)(int sockfd, struct sockaddr* sa, uint32_t sa_len);
 
-struct twk_process * twk_create_socket_server(const char *name, uint32_t addr,
-  uint16_t port, twk_client_callback callback);
+struct twk_process * twk_create_socket_server(const char *name, struct sockaddr *sa,
+  int backlog, int count, twk_client_callback callback);
 
+void sleep_for_seconds(double secs);
+void twk_wait_fd(struct twk_process *proc, int fd, bool write, double secs);
+void twk_run_blocking(struct twk_process *proc, void (*fn)(void*), void *arg);
+void twk_pin_process(struct twk_process *proc, bool pin);
 void twk_log(struct twk_process *proc, int level, const char *fmt, ...);
 void twk_vlog(struct twk_process *proc, const char *fmt, va_list ap);
 
@@ -70,11 +70,22 @@
 
 #include "common.h"
 #include "twk-internal.h"
+#include "poller.h"
+#include "coro.h"
 
 /***************************************************************/
 
-#define MAX_PROCESS 1024
-#define MAX_THREADS 8
+#define PID_SLOT_BITS 20
+#define MAX_PROCESS (1 << PID_SLOT_BITS) /* Upper bound of the process table */
+#define PID_SLOT(pid) ((pid) & (MAX_PROCESS - 1))
+#define PID_GENERATIONS (1 << (30 - PID_SLOT_BITS)) /* Keep pids positive */
+#define PROCESS_CHUNK_SIZE 256 /* Process slots allocated at a time */
+#define MAX_THREADS 256
+#define TWK_REDUCTIONS 20000 // expressions a process evaluates before it may be preempted
+#define TWK_STACK_SIZE (8*1024*1024) /* Pages are committed as they are touched */
+#define TWK_STACK_RESERVE (256*1024) /* Left for C code called from eval, and errors */
+#define MAX_SPARE_COROS 64
+#define MAX_READY_FDS 64 /* Readiness events handled per scheduler wakeup */
 #define DEFAULT_PROCESS_OUTPUT_SIZE (8*1024)
 #define DEFAULT_PROCESS_ERROR_SIZE (4*1024)
 
@@ -89,29 +100,138 @@ static const char *state_names[] = {
 	[TWK_PS_SHUTDOWN] = "shutdown"
 };
 
+/*
+ * Each worker has its own queue of runnable processes. A process
+ * is queued on the worker that ran it last and an idle worker
+ * steals from the others. See enqueue_runnable().
+ *
+ * The ring grows as needed and is only touched under its lock.
+ * Its count is also read without the lock as a hint, so it is
+ * stored and loaded atomically, see have_runnable().
+ */
+struct run_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t notify;
+	unsigned head, count, cap;
+	int idle; // waiting for notify
+	struct twk_process **items;
+};
+
 static struct twk_thread {
 	pthread_t thread;
 	unsigned shutdown: 1;
 	double run_time;
 	struct twk_process *proc;
-} threads[MAX_THREADS];
-
-static pthread_mutex_t runnable_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t runnable_notify = PTHREAD_COND_INITIALIZER;
+	struct run_queue rq;
+	// Updated by the thread itself, see scheduler-stats
+	unsigned long runs;
+	unsigned long preempts;
+	double busy_time;
+	double wait_time;
+	double max_wait_time;
+} *threads;
+
+static int nthreads = 0; // 0 until started, see twk_set_worker_count()
+static volatile unsigned next_worker = 0;
 
-static struct twk_process processes[MAX_PROCESS];
+/*
+ * Process table
+ *
+ * Slots are allocated in chunks which never move, so process
+ * pointers stay valid while the table grows. Free slots are reused
+ * in FIFO order. A pid is the slot index tagged with the slot's
+ * generation, which is bumped on every reuse, so a stale pid never
+ * refers to a newer process in the same slot.
+ */
+static struct twk_process *process_chunks[MAX_PROCESS / PROCESS_CHUNK_SIZE];
+static volatile int process_slots = 0; // slots in all chunks
+static int free_slot_head = -1, free_slot_tail = -1;
 static pthread_mutex_t pid_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long created_count = 0, released_count = 0; // pid_lock
+static unsigned long released_dropped = 0; // messages dropped by released processes
 static pthread_mutex_t twk_log_lock = PTHREAD_MUTEX_INITIALIZER;
 static volatile int sched_quit = 0;
 
+/*
+ * Stacks for running processes, see get_coro()
+ */
+static struct coro *spare_coros[MAX_SPARE_COROS];
+static int spare_coro_count = 0;
+static pthread_mutex_t coro_lock = PTHREAD_MUTEX_INITIALIZER;
+static void preempt_process(Lisp_VM *vm);
+
+/*
+ * Timer heap
+ *
+ * Processes with a timeout set, ordered by sched_time. Workers set
+ * timeouts, the scheduler expires them and sleeps until the earliest
+ * one is due.
+ */
+struct timer
+{
+	double time; // sched_time when it was set
+	struct twk_process *proc;
+};
+static struct timer *timer_heap;
+static int timer_count = 0, timer_cap = 0;
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // Notifying the scheduler which could be sleep
 // so that we can let it add more fds to watch
 static volatile int sched_sigfd = -1;
+static struct poller *sched_poller;
+
+/*
+ * Processes the scheduler should look at: to shut down, to queue
+ * for messages, or to watch the fd of. wake_sched() lists them, so
+ * that the scheduler does not scan the whole process table.
+ */
+static pthread_mutex_t sched_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct twk_process *sched_list;
+
+static void list_for_sched(struct twk_process *proc)
+{
+	pthread_mutex_lock(&sched_list_lock);
+	if (!proc->sched_listed)
+	{
+		proc->sched_listed = 1;
+		proc->sched_next = sched_list;
+		sched_list = proc;
+	}
+	pthread_mutex_unlock(&sched_list_lock);
+}
+
+static struct twk_process *next_for_sched(void)
+{
+	pthread_mutex_lock(&sched_list_lock);
+	struct twk_process *proc = sched_list;
+	if (proc)
+	{
+		sched_list = proc->sched_next;
+		proc->sched_listed = 0;
+	}
+	pthread_mutex_unlock(&sched_list_lock);
+	return proc;
+}
+
+// Before its slot is reused
+static void unlist_for_sched(struct twk_process *proc)
+{
+	pthread_mutex_lock(&sched_list_lock);
+	if (proc->sched_listed)
+	{
+		struct twk_process **pp = &sched_list;
+		while (*pp != proc)
+			pp = &(*pp)->sched_next;
+		*pp = proc->sched_next;
+		proc->sched_listed = 0;
+	}
+	pthread_mutex_unlock(&sched_list_lock);
+}
 #ifdef WIN32
 static pthread_mutex_t sched_sigfd_lock = PTHREAD_MUTEX_INITIALIZER;
 #endif
 //static int nproc = 0;
-static int next_pid = 0;
 int g_argc = 0;
 const char **g_argv;
 char g_dist_path[1024];
@@ -173,6 +293,7 @@ static volatile LONG sigfd_wakecnt;
  */
 static void wake_sched(struct twk_process *proc)
 {
+	list_for_sched(proc);
 	if (InterlockedAdd(&sigfd_wakecnt, 1) > 1)
 		return;
 
@@ -190,7 +311,7 @@ static void wake_sched(struct twk_process *proc)
 }
 
 // Return the sigfd usable for select().
-// If return -1, scheduler should rescan process list for eligible fds
+// If return -1, scheduler should look at its list of woken processes again
 static int ensure_sched_sigfd()
 {
 	if (InterlockedExchange(&sigfd_wakecnt, 0) > 1)
@@ -218,6 +339,7 @@ static int sigfd_pipe[2];
 // It's quite simpler
 static void wake_sched(struct twk_process *proc)
 {
+	list_for_sched(proc);
 	if (sched_sigfd < 0)
 		return;
 	int a = 1;
@@ -251,173 +373,291 @@ static int ensure_sched_sigfd()
 }
 
 #endif
+#ifdef _WIN32
+# define cas_state(p, old, new) \
+	(InterlockedCompareExchange((volatile LONG*)&(p)->state, (new), (old)) == (LONG)(old))
+# define memory_barrier() MemoryBarrier()
+# define store_release(p, v) (MemoryBarrier(), *(p) = (v))
+# define load_acquire(p) (*(volatile LONG*)(p))
+#else
+# define cas_state(p, old, new) \
+	__sync_bool_compare_and_swap(&(p)->state, (old), (new))
+# define memory_barrier() __sync_synchronize()
+# define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+# define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#endif
+
+// Anyone posting to a waiting process wakes it. The mbox tells us
+// who was first, so a burst of messages schedules it only once.
+// Yielded in the middle of a run, messages wait until it is over
+static bool suspended(struct twk_process *proc)
+{
+	return proc->io_wait || proc->parked_on || proc->blocked;
+}
+
+static void wake_receiver(struct twk_process *proc)
+{
+	memory_barrier();
+	if (proc->state == TWK_PS_WAITING && !suspended(proc))
+		twk_sched(proc, true);
+}
+
+static bool can_receive(struct twk_process *proc)
+{
+	return proc->state != TWK_PS_DONE
+	 && proc->state != TWK_PS_SHUTDOWN
+	 && proc->state != TWK_PS_NONE;
+}
+
 /*
- * We need to lock because there could be multiple writers
- * trying to post messages to this process.
+ * There could be multiple writers trying to post messages to this
+ * process. They don't block each other or the reader.
  * All written or none.
  */
 bool twk_post_message(struct twk_process *proc, const void *mbuf, size_t size)
 {
-	bool ok = false;
+	bool wake;
 	
 	assert(proc);
-	if (proc->mbox == NULL
-	 || proc->state == TWK_PS_DONE
-	 || proc->state == TWK_PS_SHUTDOWN
-	 || proc->state == TWK_PS_NONE)
+	if (!can_receive(proc))
 		return false;
 	
-	pthread_mutex_lock(&proc->mbox_lock);
-	if (proc->mbox && fifo_room(proc->mbox) >= size)
-	{
-		size_t n = fifo_write(proc->mbox, mbuf, size);
-		assert(n == size);
-		ok = true;
-	}
-	else
+	if (!mbox_write(&proc->mbox, mbuf, size, &wake))
 	{
 		twk_log(proc, TWK_LOGGING_INFO, "mbox full: %d, size=%d", 
-		  fifo_bytes(proc->mbox), (int)size);
-	}
-	pthread_mutex_unlock(&proc->mbox_lock);
-	
-	if (ok && proc->state == TWK_PS_WAITING)
-	{
-		twk_sched(proc, true);
+		  (int)mbox_bytes(&proc->mbox), (int)size);
+		return false;
 	}
-	return ok;
+	if (wake)
+		wake_receiver(proc);
+	return true;
 }
 
-bool twk_begin_message(struct twk_process *proc)
+/*
+ * Build a message in pieces with twk_add_message*() and post it with
+ * twk_end_message(). The message is private to the caller until then.
+ */
+bool twk_begin_message(struct twk_message *m, struct twk_process *proc)
 {
 	assert(proc);
-	if (proc->mbox == NULL
-	 || proc->state == TWK_PS_DONE
-	 || proc->state == TWK_PS_SHUTDOWN
-	 || proc->state == TWK_PS_NONE)
-		return false;
-	
-	pthread_mutex_lock(&proc->mbox_lock);
-	if (proc->mbox == NULL) {
-		pthread_mutex_unlock(&proc->mbox_lock);
+	m->proc = proc;
+	m->msg = NULL;
+	if (!can_receive(proc))
 		return false;
-	}
-	proc->mbox_last_wpos = proc->mbox->wpos;
-	proc->mbox_overflow = 0;
-	return true;
+	m->msg = mbox_msg_new(256);
+	return m->msg != NULL;
 }
 
-void twk_add_message(struct twk_process *proc, const void *buf, size_t size)
+void twk_add_message(struct twk_message *m, const void *buf, size_t size)
 {
-	if (!proc->mbox_overflow && fifo_room(proc->mbox) >= size)
-	{
-		size_t n = fifo_write(proc->mbox, buf, size);
-		assert(n == size);
-	}
-	else
-	{
-		proc->mbox_overflow = 1;
-	}
+	if (m->msg)
+		m->msg = mbox_msg_add(m->msg, buf, size);
 }
 
-void twk_add_message_cstr(struct twk_process *proc, const char *s)
+void twk_add_message_cstr(struct twk_message *m, const char *s)
 {
-	twk_add_message(proc, s, strlen(s));
+	twk_add_message(m, s, strlen(s));
 }
 
 /* Quote the buffer to lisp style string literal */
-void twk_add_message_qstr(struct twk_process *proc, const char *s, size_t len)
+void twk_add_message_qstr(struct twk_message *m, const char *s, size_t len)
 {
 	unsigned head = 0, i = 0;
 	for (i = 0; i < len; i++) {
 		if (s[i] == '\\' || s[i] == '\"') {
 			if (i > head)
-				twk_add_message(proc, s+head, i - head);
+				twk_add_message(m, s+head, i - head);
 			if (s[i] == '\\')
-				twk_add_message_cstr(proc, "\\\\");
+				twk_add_message_cstr(m, "\\\\");
 			else
-				twk_add_message_cstr(proc, "\\\"");
+				twk_add_message_cstr(m, "\\\"");
 			head = i + 1;
 		}
 	}
 	if (i > head)
-		twk_add_message(proc, s+head, i - head);
+		twk_add_message(m, s+head, i - head);
 }
 
-bool twk_end_message(struct twk_process *proc)
+bool twk_end_message(struct twk_message *m)
 {
-	bool ok = true;
+	struct twk_process *proc = m->proc;
+	bool wake;
 	
-	// If message is not delivered in its entirety,
-	// rollback to last wposition
-	if (proc->mbox_overflow)
+	if (!m->msg)
+		return false;
+	size_t size = m->msg->size;
+	bool ok = mbox_post(&proc->mbox, m->msg, &wake);
+	m->msg = NULL;
+	if (!ok)
 	{
-		twk_log(proc, TWK_LOGGING_INFO, "mbox full: %d", fifo_bytes(proc->mbox));
-		proc->mbox->wpos = proc->mbox_last_wpos;
-		ok = false;
+		twk_log(proc, TWK_LOGGING_INFO, "mbox full: %d, size=%d",
+		  (int)mbox_bytes(&proc->mbox), (int)size);
+		return false;
 	}
-	pthread_mutex_unlock(&proc->mbox_lock);
-	
-	if (ok && proc->state == TWK_PS_WAITING)
+	if (wake)
+		wake_receiver(proc);
+	return true;
+}
+
+/*
+ * Parking senders
+ *
+ * A sender that finds the mbox full can wait in post_message_wait().
+ * It links itself to the receiver and yields its run. The receiver
+ * wakes all of them once it has read its mbox down to half of the
+ * limit, or when it shuts down. All links are under park_lock.
+ */
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool update_timer(struct twk_process *proc);
+
+static bool has_room(struct twk_process *proc, size_t size)
+{
+	return mbox_bytes(&proc->mbox) + size <= proc->mbox.limit;
+}
+
+static void wake_parked(struct twk_process *proc)
+{
+	pthread_mutex_lock(&park_lock);
+	struct twk_process *p = proc->parked;
+	proc->parked = NULL;
+	while (p)
 	{
-		twk_sched(proc, true);
+		struct twk_process *next = p->parked_next;
+		p->parked_next = NULL;
+		p->parked_on = NULL;
+		memory_barrier();
+		// Still inside post_message_wait(), it can not go away
+		// before it takes the lock to unlink itself.
+		twk_sched(p, true);
+		p = next;
 	}
-	return ok;
+	pthread_mutex_unlock(&park_lock);
 }
 
-static size_t mbox_read(void *context, void *buf, size_t size)
+static void unpark(struct twk_process *self)
 {
-	struct twk_process *proc = context;
-	if (fifo_bytes(proc->mbox) > proc->mbox->size/2
-	 && proc->mbox->size < TWK_MAX_MBOX_SIZE)
+	pthread_mutex_lock(&park_lock);
+	if (self->parked_on)
 	{
-		// resize
-		pthread_mutex_lock(&proc->mbox_lock);
-		struct FIFO *fifo = fifo_new(proc->mbox->size*2);
-		assert(fifo);
-		size_t n = fifo_read(proc->mbox, fifo->buffer, fifo->size);
-		fifo->rpos = 0;
-		fifo->wpos = (int)n;
-		fifo->wtotal = proc->mbox->wtotal;
-		fifo_delete(proc->mbox);
-		proc->mbox = fifo;
-		pthread_mutex_unlock(&proc->mbox_lock);
+		struct twk_process **pp = &self->parked_on->parked;
+		while (*pp != self)
+			pp = &(*pp)->parked_next;
+		*pp = self->parked_next;
+		self->parked_next = NULL;
+		self->parked_on = NULL;
 	}
-	return fifo_read(proc->mbox, buf, size);
+	pthread_mutex_unlock(&park_lock);
+}
+
+/*
+ * Link self to the senders parked on proc, unless proc is waiting
+ * on self already, directly or down a chain of parked senders, as
+ * neither of them would read again. Return false in that case.
+ */
+static bool park_on(struct twk_process *self, struct twk_process *proc)
+{
+	pthread_mutex_lock(&park_lock);
+	for (struct twk_process *p = proc; p; p = p->parked_on)
+	{
+		if (p == self)
+		{
+			pthread_mutex_unlock(&park_lock);
+			return false;
+		}
+	}
+	self->parked_on = proc;
+	self->parked_next = proc->parked;
+	proc->parked = self;
+	pthread_mutex_unlock(&park_lock);
+	return true;
+}
+
+/*
+ * Post to process pid, waiting while its mbox is full, for at most
+ * secs if it is not negative. Return false if it is gone, the
+ * message can never fit, the time is up, or waiting would deadlock:
+ * a process does not wait on itself, nor on one parked on it.
+ * Without a stack of its own to yield, the sender holds its worker
+ * and polls, which only the timeout can break.
+ */
+static bool post_message_wait(struct twk_process *self, int pid,
+  const void *mbuf, size_t size, double secs)
+{
+	double deadline = secs >= 0 ? microtime() + secs : 0;
+	struct twk_process *proc;
+	while ((proc = twk_get_process(pid)) != NULL && can_receive(proc))
+	{
+		if (size > proc->mbox.limit)
+			return false;
+		if (has_room(proc, size) && twk_post_message(proc, mbuf, size))
+			return true;
+		if (proc == self || (deadline > 0 && microtime() >= deadline))
+			return false;
+		if (!self->coro || self->pinned || self->state != TWK_PS_RUNNING)
+		{
+			sleep_for_seconds(0.001);
+			continue;
+		}
+		if (!park_on(self, proc))
+			return false;
+		// Either the reader sees us linked, or we see what it read
+		memory_barrier();
+		if (!has_room(proc, size) && can_receive(proc))
+		{
+			// Like twk_wait_fd(), the timer is ours while parked
+			double saved = self->sched_time;
+			self->sched_time = deadline;
+			if (update_timer(self))
+				wake_sched(self);
+			self->parking = true;
+			assert(!self->pinned);
+			coro_yield(self->coro);
+			self->sched_time = saved;
+			update_timer(self);
+		}
+		unpark(self);
+	}
+	return false;
+}
+
+static size_t mbox_stream_read(void *context, void *buf, size_t size)
+{
+	struct twk_process *proc = context;
+	size_t n = mbox_read(&proc->mbox, buf, size);
+	if (proc->parked && mbox_bytes(&proc->mbox) <= proc->mbox.limit / 2)
+		wake_parked(proc);
+	return n;
 }
 
-static bool mbox_ready(void *context, int mode)
+static bool mbox_stream_ready(void *context, int mode)
 {
 	struct twk_process *proc = context;
     assert(mode == 0);
-    return fifo_bytes(proc->mbox) > 0;
+    return mbox_ready(&proc->mbox);
 }
 
 static struct lisp_stream_class_t mbox_stream_class = {
-	.read = mbox_read,
-    .ready = mbox_ready
+	.read = mbox_stream_read,
+    .ready = mbox_stream_ready
 };
 
-/* (open-mbox &optional <size>) */
+/*
+ * (open-mbox &optional <size>)
+ * <size> raises the most bytes that may be waiting to be read.
+ */
 static void op_open_mbox(Lisp_VM *vm, Lisp_Pair *args)
 {
 	struct twk_process *proc = lisp_vm_client(vm);
-	unsigned size = 4096;
 	if (lisp_number_p(CAR(args)))
-		size = lisp_safe_int(vm, CAR(args));
-	pthread_mutex_lock(&proc->mbox_lock);
-	if (proc->mbox == NULL) {
-		proc->mbox = fifo_new(size);
-	} else if (size > proc->mbox->size){
-		struct FIFO *f = fifo_copy(proc->mbox, size);
-		assert(f);
-		fifo_delete(proc->mbox);
-		proc->mbox = f;
-	}
-	pthread_mutex_unlock(&proc->mbox_lock);
+	{
+		size_t size = lisp_safe_int(vm, CAR(args));
+		if (size > proc->mbox.limit)
+			proc->mbox.limit = size;
+	}
 	lisp_push_buffer(vm, NULL, 512);
 	lisp_push_stream(vm, &mbox_stream_class, proc);
-	lisp_make_input_port(vm);
+	// Messages from other VMs may come binary, see encode_message()
+	lisp_port_set_binary(lisp_make_input_port(vm), proc->mbox.limit);
 }
 
 static bool process_output_ready(void *context, int mode)
@@ -466,12 +706,32 @@ static bool validate_name(const char *name)
 }
 
 /*
- * (send-message <pid> <message>)
+ * Encode a message for another VM: binary if possible, text
+ * otherwise. Both are taken by `read' on the receiver's mbox.
+ * The encoding stays valid until the next allocation.
+ */
+static const void *encode_message(Lisp_VM *vm, Lisp_Object *msg, size_t *size)
+{
+	if (lisp_serialize(vm, msg)) {
+		Lisp_Buffer *b = (Lisp_Buffer*)lisp_pop(vm, 1);
+		*size = lisp_buffer_size(b);
+		return lisp_buffer_bytes(b);
+	}
+	lisp_stringify(vm, msg);
+	const char *s = lisp_safe_cstring(vm, lisp_pop(vm, 1));
+	*size = strlen(s);
+	return s;
+}
+
+/*
+ * (send-message <pid> <message> [<wait>])
  *
- * Turn <message> into printable representation and append it
+ * Encode <message> (see encode_message()) and append it
  * to <pid>'s mbox if there is room.
  * Return true if message is successfully added to <pid>'s mbox.
- * If destination mbox doesn't have enough space, then return false.
+ * If destination mbox doesn't have enough space, then return false,
+ * or if <wait> is true, sleep until the receiver has read enough.
+ * A number for <wait> sleeps at most that many seconds.
  *
  * FIXME: make sure it's not shutdown, lock?
  */
@@ -480,17 +740,27 @@ static void op_send_message(Lisp_VM *vm, Lisp_Pair *args)
 	int pid = lisp_safe_int(vm, CAR(args));
 	if (!lisp_pair_p(CADR(args)))
 		lisp_err(vm, "Invalid message");
-	lisp_stringify(vm, CADR(args));
-	const char *buf = lisp_safe_cstring(vm, lisp_pop(vm, 1));
 	if (pid >= 0) {
-		struct twk_process *proc = &processes[pid % MAX_PROCESS];
-		if (pid != proc->pid)
+		struct twk_process *proc = twk_get_process(pid);
+		if (!proc)
 			lisp_push(vm, lisp_false);
 		else {
-			bool ok = twk_post_message(proc, buf, strlen(buf));
+			size_t size;
+			const void *data = encode_message(vm, CADR(args), &size);
+			Lisp_Object *wait = CADDR(args);
+			bool ok;
+			if (wait == lisp_true)
+				ok = post_message_wait(lisp_vm_client(vm), pid, data, size, -1);
+			else if (lisp_number_p(wait))
+				ok = post_message_wait(lisp_vm_client(vm), pid, data, size,
+				  fmax(lisp_safe_number(vm, wait), 0));
+			else
+				ok = twk_post_message(proc, data, size);
 			lisp_push(vm, ok ? lisp_true : lisp_false);
 		}
 	} else {
+		lisp_stringify(vm, CADR(args));
+		const char *buf = lisp_safe_cstring(vm, lisp_pop(vm, 1));
 		if (g_receive) {
 			g_receive(g_receive_context, buf);
 			lisp_push(vm, lisp_true);
@@ -631,9 +901,9 @@ static void op_spawn(Lisp_VM *vm, Lisp_Pair *args)
 	curr_proc->children = child;
 	pthread_mutex_unlock(&curr_proc->parental_lock);
 
-	lisp_stringify(vm, CADR(args));
-	const char *s = lisp_safe_cstring(vm, lisp_pop(vm, 1));
-	bool ok = twk_post_message(child, s, strlen(s));
+	size_t size;
+	const void *data = encode_message(vm, CADR(args), &size);
+	bool ok = twk_post_message(child, data, size);
 	assert(ok);
 	lisp_push(vm, (Lisp_Object*)lisp_number_new(vm, child->pid));
 }
@@ -670,20 +940,122 @@ static void op_list_processes(Lisp_VM *vm, Lisp_Pair *args)
 	lisp_push(vm, ret);
 }
 
-// Lock Protected
-static struct twk_process * find_runnable()
+static struct twk_process *rq_pop(struct run_queue *rq)
 {
-	static volatile int last = 0;
-	for (int i = 0, j = last + 1; i < MAX_PROCESS; i++, j++)
+	struct twk_process *proc = NULL;
+	pthread_mutex_lock(&rq->lock);
+	if (rq->count > 0)
 	{
-		if (j >= MAX_PROCESS)
-			j = 0;
-		if (processes[j].state == TWK_PS_RUNNABLE) {
-			last = j;
-			return &processes[j];
-		}
+		proc = rq->items[rq->head];
+		rq->head = (rq->head + 1) % rq->cap;
+		store_release(&rq->count, rq->count - 1);
 	}
-	return NULL;
+	pthread_mutex_unlock(&rq->lock);
+	return proc;
+}
+
+// Lock Protected
+static void rq_grow(struct run_queue *rq)
+{
+	unsigned cap = rq->cap ? rq->cap * 2 : 64;
+	struct twk_process **items = malloc(cap * sizeof(*items));
+	assert(items);
+	for (unsigned i = 0; i < rq->count; i++)
+		items[i] = rq->items[(rq->head + i) % rq->cap];
+	free(rq->items);
+	rq->items = items;
+	rq->head = 0;
+	rq->cap = cap;
+}
+
+// Wake the worker if it is idle. Return false if it is busy.
+static bool wake_worker(int i)
+{
+	struct run_queue *rq = &threads[i].rq;
+	bool woken = false;
+	pthread_mutex_lock(&rq->lock);
+	if (rq->idle)
+	{
+		rq->idle = 0;
+		pthread_cond_signal(&rq->notify);
+		woken = true;
+	}
+	pthread_mutex_unlock(&rq->lock);
+	return woken;
+}
+
+/*
+ * Queue a process that has just become runnable.
+ *
+ * If the preferred worker is busy, an idle one is woken as well so
+ * that it can steal the process instead of letting it wait.
+ */
+static void enqueue_runnable(struct twk_process *proc)
+{
+	int w = proc->worker;
+	if (w < 0 || w >= nthreads)
+		w = next_worker++ % nthreads;
+
+	struct run_queue *rq = &threads[w].rq;
+	proc->stats.queued_time = microtime();
+	pthread_mutex_lock(&rq->lock);
+	if (rq->count == rq->cap)
+		rq_grow(rq);
+	rq->items[(rq->head + rq->count) % rq->cap] = proc;
+	store_release(&rq->count, rq->count + 1);
+	pthread_mutex_unlock(&rq->lock);
+
+	if (wake_worker(w))
+		return;
+	for (int i = 1; i < nthreads; i++)
+	{
+		if (wake_worker((w + i) % nthreads))
+			break;
+	}
+}
+
+// Take a runnable process from our own queue, or steal one.
+static struct twk_process *dequeue_runnable(struct twk_thread *thread)
+{
+	int self = (int)(thread - threads);
+	struct twk_process *proc = rq_pop(&thread->rq);
+	for (int i = 1; !proc && i < nthreads; i++)
+		proc = rq_pop(&threads[(self + i) % nthreads].rq);
+	return proc;
+}
+
+static struct twk_process *process_at(int slot)
+{
+	return &process_chunks[slot / PROCESS_CHUNK_SIZE][slot % PROCESS_CHUNK_SIZE];
+}
+
+// Lock Protected
+static void free_slot(int slot)
+{
+	process_at(slot)->next_free_slot = -1;
+	if (free_slot_tail >= 0)
+		process_at(free_slot_tail)->next_free_slot = slot;
+	else
+		free_slot_head = slot;
+	free_slot_tail = slot;
+}
+
+// Lock Protected. Add a chunk of free slots to the table.
+static bool grow_process_table(void)
+{
+	int n = process_slots;
+	if (n >= MAX_PROCESS)
+		return false;
+	struct twk_process *chunk = calloc(PROCESS_CHUNK_SIZE, sizeof(struct twk_process));
+	if (!chunk)
+		return false;
+	process_chunks[n / PROCESS_CHUNK_SIZE] = chunk;
+	for (int i = 0; i < PROCESS_CHUNK_SIZE; i++)
+		free_slot(n + i);
+	// Others scan the table without the lock
+	memory_barrier();
+	process_slots = n + PROCESS_CHUNK_SIZE;
+	return true;
 }
 
 /*
@@ -692,39 +1064,38 @@ static struct twk_process * find_runnable()
 struct twk_process *twk_create_process(const char *name)
 {
 	struct twk_process *proc = NULL;
-	int pid = -1;
+	int slot = -1;
 	
 	pthread_mutex_lock(&pid_lock);
-	for (int i = 0; i < MAX_PROCESS; i++, next_pid++)
+	if (free_slot_head >= 0 || grow_process_table())
 	{
-		pid = next_pid % MAX_PROCESS;
-		if (processes[pid].state == TWK_PS_NONE)
-		{
-			proc = &processes[pid];
-			pid = next_pid++;
-			proc->state = TWK_PS_CREATED;
-			if (next_pid == 1000000) {
-				// We should not have 1 million processes here.
-				// we won't have enough RAM any way.
-				// Average process should require about 64KB.
-				next_pid = 1;
-			}
-			break;
-		}
+		slot = free_slot_head;
+		proc = process_at(slot);
+		free_slot_head = proc->next_free_slot;
+		if (free_slot_head < 0)
+			free_slot_tail = -1;
+		proc->state = TWK_PS_CREATED;
+		created_count++;
 	}
 	pthread_mutex_unlock(&pid_lock);
 	
 	if (proc)
 	{
-		assert(pid >= 0);
+		assert(slot >= 0);
+		unsigned gen = proc->generation;
 		memset(proc, 0, sizeof(struct twk_process));
+		proc->generation = gen;
+		proc->next_free_slot = -1;
 		proc->vm = lisp_vm_new();
 		lisp_vm_set_client(proc->vm, proc);
-		proc->pid = pid;
+		lisp_vm_set_yield(proc->vm, TWK_REDUCTIONS, preempt_process);
+		proc->pid = (int)(gen << PID_SLOT_BITS) | slot;
 		proc->fd = -1;
+		proc->poll_fd = -1;
+		proc->worker = -1;
+		proc->timer_index = -1;
         proc->start_time = microtime();
-        proc->mbox = fifo_new(TWK_INI_MBOX_SIZE);
-		pthread_mutex_init(&proc->mbox_lock, NULL);
+        mbox_init(&proc->mbox, TWK_MAX_MBOX_SIZE);
 		pthread_mutex_init(&proc->parental_lock, NULL);
 		if (name)
 			strncpy(proc->name, name, TWK_MAX_NAME-1);
@@ -735,20 +1106,151 @@ struct twk_process *twk_create_process(const char *name)
 
 struct twk_process *twk_get_process(int pid)
 {
-	int i = pid % MAX_PROCESS;
-	if (processes[i].state != TWK_PS_NONE && processes[i].pid == pid) {
-		return &processes[i];
+	if (pid < 0 || PID_SLOT(pid) >= process_slots)
+		return NULL;
+	struct twk_process *proc = process_at(PID_SLOT(pid));
+	if (proc->state != TWK_PS_NONE && proc->pid == pid) {
+		return proc;
 	} else {
 		return NULL;
 	}
 }
 
+// Return the slot of a shut down process to the table
+static void release_process(struct twk_process *proc)
+{
+	pthread_mutex_lock(&pid_lock);
+	proc->generation = (proc->generation + 1) % PID_GENERATIONS;
+	proc->state = TWK_PS_NONE;
+	free_slot(PID_SLOT(proc->pid));
+	released_count++;
+	released_dropped += proc->mbox.dropped;
+	pthread_mutex_unlock(&pid_lock);
+}
+
+
+static void timer_place(int i, struct timer t)
+{
+	timer_heap[i] = t;
+	t.proc->timer_index = i;
+}
+
+static void timer_sift_up(int i)
+{
+	struct timer t = timer_heap[i];
+	while (i > 0)
+	{
+		int parent = (i - 1) / 2;
+		if (timer_heap[parent].time <= t.time)
+			break;
+		timer_place(i, timer_heap[parent]);
+		i = parent;
+	}
+	timer_place(i, t);
+}
+
+static void timer_sift_down(int i)
+{
+	struct timer t = timer_heap[i];
+	while (true)
+	{
+		int child = 2 * i + 1;
+		if (child >= timer_count)
+			break;
+		if (child + 1 < timer_count
+		 && timer_heap[child + 1].time < timer_heap[child].time)
+			child++;
+		if (t.time <= timer_heap[child].time)
+			break;
+		timer_place(i, timer_heap[child]);
+		i = child;
+	}
+	timer_place(i, t);
+}
+
+// Lock Protected
+static void timer_remove(struct twk_process *proc)
+{
+	int i = proc->timer_index;
+	if (i < 0)
+		return;
+	proc->timer_index = -1;
+	if (--timer_count > i)
+	{
+		timer_place(i, timer_heap[timer_count]);
+		struct twk_process *moved = timer_heap[i].proc;
+		timer_sift_up(i);
+		timer_sift_down(moved->timer_index);
+	}
+}
+
+/*
+ * Move proc in the heap after its sched_time has changed, or take
+ * it out if the timeout is cleared. Return true if proc is now the
+ * earliest, so that the scheduler should recompute its wait.
+ */
+static bool update_timer(struct twk_process *proc)
+{
+	bool earliest = false;
+	pthread_mutex_lock(&timer_lock);
+	timer_remove(proc);
+	double time = proc->sched_time;
+	if (time > 0)
+	{
+		if (timer_count == timer_cap)
+		{
+			int cap = timer_cap ? timer_cap * 2 : 64;
+			struct timer *heap = realloc(timer_heap, cap * sizeof(*heap));
+			assert(heap);
+			timer_heap = heap;
+			timer_cap = cap;
+		}
+		timer_place(timer_count, (struct timer){time, proc});
+		timer_sift_up(timer_count++);
+		earliest = proc->timer_index == 0;
+	}
+	pthread_mutex_unlock(&timer_lock);
+	return earliest;
+}
+
+static bool timeout_due(struct twk_process *proc)
+{
+	return proc->sched_time > 0 && proc->sched_time <= microtime();
+}
 
-// Many threads may want to sched same process at the same time
-// we do not use a lock here, because it seems harmless
+/*
+ * Schedule the waiting processes whose timeout is due. Return the
+ * seconds until the next timeout, or -1 if there is none.
+ *
+ * Processes that are not waiting drop their timer here. They check
+ * timeout_due() once they are back to waiting.
+ */
+static double expire_timers(double curr_time)
+{
+	double next = -1;
+	pthread_mutex_lock(&timer_lock);
+	while (timer_count > 0)
+	{
+		struct twk_process *proc = timer_heap[0].proc;
+		if (timer_heap[0].time > curr_time)
+		{
+			next = timer_heap[0].time - curr_time;
+			break;
+		}
+		timer_remove(proc);
+		if (proc->state == TWK_PS_WAITING)
+			twk_sched(proc, true);
+	}
+	pthread_mutex_unlock(&timer_lock);
+	return next;
+}
+
+// Many threads may want to sched same process at the same time.
+// Only the one that wins the state change queues it.
 void twk_sched(struct twk_process *proc, bool immediate)
 {
-	if (proc->state != TWK_PS_CREATED && proc->state != TWK_PS_WAITING)
+	enum twk_process_state state = proc->state;
+	if (state != TWK_PS_CREATED && state != TWK_PS_WAITING)
 	{
 		// Already running or pending or done
 		// We should not try to do anything
@@ -757,15 +1259,21 @@ void twk_sched(struct twk_process *proc, bool immediate)
 	
 	if (immediate)
 	{
-		proc->state = TWK_PS_RUNNABLE;
-		pthread_cond_signal(&runnable_notify);
+		if (cas_state(proc, state, TWK_PS_RUNNABLE))
+			enqueue_runnable(proc);
 	}
 	else
 	{
-		proc->state = TWK_PS_WAITING;
+		cas_state(proc, TWK_PS_CREATED, TWK_PS_WAITING);
 	}
 }
 
+// Have the scheduler look at proc again, after its fd has changed
+void twk_wake_sched(struct twk_process *proc)
+{
+	wake_sched(proc);
+}
+
 static void remove_child(struct twk_process *parent, struct twk_process *child)
 {
 	assert(parent == child->parent);
@@ -795,6 +1303,8 @@ static void remove_child(struct twk_process *parent, struct twk_process *child)
 			// however, the parent needs to have input messages
 			// or timeout set
 			parent->state = TWK_PS_WAITING;
+			if (timeout_due(parent))
+				twk_sched(parent, true);
 		}
 		else if (parent->state == TWK_PS_DONE)
 		{
@@ -814,7 +1324,7 @@ static void shutdown_process(struct twk_process *proc)
 	if (proc->parent) {
 		remove_child(proc->parent, proc);
 		if (proc->parent->state == TWK_PS_SHUTDOWN || proc->parent->state==TWK_PS_WAITING) {
-			wake_sched(proc); // So our parent may be able to run as soon as possible
+			wake_sched(proc->parent); // So our parent may be able to run as soon as possible
 		}
 	}
 
@@ -824,6 +1334,11 @@ static void shutdown_process(struct twk_process *proc)
 		proc->data = NULL;
 		proc->finalize = NULL;
 	}
+	if (proc->poll_fd >= 0)
+	{
+		poller_forget(sched_poller, proc->poll_fd);
+		proc->poll_fd = -1;
+	}
 	if (proc->fd >= 0)
 	{
 		close(proc->fd);
@@ -836,15 +1351,11 @@ static void shutdown_process(struct twk_process *proc)
 		proc->instance_name = NULL;
 	}
 
-	pthread_mutex_lock(&proc->mbox_lock);
-	if (proc->mbox)
-	{
-		fifo_delete(proc->mbox);
-		proc->mbox = NULL;
-	}
-	pthread_mutex_unlock(&proc->mbox_lock);
+	wake_parked(proc);
+	mbox_close(&proc->mbox);
+	proc->sched_time = 0;
+	update_timer(proc);
 
-	pthread_mutex_destroy(&proc->mbox_lock);
 	pthread_mutex_destroy(&proc->parental_lock);
 	if (proc->vm)
 	{
@@ -858,7 +1369,8 @@ static void shutdown_process(struct twk_process *proc)
 	proc->parent = NULL;
 	proc->sib_next = NULL;
 	proc->children = NULL;
-	proc->state = TWK_PS_NONE;
+	unlist_for_sched(proc);
+	release_process(proc);
 }
 
 static void run_vm(Lisp_VM *vm, void *data)
@@ -868,81 +1380,236 @@ static void run_vm(Lisp_VM *vm, void *data)
 	p->run(p);
 }
 
+static void run_process(void *data)
+{
+	struct twk_process *proc = data;
+	lisp_vm_set_stack_size(proc->vm, TWK_STACK_SIZE - TWK_STACK_RESERVE);
+	proc->run_failed = lisp_try(proc->vm, run_vm, proc) == NULL;
+	proc->pinned = 0; // an error may have skipped twk_pin_process(proc, false)
+}
+
+/*
+ * Runs execute on stacks of their own, so that a process can be
+ * suspended in the middle of evaluation and resumed by any worker.
+ * Stacks of finished runs are kept for reuse.
+ *
+ * So a run may go on in another thread after it yields. C code that
+ * evaluates Lisp while it holds a mutex, or uses thread local data,
+ * must pin the process around it with twk_pin_process(). A pinned
+ * run is not preempted, and blocks its worker where it would park.
+ */
+void twk_pin_process(struct twk_process *proc, bool pin)
+{
+	if (pin) {
+		proc->pinned++;
+	} else {
+		assert(proc->pinned > 0);
+		proc->pinned--;
+	}
+}
+
+static struct coro *get_coro(void)
+{
+	struct coro *c = NULL;
+	pthread_mutex_lock(&coro_lock);
+	if (spare_coro_count > 0)
+		c = spare_coros[--spare_coro_count];
+	pthread_mutex_unlock(&coro_lock);
+	return c ? c : coro_new(TWK_STACK_SIZE);
+}
+
+static void put_coro(struct coro *c)
+{
+	pthread_mutex_lock(&coro_lock);
+	if (spare_coro_count < MAX_SPARE_COROS)
+	{
+		spare_coros[spare_coro_count++] = c;
+		c = NULL;
+	}
+	pthread_mutex_unlock(&coro_lock);
+	if (c)
+		coro_delete(c);
+}
+
+// Only by the thread running proc
+static void update_gc_stats(struct twk_process *proc)
+{
+	struct twk_process_stats *st = &proc->stats;
+	lisp_gc_stats_t gc;
+
+	lisp_vm_get_gc_stats(proc->vm, &gc);
+	st->gc_count = gc.minor_count + gc.major_count;
+	st->gc_pause = gc.total_pause;
+	st->gc_max_pause = gc.max_pause;
+	st->memsize = gc.memsize;
+}
+
+static void update_stats(struct twk_thread *thread, struct twk_process *proc,
+  double wait, double busy)
+{
+	struct twk_process_stats *st = &proc->stats;
+
+	thread->busy_time += busy;
+	thread->wait_time += wait;
+	if (wait > thread->max_wait_time)
+		thread->max_wait_time = wait;
+
+	st->run_time += busy;
+	if (busy > st->max_run_time)
+		st->max_run_time = busy;
+	st->wait_time += wait;
+	if (wait > st->max_wait_time)
+		st->max_wait_time = wait;
+	update_gc_stats(proc);
+}
+
+/*
+ * Whether a process waits in some run queue. The counts are read
+ * without the locks and may be stale, which is fine for a hint.
+ */
+static bool have_runnable(void)
+{
+	for (int i = 0; i < nthreads; i++)
+	{
+		if (load_acquire(&threads[i].rq.count) > 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Called by the VM of a process that has evaluated its budget of
+ * expressions. If others are waiting for a worker, suspend the run
+ * and let thread_main() queue us again.
+ */
+static void preempt_process(Lisp_VM *vm)
+{
+	struct twk_process *proc = lisp_vm_client(vm);
+	if (!proc || !proc->coro || proc->pinned || proc->state != TWK_PS_RUNNING
+	 || !have_runnable())
+		return;
+	proc->preempted = true;
+	assert(!proc->pinned);
+	coro_yield(proc->coro);
+}
+
 /*
  * Running on worker thread.
  */
 static void *thread_main(void *obj)
 {
 	struct twk_thread *thread = obj;
+	struct run_queue *rq = &thread->rq;
 	struct twk_process *proc;
+	if (!coro_thread_init())
+		twk_log(NULL, TWK_LOGGING_ERROR, "Can not switch stacks, no preemption");
 	while (!thread->shutdown)
 	{
-		proc = NULL;
-		
-		/*
-		 * Fetch a runnable process from process table.
-		 */
-		pthread_mutex_lock(&runnable_lock);
-		while (!thread->shutdown)
+		proc = dequeue_runnable(thread);
+		if (!proc)
 		{
-			proc = find_runnable();
-			if (proc)
-			{
-				proc->state = TWK_PS_RUNNING;
-				break;
-			}
-			pthread_cond_wait(&runnable_notify, &runnable_lock);
+			/*
+			 * Say we are idle before looking once more, so that
+			 * a process queued in between is either seen here
+			 * or wakes us up.
+			 */
+			pthread_mutex_lock(&rq->lock);
+			rq->idle = 1;
+			pthread_mutex_unlock(&rq->lock);
+			proc = dequeue_runnable(thread);
+			pthread_mutex_lock(&rq->lock);
+			while (!proc && rq->idle && !thread->shutdown)
+				pthread_cond_wait(&rq->notify, &rq->lock);
+			rq->idle = 0;
+			pthread_mutex_unlock(&rq->lock);
+			if (!proc)
+				continue;
 		}
-		pthread_mutex_unlock(&runnable_lock);
 
 		if (thread->shutdown)
 		{
 			/*
 			 * If we are going to shutdown but already
-			 * acquired a runnable, then we must restore its state.
+			 * acquired a runnable, then we must give it back.
 			 */
-			if (proc)
-			{
-				proc->state = TWK_PS_RUNNABLE;
-				pthread_cond_signal(&runnable_notify);
-			}
+			proc->worker = -1;
+			enqueue_runnable(proc);
 			break;
 		}
 		
+		proc->state = TWK_PS_RUNNING;
+		proc->worker = (int)(thread - threads);
 		assert(proc != NULL);
-		thread->run_time = (double)time(0);
+		thread->run_time = microtime();
 		thread->proc = proc;
 		assert(proc->run);
-		Lisp_Object* ret = lisp_try(proc->vm, run_vm, proc);
-		proc->runcnt++;
+		if (!proc->coro && (proc->coro = get_coro()) != NULL)
+			coro_start(proc->coro, run_process, proc);
+		lisp_vm_pause_profile(proc->vm, false);
+		if (proc->coro)
+			coro_resume(proc->coro);
+		else
+			run_process(proc);
+		lisp_vm_pause_profile(proc->vm, true);
+		update_stats(thread, proc, thread->run_time - proc->stats.queued_time,
+		  microtime() - thread->run_time);
 		thread->proc = NULL;
 		thread->run_time = 0.0;
-		
+
+		// Before it may park or be preempted, so that it does
+		// not wait on a child that was never started
 		if (proc->children)
 		{
 			// this process has children,
 			// therefore make all its children running
 			// new child is added to the front.
-			int new_child = 0;
 			pthread_mutex_lock(&proc->parental_lock);
 			for (struct twk_process *p = proc->children; p ; p = p->sib_next)
 			{
-				if (p->state == TWK_PS_CREATED) {
-					p->state = TWK_PS_RUNNABLE;
-					new_child++;
-				} else {
+				if (p->state != TWK_PS_CREATED)
 					break;
-				}
+				twk_sched(p, true);
 			}
 			pthread_mutex_unlock(&proc->parental_lock);
-			if (new_child > 0)
-				pthread_cond_signal(&runnable_notify);
 		}
 
+		if (proc->parking)
+		{
+			// Waiting in send-message, see post_message_wait(),
+			// for its socket, see twk_wait_fd(), or for a helper
+			// thread, see twk_run_blocking()
+			proc->parking = false;
+			cas_state(proc, TWK_PS_RUNNING, TWK_PS_WAITING);
+			memory_barrier();
+			if (proc->io_wait || proc->parked_on ? timeout_due(proc)
+			  : !proc->blocked)
+				twk_sched(proc, true);
+			else if (proc->io_wait)
+				wake_sched(proc); // so that it watches fd
+			continue;
+		}
+		if (proc->preempted)
+		{
+			// We are off its stack now, another worker may resume it
+			thread->preempts++;
+			proc->stats.preempts++;
+			proc->preempted = false;
+			proc->state = TWK_PS_RUNNABLE;
+			enqueue_runnable(proc);
+			continue;
+		}
+		if (proc->coro)
+		{
+			put_coro(proc->coro);
+			proc->coro = NULL;
+		}
+		proc->runcnt++;
+		thread->runs++;
+		
 		// Modifying process state should be the last thing we
 		// do here, because the schedule loop thread is also
 		// checking the state.
-		if (!ret)
+		if (proc->run_failed)
 		{
 			twk_log(proc, TWK_LOGGING_ERROR, "finished due to run time error");
 			if (proc->children == NULL) {
@@ -959,10 +1626,16 @@ static void *thread_main(void *obj)
 		}
 		else if (proc->state == TWK_PS_RUNNING)
 		{
-			proc->state = TWK_PS_WAITING;
-			// The scheduler may be in the middle of select()
-			// we should wake it so that it can add our fd to watch list
-			if (proc->fd >= 0 || proc->sched_time > 0) 
+			cas_state(proc, TWK_PS_RUNNING, TWK_PS_WAITING);
+			// A message posted while we were running did not
+			// schedule us. Requeue now rather than waiting for
+			// the scheduler loop to notice. Same for a timeout
+			// that expired while we were running.
+			if (mbox_bytes(&proc->mbox) > 0 || timeout_due(proc))
+				twk_sched(proc, true);
+			// The scheduler may be in the middle of a wait,
+			// we should wake it so that it can watch our fd again
+			else if (proc->fd >= 0) 
 				wake_sched(proc);
 		}
 	}
@@ -970,93 +1643,82 @@ static void *thread_main(void *obj)
 	return NULL;
 }
 
-static void set_timeval(struct timeval *tv, double secs)
-{
-	tv->tv_sec = (int)floor(secs);
-	tv->tv_usec = (int)((secs - tv->tv_sec) * 1000000);
-}
-
 /*
- * server process will return to wait if there is a 5 seconds of inactivity.
- * Therefore we will not occupy a thread instance doing nothing.
+ * Accept the clients waiting and return. The scheduler watches the
+ * listening socket and runs us again when more arrive, so we do not
+ * occupy a thread instance doing nothing.
  */
 static void socket_server_run(struct twk_process *proc)
 {
 	uint32_t clilen;
-	struct sockaddr_in cli_addr;
-	fd_set rset;
-	struct timeval timeout;
+	struct sockaddr_storage cli_addr;
 
 	while (true)
 	{
-	    int val = 1;
-
-		timeout.tv_sec = 5;
-		timeout.tv_usec = 0;
-		FD_ZERO(&rset);
-		FD_SET(proc->fd, &rset);
-		select(proc->fd+1, &rset, NULL, NULL, &timeout);
-		if (FD_ISSET(proc->fd, &rset))
+		int cli_fd = accept_tcp_client(proc->fd, &cli_addr, &clilen);
+		if (cli_fd == -1)
 		{
-			clilen = sizeof(cli_addr);
-			int cli_fd = accept(proc->fd, (struct sockaddr *)&cli_addr, &clilen);
-			if (cli_fd == -1)
-			{
-				#ifndef _WIN32
-				if (errno == EWOULDBLOCK)
-					break;
-				#endif
-				perror("socket server: accept()");
-				return;
-			}
-
-#ifdef SO_NOSIGPIPE			
-            if (setsockopt(cli_fd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&val, sizeof(int)) < 0)
-            {
-                perror("client socket: setsockopt(SO_NOSIGPIPE)");
-                close(cli_fd);
-                return;
-            }
-#endif
-            if (setsockopt(cli_fd, SOL_SOCKET, SO_KEEPALIVE, (void*)&val, sizeof(int)) < 0)
-            {
-                perror("client socket: setsockopt(SO_KEEPALIVE)");
-                close(cli_fd);
-                return;
-            }
-			char adrbuf[64] = { 0 };
-			inet_ntop(cli_addr.sin_family, &cli_addr.sin_addr, adrbuf, sizeof(adrbuf));
-			twk_log(proc, TWK_LOGGING_VERBOSE, "client fd: %d %s len=%d\n", cli_fd, 
-				adrbuf,
-					clilen);
-			twk_client_callback fn = proc->data;
-			fn(cli_fd, (struct sockaddr *)&cli_addr, clilen);
+			#ifndef _WIN32
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
+			#endif
+			perror("socket server: accept()");
+			return;
 		}
+
+		char adrbuf[64] = { 0 };
+		if (cli_addr.ss_family == AF_INET6)
+			inet_ntop(AF_INET6, &((struct sockaddr_in6*)&cli_addr)->sin6_addr,
+				adrbuf, sizeof(adrbuf));
 		else
-			break;
+			inet_ntop(AF_INET, &((struct sockaddr_in*)&cli_addr)->sin_addr,
+				adrbuf, sizeof(adrbuf));
+		twk_log(proc, TWK_LOGGING_VERBOSE, "client fd: %d %s len=%d\n", cli_fd, 
+			adrbuf,
+				clilen);
+		twk_client_callback fn = proc->data;
+		fn(cli_fd, (struct sockaddr *)&cli_addr, clilen);
 	}
 }
 
+/*
+ * Start count server processes listening on sa. More than one share
+ * the port with SO_REUSEPORT, where it is supported. Return the first.
+ */
 struct twk_process * twk_create_socket_server(
 	const char *name,
-	uint32_t addr,
-	uint16_t port,
+	struct sockaddr *sa,
+	int backlog,
+	int count,
 	twk_client_callback fn)
 {
-	int fd = open_tcp_server_socket(addr, port);
-	if (fd < 0)
-		return NULL;
-	struct twk_process *proc = twk_create_process(name);
-	if (proc)
+	struct twk_process *first = NULL;
+#ifndef SO_REUSEPORT
+	count = 1;
+#endif
+	for (int i = 0; i < count; i++)
 	{
-		// check fd
+		int fd = open_tcp_server_socket(sa, backlog, count > 1);
+		if (fd < 0)
+			break;
+		struct twk_process *proc = twk_create_process(name);
+		if (!proc)
+		{
+			close(fd);
+			break;
+		}
 		proc->fd = fd;
 		proc->run = socket_server_run;
 		proc->data = fn;
 		twk_sched(proc, false);
-		printf("Created socket server listening at port %d\n", port);
+		wake_sched(proc); // so that it watches fd
+		if (!first)
+			first = proc;
 	}
-	return proc;
+	if (first)
+		printf("Created socket server listening at port %d\n",
+			ntohs(((struct sockaddr_in*)sa)->sin_port));
+	return first;
 }
 
 void sleep_for_seconds(double secs)
@@ -1071,6 +1733,139 @@ void sleep_for_seconds(double secs)
 #endif
 }
 
+/*
+ * Wait at most secs for fd to become readable, or writable. Returns
+ * when it may be ready, callers retry their I/O and wait again.
+ *
+ * A run on a stack of its own yields, and the scheduler watches
+ * proc->fd the way asked until then, so that a slow peer does not
+ * hold the worker. Otherwise the worker blocks in select().
+ */
+void twk_wait_fd(struct twk_process *proc, int fd, bool write, double secs)
+{
+	if (!proc || fd != proc->fd || !proc->coro || proc->pinned
+	 || proc->state != TWK_PS_RUNNING || !sched_poller)
+	{
+		fd_set fs;
+		struct timeval tv;
+		FD_ZERO(&fs);
+		FD_SET(fd, &fs);
+		tv.tv_sec = (long)secs;
+		tv.tv_usec = (long)((secs - tv.tv_sec) * 1000000);
+		select(fd + 1, write ? NULL : &fs, write ? &fs : NULL, NULL, &tv);
+		return;
+	}
+	// The timeout of the process itself is only due between runs
+	double saved = proc->sched_time;
+	proc->sched_time = microtime() + secs;
+	update_timer(proc);
+	proc->io_write = write;
+	proc->io_wait = true;
+	proc->parking = true;
+	assert(!proc->pinned);
+	coro_yield(proc->coro);
+	proc->io_wait = false;
+	proc->sched_time = saved;
+	update_timer(proc);
+}
+
+/*
+ * Blocking calls
+ *
+ * twk_run_blocking() hands a call that may block for long, like a
+ * name lookup, to a few helper threads started on demand. The run
+ * yields until its call is done, so that the worker goes on with
+ * other processes. The helper clears proc->blocked and schedules
+ * it under blocking_lock, which the run takes before it returns.
+ */
+#define TWK_BLOCKING_THREADS 4
+
+struct blocking_call
+{
+	void (*fn)(void*);
+	void *arg;
+	struct twk_process *proc;
+	struct blocking_call *next;
+};
+
+static pthread_mutex_t blocking_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t blocking_notify = PTHREAD_COND_INITIALIZER;
+static struct blocking_call *blocking_head;
+static struct blocking_call **blocking_tail = &blocking_head;
+static int blocking_threads;
+static int blocking_idle;
+
+static void *blocking_main(void *arg)
+{
+	pthread_mutex_lock(&blocking_lock);
+	while (true)
+	{
+		while (!blocking_head)
+		{
+			blocking_idle++;
+			pthread_cond_wait(&blocking_notify, &blocking_lock);
+			blocking_idle--;
+		}
+		struct blocking_call *c = blocking_head;
+		blocking_head = c->next;
+		if (!blocking_head)
+			blocking_tail = &blocking_head;
+		pthread_mutex_unlock(&blocking_lock);
+
+		c->fn(c->arg);
+
+		pthread_mutex_lock(&blocking_lock);
+		// c is on the stack of the run, gone once it goes on
+		struct twk_process *proc = c->proc;
+		proc->blocked = false;
+		memory_barrier();
+		twk_sched(proc, true);
+	}
+	return NULL;
+}
+
+void twk_run_blocking(struct twk_process *proc, void (*fn)(void*), void *arg)
+{
+	if (!proc || !proc->coro || proc->pinned || proc->state != TWK_PS_RUNNING)
+	{
+		fn(arg);
+		return;
+	}
+
+	struct blocking_call c = {fn, arg, proc, NULL};
+	pthread_mutex_lock(&blocking_lock);
+	if (blocking_idle == 0 && blocking_threads < TWK_BLOCKING_THREADS)
+	{
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, blocking_main, NULL) == 0)
+		{
+			pthread_detach(tid);
+			blocking_threads++;
+		}
+	}
+	if (blocking_threads == 0)
+	{
+		pthread_mutex_unlock(&blocking_lock);
+		fn(arg);
+		return;
+	}
+	proc->blocked = true;
+	*blocking_tail = &c;
+	blocking_tail = &c.next;
+	pthread_cond_signal(&blocking_notify);
+	pthread_mutex_unlock(&blocking_lock);
+
+	// A timer or the socket may resume the run before the call is done
+	while (proc->blocked)
+	{
+		proc->parking = true;
+		assert(!proc->pinned);
+		coro_yield(proc->coro);
+	}
+	pthread_mutex_lock(&blocking_lock);
+	pthread_mutex_unlock(&blocking_lock);
+}
+
 static void op_sleep(Lisp_VM *vm, Lisp_Pair *args)
 {
 	double secs = lisp_safe_number(vm, CAR(args));
@@ -1107,6 +1902,8 @@ static void op_set_timeout(Lisp_VM *vm, Lisp_Pair *args)
 		proc->sched_time = 0;
 	else
 		proc->sched_time = microtime() + secs;
+	if (update_timer(proc))
+		wake_sched(proc);
 	lisp_push(vm, lisp_undef);
 }
 
@@ -1294,7 +2091,7 @@ static void op_wakeup_dispatch(Lisp_VM *vm, Lisp_Pair *args)
 		lisp_push(vm, lisp_undef);
 }
 
-static void op_microtime(Lisp_VM *vm, Lisp_Pair *args)
+static void op_microtime(Lisp_VM *vm, size_t argv, int argc)
 {
 	PUSHX(vm, lisp_number_new(vm, microtime()));
 }
@@ -1335,7 +2132,7 @@ static void print_threads(void)
 	double curr_time = microtime();
 	printf("*** BEGIN Thread Listing %f\n", curr_time);
 	int nrun = 0;
-	for (int i = 0; i < MAX_THREADS; i++)
+	for (int i = 0; i < nthreads; i++)
 	{
 		if (threads[i].run_time > 0)
 		{
@@ -1347,7 +2144,7 @@ static void print_threads(void)
 			nrun++;
 		}
 	}
-	printf("%d/%d running\n", nrun, MAX_THREADS);
+	printf("%d/%d running\n", nrun, nthreads);
 }
 
 static void print_processes(void)
@@ -1355,21 +2152,18 @@ static void print_processes(void)
     double curr_time = microtime();
     printf("*** BEGIN Process Listing %f\n", curr_time);
     int nrun = 0;
-    for (int i = 0; i < MAX_PROCESS; i++)
+    for (int i = 0; i < process_slots; i++)
     {
-        struct twk_process *proc = &processes[i];
+        struct twk_process *proc = process_at(i);
         if (proc->state != TWK_PS_NONE)
         {
-        	// We are accessing from another thread
-        	pthread_mutex_lock(&proc->mbox_lock);
-        	int n = (int)fifo_bytes(proc->mbox);
-        	int total = (int)proc->mbox->wtotal;
-        	pthread_mutex_unlock(&proc->mbox_lock);
+        	int n = (int)mbox_bytes(&proc->mbox);
+        	int total = (int)proc->mbox.total;
 			
             printf("NODE PROCESS PID %2d: %12s[MBOX:%d/%d/%d]: %8s, %f secs, %d\n",
               proc->pid,
               proc->name,
-			  n,(int)proc->mbox->size, total,
+			  n,(int)proc->mbox.limit, total,
               state_names[proc->state],
               curr_time - proc->start_time,
               proc->runcnt);
@@ -1378,11 +2172,157 @@ static void print_processes(void)
     }
 }
 
+static void push_stat(Lisp_VM *vm, const char *name, double value)
+{
+	lisp_make_symbol(vm, name);
+	lisp_push_number(vm, value);
+	lisp_cons(vm);
+}
+
+static void push_stat_symbol(Lisp_VM *vm, const char *name, const char *value)
+{
+	lisp_make_symbol(vm, name);
+	lisp_make_symbol(vm, value);
+	lisp_cons(vm);
+}
+
+/*
+ * Counters of another process are read while its worker may be
+ * updating them, so they are only as exact as a snapshot can be.
+ */
+static void push_process_stats(Lisp_VM *vm, struct twk_process *proc)
+{
+	struct twk_process_stats st = proc->stats;
+	char name[TWK_MAX_NAME];
+	int state = proc->state;
+
+	strncpy(name, proc->name, TWK_MAX_NAME-1);
+	name[TWK_MAX_NAME-1] = 0;
+	lisp_begin_list(vm);
+	push_stat(vm, "pid", proc->pid);
+	push_stat_symbol(vm, "name", name[0] ? name : "*noname*");
+	push_stat_symbol(vm, "state", state_names[state]);
+	push_stat(vm, "age", microtime() - proc->start_time);
+	push_stat(vm, "runs", proc->runcnt);
+	push_stat(vm, "preempts", st.preempts);
+	push_stat(vm, "run-time", st.run_time);
+	push_stat(vm, "max-run-time", st.max_run_time);
+	push_stat(vm, "wait-time", st.wait_time);
+	push_stat(vm, "max-wait-time", st.max_wait_time);
+	push_stat(vm, "mbox", (double)mbox_bytes(&proc->mbox));
+	push_stat(vm, "mbox-high", (double)proc->mbox.high);
+	push_stat(vm, "mbox-limit", (double)proc->mbox.limit);
+	push_stat(vm, "mbox-total", (double)proc->mbox.total);
+	push_stat(vm, "dropped", (double)proc->mbox.dropped);
+	push_stat(vm, "gc", (double)st.gc_count);
+	push_stat(vm, "gc-pause", st.gc_pause);
+	push_stat(vm, "gc-max-pause", st.gc_max_pause);
+	push_stat(vm, "memsize", (double)st.memsize);
+	lisp_end_list(vm);
+}
+
+/*
+ * (process-stats [<pid>])
+ *
+ * Return an alist of counters of process <pid>, or the current
+ * process if not given. Given 'all, return a list of them for every
+ * process. Return false if there is no such process. Times are in
+ * seconds, sizes in bytes. GC counters are as of the end of its
+ * last run.
+ */
+static void op_process_stats(Lisp_VM *vm, Lisp_Pair *args)
+{
+	struct twk_process *proc = lisp_vm_client(vm);
+	Lisp_Object *arg = CAR(args);
+
+	if (lisp_symbol_p(arg) && strcmp(lisp_string_cstr((Lisp_String*)arg), "all") == 0)
+	{
+		int n = 0;
+		for (int i = 0; i < process_slots; i++)
+		{
+			struct twk_process *p = process_at(i);
+			if (p->state != TWK_PS_NONE)
+			{
+				push_process_stats(vm, p);
+				n++;
+			}
+		}
+		lisp_make_list(vm, n);
+		return;
+	}
+	if (lisp_number_p(arg))
+		proc = twk_get_process(lisp_safe_int(vm, arg));
+	else
+		update_gc_stats(proc);
+	if (!proc)
+	{
+		lisp_push(vm, lisp_false);
+		return;
+	}
+	push_process_stats(vm, proc);
+}
+
+/*
+ * (scheduler-stats)
+ *
+ * Return an alist of counters of all workers and processes.
+ */
+static void op_scheduler_stats(Lisp_VM *vm, Lisp_Pair *args)
+{
+	unsigned long runs = 0, preempts = 0, created, released, dropped;
+	double busy_time = 0, wait_time = 0, max_wait_time = 0;
+	int busy = 0, runnable = 0, timers;
+
+	for (int i = 0; i < nthreads; i++)
+	{
+		struct twk_thread *t = &threads[i];
+		runs += t->runs;
+		preempts += t->preempts;
+		busy_time += t->busy_time;
+		wait_time += t->wait_time;
+		if (t->max_wait_time > max_wait_time)
+			max_wait_time = t->max_wait_time;
+		if (t->run_time > 0)
+			busy++;
+		runnable += load_acquire(&t->rq.count);
+	}
+	pthread_mutex_lock(&pid_lock);
+	created = created_count;
+	released = released_count;
+	dropped = released_dropped;
+	pthread_mutex_unlock(&pid_lock);
+	for (int i = 0; i < process_slots; i++)
+	{
+		struct twk_process *p = process_at(i);
+		if (p->state != TWK_PS_NONE)
+			dropped += p->mbox.dropped;
+	}
+	pthread_mutex_lock(&timer_lock);
+	timers = timer_count;
+	pthread_mutex_unlock(&timer_lock);
+
+	lisp_begin_list(vm);
+	push_stat(vm, "workers", nthreads);
+	push_stat(vm, "busy-workers", busy);
+	push_stat(vm, "runnable", runnable);
+	push_stat(vm, "processes", (double)(created - released));
+	push_stat(vm, "created", (double)created);
+	push_stat(vm, "timers", timers);
+	push_stat(vm, "runs", (double)runs);
+	push_stat(vm, "preempts", (double)preempts);
+	push_stat(vm, "busy-time", busy_time);
+	push_stat(vm, "wait-time", wait_time);
+	push_stat(vm, "max-wait-time", max_wait_time);
+	push_stat(vm, "dropped", (double)dropped);
+	lisp_end_list(vm);
+}
+
 void twk_log(struct twk_process *proc, int level, const char *fmt, ...)
 {
 	va_list ap;
 
-	int currlevel = proc ? proc->logging_level : processes[0].logging_level;
+	int currlevel = proc ? proc->logging_level
+	                     : process_slots > 0 ? process_at(0)->logging_level : 0;
 	if (currlevel < level)
 			return;
 	va_start(ap, fmt);
@@ -1402,42 +2342,82 @@ void twk_vlog(struct twk_process *proc, const char *fmt, va_list ap)
 	pthread_mutex_unlock(&twk_log_lock);
 }
 
+/*
+ * Make sure the scheduler poller reports proc's fd when it becomes
+ * readable, or writable while a run waits to write in twk_wait_fd().
+ * Watches are one-shot, so this re-arms after each report.
+ */
+static void watch_process_fd(struct twk_process *proc)
+{
+	bool write = proc->io_wait && proc->io_write;
+	if (proc->poll_fd != proc->fd)
+	{
+		if (proc->poll_fd >= 0)
+			poller_forget(sched_poller, proc->poll_fd);
+		proc->poll_fd = proc->fd;
+		proc->poll_armed = 0;
+	}
+	if (proc->poll_write != write)
+		proc->poll_armed = 0;
+	if (proc->fd > 0 && !proc->poll_armed)
+	{
+		bool ok = write ? poller_watch_write(sched_poller, proc->fd, proc)
+		  : poller_watch(sched_poller, proc->fd, proc);
+		if (ok)
+		{
+			proc->poll_armed = 1;
+			proc->poll_write = write;
+		}
+		else
+			twk_log(proc, TWK_LOGGING_ERROR, "can not watch fd %d", proc->fd);
+	}
+}
+
 static void sched_loop(void)
 {
-	fd_set rset;
-	struct timeval timeout;
+	void *ready[MAX_READY_FDS];
 	struct twk_process *proc;
 	double last_check_time;
+	int watched_sigfd = -1;
+	bool sigfd_armed = false;
 	last_check_time = microtime();
 
+	sched_poller = poller_new();
+	if (!sched_poller)
+	{
+		perror("poller_new");
+		return;
+	}
+
 	while (!sched_quit)
 	{
-		FD_ZERO(&rset);
-		int maxfd = 0;
 		double curr_time = microtime();
-		// Affects performance?
-		double max_wait_secs = 10;
+		// Wake up for the next listing at least
+		double max_wait_secs = last_check_time + 15.0 - curr_time;
 
 
+		// Counters are in process-stats, the listing is for debugging
 		if (curr_time - last_check_time > 15.0)
 		{
-			print_threads();
-			print_processes();
+			if (process_at(0)->logging_level >= TWK_LOGGING_VERBOSE)
+			{
+				print_threads();
+				print_processes();
+			}
 			last_check_time = curr_time;
 		}
 Retry:
 		reset_sched_sigfd();
 		/*
-		 * Checking if there is scheduled process
+		 * Checking the processes that woke us
 		 */
-		for (int i = 0; i < MAX_PROCESS; i++)
+		while ((proc = next_for_sched()) != NULL)
 		{
-			proc = &processes[i];
-			
 			if (proc->state == TWK_PS_SHUTDOWN)
 			{
+				bool root = proc == process_at(0);
 				shutdown_process(proc);
-				if (i == 0) { // Root process
+				if (root) {
 					// There is no more active processes
 					goto Done;
 				}
@@ -1447,71 +2427,53 @@ Retry:
 			if (proc->state != TWK_PS_WAITING)
 				continue;
 			
-			int fd = proc->fd;
-			double sched_time = proc->sched_time;
-
-			if (proc->mbox && proc->mbox->rpos != proc->mbox->wpos)
+			if (mbox_bytes(&proc->mbox) > 0 && !suspended(proc))
 			{
 				twk_sched(proc, true);
 			}
-			else if (sched_time > 0)
-			{
-				if (sched_time <= curr_time)
-				{
-					twk_sched(proc, true);
-				}
-				else
-				{
-					max_wait_secs = MIN(max_wait_secs,
-					  sched_time - curr_time);
-				}
-			}
 
-			if (fd > 0) 
-			{
-				if (fd > maxfd)
-					maxfd = fd;
-				FD_SET(fd, &rset);
-			}
+			if (proc->state == TWK_PS_WAITING)
+				watch_process_fd(proc);
 		}
 
-		// Potential bug
-		// what if we are waiting for timeout , a long timeout, and then
-		// a new socket is not in the set, how can we responds to that?
-		// perhaps we should use a way to interrupt the select.
-		int rc;
-	
 		int sigfd = ensure_sched_sigfd();
 		if (sigfd < 0)
 			goto Retry;
-		if (sigfd > maxfd)
-			maxfd = sigfd;
-		FD_SET(sigfd, &rset);
+		if (sigfd != watched_sigfd)
+		{
+			// Windows replaces the socket on every wake up
+			if (watched_sigfd >= 0)
+				poller_forget(sched_poller, watched_sigfd);
+			watched_sigfd = sigfd;
+			sigfd_armed = false;
+		}
+		if (!sigfd_armed)
+			sigfd_armed = poller_watch(sched_poller, sigfd, NULL);
 		
-		set_timeval(&timeout, max_wait_secs);
-		rc = select(maxfd + 1, &rset, NULL, NULL, &timeout);
-		if (rc < 0) {
+		double next_timeout = expire_timers(microtime());
+		if (next_timeout >= 0)
+			max_wait_secs = MIN(max_wait_secs, next_timeout);
+		if (max_wait_secs < 0)
+			max_wait_secs = 0;
+		int n = poller_wait(sched_poller, max_wait_secs, ready, MAX_READY_FDS);
+		if (n < 0 && errno != EINTR) {
 			// It's because the sigfd
-			perror("select");
-		}
-		else if (rc == 0) {
-			// timeout
-		}
-		else {
-
+			perror("poller_wait");
 		}
 		
-		// TODO rc optimize
-		for (int i = 0; rc > 0 && i < MAX_PROCESS; i++)
+		for (int i = 0; i < n; i++)
 		{
-			proc = &processes[i];
-			if (proc->fd < 0 || proc->state != TWK_PS_WAITING)
+			proc = ready[i];
+			if (!proc)
+			{
+				sigfd_armed = false;
 				continue;
-			if (FD_ISSET(proc->fd, &rset))
+			}
+			proc->poll_armed = 0;
+			if (proc->state == TWK_PS_WAITING)
 			{
 				twk_log(proc, TWK_LOGGING_VERBOSE, "fd ready");
 				twk_sched(proc, true);
-
 			}
 		}
 	}
@@ -1520,8 +2482,9 @@ Done:
 	// Wait for all worker threads to quit
 	while (true) {
 		int nrun = 0;
-		for (int i = 0; i < MAX_THREADS; i++) {
+		for (int i = 0; i < nthreads; i++) {
 			threads[i].shutdown = 1;
+			wake_worker(i);
 			if (threads[i].proc) {
 				nrun++;
 			}
@@ -1532,6 +2495,8 @@ Done:
 			break;
 		}
 	}
+	poller_delete(sched_poller);
+	sched_poller = NULL;
 	twk_log(NULL, TWK_LOGGING_VERBOSE, "Scheduler finished");
 	return;
 }
@@ -1550,7 +2515,7 @@ static void init(struct twk_process *root)
 	
 	lisp_defn(g_vm, "spawn",           op_spawn);
 	lisp_defn(g_vm, "sleep",           op_sleep);
-	lisp_defn(g_vm, "microtime",       op_microtime);
+	lisp_defn_stack(g_vm, "microtime", op_microtime);
 	lisp_defn(g_vm, "send-message",    op_send_message);
 	lisp_defn(g_vm, "exit",            op_exit);
 	lisp_defn(g_vm, "wait",            op_wait);
@@ -1560,6 +2525,8 @@ static void init(struct twk_process *root)
 	lisp_defn(g_vm, "open-mbox",       op_open_mbox);
 //	lisp_defn(g_vm, "mbox-ready?",     op_mbox_ready_p);
 	lisp_defn(g_vm, "list-processes",  op_list_processes);
+	lisp_defn(g_vm, "process-stats",   op_process_stats);
+	lisp_defn(g_vm, "scheduler-stats", op_scheduler_stats);
 	lisp_defn(g_vm, "set-timeout",     op_set_timeout);
 	lisp_defn(g_vm, "get-timeout",     op_get_timeout);
 	lisp_defn(g_vm, "wakeup-dispatch", op_wakeup_dispatch);
@@ -1603,6 +2570,26 @@ static void sigterm_handler(int sig)
 }
 
 
+static int online_cpus(void)
+{
+	int n;
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	n = (int)info.dwNumberOfProcessors;
+#else
+	n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return n < 1 ? 1 : n > MAX_THREADS ? MAX_THREADS : n;
+}
+
+void twk_set_worker_count(int n)
+{
+	// Only before the workers are started
+	if (!threads)
+		nthreads = n < 0 ? 0 : n > MAX_THREADS ? MAX_THREADS : n;
+}
+
 void* twk_start_threads(void *_ptr)
 {
 	srand((unsigned int)time(NULL));
@@ -1612,11 +2599,25 @@ void* twk_start_threads(void *_ptr)
 	signal(SIGTERM, sigterm_handler);
 	#endif
 	
-	for (int i = 0; i < MAX_THREADS; i++)
+	if (nthreads <= 0)
+		nthreads = online_cpus();
+	threads = calloc(nthreads, sizeof(struct twk_thread));
+	assert(threads);
+	for (int i = 0; i < nthreads; i++)
 	{
-		pthread_create(&threads[i].thread, NULL, thread_main,
+		pthread_mutex_init(&threads[i].rq.lock, NULL);
+		pthread_cond_init(&threads[i].rq.notify, NULL);
+	}
+	// Processes run on worker stacks where there are no coros
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, TWK_STACK_SIZE);
+	for (int i = 0; i < nthreads; i++)
+	{
+		pthread_create(&threads[i].thread, &attr, thread_main,
 		  &threads[i]);
 	}
+	pthread_attr_destroy(&attr);
 
 	struct twk_process *proc = twk_create_process("init");
 	if (proc)
@@ -1663,6 +2664,9 @@ int twk_start(int n, const char *argv[])
 	
 	s = getenv("TWK_VAR");
 	if (s) twk_set_var_path(s);
+
+	s = getenv("TWK_WORKERS");
+	if (s) twk_set_worker_count(atoi(s));
 	
 	if (!g_dist_path[0]) g_dist_path[0] = '.';
 	if (!g_var_path[0]) g_var_path[0] = '.';